@@ -0,0 +1,31 @@
+
+-- Rewrite the fragmented bitmap vectors of an index into consecutive pages
+CREATE FUNCTION yabit_compact(index regclass, min_fragmentation float8 DEFAULT 0.2)
+    RETURNS bigint
+    AS 'MODULE_PATHNAME', 'yabit_compact'
+    LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION yabit_compact(regclass, float8) IS 'Compact the fragmented bitmap vectors of a yabit index';
+
+CREATE FUNCTION yabit_summarize(index regclass)
+    RETURNS bigint
+    AS 'MODULE_PATHNAME', 'yabit_summarize'
+    LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION yabit_summarize(regclass) IS 'Index the heap blocks a deferred yabit index has left out';
+
+-- Count the rows whose indexed value lies between two bounds; NULL leaves a side open
+CREATE FUNCTION yabit_count(index regclass, lower anyelement, upper anyelement DEFAULT NULL)
+    RETURNS bigint
+    AS 'MODULE_PATHNAME', 'yabit_count'
+    LANGUAGE C STABLE;
+
+COMMENT ON FUNCTION yabit_count(regclass, anyelement, anyelement) IS 'Count the rows of a yabit index between two values from its bitmap vectors';
+
+-- Count the rows of each distinct value of an index from its bitmap vectors
+CREATE FUNCTION yabit_value_counts(index regclass, OUT value text, OUT count bigint)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'yabit_value_counts'
+    LANGUAGE C STRICT STABLE;
+
+COMMENT ON FUNCTION yabit_value_counts(regclass) IS 'Count the rows of each value of a yabit index from its bitmap vectors';
@@ -23,6 +23,8 @@
 #include "access/table.h"
 #include "access/relscan.h"
 #include "catalog/index.h"
+#include "commands/progress.h"
+#include "pgstat.h"
 #include "utils/rel.h"
 #include "miscadmin.h"
 #include "nodes/tidbitmap.h"
@@ -62,11 +64,14 @@ bmbuild_internal(Relation heap, Relation index, IndexInfo *indexInfo)
 	/* init build state */
 	_bitmap_init_buildstate(index, &bmstate);
 
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE,
+								 PROGRESS_BM_PHASE_INDEXBUILD_TABLESCAN);
+
 	reltuples = table_index_build_scan(heap,
 									  index,
 									  indexInfo,
 									  false,  /* allow_sync */
-									  false,  /* progress */
+									  true,   /* progress */
 									  bmbuildCallback,
 									  (void *)&bmstate,
 									  (TableScanDesc) NULL);
@@ -77,16 +82,35 @@ bmbuild_internal(Relation heap, Relation index, IndexInfo *indexInfo)
 	/* fsync unless building a local temp index */
 	if (!(XLogArchivingActive() && !index->rd_islocaltemp))
 	{
-		FlushRelationBuffers(bmstate.bm_lov_heap);
-		smgrimmedsync(bmstate.bm_lov_heap->rd_smgr, MAIN_FORKNUM);
+		pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE,
+									 PROGRESS_BM_PHASE_SYNC);
+
+		if (bmstate.bm_lov_heap != NULL)
+		{
+			FlushRelationBuffers(bmstate.bm_lov_heap);
+			smgrimmedsync(bmstate.bm_lov_heap->rd_smgr, MAIN_FORKNUM);
 
-		FlushRelationBuffers(bmstate.bm_lov_index);
-		smgrimmedsync(bmstate.bm_lov_index->rd_smgr, MAIN_FORKNUM);
+			FlushRelationBuffers(bmstate.bm_lov_index);
+			smgrimmedsync(bmstate.bm_lov_index->rd_smgr, MAIN_FORKNUM);
+		}
 
 		FlushRelationBuffers(index);
 		smgrimmedsync(index->rd_smgr, MAIN_FORKNUM);
 	}
 
+	ereport(DEBUG1,
+			(errmsg("bitmap index \"%s\" built from %.0f tuples with %llu distinct values",
+					RelationGetRelationName(index), bmstate.ituples,
+					(unsigned long long) bmstate.bm_stats.lov_misses),
+			 errdetail("Value lookups: %llu hits, %llu misses. "
+					   "Buffer went over maintenance_work_mem %llu times, "
+					   "spilling %llu runs of %llu bytes.",
+					   (unsigned long long) bmstate.bm_stats.lov_hits,
+					   (unsigned long long) bmstate.bm_stats.lov_misses,
+					   (unsigned long long) bmstate.bm_stats.buf_flushes,
+					   (unsigned long long) bmstate.bm_stats.spilled_runs,
+					   (unsigned long long) bmstate.bm_stats.spilled_bytes)));
+
 	/* return stats */
 	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
 	result->heap_tuples = reltuples;
@@ -108,6 +132,7 @@ bmbuildempty_internal(Relation index)
     Page lovpage;
     BMPageOpaque opaque;
     BMMetaPage  bm_metapage;
+    BlockNumber filterblk = InvalidBlockNumber;
 
     /* Ensure the storage manager handle is opened */
     RelationGetSmgr(index);
@@ -131,9 +156,29 @@ bmbuildempty_internal(Relation index)
 
     /* Set Meta Data */
     bm_metapage = (BMMetaPage) PageGetContents(metapage);
+    bm_metapage->bm_magic = BM_MAGIC;
+    bm_metapage->bm_version = BM_VERSION;
     bm_metapage->bm_lov_heapId = InvalidOid; 
     bm_metapage->bm_lov_indexId = InvalidOid;
     bm_metapage->bm_lov_lastpage = BM_LOV_STARTPAGE; // Point to Block 1
+    bm_metapage->bm_summarized_end = InvalidBlockNumber;
+    bm_metapage->bm_summarizing_end = InvalidBlockNumber;
+    bm_metapage->bm_dict_root = BMUsesDictionary(index) ?
+        BM_LOV_STARTPAGE + 1 : InvalidBlockNumber;
+    bm_metapage->bm_map_root = BMUsesDirectMap(index) ?
+        BM_LOV_STARTPAGE + 2 : InvalidBlockNumber;
+    if (OidIsValid(_bitmap_filter_hashproc(index)))
+    {
+        filterblk = BM_LOV_STARTPAGE + 1;
+        if (BMUsesDictionary(index))
+            filterblk++;
+        if (BMUsesDirectMap(index))
+            filterblk++;
+    }
+    bm_metapage->bm_filter_block = filterblk;
+    bm_metapage->bm_key_scale = BMUsesDictionary(index) ?
+        _bitmap_dict_key_scale(index) : -1;
+    bm_metapage->bm_lov_nitems = 1;
 
     /* Write Meta Page to Block 0 */
     smgr_bulk_write(bulkstate, BM_METAPAGE, metabuf, true);
@@ -146,10 +191,11 @@ bmbuildempty_internal(Relation index)
     
     /* Add the first empty LOV item (corresponding to a NULL value) */
     {
-        BMLOVItem lovItem = _bitmap_formitem(0); // 假设 _bitmap_formitem(0) 已定义
+        BMLOVItem lovItem = _bitmap_formitem(0, BMGetLovTailWords(index));
         OffsetNumber off;
         
-        off = PageAddItem(lovpage, (Item)lovItem, sizeof(BMLOVItemData),
+        off = PageAddItem(lovpage, (Item)lovItem,
+                          BM_LOV_ITEM_SIZE(lovItem->bm_tail_size),
                           InvalidOffsetNumber, false, false);
         if (off == InvalidOffsetNumber)
              elog(ERROR, "failed to add NULL LOV item in buildempty");
@@ -160,6 +206,33 @@ bmbuildempty_internal(Relation index)
     /* Write LOV Page to Block 1 */
     smgr_bulk_write(bulkstate, BM_LOV_STARTPAGE, lovbuf, true);
 
+    /* An empty dictionary is a leaf root page after it */
+    if (BMUsesDictionary(index))
+    {
+        BulkWriteBuffer dictbuf = smgr_bulk_get_buf(bulkstate);
+
+        _bitmap_init_dictpage((Page) dictbuf, BLCKSZ, 0);
+        smgr_bulk_write(bulkstate, BM_LOV_STARTPAGE + 1, dictbuf, true);
+    }
+
+    /* and an empty direct map is a directory page after that */
+    if (BMUsesDirectMap(index))
+    {
+        BulkWriteBuffer mapbuf = smgr_bulk_get_buf(bulkstate);
+
+        _bitmap_init_mappage((Page) mapbuf, BLCKSZ, true);
+        smgr_bulk_write(bulkstate, BM_LOV_STARTPAGE + 2, mapbuf, true);
+    }
+
+    /* the filter page comes last */
+    if (filterblk != InvalidBlockNumber)
+    {
+        BulkWriteBuffer filterbuf = smgr_bulk_get_buf(bulkstate);
+
+        _bitmap_init_filterpage((Page) filterbuf, BLCKSZ);
+        smgr_bulk_write(bulkstate, filterblk, filterbuf, true);
+    }
+
     /* 4. Finish the bulk write operation */
     smgr_bulk_finish(bulkstate);
 }
@@ -178,21 +251,42 @@ bminsert_internal(Relation indexRelation,
 		 bool indexUnchanged,
 		 IndexInfo *indexInfo)
 {
+	BMInsertState *state = (BMInsertState *) indexInfo->ii_AmCache;
+
+	/* a deferred index leaves the new heap blocks to _bitmap_summarize() */
+	if (_bitmap_defer_insert(indexRelation, heapRelation, heap_tid))
+		return true;
+
+	/*
+	 * The TIDs inserted by a statement are buffered per distinct value in
+	 * ii_AmCache, and written out by bminsertcleanup() at the latest.
+	 */
+	if (state == NULL)
+	{
+		state = _bitmap_begin_insert(indexRelation, indexInfo->ii_Context);
+		indexInfo->ii_AmCache = state;
+	}
+
 	/* indexRelation is the index rel in which to insert */
-	_bitmap_doinsert(indexRelation, *heap_tid, values, isnull);
+	_bitmap_buffered_insert(state, *heap_tid, values, isnull);
 	return true;
 }
 
 /* 
  * bminsertcleanup() -- clean up after insertions
+ *
+ * Write out the TIDs the statement has left pending.
  */
 void
 bminsertcleanup_internal(Relation index, IndexInfo *indexInfo)
 {
-    /**
-	 * The current implementation seems to write directly to the buffer with each insert, without any persistent state,
-	 * so this can be left empty here.
-	 */
+	BMInsertState *state = (BMInsertState *) indexInfo->ii_AmCache;
+
+	if (state == NULL)
+		return;
+
+	_bitmap_end_insert(state);
+	indexInfo->ii_AmCache = NULL;
 }
 
 /*
@@ -228,25 +322,89 @@ bmgetbitmap_internal(IndexScanDesc scan, TIDBitmap *tbm)
 {
     int64 ntids = 0;
     ItemPointer heapTid;
+    BMScanOpaque so = (BMScanOpaque) scan->opaque;
+    BlockNumber summarizedEnd;
+
+    /*
+     * Read the end of the summarized blocks before the vectors, so that
+     * the blocks summarized meanwhile are returned one way or the other.
+     */
+    summarizedEnd = _bitmap_get_summarized_end(scan->indexRelation);
 
     /* Fetch the first tuple */
     if (!_bitmap_first(scan, ForwardScanDirection))
-    {
         elog(NOTICE, "=bmgetbitmap_internal: no tuples found");
-        PG_RETURN_INT64(0);
-    }
-
-    /* Save TID */
-    heapTid = &scan->xs_heaptid;
-    tbm_add_tuples(tbm, heapTid, 1, false);
-    ntids++;
-
-    /* Iterate next tuples */
-    while (_bitmap_next(scan, ForwardScanDirection))
+    else
     {
+        /* Save TID */
         heapTid = &scan->xs_heaptid;
         tbm_add_tuples(tbm, heapTid, 1, false);
         ntids++;
+
+        /* Iterate next tuples */
+        while (_bitmap_next(scan, ForwardScanDirection))
+        {
+            heapTid = &scan->xs_heaptid;
+            tbm_add_tuples(tbm, heapTid, 1, false);
+            ntids++;
+        }
+    }
+
+    /* add the bits the vectors keep in their delta pages */
+    if (so->bm_currPos != NULL)
+    {
+        int vectorNo;
+
+        for (vectorNo = 0; vectorNo < so->bm_currPos->nvec; vectorNo++)
+        {
+            BMVector vec = &so->bm_currPos->posvecs[vectorNo];
+            uint32 i;
+
+            for (i = 0; i < vec->bm_numDeltaTids; i++)
+            {
+                ItemPointerData htid;
+
+                ItemPointerSet(&htid, BM_INT_GET_BLOCKNO(vec->bm_deltaTids[i]),
+                               BM_INT_GET_OFFSET(vec->bm_deltaTids[i]));
+                tbm_add_tuples(tbm, &htid, 1, false);
+                ntids++;
+            }
+        }
+
+        /*
+         * The whole bitmap is built, so let the LOV pages go now rather
+         * than at bmendscan(): vacuum and compaction wait for their pins.
+         */
+        for (vectorNo = 0; vectorNo < so->bm_currPos->nvec; vectorNo++)
+        {
+            BMVector vec = &so->bm_currPos->posvecs[vectorNo];
+
+            if (BufferIsValid(vec->bm_lovBuffer))
+            {
+                ReleaseBuffer(vec->bm_lovBuffer);
+                vec->bm_lovBuffer = InvalidBuffer;
+            }
+        }
+    }
+
+    /*
+     * The heap blocks a deferred index has not summarized yet may hold
+     * any value, so they are all returned as lossy pages to recheck.
+     */
+    if (BlockNumberIsValid(summarizedEnd))
+    {
+        Relation heapRel;
+        BlockNumber nblocks;
+        BlockNumber blkno;
+
+        heapRel = table_open(IndexGetRelation(RelationGetRelid(scan->indexRelation),
+                                              false),
+                             AccessShareLock);
+        nblocks = RelationGetNumberOfBlocks(heapRel);
+        table_close(heapRel, AccessShareLock);
+
+        for (blkno = summarizedEnd; blkno < nblocks; blkno++)
+            tbm_add_page(tbm, blkno);
     }
 
     elog(NOTICE, "=bmgetbitmap_internal: added %ld tuples to bitmap, total size = %ld bytes", ntids, ntids * sizeof(ItemPointerData));
@@ -308,6 +466,9 @@ bmrescan_internal(IndexScanDesc scan, ScanKey scankey, int nscankeys,
 
 	MemoryContextReset(so->scanMemoryContext);
 
+	/* see what this backend has inserted but not written yet */
+	_bitmap_flush_pending_inserts(scan->indexRelation);
+
     so->bm_currPos = NULL;
     so->bm_markPos = NULL;
     so->cur_pos_valid = false;
@@ -495,8 +656,7 @@ bmrestrpos_internal(PG_FUNCTION_ARGS)
 /*
  * bmbulkdelete() -- bulk delete index entries
  *
- * Re-index is performed before retrieving the number of tuples
- * indexed in this index.
+ * Clear the bits of the dead TIDs in every vector; see _bitmap_vacuum().
  */
 IndexBulkDeleteResult *
 bmbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
@@ -509,14 +669,12 @@ bmbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 		stats = (IndexBulkDeleteResult *)
 			palloc0(sizeof(IndexBulkDeleteResult));
 
-	stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
-
+	/* each pass counts the live TIDs of every vector afresh */
+	stats->num_index_tuples = 0;
+	stats->estimated_count = false;
 	_bitmap_vacuum(info, stats, callback, callback_state);
     
 	stats->num_pages = RelationGetNumberOfBlocks(rel);
-	/* Since we re-build the index, set this to number of heap tuples. */
-	stats->num_index_tuples = info->num_heap_tuples;
-	stats->tuples_removed = 0;
     
 	return stats;
 }
@@ -524,22 +682,35 @@ bmbulkdelete_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 /*
  * bmvacuumcleanup() -- post-vacuum cleanup.
  *
- * We do nothing useful here.
+ * Hand the bitmap pages deleted by this and earlier vacuums over to the
+ * free space map, and truncate the index if it ends with such pages.
  */
 IndexBulkDeleteResult *
 bmvacuumcleanup_internal(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 {
 	Relation    rel = info->index;
 
+	if (info->analyze_only)
+		return stats;
+
+	/*
+	 * bmbulkdelete() folds the delta pages of each vector it visits; if
+	 * it did not run, do that here.
+	 */
 	if (stats == NULL)
+	{
 		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+		_bitmap_vacuum_deltas(info, stats);
+
+		/* the set bits were not counted; assume one per heap tuple */
+		stats->num_index_tuples = info->num_heap_tuples;
+		stats->estimated_count = info->estimated_count;
+	}
+
+	_bitmap_vacuum_pages(info, stats);
 
 	/* update statistics */
 	stats->num_pages = RelationGetNumberOfBlocks(rel);
-	stats->pages_deleted = 0;
-	stats->pages_free = 0;
-	/* XXX: dodgy hack to shutup index_scan() and vacuum_index() */
-	stats->num_index_tuples = info->num_heap_tuples;
 
 	return stats;
 }
@@ -560,6 +731,9 @@ bmbuildCallback(Relation index, ItemPointer tid, Datum *attdata,
     _bitmap_buildinsert(index, tid, attdata, nulls, bstate);
     ++bstate->ituples;
 
+    pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE,
+								 (int64) bstate->ituples);
+
 #ifdef DEBUG_BMI
     elog(NOTICE,"[bmbuildCallback] END");
 #endif
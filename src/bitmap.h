@@ -18,17 +18,27 @@
 /* this macro enables debug messages */
 
 /* Custom namespace for bitmap index LOV tables */
-extern Oid bitmap_internal_namespace;
-#define PG_BITMAPINDEX_NAMESPACE bitmap_internal_namespace
+extern Oid _bitmap_internal_namespace(void);
+#define PG_BITMAPINDEX_NAMESPACE _bitmap_internal_namespace()
+
+/* yabit.lov_cache_size: values per index in the LOV lookup cache */
+extern int yabit_lov_cache_size;
+/* yabit.shared_lov_cache_size: values in the shared LOV cache */
+extern int yabit_shared_lov_cache_size;
+/* yabit.enable_count: plan count(*) queries as counts of bitmap vectors */
+extern bool yabit_enable_count;
 
 #include "access/genam.h"
+#include "access/heapam.h"
 #include "access/htup.h"
 #include "access/itup.h"
 #include "access/relscan.h"
 #include "access/sdir.h"
 #include "access/xlogutils.h"
+#include "executor/tuptable.h"
 #include "nodes/tidbitmap.h"
 #include "nodes/pathnodes.h"
+#include "storage/buffile.h"
 #include "storage/lock.h"
 #include "storage/smgr.h"
 #include "storage/relfilelocator.h"
@@ -59,6 +69,13 @@ typedef uint16			BM_WORD;
  */
 typedef struct BMMetaPageData 
 {
+	/*
+	 * BM_MAGIC, and the BM_VERSION of the on-disk format the index was
+	 * built with. Indexes of any other version have to be rebuilt.
+	 */
+	uint32		bm_magic;
+	uint32		bm_version;
+
 	/*
 	 * The relation ids for a heap and a btree on this heap. They are
 	 * used to speed up finding the bitmap vector for given attribute
@@ -70,10 +87,98 @@ typedef struct BMMetaPageData
 
 	/* the block number for the last LOV pages. */
 	BlockNumber	bm_lov_lastpage;
+
+	/*
+	 * For a deferred index, the heap blocks from bm_summarized_end on are
+	 * not indexed yet, and scans return them as lossy pages. It is
+	 * InvalidBlockNumber when the whole heap is indexed. While
+	 * _bitmap_summarize() indexes the blocks up to bm_summarizing_end,
+	 * inserts into them are indexed too. See _bitmap_defer_insert().
+	 */
+	BlockNumber	bm_summarized_end;
+	BlockNumber	bm_summarizing_end;
+
+	/*
+	 * The root page of the value dictionary, for an index built with the
+	 * dictionary option; InvalidBlockNumber when the index looks its
+	 * values up in the LOV heap and btree instead. See bitmapdict.c.
+	 */
+	BlockNumber	bm_dict_root;
+
+	/*
+	 * The directory page of the direct map, for an index built with the
+	 * direct_map option; InvalidBlockNumber otherwise.
+	 */
+	BlockNumber	bm_map_root;
+
+	/*
+	 * The filter page of the distinct values, or InvalidBlockNumber if
+	 * the values have no hash function. See bitmapfilter.c.
+	 */
+	BlockNumber	bm_filter_block;
+
+	/*
+	 * For a dictionary on a numeric column of bounded precision, the scale
+	 * by which its values are turned into the int64 keys the dictionary
+	 * holds; -1 if the dictionary holds the values themselves.
+	 */
+	int32		bm_key_scale;
+
+	/*
+	 * The number of LOV items, the one for NULLs included, that is the
+	 * number of bitmap vectors. It is kept by create_lovitem() under the
+	 * insert lock, and read by bmcostestimate_internal().
+	 */
+	uint32		bm_lov_nitems;
 } BMMetaPageData;
 
 typedef BMMetaPageData *BMMetaPage;
 
+#define BM_MAGIC	0x59414249	/* "YABI" */
+
+/*
+ * The version of the on-disk format: of the metapage, the LOV items, and
+ * the bitmap, dictionary, map and filter pages. Bump it with any change
+ * to their layout. Indexes built before the version was kept have none,
+ * so they fail the check of bm_magic.
+ */
+#define BM_VERSION	1
+
+/*
+ * Per-relation state cached in rd_amcache, so that inserts and scans do
+ * not read the metapage and look up operators in the catalogs each time.
+ * It goes away with the relcache entry on invalidation (a REINDEX gives
+ * the index a new LOV heap and btree, and invalidates it), and is built
+ * again by _bitmap_get_relcache() on the next use.
+ */
+typedef struct BMRelCache
+{
+	Oid				bm_lov_heapId;
+	Oid				bm_lov_indexId;
+	BlockNumber		bm_dict_root;
+	BlockNumber		bm_map_root;
+	BlockNumber		bm_filter_block;
+
+	/*
+	 * bm_lov_nitems as of when the entry was built, for the planner's
+	 * estimates. Only the LOV items this backend creates update it, so it
+	 * may lag behind until the relcache entry is rebuilt, as it is when
+	 * vacuum or analyze update the index's statistics.
+	 */
+	uint32			bm_lov_nitems;
+
+	/* the hash function of the values, for the filter page */
+	FmgrInfo		bm_filter_hash;
+
+	/* the scale of normalized dictionary keys, and their tuple descriptor */
+	int32			bm_key_scale;
+	TupleDesc		bm_dict_desc;
+
+	/* the equality procedure of each indexed attribute, for LOV lookups */
+	int				natts;
+	RegProcedure	eq_procs[INDEX_MAX_KEYS];
+} BMRelCache;
+
 /*
  * The meta page is always the first block of the index
  */
@@ -110,6 +215,13 @@ typedef BMMetaPageData *BMMetaPage;
  */
 #define		BM_LOV_STARTPAGE	1 
 
+/*
+ * The largest tail buffer a LOV item can have, in words, and the size
+ * given to new items by default; see BMLOVItemData.
+ */
+#define BM_MAX_LOV_TAIL_WORDS		128
+#define BM_DEFAULT_LOV_TAIL_WORDS	32
+
 /*
  * Items in a LOV page.
  *
@@ -168,15 +280,129 @@ typedef struct BMLOVItemData
 	 * bit is 1, it represents that bm_last_compword is a fill word.
 	 */
 	uint8			lov_words_header;
-	 
+
+	/*
+	 * Blocks reserved for the growth of the bitmap vector: the blocks
+	 * from bm_extent_next up to, but not including, bm_extent_end were
+	 * added to the index as one extent and are handed out to this vector
+	 * in order. bm_extent_size is the size of the last extent reserved;
+	 * the next one is twice as large, up to BM_MAX_EXTENT_PAGES. See
+	 * _bitmap_alloc_bitmappage(). bm_extent_vacuumed is bm_extent_next as
+	 * the last vacuum found it; an extent the vector has not taken a page
+	 * from since is given up by the next one.
+	 */
+	BlockNumber		bm_extent_next;
+	BlockNumber		bm_extent_end;
+	uint32			bm_extent_size;
+	BlockNumber		bm_extent_vacuumed;
+
+	/*
+	 * The newest delta page of the vector, or InvalidBlockNumber. Bits
+	 * set behind the end of the vector are collected in delta pages
+	 * rather than squeezed into its compressed words; see
+	 * BM_PAGE_DELTA.
+	 */
+	BlockNumber		bm_delta_head;
+
+	/*
+	 * Statistics of the vector, so that nobody has to decode it for them.
+	 * bm_nsetbits is the number of rows with this value: it counts each
+	 * TID as it is inserted, in the words or in a delta page, and drops
+	 * the TIDs vacuum removes. A TID inserted twice, as
+	 * _bitmap_summarize() may do, is counted twice until vacuum counts
+	 * the bits of the vector again, so it is an upper bound. bm_npages
+	 * is the number of bitmap pages in the vector, delta pages aside.
+	 */
+	uint64			bm_nsetbits;
+	uint32			bm_npages;
+
+	/*
+	 * The tail buffer: complete words of the vector that come after the
+	 * words in its bitmap pages and before bm_last_compword. Words are
+	 * collected here until bm_tail_size of them would be exceeded, and
+	 * then written to the last bitmap page in one go, so that appends
+	 * touch the bitmap pages only every so often. bm_tail_size is fixed
+	 * when the item is created (see the lov_tail_words option), and the
+	 * item is that much larger. bm_tail_tid_location is the location of
+	 * the last bit covered by the words in the buffer, as
+	 * bm_last_tid_location is for a bitmap page.
+	 */
+	uint64			bm_tail_tid_location;
+	uint16			bm_tail_size;
+	uint16			bm_tail_nwords;
+	BM_WORD			bm_tail_hwords[BM_MAX_LOV_TAIL_WORDS / BM_WORD_SIZE];
+	BM_WORD			bm_tail_words[FLEXIBLE_ARRAY_MEMBER];
 } BMLOVItemData;
 typedef BMLOVItemData *BMLOVItem;
 
-#define BM_LOV_ITEM_SIZE (sizeof(BMLOVItemData))
+#define BM_LOV_ITEM_SIZE(tailWords) \
+	(offsetof(BMLOVItemData, bm_tail_words) + (tailWords) * sizeof(BM_WORD))
 
 #define BM_MAX_LOVITEMS_PER_PAGE	\
 	((BLCKSZ - sizeof(PageHeaderData)) / sizeof(BMLOVItemData))
 
+/*
+ * Index options, from the WITH clause of CREATE INDEX.
+ *
+ * lov_items_per_page caps the number of LOV items placed on one LOV page.
+ * Every insert locks the LOV page of its value exclusively to update the
+ * vector's tail words, so values that share a page also share that lock.
+ * Zero, the default, packs the pages full; small values spread hot values
+ * over more pages at the cost of a larger index. See create_lovitem().
+ *
+ * lov_tail_words is the size of the tail buffer given to new LOV items.
+ *
+ * deferred leaves the rows appended to the heap out of the index until
+ * yabit_summarize() or the compaction worker indexes them in bulk.
+ *
+ * dictionary keeps the distinct values in dictionary pages of the index
+ * itself instead of the LOV heap and btree. It is read when the index is
+ * built, so changing it takes a REINDEX.
+ *
+ * direct_map adds a direct map from value to LOV item to the dictionary
+ * of an index on an int4 or date column. It implies dictionary.
+ */
+typedef struct BMOptions
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	int			fillfactor;
+	int			lov_items_per_page;
+	int			lov_tail_words;
+	bool		deferred;
+	bool		dictionary;
+	bool		direct_map;
+} BMOptions;
+
+#define BM_MIN_FILLFACTOR			10
+#define BM_DEFAULT_FILLFACTOR		100
+
+#define BMGetLovItemsPerPage(rel) \
+	(((rel)->rd_options != NULL && \
+	  ((BMOptions *) (rel)->rd_options)->lov_items_per_page > 0) ? \
+	 ((BMOptions *) (rel)->rd_options)->lov_items_per_page : \
+	 (int) BM_MAX_LOVITEMS_PER_PAGE)
+
+#define BMGetLovTailWords(rel) \
+	((rel)->rd_options != NULL ? \
+	 ((BMOptions *) (rel)->rd_options)->lov_tail_words : \
+	 BM_DEFAULT_LOV_TAIL_WORDS)
+
+#define BMIsDeferred(rel) \
+	((rel)->rd_options != NULL && \
+	 ((BMOptions *) (rel)->rd_options)->deferred)
+
+#define BMUsesDirectMap(rel) \
+	((rel)->rd_options != NULL && \
+	 ((BMOptions *) (rel)->rd_options)->direct_map)
+
+#define BMUsesDictionary(rel) \
+	(BMUsesDirectMap(rel) || \
+	 ((rel)->rd_options != NULL && \
+	  ((BMOptions *) (rel)->rd_options)->dictionary))
+
+/* the largest extent of bitmap pages reserved for one vector at a time */
+#define BM_MAX_EXTENT_PAGES	64
+
 #define BM_LOV_WORDS_NO_FILL 0
 #define BM_LAST_WORD_BIT 1
 #define BM_LAST_COMPWORD_BIT 2
@@ -218,10 +444,176 @@ typedef struct BMPageOpaqueData
      */
 	uint64		bm_last_tid_location;
 	uint16		bm_page_id; /* bitmap index identifier */
+	uint16		bm_flags;	/* see below */
 } BMPageOpaqueData;
 typedef BMPageOpaqueData *BMPageOpaque;
 
 #define BM_PAGE_ID 0xFF82
+
+/*
+ * Bits in bm_flags.
+ *
+ * BM_PAGE_DELETED marks a bitmap page that vacuum has unlinked from its
+ * vector. It keeps its next link for scans that were already on their
+ * way to it, and its contents hold the next full transaction id at the
+ * time it was deleted: once that is older than every running snapshot,
+ * no such scan can be left and the page goes to the free space map.
+ */
+#define BM_PAGE_DELETED		(1 << 0)
+
+/*
+ * BM_PAGE_DELTA marks a delta page. Setting a bit in the middle of a
+ * vector would mean splitting a fill word and shifting the rest of its
+ * page, maybe into a new page; instead the TID location is appended to
+ * the newest delta page of the vector. A delta page holds
+ * bm_hrl_words_used TID locations in the order they came in, and
+ * bm_bitmap_next links it to the next older delta page. Scans read the
+ * deltas of a vector along with its words, and vacuum folds them into
+ * the vector (_bitmap_fold_deltas()).
+ */
+#define BM_PAGE_DELTA		(1 << 1)
+
+#define BM_MAX_DELTA_TIDS_PER_PAGE \
+	((BLCKSZ - \
+	MAXALIGN(sizeof(PageHeaderData)) - \
+	MAXALIGN(sizeof(BMPageOpaqueData)))/sizeof(uint64))
+
+#define BMPageGetDeltaTids(page) \
+	((uint64 *) PageGetContents(page))
+
+#define BMPageIsBitmapPage(page) \
+	(PageGetSpecialSize(page) == MAXALIGN(sizeof(BMPageOpaqueData)) && \
+	 ((BMPageOpaque) PageGetSpecialPointer(page))->bm_page_id == BM_PAGE_ID)
+#define BMPageIsDeleted(page) \
+	((((BMPageOpaque) PageGetSpecialPointer(page))->bm_flags & \
+	  BM_PAGE_DELETED) != 0)
+#define BMPageGetDeleteXid(page) \
+	(*((FullTransactionId *) PageGetContents(page)))
+/*
+ * Dictionary page -- the pages of the value dictionary, a small search
+ * tree an index built with the dictionary option keeps instead of the
+ * LOV heap and btree.
+ *
+ * A dictionary page holds index tuples sorted by value, in the order of
+ * the first support procedure of the operator class, with NULLs last.
+ * On a leaf page (level 0) the TID of a tuple is the position of the LOV
+ * item of its value. On an internal page the block number of the TID is
+ * the child page whose values start at the tuple's value; the first
+ * tuple of an internal page stands for minus infinity. The pages of
+ * each level are linked from left to right. Values are never removed,
+ * and a split only moves the upper half of a page to a new right
+ * sibling, so a lookup that comes down to a page left of its value
+ * finds it by following the right links. The root stays at
+ * bm_dict_root: when it splits, its tuples move to two new pages on
+ * the level below.
+ */
+typedef struct BMDictPageOpaqueData
+{
+	BlockNumber	bm_dict_right;	/* the next page on the same level */
+	uint16		bm_dict_level;	/* 0 for leaf pages */
+	uint16		bm_page_id;		/* BM_DICT_PAGE_ID */
+} BMDictPageOpaqueData;
+typedef BMDictPageOpaqueData *BMDictPageOpaque;
+
+#define BM_DICT_PAGE_ID 0xFF83
+
+#define BMPageIsDictPage(page) \
+	(PageGetSpecialSize(page) == MAXALIGN(sizeof(BMDictPageOpaqueData)) && \
+	 ((BMDictPageOpaque) PageGetSpecialPointer(page))->bm_page_id == \
+	 BM_DICT_PAGE_ID)
+
+/* a dictionary tuple may take a third of a page, so that a split works */
+#define BM_DICT_MAX_ITEM_SIZE \
+	MAXALIGN_DOWN((BLCKSZ - \
+				   MAXALIGN(SizeOfPageHeaderData + 3 * sizeof(ItemIdData)) - \
+				   MAXALIGN(sizeof(BMDictPageOpaqueData))) / 3)
+
+/* the support procedure that orders the values of a dictionary */
+#define BM_ORDER_PROC	1
+
+/*
+ * The values of a numeric(p,s) column with p up to BM_DICT_KEY_DIGITS and
+ * s from 0 to that are kept in the dictionary as value * 10^s in an int64,
+ * which is below BM_DICT_KEY_LIMIT in magnitude, and compared as integers.
+ * NaN, which sorts after all numbers, becomes BM_DICT_KEY_NAN.
+ */
+#define BM_DICT_KEY_DIGITS	18
+#define BM_DICT_KEY_LIMIT	INT64CONST(1000000000000000000)
+#define BM_DICT_KEY_NAN		PG_INT64_MAX
+
+/*
+ * Direct map pages -- an index with the direct_map option, on a single
+ * int4 or date column, also keeps an array from value to the position of
+ * its LOV item for the values from BM_MAP_MIN_VALUE on, BM_MAP_NVALUES of
+ * them, so that a lookup of such a value is a directory page read and a
+ * map page read, with no search. That covers about 1.4 million values on
+ * either side of zero with 8K pages: small integer codes, and the dates of
+ * several millennia around 2000-01-01.
+ *
+ * The directory page at bm_map_root holds the block number of the map
+ * page of each run of BM_MAP_SLOTS_PER_PAGE values, or InvalidBlockNumber
+ * for a run that has no values yet. A map page holds the LOV item
+ * positions of the values of its run, invalid for those not in the index.
+ * The values are in the dictionary as well, which serves the values out
+ * of the map, range scans and the walks over all vectors.
+ */
+typedef struct BMMapPageOpaqueData
+{
+	uint32		bm_map_chunk;	/* the run of values of a map page */
+	uint16		bm_map_flags;	/* see below */
+	uint16		bm_page_id;		/* BM_MAP_PAGE_ID */
+} BMMapPageOpaqueData;
+typedef BMMapPageOpaqueData *BMMapPageOpaque;
+
+#define BM_MAP_PAGE_ID 0xFF84
+
+/* bm_map_flags: the directory page rather than a map page */
+#define BM_MAP_DIRECTORY	(1 << 0)
+
+#define BM_MAP_PAGE_AREA \
+	(BLCKSZ - \
+	 MAXALIGN(SizeOfPageHeaderData) - \
+	 MAXALIGN(sizeof(BMMapPageOpaqueData)))
+#define BM_MAP_SLOTS_PER_PAGE \
+	((int64) (BM_MAP_PAGE_AREA / sizeof(ItemPointerData)))
+#define BM_MAP_DIR_ENTRIES \
+	((int64) (BM_MAP_PAGE_AREA / sizeof(BlockNumber)))
+#define BM_MAP_NVALUES		(BM_MAP_DIR_ENTRIES * BM_MAP_SLOTS_PER_PAGE)
+#define BM_MAP_MIN_VALUE	(-(BM_MAP_NVALUES / 2))
+
+#define BMPageGetMapDirectory(page) \
+	((BlockNumber *) PageGetContents(page))
+#define BMPageGetMapSlots(page) \
+	((ItemPointerData *) PageGetContents(page))
+
+/*
+ * Filter page -- a Bloom filter over the distinct values of the index, so
+ * that a value that has no LOV item is usually known to be absent after
+ * one page read, without searching the LOV btree or the dictionary. Each
+ * value sets BM_FILTER_NHASHES bits of the page. Once BM_FILTER_MAX_VALUES
+ * values are in, about one in a hundred absent values would still pass,
+ * and the filter is no longer consulted; REINDEX starts a new one.
+ */
+typedef struct BMFilterPageOpaqueData
+{
+	uint32		bm_filter_nvalues;	/* the values added so far */
+	uint16		bm_filter_unused;
+	uint16		bm_page_id;			/* BM_FILTER_PAGE_ID */
+} BMFilterPageOpaqueData;
+typedef BMFilterPageOpaqueData *BMFilterPageOpaque;
+
+#define BM_FILTER_PAGE_ID 0xFF85
+
+#define BM_FILTER_NBITS \
+	((uint32) ((BLCKSZ - \
+				MAXALIGN(SizeOfPageHeaderData) - \
+				MAXALIGN(sizeof(BMFilterPageOpaqueData))) * BITS_PER_BYTE))
+#define BM_FILTER_NHASHES		4
+#define BM_FILTER_MAX_VALUES	(BM_FILTER_NBITS / 10)
+
+#define BMPageGetFilterBits(page) \
+	((uint8 *) PageGetContents(page))
+
 /*
  * Approximately 4078 words per 8K page
  */
@@ -255,6 +647,19 @@ typedef struct BMBitmapVectorPageData
 } BMBitmapVectorPageData;
 typedef BMBitmapVectorPageData *BMBitmapVectorPage;
 
+/*
+ * Counters kept during bmbuild(), logged at DEBUG1 when the build is
+ * over. They tell how well maintenance_work_mem fitted the build.
+ */
+typedef struct BMBuildStats
+{
+	uint64		lov_hits;		/* tuples whose value already had a vector */
+	uint64		lov_misses;		/* tuples that created a new vector */
+	uint64		buf_flushes;	/* times the buffer went over the limit */
+	uint64		spilled_runs;	/* runs written to the spill file */
+	uint64		spilled_bytes;	/* bytes written to the spill file */
+} BMBuildStats;
+
 /*
  * Data structure for used to buffer index creation during bmbuild().
  * Buffering provides three benefits: firstly, it makes for many fewer
@@ -264,18 +669,29 @@ typedef BMBitmapVectorPageData *BMBitmapVectorPage;
  * on disk.
  *
  * byte_size counts how many bytes we've consumed in the buffer.
- * max_lov_block is a hint as to whether we'll find a LOV block in lov_blocks
- * or not (we take advantage of the fact that LOV block numbers will be
- * increasing).
- * lov_blocks is a list of LOV block buffers. The structures put in
- * this list are defined in bitmapinsert.c.
+ * max_lov_block is the highest LOV block we have buffered tids for.
+ * lov_blocks is an array of LOV block buffers indexed by LOV block number,
+ * num_lov_blocks entries long. The structures put in this array are
+ * defined in bitmapinsert.c.
+ *
+ * When byte_size goes over maintenance_work_mem, the words of the largest
+ * and least recently used vectors are spilled to spill_file as runs. clock
+ * is bumped for every buffered tid and is what "recently" is measured in.
+ * The runs of each vector are written to its bitmap pages, in order and
+ * followed by its in-memory words, in _bitmap_write_alltids().
  */
 
 typedef struct BMTidBuildBuf
 {
-	uint32 byte_size; /* The size in bytes of the buffer's data */
+	Size		byte_size; /* The size in bytes of the buffer's data */
 	BlockNumber max_lov_block; /* highest lov block we're seen */
-	List *lov_blocks;	/* list of lov blocks we're buffering */
+	struct BMTIDLOVBuffer **lov_blocks;	/* lov blocks we're buffering */
+	BlockNumber	num_lov_blocks;	/* allocated length of lov_blocks */
+	uint64		clock;		/* number of tids buffered so far */
+	BufFile	   *spill_file;	/* spilled runs, or NULL if none yet */
+	int			spill_end_fileno;	/* where the next run is appended */
+	off_t		spill_end_offset;
+	BMBuildStats *stats;	/* the build's counters */
 } BMTidBuildBuf;
 
 
@@ -391,6 +807,7 @@ typedef struct BMTIDBuffer
 
 	uint64			start_tid;	/* starting TID for this buffer */
 	uint64			last_tid;	/* most recent tid added */
+	uint64			num_tids;	/* tids added, not yet counted in the LOV item */
 	int16			curword; /* index into content */
 	int16			num_cwords;	/* number of allocated words in content */
 
@@ -412,6 +829,15 @@ typedef struct BMTIDBuffer
   /* temporary buffer to store merged words */
   BM_WORD *tmp_hwords;
   uint64   tmp_hwords_cap;
+
+	/*
+	 * Build only: the build buffer this vector belongs to (NULL outside
+	 * of a build), the owner's clock when a tid was last added, and the
+	 * runs of words spilled to the owner's spill_file, oldest first.
+	 */
+	BMTidBuildBuf *owner;
+	uint64		last_used;
+	List	   *spill_runs;
 } BMTIDBuffer;
 
 typedef struct BMBuildLovData
@@ -450,8 +876,21 @@ typedef struct BMBuildState
 	 */
 	BMTidBuildBuf	*bm_tidLocsBuffer;
 
+	/*
+	 * When the LOV lookups during the build are served by lovitem_hash,
+	 * nobody reads the LOV btree until the build is over. In that case
+	 * new LOV tuples are only batched into the LOV heap, and the btree
+	 * is built from the heap in one sorted pass at the end of the build
+	 * (see _bitmap_end_lov_bulkload()).
+	 */
+	bool			bm_lov_deferred;
+	BulkInsertState	bm_lov_bistate;
+	TupleTableSlot **bm_lov_slots;
+	int				bm_lov_nslots;
+
 	double 		ituples; /* the number of index tuples */
 	bool			use_wal; /* whether or not we write WAL records */
+	BMBuildStats	bm_stats;
 
   /* HOT tuples prebuffer */
   BlockNumber hot_prebuffer_block;
@@ -462,6 +901,92 @@ typedef struct BMBuildState
   int16 hot_prebuffer_count;
 } BMBuildState;
 
+/*
+ * A scan of the value dictionary, returning the LOV item positions of
+ * the values that satisfy the scan keys in value order. The positions
+ * are copied out one leaf page at a time, so no lock is held between
+ * calls to _bitmap_dict_getnext().
+ */
+typedef struct BMDictScanData
+{
+	Relation		bm_rel;
+	ScanKey			bm_keys;
+	int				bm_nkeys;
+	BlockNumber		bm_next;	/* the next leaf page to read */
+	int				bm_nitems;
+	int				bm_curitem;
+	ItemPointerData	bm_items[MaxIndexTuplesPerPage];
+
+	/* if not NULL, copies of the items' tuples, at bm_tupleoffs */
+	char		   *bm_tuples;
+	uint16			bm_tupleoffs[MaxIndexTuplesPerPage];
+} BMDictScanData;
+typedef BMDictScanData *BMDictScan;
+
+/*
+ * A walk over the LOV items of all the distinct values of an index, but
+ * for the NULL item, through the LOV heap or the value dictionary.
+ */
+typedef struct BMLovScanData
+{
+	Relation		bm_lov_heap;
+	TableScanDesc	bm_heap_scan;
+	TupleTableSlot *bm_slot;
+	BMDictScan		bm_dict_scan;
+} BMLovScanData;
+typedef BMLovScanData *BMLovScan;
+
+/*
+ * The number of rows of one distinct value of an index, as counted by
+ * _bitmap_count_values().
+ */
+typedef struct BMValueCount
+{
+	Datum			value;
+	bool			isnull;
+	int64			count;
+} BMValueCount;
+
+/*
+ * the state for the inserts of one statement, kept in ii_AmCache.
+ *
+ * The LOV heap and btree stay open and the scan keys are built once for
+ * the whole statement. The TIDs inserted are not written right away but
+ * collected per LOV item in pending, and appended to their vectors in
+ * sorted batches when the pending TIDs outgrow work_mem, when a scan of
+ * the index starts in this backend, and at the end of the statement.
+ * See _bitmap_flush_inserts().
+ */
+typedef struct BMInsertState
+{
+	Relation		bm_index;
+	Buffer			bm_metabuf;
+	Relation		bm_lov_heap;
+	Relation		bm_lov_index;
+	ScanKey			bm_lov_scanKeys;
+	IndexScanDesc	bm_lov_scanDesc;
+
+	MemoryContext	pending_cxt;	/* holds pending and its TID arrays */
+	HTAB		   *pending;		/* BMInsertPending entries by LOV item */
+	Size			pending_bytes;
+
+	struct BMInsertState *next;	/* in the backend's list of active states */
+} BMInsertState;
+
+/*
+ * Subphases of a bitmap index build, as reported in
+ * pg_stat_progress_create_index. While the LOV btree is built at the
+ * end of our build, btbuild() reports its own subphases 2 to 5 under
+ * our command; 3 to 5 are named after what they mean for the LOV.
+ */
+#define PROGRESS_BM_PHASE_INDEXBUILD_TABLESCAN	2
+#define PROGRESS_BM_PHASE_LOV_SORT_1			3
+#define PROGRESS_BM_PHASE_LOV_SORT_2			4
+#define PROGRESS_BM_PHASE_LOV_LEAF_LOAD			5
+#define PROGRESS_BM_PHASE_WRITE_VECTORS			6
+#define PROGRESS_BM_PHASE_LOAD_LOV				7
+#define PROGRESS_BM_PHASE_SYNC					8
+
 /*
  * Define an iteration result while scanning an BMBatchWords.
  *
@@ -523,6 +1048,10 @@ typedef struct BMVectorData
 	bool			bm_readLastWords;
 	BMBatchWords   *bm_batchWords; /* actual bitmap words */
 
+	/* the TID locations in the delta pages of the vector */
+	uint64		   *bm_deltaTids;
+	uint32			bm_numDeltaTids;
+
 } BMVectorData;
 typedef BMVectorData *BMVector;
 
@@ -768,6 +1297,8 @@ extern void bmcostestimate_internal(PlannerInfo *root, IndexPath *path, double l
     double *indexPages);
 extern bool bmvalidate_internal(Oid opclassoid);
 extern bytea *bmoptions_internal(Datum reloptions, bool validate);
+extern void _bitmap_init_reloptions(void);
+extern char *bmbuildphasename_internal(int64 phasenum);
 
 /* bitmappages.c */
 extern Buffer _bitmap_getbuf(Relation rel, BlockNumber blkno, int access);
@@ -776,6 +1307,11 @@ extern void _bitmap_relbuf(Buffer buf);
 extern void _bitmap_wrtnorelbuf(Buffer buf);
 extern void _bitmap_init_lovpage(Buffer buf);
 extern void _bitmap_init_bitmappage(Buffer buf);
+extern Buffer _bitmap_alloc_bitmappage(Relation rel, Buffer lovBuffer,
+									   BMLOVItem lovItem, uint32 npages,
+									   bool grow);
+extern void _bitmap_delete_bitmappage(Page page);
+extern bool _bitmap_page_recyclable(Page page);
 extern void _bitmap_init_buildstate(Relation index, BMBuildState* bmstate);
 extern void _bitmap_cleanup_buildstate(Relation index, BMBuildState* bmstate);
 extern void _bitmap_init(Relation index, bool use_wal);
@@ -786,6 +1322,21 @@ extern void _bitmap_buildinsert(Relation index, ItemPointer tid,
 							 	BMBuildState *state);
 extern void _bitmap_doinsert(Relation rel, ItemPointerData ht_ctid, 
 							 Datum *attdata, bool *nulls);
+extern BMInsertState *_bitmap_begin_insert(Relation rel,
+										   MemoryContext cxt);
+extern void _bitmap_buffered_insert(BMInsertState *state,
+									ItemPointerData ht_ctid,
+									Datum *attdata, bool *nulls);
+extern void _bitmap_flush_inserts(BMInsertState *state);
+extern void _bitmap_flush_pending_inserts(Relation rel);
+extern void _bitmap_end_insert(BMInsertState *state);
+extern bool _bitmap_find_lovitem(Relation rel, Datum *attdata, bool *nulls,
+								 BlockNumber *lovBlockP,
+								 OffsetNumber *lovOffsetP);
+extern bool _bitmap_defer_insert(Relation rel, Relation heapRel,
+								 ItemPointer ht_ctid);
+extern BlockNumber _bitmap_get_summarized_end(Relation rel);
+extern BlockNumber _bitmap_summarize(Relation heapRel, Relation rel);
 extern void _bitmap_write_alltids(Relation rel, BMTidBuildBuf *tids,
 						  		  bool use_wal);
 extern uint64 _bitmap_write_bitmapwords(Buffer bitmapBuffer,
@@ -794,11 +1345,23 @@ extern void _bitmap_write_new_bitmapwords(
 	Relation rel,
 	Buffer lovBuffer, OffsetNumber lovOffset,
 	BMTIDBuffer* buf, bool use_wal);
+extern void _bitmap_flush_tail_words(Relation rel, Buffer lovBuffer,
+									 BMLOVItem lovItem);
+extern void _bitmap_append_bitmapwords(Relation rel, Buffer lovBuffer,
+									   BMLOVItem lovItem, BM_WORD *words,
+									   bool *fills, uint32 nwords,
+									   uint64 tidLocation);
 extern uint16 _bitmap_free_tidbuf(BMTIDBuffer* buf);
 extern void build_inserttuple_flush(Relation rel, BMBuildState *state);
+extern BlockNumber _bitmap_fold_deltas(Relation rel, BlockNumber lovBlock,
+									   OffsetNumber lovOffset,
+									   IndexBulkDeleteCallback callback,
+									   void *callback_state,
+									   double *tuples_removed);
 
 /* bitmaputil.c */
-extern BMLOVItem _bitmap_formitem(uint64 currTidNumber);
+extern BMLOVItem _bitmap_formitem(uint64 currTidNumber, uint16 tailWords);
+extern BMRelCache *_bitmap_get_relcache(Relation rel);
 extern void _bitmap_init_batchwords(BMBatchWords* words,
 									uint32	maxNumOfWords,
 									MemoryContext mcxt);
@@ -854,17 +1417,88 @@ extern void _bitmap_create_lov_heapandindex(Relation rel, Oid *heapId,
 extern void _bitmap_open_lov_heapandindex(BMMetaPage metapage,
 						 Relation *lovHeapP, Relation *lovIndexP,
 						 LOCKMODE lockMode);
+extern void _bitmap_open_lov(Relation rel, Relation *lovHeapP,
+							 Relation *lovIndexP, LOCKMODE lockMode);
 extern void _bitmap_insert_lov(Relation lovHeap, Relation lovIndex,
 							   Datum *datum, bool *nulls, bool use_wal);
 extern void _bitmap_close_lov_heapandindex(Relation lovHeap, 
 										Relation lovIndex, LOCKMODE lockMode);
+extern void _bitmap_build_lov_index(Relation lovHeap, Relation lovIndex);
+extern void _bitmap_begin_lov_bulkload(BMBuildState *state);
+extern void _bitmap_bulkload_lov(BMBuildState *state, Datum *datum,
+								 bool *nulls);
+extern void _bitmap_end_lov_bulkload(BMBuildState *state);
 extern bool _bitmap_findvalue(Relation lovHeap, Relation lovIndex,
 							 ScanKey scanKey, IndexScanDesc scanDesc,
 							 BlockNumber *lovBlock, bool *blockNull,
 							 OffsetNumber *lovOffset, bool *offsetNull);
+extern bool _bitmap_lovcache_lookup(Relation rel, Datum *values,
+									bool *isnull, BlockNumber *lovBlock,
+									OffsetNumber *lovOffset);
+extern void _bitmap_lovcache_store(Relation rel, Datum *values, bool *isnull,
+								   BlockNumber lovBlock,
+								   OffsetNumber lovOffset);
+extern void _bitmap_shared_lovcache_forget(Relation rel);
+extern Size _bitmap_shared_lovcache_shmem_size(void);
+extern void _bitmap_shared_lovcache_shmem_init(void);
+extern void _bitmap_drop_lov_heapandindex(Relation rel);
+extern BMLovScan _bitmap_begin_lovscan(Relation rel, bool values);
+extern bool _bitmap_lovscan_next(BMLovScan scan, BlockNumber *lovBlock,
+								 OffsetNumber *lovOffset);
+extern void _bitmap_lovscan_getvalue(BMLovScan scan, Datum *value,
+									 bool *isnull);
+extern void _bitmap_end_lovscan(BMLovScan scan);
 extern void _bitmap_vacuum(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 			               IndexBulkDeleteCallback callback, 
 						   void *callback_state);
+extern void _bitmap_vacuum_pages(IndexVacuumInfo *info,
+								 IndexBulkDeleteResult *stats);
+extern void _bitmap_vacuum_deltas(IndexVacuumInfo *info,
+								  IndexBulkDeleteResult *stats);
+extern bool _bitmap_compact_vector(Relation rel, BlockNumber lovBlock,
+								   OffsetNumber lovOffset,
+								   double min_fragmentation);
+extern int64 _bitmap_compact(Relation rel, double min_fragmentation);
+
+/* bitmapdict.c */
+extern void _bitmap_init_dictpage(Page page, Size pageSize, uint16 level);
+extern BlockNumber _bitmap_dict_create(Relation rel);
+extern bool _bitmap_dict_lookup(Relation rel, Datum *values, bool *isnull,
+								BlockNumber *lovBlock,
+								OffsetNumber *lovOffset);
+extern void _bitmap_dict_insert(Relation rel, Datum *values, bool *isnull,
+								BlockNumber lovBlock, OffsetNumber lovOffset);
+extern BMDictScan _bitmap_dict_beginscan(Relation rel, ScanKey keys,
+										 int nkeys);
+extern bool _bitmap_dict_getnext(BMDictScan scan, BlockNumber *lovBlock,
+								 OffsetNumber *lovOffset);
+extern void _bitmap_dict_endscan(BMDictScan scan);
+extern void _bitmap_dict_getvalue(BMDictScan scan, Datum *value,
+								  bool *isnull);
+extern int32 _bitmap_dict_key_scale(Relation rel);
+extern void _bitmap_init_mappage(Page page, Size pageSize, bool directory);
+extern void _bitmap_check_direct_map(Relation rel);
+extern BlockNumber _bitmap_map_create(Relation rel);
+
+/* bitmapfilter.c */
+extern Oid _bitmap_filter_hashproc(Relation rel);
+extern void _bitmap_init_filterpage(Page page, Size pageSize);
+extern BlockNumber _bitmap_filter_create(Relation rel);
+extern bool _bitmap_filter_maybe_present(Relation rel, Datum *values,
+										 bool *isnull);
+extern void _bitmap_filter_add(Relation rel, Datum *values, bool *isnull);
+
+/* bitmapcount.c */
+extern void _bitmap_count_initkey(Relation indexRel, ScanKey key, Oid opno,
+								  Datum arg);
+extern int64 _bitmap_count(Relation heapRel, Relation indexRel,
+						   Snapshot snapshot, ScanKey keys, int nkeys);
+extern BMValueCount *_bitmap_count_values(Relation heapRel,
+										  Relation indexRel,
+										  Snapshot snapshot, int *ngroups);
+
+/* bitmapplan.c */
+extern void _bitmap_init_planner(void);
 
 /*
  * TODO: WAL recovery functions
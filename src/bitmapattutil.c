@@ -27,14 +27,98 @@
 #include "catalog/namespace.h"
 #include "catalog/pg_namespace.h"
 #include "access/heapam.h"
+#include "access/tableam.h"
+#include "executor/tuptable.h"
 #include "optimizer/clauses.h"
 #include "utils/syscache.h"
 #include "utils/lsyscache.h"
 #include "utils/builtins.h"
+#include "utils/snapmgr.h"
 #include "commands/defrem.h"
 #include "commands/tablecmds.h"
+#include "common/hashfn.h"
+#include "lib/stringinfo.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+
+/*
+ * The LOV lookup cache of this backend: for each index, a hash table from
+ * the binary image of a value to the position of its LOV item, see
+ * _bitmap_lovcache_lookup().
+ */
+typedef struct BMLovCacheKey
+{
+	uint32		hash;			/* hash_bytes() of data */
+	uint32		len;
+	char	   *data;			/* the value image, in the index's cxt */
+} BMLovCacheKey;
+
+typedef struct BMLovCacheEntry
+{
+	BMLovCacheKey key;
+	BlockNumber	lovBlock;
+	OffsetNumber lovOffset;
+} BMLovCacheEntry;
+
+typedef struct BMLovCacheIndex
+{
+	Oid			indexid;		/* hash key */
+	RelFileNumber relnumber;	/* the storage the positions are valid for */
+	MemoryContext cxt;
+	HTAB	   *values;
+} BMLovCacheIndex;
+
+static HTAB *lov_caches = NULL;
+static MemoryContext lov_cache_cxt = NULL;
+
+/*
+ * The shared LOV cache: the same mapping for all backends, in a shared
+ * hash table keyed by the storage of the index and the value image. Only
+ * images of up to BM_SHARED_LOV_KEY_SIZE bytes are kept, so that the whole
+ * image is in the key and a match is exact.
+ */
+#define BM_SHARED_LOV_KEY_SIZE	32
+
+typedef struct BMSharedLovKey
+{
+	RelFileLocator locator;
+	uint32		len;
+	char		data[BM_SHARED_LOV_KEY_SIZE];
+} BMSharedLovKey;
+
+typedef struct BMSharedLovEntry
+{
+	BMSharedLovKey key;
+	BlockNumber	lovBlock;
+	OffsetNumber lovOffset;
+} BMSharedLovEntry;
+
+static HTAB *shared_lov_cache = NULL;
+static LWLock *shared_lov_lock = NULL;
 
 static TupleDesc _bitmap_create_lov_heapTupleDesc(Relation rel);
+static void flush_lov_bulkload(BMBuildState *state);
+static bool lovcache_key(Relation rel, Datum *values, bool *isnull,
+						 StringInfo key);
+static BMLovCacheIndex *lovcache_get(Relation rel, bool create);
+static void lovcache_reset(BMLovCacheIndex *icache);
+static void lovcache_drop(BMLovCacheIndex *icache);
+static void lovcache_invalidate(Datum arg, Oid relid);
+static void lovcache_store_local(Relation rel, StringInfo key,
+								 BlockNumber lovBlock,
+								 OffsetNumber lovOffset);
+static bool shared_lovcache_key(Relation rel, StringInfo image,
+								BMSharedLovKey *key);
+static uint32 lovcache_hash(const void *key, Size keysize);
+static int lovcache_match(const void *key1, const void *key2, Size keysize);
+
+/*
+ * The number of LOV tuples we collect before handing them to
+ * table_multi_insert() during an index build.
+ */
+#define BM_LOV_BULKLOAD_BATCH	1000
 
 /*
  * _bitmap_create_lov_heapandindex() -- create a new heap relation and
@@ -50,8 +134,6 @@ _bitmap_create_lov_heapandindex(Relation rel, Oid *lovHeapId, Oid *lovIndexId)
 	IndexInfo  *indexInfo;
 	ObjectAddress		objAddr, referenced;
 	Oid		*classObjectId;
-	Oid		heapid;
-	Oid		indid;
 	Oid 	typid;
 	int		indattrs;
 	int		i;
@@ -69,31 +151,7 @@ _bitmap_create_lov_heapandindex(Relation rel, Oid *lovHeapId, Oid *lovIndexId)
 	 * have existed already. Here, we delete this heap and its btree
 	 * index first.
 	 */
-	heapid = get_relname_relid(lovHeapName, PG_BITMAPINDEX_NAMESPACE);
-	if (OidIsValid(heapid))
-	{
-		ObjectAddress object;
-		indid = get_relname_relid(lovIndexName, PG_BITMAPINDEX_NAMESPACE);
-
-		Assert(OidIsValid(indid));
-
-		/*
-		 * Remove the dependency between the LOV heap relation, 
-		 * the LOV index, and the parent bitmap index before 
-		 * we drop the lov heap and index.
-		 */
-		deleteDependencyRecordsFor(RelationRelationId, heapid, false);
-		deleteDependencyRecordsFor(RelationRelationId, indid, false);
-		CommandCounterIncrement();
-
-		object.classId = RelationRelationId;
-		object.objectId = indid;
-		object.objectSubId = 0;
-		performDeletion(&object, DROP_RESTRICT, 0);
-
-		object.objectId = heapid;
-		performDeletion(&object, DROP_RESTRICT, 0);
-	}
+	_bitmap_drop_lov_heapandindex(rel);
 
 	/*
 	 * create a new empty heap to store all attribute values with their
@@ -165,13 +223,17 @@ _bitmap_create_lov_heapandindex(Relation rel, Oid *lovHeapId, Oid *lovIndexId)
 	/** Use the opened LOV Heap Relation (lovHeapRel) instead of the potentially
      * incorrect index relation (rel) as the base relation for the LOV index.
      * This avoids passing a relkind='i' relation to the start of index_create.
+     *
+     * The btree is created empty and unbuilt: the caller either builds it
+     * right away with _bitmap_build_lov_index(), or loads the LOV heap first
+     * and builds the btree over it at the end of the bitmap index build.
      */
 	*lovIndexId = index_create(lovHeapRel, lovIndexName, InvalidOid,
 				   InvalidOid, InvalidOid, InvalidOid, indexInfo, 
 				   indexColNames, BTREE_AM_OID, 
 				   rel->rd_rel->reltablespace, 
 				   classObjectId, classObjectId, NULL, NULL, NULL, 
-				   (Datum) 0, 0, 0, false, false, NULL);
+				   (Datum) 0, INDEX_CREATE_SKIP_BUILD, 0, false, false, NULL);
 
 	table_close(lovHeapRel, AccessShareLock);
 
@@ -188,6 +250,53 @@ _bitmap_create_lov_heapandindex(Relation rel, Oid *lovHeapId, Oid *lovIndexId)
 	pfree(indexInfo);
 }
 
+/*
+ * _bitmap_drop_lov_heapandindex() -- drop the LOV heap and btree a
+ *	previous build of the given bitmap index has left, if any.
+ *
+ * A REINDEX builds the index again from scratch, with a new LOV heap and
+ * btree, or with none if it is to use the value dictionary now.
+ */
+void
+_bitmap_drop_lov_heapandindex(Relation rel)
+{
+	char		lovHeapName[NAMEDATALEN];
+	char		lovIndexName[NAMEDATALEN];
+	Oid			heapid;
+	Oid			indid;
+	ObjectAddress object;
+
+	snprintf(lovHeapName, sizeof(lovHeapName), 
+			 "pg_bm_%u", RelationGetRelid(rel)); 
+	snprintf(lovIndexName, sizeof(lovIndexName), 
+			 "pg_bm_%u_index", RelationGetRelid(rel)); 
+
+	heapid = get_relname_relid(lovHeapName, PG_BITMAPINDEX_NAMESPACE);
+	if (!OidIsValid(heapid))
+		return;
+
+	indid = get_relname_relid(lovIndexName, PG_BITMAPINDEX_NAMESPACE);
+
+	Assert(OidIsValid(indid));
+
+	/*
+	 * Remove the dependency between the LOV heap relation, 
+	 * the LOV index, and the parent bitmap index before 
+	 * we drop the lov heap and index.
+	 */
+	deleteDependencyRecordsFor(RelationRelationId, heapid, false);
+	deleteDependencyRecordsFor(RelationRelationId, indid, false);
+	CommandCounterIncrement();
+
+	object.classId = RelationRelationId;
+	object.objectId = indid;
+	object.objectSubId = 0;
+	performDeletion(&object, DROP_RESTRICT, 0);
+
+	object.objectId = heapid;
+	performDeletion(&object, DROP_RESTRICT, 0);
+}
+
 /*
  * _bitmap_create_lov_heapTupleDesc() -- create the new heap tuple descriptor.
  */
@@ -244,6 +353,20 @@ _bitmap_open_lov_heapandindex(BMMetaPage metapage,
 	*lovIndexP = index_open(metapage->bm_lov_indexId, lockMode);
 }
 
+/*
+ * _bitmap_open_lov() -- open the LOV heap and btree of the given bitmap
+ *		index, as recorded in its cached metapage contents.
+ */
+void
+_bitmap_open_lov(Relation rel, Relation *lovHeapP, Relation *lovIndexP,
+				 LOCKMODE lockMode)
+{
+	BMRelCache *cache = _bitmap_get_relcache(rel);
+
+	*lovHeapP = table_open(cache->bm_lov_heapId, lockMode);
+	*lovIndexP = index_open(cache->bm_lov_indexId, lockMode);
+}
+
 /*
  * _bitmap_insert_lov() -- insert a new data into the given heap and index.
  */
@@ -280,6 +403,124 @@ _bitmap_insert_lov(Relation lovHeap, Relation lovIndex, Datum *datum,
 }
 
 
+/*
+ * _bitmap_build_lov_index() -- build the btree on the LOV heap.
+ *
+ * The LOV btree is created without being built (see
+ * _bitmap_create_lov_heapandindex()). This runs the regular btree build
+ * over whatever the LOV heap holds at this point, so a heap filled by
+ * _bitmap_bulkload_lov() gets its btree through the sorted build path
+ * instead of one uniqueness-checked insert per value.
+ */
+void
+_bitmap_build_lov_index(Relation lovHeap, Relation lovIndex)
+{
+	IndexInfo  *indexInfo;
+
+	indexInfo = BuildIndexInfo(lovIndex);
+	index_build(lovHeap, lovIndex, indexInfo, false, false);
+
+	/* make the new btree visible to the lookups that follow */
+	CommandCounterIncrement();
+
+	pfree(indexInfo);
+}
+
+/*
+ * _bitmap_begin_lov_bulkload() -- prepare to batch LOV tuples during
+ *	an index build.
+ */
+void
+_bitmap_begin_lov_bulkload(BMBuildState *state)
+{
+	int			i;
+
+	state->bm_lov_deferred = true;
+	state->bm_lov_bistate = GetBulkInsertState();
+	state->bm_lov_slots = (TupleTableSlot **)
+		palloc(BM_LOV_BULKLOAD_BATCH * sizeof(TupleTableSlot *));
+	for (i = 0; i < BM_LOV_BULKLOAD_BATCH; i++)
+		state->bm_lov_slots[i] = table_slot_create(state->bm_lov_heap, NULL);
+	state->bm_lov_nslots = 0;
+}
+
+/*
+ * _bitmap_bulkload_lov() -- queue a new LOV tuple during an index build.
+ *
+ * This is the build-time counterpart of _bitmap_insert_lov(). The tuple
+ * is not inserted into the LOV btree at all; the btree is built once all
+ * distinct values are known, in _bitmap_end_lov_bulkload().
+ */
+void
+_bitmap_bulkload_lov(BMBuildState *state, Datum *datum, bool *nulls)
+{
+	TupleTableSlot *slot;
+	int			natts;
+
+	Assert(state->bm_lov_deferred);
+
+	if (state->bm_lov_nslots == BM_LOV_BULKLOAD_BATCH)
+		flush_lov_bulkload(state);
+
+	slot = state->bm_lov_slots[state->bm_lov_nslots];
+	natts = slot->tts_tupleDescriptor->natts;
+
+	ExecClearTuple(slot);
+	memcpy(slot->tts_values, datum, natts * sizeof(Datum));
+	memcpy(slot->tts_isnull, nulls, natts * sizeof(bool));
+	ExecStoreVirtualTuple(slot);
+
+	/* the caller's datums do not survive until the batch is flushed */
+	ExecMaterializeSlot(slot);
+
+	state->bm_lov_nslots++;
+}
+
+/*
+ * _bitmap_end_lov_bulkload() -- write the remaining LOV tuples and build
+ *	the LOV btree.
+ */
+void
+_bitmap_end_lov_bulkload(BMBuildState *state)
+{
+	int			i;
+
+	Assert(state->bm_lov_deferred);
+
+	flush_lov_bulkload(state);
+	table_finish_bulk_insert(state->bm_lov_heap, TABLE_INSERT_SKIP_FSM);
+	FreeBulkInsertState(state->bm_lov_bistate);
+
+	for (i = 0; i < BM_LOV_BULKLOAD_BATCH; i++)
+		ExecDropSingleTupleTableSlot(state->bm_lov_slots[i]);
+	pfree(state->bm_lov_slots);
+
+	state->bm_lov_slots = NULL;
+	state->bm_lov_bistate = NULL;
+	state->bm_lov_deferred = false;
+
+	_bitmap_build_lov_index(state->bm_lov_heap, state->bm_lov_index);
+}
+
+/*
+ * flush_lov_bulkload() -- hand the queued LOV tuples to the table AM.
+ *
+ * The LOV heap was created in this transaction, so we skip the FSM;
+ * the table AM also skips WAL by itself when wal_level is minimal.
+ */
+static void
+flush_lov_bulkload(BMBuildState *state)
+{
+	if (state->bm_lov_nslots == 0)
+		return;
+
+	table_multi_insert(state->bm_lov_heap, state->bm_lov_slots,
+					   state->bm_lov_nslots, GetCurrentCommandId(true),
+					   TABLE_INSERT_SKIP_FSM, state->bm_lov_bistate);
+
+	state->bm_lov_nslots = 0;
+}
+
 /*
  * _bitmap_close_lov_heapandindex() -- close the heap and the index.
  */
@@ -336,4 +577,539 @@ _bitmap_findvalue(Relation lovHeap, Relation lovIndex,
 	ExecDropSingleTupleTableSlot(slot);
 	
 	return found;
-}
\ No newline at end of file
+}
+
+/*
+ * _bitmap_lovcache_lookup() -- look the given values up in the LOV lookup
+ *	cache of this backend.
+ *
+ * Once a value has a LOV item, the item never moves and is never removed,
+ * so a position seen once stays good for as long as the index keeps its
+ * storage. The cache of an index is dropped when its relcache entry is
+ * invalidated, as REINDEX, TRUNCATE and DROP do, and is also checked
+ * against the relfilenumber of the index on every use.
+ *
+ * Values are keyed by their binary image rather than by the operator
+ * class, so two equal values with different images, like 1.0 and 1.00,
+ * take an entry each. Both lead to the same LOV item. Values with a NULL
+ * are not cached.
+ *
+ * A value this backend has not seen is looked for in the shared LOV cache
+ * next, if the server has one, and copied from there.
+ */
+bool
+_bitmap_lovcache_lookup(Relation rel, Datum *values, bool *isnull,
+						BlockNumber *lovBlock, OffsetNumber *lovOffset)
+{
+	StringInfoData key;
+	BMLovCacheIndex *icache;
+	BMLovCacheEntry *entry = NULL;
+	BMLovCacheKey hkey;
+	BMSharedLovKey skey;
+
+	if (yabit_lov_cache_size <= 0 && shared_lov_cache == NULL)
+		return false;
+
+	/* detoasting may process invalidations, so build the key first */
+	initStringInfo(&key);
+	if (!lovcache_key(rel, values, isnull, &key))
+	{
+		pfree(key.data);
+		return false;
+	}
+
+	icache = lovcache_get(rel, false);
+	if (icache != NULL)
+	{
+		hkey.hash = hash_bytes((unsigned char *) key.data, key.len);
+		hkey.len = key.len;
+		hkey.data = key.data;
+		entry = (BMLovCacheEntry *) hash_search(icache->values, &hkey,
+												HASH_FIND, NULL);
+	}
+
+	if (entry != NULL)
+	{
+		*lovBlock = entry->lovBlock;
+		*lovOffset = entry->lovOffset;
+		pfree(key.data);
+		return true;
+	}
+
+	/* another backend may have seen the value */
+	if (shared_lovcache_key(rel, &key, &skey))
+	{
+		BMSharedLovEntry *sentry;
+
+		LWLockAcquire(shared_lov_lock, LW_SHARED);
+		sentry = (BMSharedLovEntry *) hash_search(shared_lov_cache, &skey,
+												  HASH_FIND, NULL);
+		if (sentry != NULL)
+		{
+			*lovBlock = sentry->lovBlock;
+			*lovOffset = sentry->lovOffset;
+		}
+		LWLockRelease(shared_lov_lock);
+
+		if (sentry != NULL)
+		{
+			lovcache_store_local(rel, &key, *lovBlock, *lovOffset);
+			pfree(key.data);
+			return true;
+		}
+	}
+
+	pfree(key.data);
+	return false;
+}
+
+/*
+ * _bitmap_lovcache_store() -- remember the LOV item position of the given
+ *	values in the LOV lookup cache of this backend, and in the shared LOV
+ *	cache if there is one.
+ */
+void
+_bitmap_lovcache_store(Relation rel, Datum *values, bool *isnull,
+					   BlockNumber lovBlock, OffsetNumber lovOffset)
+{
+	StringInfoData key;
+	BMSharedLovKey skey;
+
+	if (yabit_lov_cache_size <= 0 && shared_lov_cache == NULL)
+		return;
+
+	initStringInfo(&key);
+	if (!lovcache_key(rel, values, isnull, &key))
+	{
+		pfree(key.data);
+		return;
+	}
+
+	lovcache_store_local(rel, &key, lovBlock, lovOffset);
+
+	/*
+	 * A full shared cache takes no more values; the ones in it are as good
+	 * as any, since a LOV item position never goes stale.
+	 */
+	if (shared_lovcache_key(rel, &key, &skey))
+	{
+		BMSharedLovEntry *sentry;
+
+		LWLockAcquire(shared_lov_lock, LW_EXCLUSIVE);
+		sentry = (BMSharedLovEntry *) hash_search(shared_lov_cache, &skey,
+												  HASH_ENTER_NULL, NULL);
+		if (sentry != NULL)
+		{
+			sentry->lovBlock = lovBlock;
+			sentry->lovOffset = lovOffset;
+		}
+		LWLockRelease(shared_lov_lock);
+	}
+
+	pfree(key.data);
+}
+
+/*
+ * lovcache_store_local() -- put a value image and its LOV item position
+ *	into the LOV lookup cache of this backend.
+ *
+ * When the cache of the index holds yabit.lov_cache_size values already,
+ * it is emptied first.
+ */
+static void
+lovcache_store_local(Relation rel, StringInfo key, BlockNumber lovBlock,
+					 OffsetNumber lovOffset)
+{
+	BMLovCacheIndex *icache;
+	BMLovCacheEntry *entry;
+	BMLovCacheKey hkey;
+	bool		found;
+
+	if (yabit_lov_cache_size <= 0)
+		return;
+
+	icache = lovcache_get(rel, true);
+	if (hash_get_num_entries(icache->values) >= yabit_lov_cache_size)
+		lovcache_reset(icache);
+
+	/* copy the image first, so that an entry never points at key->data */
+	hkey.hash = hash_bytes((unsigned char *) key->data, key->len);
+	hkey.len = key->len;
+	hkey.data = MemoryContextAlloc(icache->cxt, key->len);
+	memcpy(hkey.data, key->data, key->len);
+	entry = (BMLovCacheEntry *) hash_search(icache->values, &hkey,
+											HASH_ENTER, &found);
+	if (found)
+		pfree(hkey.data);
+	entry->lovBlock = lovBlock;
+	entry->lovOffset = lovOffset;
+}
+
+/*
+ * lovcache_key() -- build the binary image of the given values in key.
+ *
+ * Varlena values are detoasted and stored without their header, so that
+ * the same value has the same image whether it came in compressed, short
+ * or plain. Returns false if a value is NULL.
+ */
+static bool
+lovcache_key(Relation rel, Datum *values, bool *isnull, StringInfo key)
+{
+	TupleDesc	tupDesc = RelationGetDescr(rel);
+	int			attno;
+
+	for (attno = 0; attno < tupDesc->natts; attno++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupDesc, attno);
+
+		if (isnull[attno])
+			return false;
+
+		if (att->attbyval)
+			appendBinaryStringInfo(key, (char *) &values[attno],
+								   sizeof(Datum));
+		else if (att->attlen > 0)
+			appendBinaryStringInfo(key, DatumGetPointer(values[attno]),
+								   att->attlen);
+		else if (att->attlen == -1)
+		{
+			struct varlena *orig = (struct varlena *)
+				DatumGetPointer(values[attno]);
+			struct varlena *val = pg_detoast_datum_packed(orig);
+			uint32		len = VARSIZE_ANY_EXHDR(val);
+
+			appendBinaryStringInfo(key, (char *) &len, sizeof(len));
+			appendBinaryStringInfo(key, VARDATA_ANY(val), len);
+			if (val != orig)
+				pfree(val);
+		}
+		else
+		{
+			char	   *str = DatumGetCString(values[attno]);
+
+			appendBinaryStringInfo(key, str, strlen(str) + 1);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * lovcache_get() -- find the LOV lookup cache of the given index, and
+ *	create an empty one if there is none and create is true.
+ *
+ * A cache left from other storage of the index is emptied.
+ */
+static BMLovCacheIndex *
+lovcache_get(Relation rel, bool create)
+{
+	Oid			indexid = RelationGetRelid(rel);
+	BMLovCacheIndex *icache;
+	bool		found;
+
+	if (lov_caches == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		if (!create)
+			return NULL;
+
+		lov_cache_cxt = AllocSetContextCreate(TopMemoryContext,
+											  "Bitmap index LOV cache",
+											  ALLOCSET_SMALL_SIZES);
+
+		MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(BMLovCacheIndex);
+		hash_ctl.hcxt = lov_cache_cxt;
+		lov_caches = hash_create("Bitmap index LOV caches", 16, &hash_ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(lovcache_invalidate, (Datum) 0);
+	}
+
+	icache = (BMLovCacheIndex *) hash_search(lov_caches, &indexid,
+											 create ? HASH_ENTER : HASH_FIND,
+											 &found);
+	if (icache == NULL)
+		return NULL;
+
+	if (!found)
+	{
+		icache->relnumber = rel->rd_locator.relNumber;
+		icache->cxt = AllocSetContextCreate(lov_cache_cxt,
+											"Bitmap index LOV cache values",
+											ALLOCSET_DEFAULT_SIZES);
+		icache->values = NULL;
+		lovcache_reset(icache);
+	}
+	else if (icache->relnumber != rel->rd_locator.relNumber)
+	{
+		lovcache_reset(icache);
+		icache->relnumber = rel->rd_locator.relNumber;
+	}
+
+	return icache;
+}
+
+/*
+ * lovcache_reset() -- start the LOV lookup cache of an index over with an
+ *	empty hash table.
+ *
+ * The table and the value images live in cxt, so resetting it frees all.
+ */
+static void
+lovcache_reset(BMLovCacheIndex *icache)
+{
+	HASHCTL		hash_ctl;
+
+	MemoryContextReset(icache->cxt);
+
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(BMLovCacheKey);
+	hash_ctl.entrysize = sizeof(BMLovCacheEntry);
+	hash_ctl.hash = lovcache_hash;
+	hash_ctl.match = lovcache_match;
+	hash_ctl.hcxt = icache->cxt;
+	icache->values = hash_create("Bitmap index LOV cache values", 256,
+								 &hash_ctl,
+								 HASH_ELEM | HASH_FUNCTION |
+								 HASH_COMPARE | HASH_CONTEXT);
+}
+
+/*
+ * lovcache_drop() -- forget the LOV lookup cache of an index.
+ */
+static void
+lovcache_drop(BMLovCacheIndex *icache)
+{
+	Oid			indexid = icache->indexid;
+
+	MemoryContextDelete(icache->cxt);
+	hash_search(lov_caches, &indexid, HASH_REMOVE, NULL);
+}
+
+/*
+ * lovcache_invalidate() -- relcache invalidation callback, which drops
+ *	the LOV lookup cache of the invalidated index, or of all indexes.
+ */
+static void
+lovcache_invalidate(Datum arg, Oid relid)
+{
+	BMLovCacheIndex *icache;
+
+	if (lov_caches == NULL)
+		return;
+
+	if (OidIsValid(relid))
+	{
+		icache = (BMLovCacheIndex *) hash_search(lov_caches, &relid,
+												 HASH_FIND, NULL);
+		if (icache != NULL)
+			lovcache_drop(icache);
+	}
+	else
+	{
+		HASH_SEQ_STATUS status;
+
+		hash_seq_init(&status, lov_caches);
+		while ((icache = (BMLovCacheIndex *) hash_seq_search(&status)) != NULL)
+			lovcache_drop(icache);
+	}
+}
+
+static uint32
+lovcache_hash(const void *key, Size keysize)
+{
+	return ((const BMLovCacheKey *) key)->hash;
+}
+
+static int
+lovcache_match(const void *key1, const void *key2, Size keysize)
+{
+	const BMLovCacheKey *k1 = (const BMLovCacheKey *) key1;
+	const BMLovCacheKey *k2 = (const BMLovCacheKey *) key2;
+
+	if (k1->hash != k2->hash || k1->len != k2->len)
+		return 1;
+	return memcmp(k1->data, k2->data, k1->len);
+}
+
+/*
+ * shared_lovcache_key() -- build the key of a value image in the shared
+ *	LOV cache.
+ *
+ * Returns false if there is no shared cache or the image is too long for
+ * it. The key is zeroed first, as the whole of it is hashed and compared.
+ */
+static bool
+shared_lovcache_key(Relation rel, StringInfo image, BMSharedLovKey *key)
+{
+	if (shared_lov_cache == NULL || image->len > BM_SHARED_LOV_KEY_SIZE)
+		return false;
+
+	MemSet(key, 0, sizeof(BMSharedLovKey));
+	key->locator = rel->rd_locator;
+	key->len = image->len;
+	memcpy(key->data, image->data, image->len);
+	return true;
+}
+
+/*
+ * _bitmap_shared_lovcache_forget() -- remove the entries of the given
+ *	index from the shared LOV cache.
+ *
+ * Called when the index is built on new storage: entries left by a
+ * dropped index whose relfilenumber has been reused would be wrong for
+ * the new one. Entries of an index's old storage are otherwise harmless,
+ * as nothing looks them up anymore, and go when the server restarts.
+ */
+void
+_bitmap_shared_lovcache_forget(Relation rel)
+{
+	HASH_SEQ_STATUS status;
+	BMSharedLovEntry *sentry;
+
+	if (shared_lov_cache == NULL)
+		return;
+
+	LWLockAcquire(shared_lov_lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, shared_lov_cache);
+	while ((sentry = (BMSharedLovEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (RelFileLocatorEquals(sentry->key.locator, rel->rd_locator))
+			hash_search(shared_lov_cache, &sentry->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(shared_lov_lock);
+}
+
+/*
+ * _bitmap_shared_lovcache_shmem_size() -- the shared memory the shared LOV
+ *	cache takes, for yabit.shared_lov_cache_size values.
+ */
+Size
+_bitmap_shared_lovcache_shmem_size(void)
+{
+	return hash_estimate_size(yabit_shared_lov_cache_size,
+							  sizeof(BMSharedLovEntry));
+}
+
+/*
+ * _bitmap_shared_lovcache_shmem_init() -- create or attach to the shared
+ *	LOV cache; called from the shmem_startup_hook.
+ */
+void
+_bitmap_shared_lovcache_shmem_init(void)
+{
+	HASHCTL		info;
+
+	if (yabit_shared_lov_cache_size <= 0)
+		return;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(BMSharedLovKey);
+	info.entrysize = sizeof(BMSharedLovEntry);
+	shared_lov_cache = ShmemInitHash("yabit LOV cache",
+									 yabit_shared_lov_cache_size,
+									 yabit_shared_lov_cache_size,
+									 &info, HASH_ELEM | HASH_BLOBS);
+	shared_lov_lock = &(GetNamedLWLockTranche("yabit LOV cache"))->lock;
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * _bitmap_begin_lovscan() -- start a walk over the LOV items of all the
+ *	distinct values of the given index.
+ *
+ * The NULL item, which has no entry in the LOV heap or the dictionary, is
+ * not returned; the callers visit it on their own. With values, the value
+ * of each LOV item can be had from _bitmap_lovscan_getvalue().
+ */
+BMLovScan
+_bitmap_begin_lovscan(Relation rel, bool values)
+{
+	BMRelCache *cache = _bitmap_get_relcache(rel);
+	BMLovScan	scan;
+
+	scan = (BMLovScan) palloc0(sizeof(BMLovScanData));
+
+	if (cache->bm_dict_root != InvalidBlockNumber)
+	{
+		scan->bm_dict_scan = _bitmap_dict_beginscan(rel, NULL, 0);
+		if (values)
+			scan->bm_dict_scan->bm_tuples = (char *) palloc(BLCKSZ);
+	}
+	else
+	{
+		scan->bm_lov_heap = table_open(cache->bm_lov_heapId, AccessShareLock);
+		scan->bm_heap_scan = table_beginscan(scan->bm_lov_heap, SnapshotAny,
+											 0, NULL);
+		scan->bm_slot = table_slot_create(scan->bm_lov_heap, NULL);
+	}
+
+	return scan;
+}
+
+/*
+ * _bitmap_lovscan_next() -- return the position of the next LOV item, or
+ *	false when there are no more.
+ */
+bool
+_bitmap_lovscan_next(BMLovScan scan, BlockNumber *lovBlock,
+					 OffsetNumber *lovOffset)
+{
+	TupleDesc	desc;
+	HeapTuple	tuple;
+	bool		isnull;
+
+	if (scan->bm_dict_scan != NULL)
+		return _bitmap_dict_getnext(scan->bm_dict_scan, lovBlock, lovOffset);
+
+	if (!table_scan_getnextslot(scan->bm_heap_scan, ForwardScanDirection,
+								scan->bm_slot))
+		return false;
+
+	desc = RelationGetDescr(scan->bm_lov_heap);
+	tuple = ExecFetchSlotHeapTuple(scan->bm_slot, false, NULL);
+	*lovBlock = DatumGetInt32(heap_getattr(tuple, desc->natts - 1, desc,
+										   &isnull));
+	*lovOffset = DatumGetInt16(heap_getattr(tuple, desc->natts, desc,
+											&isnull));
+	return true;
+}
+
+/*
+ * _bitmap_lovscan_getvalue() -- return the value of the LOV item the walk
+ *	is on, for a walk begun with values.
+ *
+ * A value taken from the LOV heap points into the walk's slot, and is
+ * good until the next call to _bitmap_lovscan_next().
+ */
+void
+_bitmap_lovscan_getvalue(BMLovScan scan, Datum *value, bool *isnull)
+{
+	if (scan->bm_dict_scan != NULL)
+		_bitmap_dict_getvalue(scan->bm_dict_scan, value, isnull);
+	else
+		*value = slot_getattr(scan->bm_slot, 1, isnull);
+}
+
+/*
+ * _bitmap_end_lovscan() -- end a walk over the LOV items.
+ */
+void
+_bitmap_end_lovscan(BMLovScan scan)
+{
+	if (scan->bm_dict_scan != NULL)
+		_bitmap_dict_endscan(scan->bm_dict_scan);
+	else
+	{
+		ExecDropSingleTupleTableSlot(scan->bm_slot);
+		table_endscan(scan->bm_heap_scan);
+		table_close(scan->bm_lov_heap, AccessShareLock);
+	}
+	pfree(scan);
+}
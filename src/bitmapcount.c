@@ -0,0 +1,701 @@
+/*-------------------------------------------------------------------------
+ *
+ * bitmapcount.c
+ *	Count the rows a scan of an on-disk bitmap index matches, without
+ *	making a TID bitmap of them.
+ *
+ * The words of the matching vectors are ORed by _bitmap_union() as for
+ * any scan, and counted as they come: a fill word of ones counts the
+ * rows it covers block by block, and a literal word its set bits. A row
+ * is only counted that way if its heap block is all-visible in the
+ * visibility map, as in an index-only scan; otherwise its heap tuple is
+ * fetched and counted if the snapshot sees it. The TIDs of the delta
+ * pages are merged in as the words go by, so that a TID vacuum has
+ * folded into the words meanwhile is counted once.
+ *
+ * The heap blocks a deferred index has not summarized yet are scanned
+ * instead, and their rows tested against the scan keys.
+ *
+ * _bitmap_count_values() counts each vector of the index on its own this
+ * way, for the rows of each distinct value.
+ *
+ * IDENTIFICATION
+ *	  $PostgreSQL$
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "bitmap.h"
+
+#include "access/tableam.h"
+#include "access/visibilitymap.h"
+#include "catalog/index.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "port/pg_bitutils.h"
+#include "storage/bufmgr.h"
+#include "utils/datum.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+
+/*
+ * The state of a count.
+ */
+typedef struct BMCountState
+{
+	Relation	heapRel;
+	Snapshot	snapshot;
+	BlockNumber	summarizedEnd;	/* bits from here on are not counted */
+	IndexFetchTableData *fetch;
+	TupleTableSlot *slot;
+	Buffer		vmbuffer;
+	BlockNumber	visBlock;		/* the block visAll is for */
+	bool		visAll;
+	uint64	   *deltas;			/* sorted, distinct delta TIDs */
+	uint32		ndeltas;
+	uint32		nextDelta;
+	int64		count;
+} BMCountState;
+
+/*
+ * What count_value_cmp() orders values by.
+ */
+typedef struct BMValueCmp
+{
+	FmgrInfo   *proc;
+	Oid			collation;
+} BMValueCmp;
+
+static void count_begin(BMCountState *state, Relation heapRel,
+						Snapshot snapshot, BlockNumber summarizedEnd);
+static void count_end(BMCountState *state);
+static void count_scanpos(BMCountState *state, IndexScanDesc scan);
+static void count_collect_deltas(BMCountState *state, BMScanPosition scanPos);
+static bool count_block_visible(BMCountState *state, BlockNumber blkno);
+static void count_tid(BMCountState *state, uint64 tidnum);
+static void count_range(BMCountState *state, uint64 first, uint64 last);
+static void count_word(BMCountState *state, BM_WORD word, bool isFill,
+					   uint64 location);
+static void count_unsummarized(BMCountState *state, Relation indexRel,
+							   ScanKey keys, int nkeys);
+static int64 count_vector(BMCountState *state, IndexScanDesc scan,
+						  BlockNumber lovBlock, OffsetNumber lovOffset);
+static void count_unsummarized_values(BMCountState *state,
+									  Relation indexRel, BMValueCmp *cmp,
+									  BMValueCount **groups, int *ngroups,
+									  int *maxgroups);
+static void count_add_group(BMValueCount **groups, int *ngroups,
+							int *maxgroups, Datum value, bool isnull,
+							int64 count);
+static int	count_delta_cmp(const void *a, const void *b);
+static int	count_value_cmp(const void *a, const void *b, void *arg);
+
+/*
+ * _bitmap_count_initkey() -- initialize a scan key comparing the column
+ *	of the given index with arg through the operator opno.
+ *
+ * opno has to be a btree comparison operator of the index's operator
+ * family, with the index's type on its left.
+ */
+void
+_bitmap_count_initkey(Relation indexRel, ScanKey key, Oid opno, Datum arg)
+{
+	int			strategy;
+	Oid			lefttype;
+	Oid			righttype;
+
+	get_op_opfamily_properties(opno, indexRel->rd_opfamily[0], false,
+							   &strategy, &lefttype, &righttype);
+
+	ScanKeyEntryInitialize(key, 0, 1, (StrategyNumber) strategy, righttype,
+						   indexRel->rd_indcollation[0], get_opcode(opno),
+						   arg);
+}
+
+/*
+ * _bitmap_count() -- count the rows of heapRel the snapshot sees whose
+ *	value in indexRel satisfies all the keys.
+ */
+int64
+_bitmap_count(Relation heapRel, Relation indexRel, Snapshot snapshot,
+			  ScanKey keys, int nkeys)
+{
+	BMCountState state;
+	IndexScanDesc scan;
+
+	/* as in bmgetbitmap_internal(), before the vectors */
+	count_begin(&state, heapRel, snapshot,
+				_bitmap_get_summarized_end(indexRel));
+
+	scan = index_beginscan_bitmap(indexRel, snapshot, nkeys);
+	index_rescan(scan, keys, nkeys, NULL, 0);
+
+	_bitmap_findbitmaps(scan, ForwardScanDirection);
+	count_scanpos(&state, scan);
+
+	index_endscan(scan);
+
+	if (BlockNumberIsValid(state.summarizedEnd))
+		count_unsummarized(&state, indexRel, keys, nkeys);
+
+	count_end(&state);
+
+	return state.count;
+}
+
+/*
+ * _bitmap_count_values() -- count the rows of heapRel the snapshot sees
+ *	for each distinct value of indexRel, NULL included.
+ *
+ * Returns the values that have rows, ordered by the index's order
+ * procedure with NULL last, and sets *ngroups to their number.
+ */
+BMValueCount *
+_bitmap_count_values(Relation heapRel, Relation indexRel, Snapshot snapshot,
+					 int *ngroups)
+{
+	Form_pg_attribute att = TupleDescAttr(RelationGetDescr(indexRel), 0);
+	BMCountState state;
+	IndexScanDesc scan;
+	BMScanOpaque so;
+	BMLovScan	lovScan;
+	BlockNumber	lovBlock;
+	OffsetNumber lovOffset;
+	BMValueCount *groups;
+	int			maxgroups = 64;
+	int64		count;
+	BMValueCmp	cmp;
+
+	*ngroups = 0;
+	groups = (BMValueCount *) palloc(maxgroups * sizeof(BMValueCount));
+
+	count_begin(&state, heapRel, snapshot,
+				_bitmap_get_summarized_end(indexRel));
+
+	scan = index_beginscan_bitmap(indexRel, snapshot, 0);
+	index_rescan(scan, NULL, 0, NULL, 0);
+
+	/* count_vector() sets the position up for one vector at a time */
+	so = (BMScanOpaque) scan->opaque;
+	so->bm_currPos = (BMScanPosition)
+		MemoryContextAllocZero(so->scanMemoryContext,
+							   sizeof(BMScanPositionData));
+
+	/* the NULL vector has no LOV heap tuple */
+	count = count_vector(&state, scan, BM_LOV_STARTPAGE, 1);
+	if (count > 0)
+		count_add_group(&groups, ngroups, &maxgroups, (Datum) 0, true, count);
+
+	lovScan = _bitmap_begin_lovscan(indexRel, true);
+	while (_bitmap_lovscan_next(lovScan, &lovBlock, &lovOffset))
+	{
+		Datum		value;
+		bool		isnull;
+
+		count = count_vector(&state, scan, lovBlock, lovOffset);
+		if (count == 0)
+			continue;
+
+		_bitmap_lovscan_getvalue(lovScan, &value, &isnull);
+		count_add_group(&groups, ngroups, &maxgroups,
+						isnull ? (Datum) 0 :
+						datumCopy(value, att->attbyval, att->attlen),
+						isnull, count);
+	}
+	_bitmap_end_lovscan(lovScan);
+
+	index_endscan(scan);
+
+	cmp.proc = index_getprocinfo(indexRel, 1, BM_ORDER_PROC);
+	cmp.collation = indexRel->rd_indcollation[0];
+	qsort_arg(groups, *ngroups, sizeof(BMValueCount), count_value_cmp, &cmp);
+
+	if (BlockNumberIsValid(state.summarizedEnd))
+		count_unsummarized_values(&state, indexRel, &cmp, &groups, ngroups,
+								  &maxgroups);
+
+	count_end(&state);
+
+	return groups;
+}
+
+/*
+ * count_vector() -- count the rows of the vector of one LOV item.
+ */
+static int64
+count_vector(BMCountState *state, IndexScanDesc scan, BlockNumber lovBlock,
+			 OffsetNumber lovOffset)
+{
+	BMScanOpaque so = (BMScanOpaque) scan->opaque;
+	BMScanPosition scanPos = so->bm_currPos;
+
+	CHECK_FOR_INTERRUPTS();
+
+	if (state->deltas != NULL)
+		pfree(state->deltas);
+	state->deltas = NULL;
+	state->ndeltas = 0;
+	state->nextDelta = 0;
+	state->count = 0;
+
+	scanPos->done = false;
+	MemSet(&scanPos->bm_result, 0, sizeof(BMIterateResult));
+	scanPos->posvecs = (BMVector)
+		MemoryContextAllocZero(so->scanMemoryContext, sizeof(BMVectorData));
+	_bitmap_initscanpos(scan, scanPos->posvecs, lovBlock, lovOffset);
+	scanPos->nvec = 1;
+	scanPos->bm_batchWords = scanPos->posvecs->bm_batchWords;
+
+	count_scanpos(state, scan);
+
+	/* let the next vector start afresh, and bmendscan find nothing */
+	_bitmap_cleanup_scanpos(scanPos->posvecs, scanPos->nvec);
+	scanPos->posvecs = NULL;
+	scanPos->nvec = 0;
+
+	return state->count;
+}
+
+/*
+ * count_scanpos() -- count the rows of the vectors set up in the current
+ *	position of the given scan.
+ */
+static void
+count_scanpos(BMCountState *state, IndexScanDesc scan)
+{
+	BMScanPosition scanPos = ((BMScanOpaque) scan->opaque)->bm_currPos;
+	uint64		location = 0;
+
+	if (scanPos == NULL || scanPos->done)
+		return;
+
+	count_collect_deltas(state, scanPos);
+
+	for (;;)
+	{
+		BMBatchWords *words;
+		uint32		wordNo;
+
+		CHECK_FOR_INTERRUPTS();
+
+		_bitmap_reset_batchwords(scanPos->bm_batchWords);
+		if (!_bitmap_nextbatchwords(scan, ForwardScanDirection))
+			break;
+
+		words = scanPos->bm_batchWords;
+		if (words->nwords == 0)
+			break;
+
+		for (wordNo = words->startNo;
+			 wordNo < words->startNo + words->nwords; wordNo++)
+		{
+			BM_WORD		word = words->cwords[wordNo];
+			bool		isFill = IS_FILL_WORD(words->hwords, wordNo);
+
+			count_word(state, word, isFill, location);
+			location += (isFill ? FILL_LENGTH(word) : 1) * BM_WORD_SIZE;
+		}
+	}
+
+	/* the deltas past the last word */
+	while (state->nextDelta < state->ndeltas)
+		count_tid(state, state->deltas[state->nextDelta++]);
+}
+
+/*
+ * count_begin() -- set up the state of a count.
+ */
+static void
+count_begin(BMCountState *state, Relation heapRel, Snapshot snapshot,
+			BlockNumber summarizedEnd)
+{
+	MemSet(state, 0, sizeof(BMCountState));
+	state->heapRel = heapRel;
+	state->snapshot = snapshot;
+	state->summarizedEnd = summarizedEnd;
+	state->fetch = table_index_fetch_begin(heapRel);
+	state->slot = table_slot_create(heapRel, NULL);
+	state->vmbuffer = InvalidBuffer;
+	state->visBlock = InvalidBlockNumber;
+}
+
+/*
+ * count_end() -- release what a count holds.
+ */
+static void
+count_end(BMCountState *state)
+{
+	table_index_fetch_end(state->fetch);
+	ExecDropSingleTupleTableSlot(state->slot);
+	if (BufferIsValid(state->vmbuffer))
+		ReleaseBuffer(state->vmbuffer);
+	if (state->deltas != NULL)
+		pfree(state->deltas);
+}
+
+/*
+ * count_collect_deltas() -- gather the delta TIDs of all the vectors in
+ *	the scan position, in order and without duplicates.
+ */
+static void
+count_collect_deltas(BMCountState *state, BMScanPosition scanPos)
+{
+	uint32		ndeltas = 0;
+	uint32		i;
+	uint32		j;
+	int			vectorNo;
+
+	for (vectorNo = 0; vectorNo < scanPos->nvec; vectorNo++)
+		ndeltas += scanPos->posvecs[vectorNo].bm_numDeltaTids;
+	if (ndeltas == 0)
+		return;
+
+	state->deltas = (uint64 *) palloc(ndeltas * sizeof(uint64));
+	for (vectorNo = 0; vectorNo < scanPos->nvec; vectorNo++)
+	{
+		BMVector	vec = &scanPos->posvecs[vectorNo];
+
+		memcpy(state->deltas + state->ndeltas, vec->bm_deltaTids,
+			   vec->bm_numDeltaTids * sizeof(uint64));
+		state->ndeltas += vec->bm_numDeltaTids;
+	}
+
+	qsort(state->deltas, state->ndeltas, sizeof(uint64), count_delta_cmp);
+	for (i = 1, j = 0; i < state->ndeltas; i++)
+	{
+		if (state->deltas[i] != state->deltas[j])
+			state->deltas[++j] = state->deltas[i];
+	}
+	state->ndeltas = j + 1;
+}
+
+/*
+ * count_block_visible() -- is the given heap block all-visible?
+ *
+ * The answer for the last block asked about is kept, as the bits of a
+ * block come one after the other.
+ */
+static bool
+count_block_visible(BMCountState *state, BlockNumber blkno)
+{
+	if (blkno != state->visBlock)
+	{
+		state->visBlock = blkno;
+		state->visAll = VM_ALL_VISIBLE(state->heapRel, blkno,
+									   &state->vmbuffer);
+	}
+
+	return state->visAll;
+}
+
+/*
+ * count_tid() -- count the row of the given TID location if the
+ *	snapshot sees it.
+ */
+static void
+count_tid(BMCountState *state, uint64 tidnum)
+{
+	BlockNumber	blkno = BM_INT_GET_BLOCKNO(tidnum);
+	ItemPointerData htid;
+	bool		call_again = false;
+	bool		all_dead = false;
+
+	if (blkno >= state->summarizedEnd)
+		return;
+
+	if (count_block_visible(state, blkno))
+	{
+		state->count++;
+		return;
+	}
+
+	ItemPointerSet(&htid, blkno, BM_INT_GET_OFFSET(tidnum));
+	if (table_index_fetch_tuple(state->fetch, &htid, state->snapshot,
+								state->slot, &call_again, &all_dead))
+		state->count++;
+}
+
+/*
+ * count_range() -- count the rows of the TID locations first to last,
+ *	which all have their bit set.
+ */
+static void
+count_range(BMCountState *state, uint64 first, uint64 last)
+{
+	while (first <= last)
+	{
+		BlockNumber	blkno = BM_INT_GET_BLOCKNO(first);
+		uint64		blockLast;
+
+		if (blkno >= state->summarizedEnd)
+			return;
+
+		blockLast = Min(last, (uint64) (blkno + 1) * BM_MAX_HTUP_PER_PAGE);
+		if (count_block_visible(state, blkno))
+			state->count += blockLast - first + 1;
+		else
+		{
+			uint64		tidnum;
+
+			for (tidnum = first; tidnum <= blockLast; tidnum++)
+				count_tid(state, tidnum);
+		}
+		first = blockLast + 1;
+	}
+}
+
+/*
+ * count_word() -- count the rows of one word of the ORed vectors, which
+ *	covers the TID locations after location, and those of the deltas
+ *	before its end.
+ */
+static void
+count_word(BMCountState *state, BM_WORD word, bool isFill, uint64 location)
+{
+	uint64		last = location +
+		(isFill ? FILL_LENGTH(word) : 1) * BM_WORD_SIZE;
+	bool		anyDelta = false;
+
+	/* the deltas before the word are in no word */
+	while (state->nextDelta < state->ndeltas &&
+		   state->deltas[state->nextDelta] <= location)
+		count_tid(state, state->deltas[state->nextDelta++]);
+
+	/* those within it count unless the word has their bit set */
+	while (state->nextDelta < state->ndeltas &&
+		   state->deltas[state->nextDelta] <= last)
+	{
+		uint64		tidnum = state->deltas[state->nextDelta++];
+
+		if (isFill ? !GET_FILL_BIT(word) :
+			(word & (((BM_WORD) 1) << (tidnum - location - 1))) == 0)
+			count_tid(state, tidnum);
+		anyDelta = true;
+	}
+
+	if (isFill)
+	{
+		if (GET_FILL_BIT(word) == 1)
+			count_range(state, location + 1, last);
+	}
+	else if (word != 0)
+	{
+		BlockNumber	blkno = BM_INT_GET_BLOCKNO(location + 1);
+
+		if (!anyDelta && blkno == BM_INT_GET_BLOCKNO(last) &&
+			blkno < state->summarizedEnd &&
+			count_block_visible(state, blkno))
+			state->count += pg_popcount32(word);
+		else
+		{
+			int			bit;
+
+			for (bit = 0; bit < BM_WORD_SIZE; bit++)
+			{
+				if (word & (((BM_WORD) 1) << bit))
+					count_tid(state, location + bit + 1);
+			}
+		}
+	}
+}
+
+/*
+ * count_unsummarized() -- count the rows of the heap blocks a deferred
+ *	index has not summarized that satisfy all the keys.
+ */
+static void
+count_unsummarized(BMCountState *state, Relation indexRel, ScanKey keys,
+				   int nkeys)
+{
+	BlockNumber	nblocks = RelationGetNumberOfBlocks(state->heapRel);
+	IndexInfo  *indexInfo;
+	EState	   *estate;
+	ExprContext *econtext;
+	ExprState  *predicate;
+	TableScanDesc scan;
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+
+	if (state->summarizedEnd >= nblocks)
+		return;
+
+	indexInfo = BuildIndexInfo(indexRel);
+	estate = CreateExecutorState();
+	econtext = GetPerTupleExprContext(estate);
+	econtext->ecxt_scantuple = state->slot;
+	predicate = ExecPrepareQual(indexInfo->ii_Predicate, estate);
+
+	scan = table_beginscan_strat(state->heapRel, state->snapshot, 0, NULL,
+								 true, false);
+	heap_setscanlimits(scan, state->summarizedEnd,
+					   nblocks - state->summarizedEnd);
+
+	while (table_scan_getnextslot(scan, ForwardScanDirection, state->slot))
+	{
+		bool		match = true;
+		int			keyNo;
+
+		CHECK_FOR_INTERRUPTS();
+		ResetExprContext(econtext);
+
+		if (predicate != NULL && !ExecQual(predicate, econtext))
+			continue;
+
+		FormIndexDatum(indexInfo, state->slot, estate, values, isnull);
+		if (isnull[0])
+			continue;
+
+		for (keyNo = 0; keyNo < nkeys && match; keyNo++)
+		{
+			ScanKey		key = &keys[keyNo];
+
+			match = !(key->sk_flags & SK_ISNULL) &&
+				DatumGetBool(FunctionCall2Coll(&key->sk_func,
+											   key->sk_collation,
+											   values[0],
+											   key->sk_argument));
+		}
+		if (match)
+			state->count++;
+	}
+
+	table_endscan(scan);
+	FreeExecutorState(estate);
+}
+
+/*
+ * count_unsummarized_values() -- add the rows of the heap blocks a
+ *	deferred index has not summarized to the counts of their values.
+ *
+ * The values of those rows are sorted and merged with the groups, which
+ * are sorted already; a value no vector has yet gets a group of its own.
+ */
+static void
+count_unsummarized_values(BMCountState *state, Relation indexRel,
+						  BMValueCmp *cmp, BMValueCount **groups,
+						  int *ngroups, int *maxgroups)
+{
+	Form_pg_attribute att = TupleDescAttr(RelationGetDescr(indexRel), 0);
+	BlockNumber	nblocks = RelationGetNumberOfBlocks(state->heapRel);
+	BMValueCount *rows;
+	int			nrows = 0;
+	int			maxrows = 64;
+	int			ngroupsOld;
+	int			i;
+	int			j;
+
+	rows = (BMValueCount *) palloc(maxrows * sizeof(BMValueCount));
+
+	if (state->summarizedEnd < nblocks)
+	{
+		IndexInfo  *indexInfo = BuildIndexInfo(indexRel);
+		EState	   *estate = CreateExecutorState();
+		ExprContext *econtext = GetPerTupleExprContext(estate);
+		ExprState  *predicate;
+		TableScanDesc scan;
+		Datum		values[INDEX_MAX_KEYS];
+		bool		isnull[INDEX_MAX_KEYS];
+
+		econtext->ecxt_scantuple = state->slot;
+		predicate = ExecPrepareQual(indexInfo->ii_Predicate, estate);
+
+		scan = table_beginscan_strat(state->heapRel, state->snapshot, 0, NULL,
+									 true, false);
+		heap_setscanlimits(scan, state->summarizedEnd,
+						   nblocks - state->summarizedEnd);
+
+		while (table_scan_getnextslot(scan, ForwardScanDirection,
+									  state->slot))
+		{
+			CHECK_FOR_INTERRUPTS();
+			ResetExprContext(econtext);
+
+			if (predicate != NULL && !ExecQual(predicate, econtext))
+				continue;
+
+			FormIndexDatum(indexInfo, state->slot, estate, values, isnull);
+			count_add_group(&rows, &nrows, &maxrows,
+							isnull[0] ? (Datum) 0 :
+							datumCopy(values[0], att->attbyval, att->attlen),
+							isnull[0], 1);
+		}
+
+		table_endscan(scan);
+		FreeExecutorState(estate);
+	}
+
+	qsort_arg(rows, nrows, sizeof(BMValueCount), count_value_cmp, cmp);
+
+	ngroupsOld = *ngroups;
+	for (i = 0, j = 0; i < nrows;)
+	{
+		int			run = 1;
+		int			c = 1;
+
+		while (i + run < nrows &&
+			   count_value_cmp(&rows[i], &rows[i + run], cmp) == 0)
+			run++;
+
+		while (j < ngroupsOld &&
+			   (c = count_value_cmp(&(*groups)[j], &rows[i], cmp)) < 0)
+			j++;
+
+		if (j < ngroupsOld && c == 0)
+			(*groups)[j].count += run;
+		else
+			count_add_group(groups, ngroups, maxgroups, rows[i].value,
+							rows[i].isnull, run);
+		i += run;
+	}
+	pfree(rows);
+
+	if (*ngroups > ngroupsOld)
+		qsort_arg(*groups, *ngroups, sizeof(BMValueCount), count_value_cmp,
+				  cmp);
+}
+
+/*
+ * count_add_group() -- append a value and its count to an array of them.
+ */
+static void
+count_add_group(BMValueCount **groups, int *ngroups, int *maxgroups,
+				Datum value, bool isnull, int64 count)
+{
+	if (*ngroups >= *maxgroups)
+	{
+		*maxgroups *= 2;
+		*groups = (BMValueCount *) repalloc_huge(*groups,
+												 *maxgroups *
+												 sizeof(BMValueCount));
+	}
+
+	(*groups)[*ngroups].value = value;
+	(*groups)[*ngroups].isnull = isnull;
+	(*groups)[*ngroups].count = count;
+	(*ngroups)++;
+}
+
+static int
+count_delta_cmp(const void *a, const void *b)
+{
+	uint64		ta = *(const uint64 *) a;
+	uint64		tb = *(const uint64 *) b;
+
+	if (ta == tb)
+		return 0;
+	return (ta < tb) ? -1 : 1;
+}
+
+/* order values by the order procedure of the index, NULL last */
+static int
+count_value_cmp(const void *a, const void *b, void *arg)
+{
+	const BMValueCount *va = (const BMValueCount *) a;
+	const BMValueCount *vb = (const BMValueCount *) b;
+	BMValueCmp *cmp = (BMValueCmp *) arg;
+
+	if (va->isnull || vb->isnull)
+		return (int) va->isnull - (int) vb->isnull;
+
+	return DatumGetInt32(FunctionCall2Coll(cmp->proc, cmp->collation,
+										   va->value, vb->value));
+}
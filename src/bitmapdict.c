@@ -0,0 +1,1222 @@
+/*-------------------------------------------------------------------------
+ *
+ * bitmapdict.c
+ *	Maintain the value dictionary of an on-disk bitmap index: a small
+ *	search tree in the index itself that maps every distinct value to
+ *	the position of its LOV item.
+ *
+ * An index built with the dictionary option uses it in place of the LOV
+ * heap and btree of bitmapattutil.c, so looking a value up takes a few
+ * buffer reads of the index and no relation opens, and building the
+ * index creates no catalog entries. See BMDictPageOpaqueData for the
+ * layout of the pages.
+ *
+ * A numeric column of bounded precision has its values kept as scaled
+ * int64 keys, see BM_DICT_KEY_DIGITS, so that lookups and scans compare
+ * integers rather than calling numeric_cmp(). Scan keys are turned into
+ * keys on the same scale, rounded towards the values they admit.
+ *
+ * For an int4 or date column, the direct map of the dictionary answers
+ * the lookups of the values it covers on its own, see
+ * BMMapPageOpaqueData.
+ *
+ * Only inserts of new values change the dictionary, and those hold the
+ * index's insert lock (see find_lovitem()), or are part of the index
+ * build, so there is one writer at a time. Readers take no lock but
+ * the buffer lock of the page they are on.
+ *
+ * IDENTIFICATION
+ *	  $PostgreSQL$
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "bitmap.h"
+
+#include "access/genam.h"
+#include "access/itup.h"
+#include "access/stratnum.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/fmgrprotos.h"
+#include "utils/fmgroids.h"
+#include "utils/numeric.h"
+#include "utils/rel.h"
+
+static int	dict_compare(Relation rel, IndexTuple itup, Datum *values,
+						 bool *isnull, int nkeys);
+static OffsetNumber dict_binsrch(Relation rel, Page page, Datum *values,
+								 bool *isnull, int nkeys);
+static Buffer dict_descend(Relation rel, Datum *values, bool *isnull,
+						   int nkeys, uint16 level, int access);
+static void dict_insert_item(Relation rel, Buffer buf, IndexTuple itup,
+							 OffsetNumber offset);
+static void dict_split(Relation rel, Buffer buf, IndexTuple itup,
+					   OffsetNumber offset);
+static void dict_fill_page(Page page, IndexTuple *items, int nitems);
+static bool dict_checkkeys(BMDictScan scan, IndexTuple itup, bool *stop);
+static void dict_readpage(BMDictScan scan, Buffer buf);
+static TupleDesc dict_desc(Relation rel);
+static Datum *dict_keys(Relation rel, Datum *values, bool *isnull,
+						Datum *keys);
+static bool dict_numeric_key(Numeric num, int32 scale, int64 *floorKey,
+							 int64 *ceilKey);
+static int64 dict_clamp_key(Datum num, bool *clamped);
+static ScanKey dict_scale_scankeys(Relation rel, ScanKey keys, int nkeys,
+								   bool *empty);
+static bool dict_test_key(StrategyNumber strategy, int64 key, int64 arg);
+static bool map_position(Datum value, int64 *chunk, int64 *slot);
+static bool map_lookup(Relation rel, Datum value, bool *found,
+					   BlockNumber *lovBlock, OffsetNumber *lovOffset);
+static void map_insert(Relation rel, Datum value, BlockNumber lovBlock,
+					   OffsetNumber lovOffset);
+
+/*
+ * _bitmap_init_dictpage() -- initialize a new dictionary page.
+ */
+void
+_bitmap_init_dictpage(Page page, Size pageSize, uint16 level)
+{
+	BMDictPageOpaque opaque;
+
+	PageInit(page, pageSize, sizeof(BMDictPageOpaqueData));
+
+	opaque = (BMDictPageOpaque) PageGetSpecialPointer(page);
+	opaque->bm_dict_right = InvalidBlockNumber;
+	opaque->bm_dict_level = level;
+	opaque->bm_page_id = BM_DICT_PAGE_ID;
+}
+
+/*
+ * _bitmap_dict_create() -- add the root page of an empty dictionary to
+ *	the index, and return its block number.
+ */
+BlockNumber
+_bitmap_dict_create(Relation rel)
+{
+	Buffer		buf;
+	BlockNumber	blkno;
+
+	buf = _bitmap_getbuf(rel, P_NEW, BM_WRITE);
+
+	START_CRIT_SECTION();
+	_bitmap_init_dictpage(BufferGetPage(buf), BufferGetPageSize(buf), 0);
+	MarkBufferDirty(buf);
+	END_CRIT_SECTION();
+
+	blkno = BufferGetBlockNumber(buf);
+	_bitmap_relbuf(buf);
+
+	return blkno;
+}
+
+/*
+ * _bitmap_dict_lookup() -- find the LOV item of the given values.
+ *
+ * Returns false if the dictionary does not have them.
+ */
+bool
+_bitmap_dict_lookup(Relation rel, Datum *values, bool *isnull,
+					BlockNumber *lovBlock, OffsetNumber *lovOffset)
+{
+	int			natts = RelationGetDescr(rel)->natts;
+	Datum		keys[INDEX_MAX_KEYS];
+	Buffer		buf;
+	bool		found = false;
+
+	if (!isnull[0] &&
+		map_lookup(rel, values[0], &found, lovBlock, lovOffset))
+		return found;
+
+	values = dict_keys(rel, values, isnull, keys);
+	buf = dict_descend(rel, values, isnull, natts, 0, BM_READ);
+
+	for (;;)
+	{
+		Page		page = BufferGetPage(buf);
+		BMDictPageOpaque opaque = (BMDictPageOpaque) PageGetSpecialPointer(page);
+		OffsetNumber off = dict_binsrch(rel, page, values, isnull, natts);
+		BlockNumber	next;
+
+		if (off <= PageGetMaxOffsetNumber(page))
+		{
+			IndexTuple	itup = (IndexTuple) PageGetItem(page,
+														PageGetItemId(page, off));
+
+			if (dict_compare(rel, itup, values, isnull, natts) == 0)
+			{
+				*lovBlock = ItemPointerGetBlockNumber(&itup->t_tid);
+				*lovOffset = ItemPointerGetOffsetNumber(&itup->t_tid);
+				found = true;
+			}
+			break;
+		}
+
+		/* all values here are smaller; the page may have split on us */
+		next = opaque->bm_dict_right;
+		if (next == InvalidBlockNumber)
+			break;
+		_bitmap_relbuf(buf);
+		buf = _bitmap_getbuf(rel, next, BM_READ);
+	}
+
+	_bitmap_relbuf(buf);
+	return found;
+}
+
+/*
+ * _bitmap_dict_insert() -- add the given values, whose LOV item is at
+ *	lovBlock and lovOffset, to the dictionary.
+ *
+ * The values must not be in the dictionary yet, and the caller must be
+ * the only writer of the dictionary, see the head of this file.
+ */
+void
+_bitmap_dict_insert(Relation rel, Datum *values, bool *isnull,
+					BlockNumber lovBlock, OffsetNumber lovOffset)
+{
+	TupleDesc	tupDesc = dict_desc(rel);
+	Datum		keys[INDEX_MAX_KEYS];
+	Datum	   *dvalues = dict_keys(rel, values, isnull, keys);
+	IndexTuple	itup;
+	Buffer		buf;
+	Page		page;
+	OffsetNumber off;
+
+	itup = index_form_tuple(tupDesc, dvalues, isnull);
+	ItemPointerSet(&itup->t_tid, lovBlock, lovOffset);
+
+	if (IndexTupleSize(itup) > BM_DICT_MAX_ITEM_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("index row size %zu exceeds maximum %zu for the dictionary of index \"%s\"",
+						(Size) IndexTupleSize(itup),
+						(Size) BM_DICT_MAX_ITEM_SIZE,
+						RelationGetRelationName(rel))));
+
+	buf = dict_descend(rel, dvalues, isnull, tupDesc->natts, 0, BM_WRITE);
+
+	/*
+	 * If a split before ours failed to add its downlink, the values past
+	 * the end of this page may live on its right sibling already.
+	 */
+	for (;;)
+	{
+		BMDictPageOpaque opaque;
+		Buffer		rbuf;
+		Page		rpage;
+
+		page = BufferGetPage(buf);
+		opaque = (BMDictPageOpaque) PageGetSpecialPointer(page);
+		off = dict_binsrch(rel, page, dvalues, isnull, tupDesc->natts);
+
+		if (off <= PageGetMaxOffsetNumber(page) ||
+			opaque->bm_dict_right == InvalidBlockNumber)
+			break;
+
+		rbuf = _bitmap_getbuf(rel, opaque->bm_dict_right, BM_WRITE);
+		rpage = BufferGetPage(rbuf);
+		if (PageGetMaxOffsetNumber(rpage) == InvalidOffsetNumber ||
+			dict_compare(rel,
+						 (IndexTuple) PageGetItem(rpage,
+												  PageGetItemId(rpage, FirstOffsetNumber)),
+						 dvalues, isnull, tupDesc->natts) > 0)
+		{
+			_bitmap_relbuf(rbuf);
+			break;
+		}
+		_bitmap_relbuf(buf);
+		buf = rbuf;
+	}
+
+	dict_insert_item(rel, buf, itup, off);
+	pfree(itup);
+
+	if (!isnull[0])
+		map_insert(rel, values[0], lovBlock, lovOffset);
+}
+
+/*
+ * _bitmap_dict_beginscan() -- start a scan of the dictionary for the
+ *	values that satisfy all of the given scan keys.
+ *
+ * With no keys, the scan returns every value. A key on the first column
+ * that gives a lower bound sends the scan down to the first leaf page
+ * that may hold a match; one that gives an upper bound ends it at the
+ * first value past that bound.
+ */
+BMDictScan
+_bitmap_dict_beginscan(Relation rel, ScanKey keys, int nkeys)
+{
+	BMDictScan	scan;
+	ScanKey		startKey = NULL;
+	bool		startNull = false;
+	Buffer		buf;
+	int			i;
+
+	scan = (BMDictScan) palloc0(sizeof(BMDictScanData));
+	scan->bm_rel = rel;
+	scan->bm_nkeys = nkeys;
+
+	if (nkeys > 0 && _bitmap_get_relcache(rel)->bm_key_scale >= 0)
+	{
+		bool		empty;
+
+		keys = dict_scale_scankeys(rel, keys, nkeys, &empty);
+		if (empty)
+		{
+			/* an equality key that no value of the column can meet */
+			scan->bm_keys = keys;
+			scan->bm_next = InvalidBlockNumber;
+			return scan;
+		}
+	}
+	scan->bm_keys = keys;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		ScanKey		key = &keys[i];
+
+		if (key->sk_attno == 1 && !(key->sk_flags & SK_ISNULL) &&
+			(key->sk_strategy == BTEqualStrategyNumber ||
+			 key->sk_strategy == BTGreaterEqualStrategyNumber ||
+			 key->sk_strategy == BTGreaterStrategyNumber) &&
+			(key->sk_subtype == InvalidOid ||
+			 key->sk_subtype == rel->rd_opcintype[0]))
+		{
+			startKey = key;
+			break;
+		}
+	}
+
+	/* the direct map answers a lone equality key on a value it covers */
+	if (startKey != NULL && nkeys == 1 &&
+		startKey->sk_strategy == BTEqualStrategyNumber)
+	{
+		BlockNumber	lovBlock;
+		OffsetNumber lovOffset;
+		bool		found;
+
+		if (map_lookup(rel, startKey->sk_argument, &found,
+					   &lovBlock, &lovOffset))
+		{
+			if (found)
+				ItemPointerSet(&scan->bm_items[scan->bm_nitems++],
+							   lovBlock, lovOffset);
+			scan->bm_next = InvalidBlockNumber;
+			return scan;
+		}
+	}
+
+	if (startKey != NULL)
+		buf = dict_descend(rel, &startKey->sk_argument, &startNull, 1, 0,
+						   BM_READ);
+	else
+		buf = dict_descend(rel, NULL, NULL, 0, 0, BM_READ);
+
+	dict_readpage(scan, buf);
+	_bitmap_relbuf(buf);
+
+	return scan;
+}
+
+/*
+ * _bitmap_dict_getnext() -- return the LOV item position of the next
+ *	value of a dictionary scan, or false when there are no more.
+ */
+bool
+_bitmap_dict_getnext(BMDictScan scan, BlockNumber *lovBlock,
+					 OffsetNumber *lovOffset)
+{
+	ItemPointer	tid;
+
+	while (scan->bm_curitem >= scan->bm_nitems)
+	{
+		Buffer		buf;
+
+		if (scan->bm_next == InvalidBlockNumber)
+			return false;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = _bitmap_getbuf(scan->bm_rel, scan->bm_next, BM_READ);
+		dict_readpage(scan, buf);
+		_bitmap_relbuf(buf);
+	}
+
+	tid = &scan->bm_items[scan->bm_curitem++];
+	*lovBlock = ItemPointerGetBlockNumber(tid);
+	*lovOffset = ItemPointerGetOffsetNumber(tid);
+
+	return true;
+}
+
+/*
+ * _bitmap_dict_endscan() -- end a dictionary scan.
+ */
+void
+_bitmap_dict_endscan(BMDictScan scan)
+{
+	if (scan->bm_tuples != NULL)
+		pfree(scan->bm_tuples);
+	pfree(scan);
+}
+
+/*
+ * _bitmap_dict_getvalue() -- return the value of the item the scan
+ *	returned last, for a scan that keeps its tuples in bm_tuples.
+ *
+ * A scaled key is turned back into the numeric it stands for. Other
+ * values point into bm_tuples, and are good until the next call to
+ * _bitmap_dict_getnext().
+ */
+void
+_bitmap_dict_getvalue(BMDictScan scan, Datum *value, bool *isnull)
+{
+	int32		scale = _bitmap_get_relcache(scan->bm_rel)->bm_key_scale;
+	IndexTuple	itup;
+
+	Assert(scan->bm_tuples != NULL && scan->bm_curitem > 0);
+
+	itup = (IndexTuple)
+		(scan->bm_tuples + scan->bm_tupleoffs[scan->bm_curitem - 1]);
+	*value = index_getattr(itup, 1, dict_desc(scan->bm_rel), isnull);
+	if (!*isnull && scale >= 0)
+		*value = NumericGetDatum(int64_div_fast_to_numeric(DatumGetInt64(*value),
+															scale));
+}
+
+/*
+ * _bitmap_dict_key_scale() -- decide at build time whether the dictionary
+ *	of the given index can hold its values as scaled int64 keys.
+ *
+ * That is the case for a numeric_ops index on a single numeric(p,s)
+ * column with p up to BM_DICT_KEY_DIGITS and s not negative: the typmod
+ * makes value * 10^s an integer below 10^p in magnitude for every value
+ * stored. Returns s, or -1 if the values are kept as they are.
+ */
+int32
+_bitmap_dict_key_scale(Relation rel)
+{
+	TupleDesc	tupDesc = RelationGetDescr(rel);
+	Form_pg_attribute att;
+	int32		typmod;
+	int32		precision;
+	int32		scale;
+
+	if (tupDesc->natts != 1)
+		return -1;
+
+	att = TupleDescAttr(tupDesc, 0);
+	if (att->atttypid != NUMERICOID || att->atttypmod < (int32) VARHDRSZ ||
+		index_getprocid(rel, 1, BM_ORDER_PROC) != F_NUMERIC_CMP)
+		return -1;
+
+	/* see make_numeric_typmod() */
+	typmod = att->atttypmod - VARHDRSZ;
+	precision = (typmod >> 16) & 0xffff;
+	scale = ((typmod & 0x7ff) ^ 1024) - 1024;
+
+	if (precision > BM_DICT_KEY_DIGITS || scale < 0 ||
+		scale > BM_DICT_KEY_DIGITS)
+		return -1;
+
+	return scale;
+}
+
+/*
+ * dict_desc() -- the tuple descriptor of the tuples of the dictionary.
+ */
+static TupleDesc
+dict_desc(Relation rel)
+{
+	BMRelCache *cache = _bitmap_get_relcache(rel);
+
+	return (cache->bm_key_scale >= 0) ? cache->bm_dict_desc :
+		RelationGetDescr(rel);
+}
+
+/*
+ * dict_keys() -- turn the values of an indexed tuple into the values the
+ *	dictionary holds for them.
+ *
+ * Returns values itself unless the dictionary holds scaled keys, in which
+ * case they are put into keys and it is returned.
+ */
+static Datum *
+dict_keys(Relation rel, Datum *values, bool *isnull, Datum *keys)
+{
+	int32		scale = _bitmap_get_relcache(rel)->bm_key_scale;
+	int64		floorKey;
+	int64		ceilKey;
+
+	if (scale < 0)
+		return values;
+
+	keys[0] = (Datum) 0;
+	if (!isnull[0])
+	{
+		if (!dict_numeric_key(DatumGetNumeric(values[0]), scale,
+							  &floorKey, &ceilKey))
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("value does not fit the scale of the dictionary of index \"%s\"",
+							RelationGetRelationName(rel)),
+					 errhint("REINDEX the index.")));
+		keys[0] = Int64GetDatum(floorKey);
+	}
+
+	return keys;
+}
+
+/*
+ * dict_numeric_key() -- scale a numeric to a dictionary key.
+ *
+ * Returns true if num * 10^scale is an integer that a value of the column
+ * can have, and sets both keys to it. Otherwise it lies strictly between
+ * *floorKey and *ceilKey, which are clamped to BM_DICT_KEY_LIMIT in
+ * magnitude; infinities land on the limits as well.
+ */
+static bool
+dict_numeric_key(Numeric num, int32 scale, int64 *floorKey, int64 *ceilKey)
+{
+	Datum		scaled;
+	Datum		fl;
+	Datum		ce;
+	int64		factor = 1;
+	bool		flClamped;
+	bool		ceClamped;
+	int			i;
+
+	if (numeric_is_nan(num))
+	{
+		*floorKey = *ceilKey = BM_DICT_KEY_NAN;
+		return true;
+	}
+
+	for (i = 0; i < scale; i++)
+		factor *= 10;
+
+	scaled = DirectFunctionCall2(numeric_mul, NumericGetDatum(num),
+								 NumericGetDatum(int64_to_numeric(factor)));
+	fl = DirectFunctionCall1(numeric_floor, scaled);
+	ce = DirectFunctionCall1(numeric_ceil, scaled);
+
+	*floorKey = dict_clamp_key(fl, &flClamped);
+	*ceilKey = dict_clamp_key(ce, &ceClamped);
+
+	return !flClamped && !ceClamped && *floorKey == *ceilKey;
+}
+
+/*
+ * dict_clamp_key() -- convert an integral or infinite numeric to an int64
+ *	key, clamped to BM_DICT_KEY_LIMIT in magnitude.
+ */
+static int64
+dict_clamp_key(Datum num, bool *clamped)
+{
+	Datum		limit = NumericGetDatum(int64_to_numeric(BM_DICT_KEY_LIMIT));
+	Datum		negLimit = NumericGetDatum(int64_to_numeric(-BM_DICT_KEY_LIMIT));
+
+	*clamped = true;
+	if (DatumGetInt32(DirectFunctionCall2(numeric_cmp, num, limit)) >= 0)
+		return BM_DICT_KEY_LIMIT;
+	if (DatumGetInt32(DirectFunctionCall2(numeric_cmp, num, negLimit)) <= 0)
+		return -BM_DICT_KEY_LIMIT;
+
+	*clamped = false;
+	return DatumGetInt64(DirectFunctionCall1(numeric_int8, num));
+}
+
+/*
+ * dict_scale_scankeys() -- turn the scan keys of a dictionary with scaled
+ *	keys into int64 keys that admit the same values.
+ *
+ * A bound that falls between two keys is rounded towards the values it
+ * admits, and a strict one then becomes inclusive. *empty is set if an
+ * equality key admits no value of the column at all.
+ */
+static ScanKey
+dict_scale_scankeys(Relation rel, ScanKey keys, int nkeys, bool *empty)
+{
+	int32		scale = _bitmap_get_relcache(rel)->bm_key_scale;
+	ScanKey		scaled;
+	int			i;
+
+	scaled = (ScanKey) palloc(nkeys * sizeof(ScanKeyData));
+	memcpy(scaled, keys, nkeys * sizeof(ScanKeyData));
+	*empty = false;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		ScanKey		key = &scaled[i];
+		int64		floorKey;
+		int64		ceilKey;
+		bool		exact;
+
+		if (key->sk_flags & SK_ISNULL)
+			continue;
+
+		exact = dict_numeric_key(DatumGetNumeric(key->sk_argument), scale,
+								 &floorKey, &ceilKey);
+
+		switch (key->sk_strategy)
+		{
+			case BTLessStrategyNumber:
+				if (!exact)
+					key->sk_strategy = BTLessEqualStrategyNumber;
+				/* FALLTHROUGH */
+			case BTLessEqualStrategyNumber:
+				key->sk_argument = Int64GetDatum(floorKey);
+				break;
+			case BTEqualStrategyNumber:
+				if (!exact)
+					*empty = true;
+				key->sk_argument = Int64GetDatum(floorKey);
+				break;
+			case BTGreaterStrategyNumber:
+				if (!exact)
+					key->sk_strategy = BTGreaterEqualStrategyNumber;
+				/* FALLTHROUGH */
+			case BTGreaterEqualStrategyNumber:
+				key->sk_argument = Int64GetDatum(ceilKey);
+				break;
+			default:
+				elog(ERROR, "unrecognized strategy number: %d",
+					 key->sk_strategy);
+		}
+		key->sk_subtype = InvalidOid;
+	}
+
+	return scaled;
+}
+
+/*
+ * dict_test_key() -- test a scaled key against a scaled scan key.
+ */
+static bool
+dict_test_key(StrategyNumber strategy, int64 key, int64 arg)
+{
+	switch (strategy)
+	{
+		case BTLessStrategyNumber:
+			return key < arg;
+		case BTLessEqualStrategyNumber:
+			return key <= arg;
+		case BTEqualStrategyNumber:
+			return key == arg;
+		case BTGreaterEqualStrategyNumber:
+			return key >= arg;
+		case BTGreaterStrategyNumber:
+			return key > arg;
+	}
+	elog(ERROR, "unrecognized strategy number: %d", strategy);
+	return false;
+}
+
+/*
+ * dict_compare() -- compare the first nkeys columns of a dictionary
+ *	tuple with the given values.
+ *
+ * Returns a negative number, zero or a positive number as the tuple sorts
+ * before, with or after the values. NULLs sort after all other values.
+ */
+static int
+dict_compare(Relation rel, IndexTuple itup, Datum *values, bool *isnull,
+			 int nkeys)
+{
+	TupleDesc	tupDesc = dict_desc(rel);
+	bool		scaled = _bitmap_get_relcache(rel)->bm_key_scale >= 0;
+	int			attno;
+
+	for (attno = 1; attno <= nkeys; attno++)
+	{
+		Datum		datum;
+		bool		null;
+		int32		result;
+
+		datum = index_getattr(itup, attno, tupDesc, &null);
+
+		if (null || isnull[attno - 1])
+		{
+			if (null && isnull[attno - 1])
+				continue;
+			return null ? 1 : -1;
+		}
+
+		if (scaled)
+		{
+			int64		key = DatumGetInt64(datum);
+			int64		arg = DatumGetInt64(values[attno - 1]);
+
+			if (key != arg)
+				return (key > arg) ? 1 : -1;
+			continue;
+		}
+
+		result = DatumGetInt32(FunctionCall2Coll(index_getprocinfo(rel, attno,
+																   BM_ORDER_PROC),
+												 rel->rd_indcollation[attno - 1],
+												 datum, values[attno - 1]));
+		if (result != 0)
+			return (result > 0) ? 1 : -1;
+	}
+
+	return 0;
+}
+
+/*
+ * dict_binsrch() -- find the first tuple of a dictionary page that does
+ *	not sort before the given values.
+ *
+ * Returns the offset past the last tuple if every tuple does. On an
+ * internal page the first tuple stands for minus infinity and is not
+ * compared, so the child to descend to is the one before the offset
+ * returned.
+ */
+static OffsetNumber
+dict_binsrch(Relation rel, Page page, Datum *values, bool *isnull, int nkeys)
+{
+	BMDictPageOpaque opaque = (BMDictPageOpaque) PageGetSpecialPointer(page);
+	OffsetNumber low = FirstOffsetNumber;
+	OffsetNumber high = OffsetNumberNext(PageGetMaxOffsetNumber(page));
+
+	if (opaque->bm_dict_level > 0 && low < high)
+		low = OffsetNumberNext(low);
+
+	while (low < high)
+	{
+		OffsetNumber mid = low + (high - low) / 2;
+		IndexTuple	itup = (IndexTuple) PageGetItem(page,
+													PageGetItemId(page, mid));
+
+		if (dict_compare(rel, itup, values, isnull, nkeys) < 0)
+			low = OffsetNumberNext(mid);
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * dict_descend() -- go down from the root to the page on the given level
+ *	where the given values belong, and return it locked in access mode.
+ *
+ * The page returned is the last one whose first value sorts before the
+ * values, so a value equal to the first one of a page is looked for on
+ * its left sibling first, and found by moving right. The upper levels
+ * are only share locked; a writer gets its page exclusively locked.
+ */
+static Buffer
+dict_descend(Relation rel, Datum *values, bool *isnull, int nkeys,
+			 uint16 level, int access)
+{
+	BlockNumber	blkno = _bitmap_get_relcache(rel)->bm_dict_root;
+
+	Assert(blkno != InvalidBlockNumber);
+
+	for (;;)
+	{
+		Buffer		buf;
+		Page		page;
+		BMDictPageOpaque opaque;
+		OffsetNumber off;
+		IndexTuple	itup;
+
+		buf = _bitmap_getbuf(rel, blkno, BM_READ);
+		page = BufferGetPage(buf);
+		opaque = (BMDictPageOpaque) PageGetSpecialPointer(page);
+
+		if (!BMPageIsDictPage(page))
+			ereport(ERROR,
+					(errcode(ERRCODE_INDEX_CORRUPTED),
+					 errmsg("block %u of index \"%s\" is not a dictionary page",
+							blkno, RelationGetRelationName(rel))));
+
+		if (opaque->bm_dict_level == level)
+		{
+			/* we are the only writer, so the page can't change meanwhile */
+			if (access != BM_READ)
+			{
+				LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+				LockBuffer(buf, access);
+			}
+			return buf;
+		}
+
+		if (opaque->bm_dict_level < level)
+			elog(ERROR, "dictionary of index \"%s\" has no level %u",
+				 RelationGetRelationName(rel), level);
+
+		off = dict_binsrch(rel, page, values, isnull, nkeys);
+		itup = (IndexTuple) PageGetItem(page,
+										PageGetItemId(page, OffsetNumberPrev(off)));
+		blkno = ItemPointerGetBlockNumber(&itup->t_tid);
+
+		_bitmap_relbuf(buf);
+	}
+}
+
+/*
+ * dict_insert_item() -- put a tuple at the given offset of a dictionary
+ *	page, splitting the page if it has no room for it.
+ *
+ * buf is exclusively locked, and released here.
+ */
+static void
+dict_insert_item(Relation rel, Buffer buf, IndexTuple itup,
+				 OffsetNumber offset)
+{
+	Page		page = BufferGetPage(buf);
+
+	if (PageGetFreeSpace(page) < MAXALIGN(IndexTupleSize(itup)))
+	{
+		dict_split(rel, buf, itup, offset);
+		return;
+	}
+
+	START_CRIT_SECTION();
+
+	if (PageAddItem(page, (Item) itup, IndexTupleSize(itup), offset,
+					false, false) == InvalidOffsetNumber)
+		elog(PANIC, "failed to add dictionary tuple to \"%s\"",
+			 RelationGetRelationName(rel));
+	MarkBufferDirty(buf);
+
+	END_CRIT_SECTION();
+
+	_bitmap_relbuf(buf);
+}
+
+/*
+ * dict_split() -- split a full dictionary page while adding a tuple to
+ *	it at the given offset.
+ *
+ * The upper half of the tuples moves to a new right sibling, and a
+ * downlink to it is added to the parent page, which may split in turn.
+ * The root moves both halves to new pages and becomes their parent, so
+ * that the tree grows a level. buf is released here.
+ */
+static void
+dict_split(Relation rel, Buffer buf, IndexTuple itup, OffsetNumber offset)
+{
+	Page		page = BufferGetPage(buf);
+	BMDictPageOpaque opaque = (BMDictPageOpaque) PageGetSpecialPointer(page);
+	BlockNumber	blkno = BufferGetBlockNumber(buf);
+	bool		isroot = (blkno == _bitmap_get_relcache(rel)->bm_dict_root);
+	uint16		level = opaque->bm_dict_level;
+	int			nitems = PageGetMaxOffsetNumber(page) + 1;
+	IndexTuple *items;
+	Size		total = 0;
+	Size		leftsize = 0;
+	int			nleft;
+	int			i;
+	OffsetNumber off;
+	Buffer		leftbuf;
+	Buffer		rightbuf;
+	Page		leftpage;
+	Page		rightpage;
+	IndexTuple	downlink;
+	IndexTuple	leftlink = NULL;
+
+	/* the tuples of the page in order, with the new one in its place */
+	items = (IndexTuple *) palloc(nitems * sizeof(IndexTuple));
+	off = FirstOffsetNumber;
+	for (i = 0; i < nitems; i++)
+	{
+		if (i == offset - 1)
+			items[i] = itup;
+		else
+		{
+			items[i] = (IndexTuple) PageGetItem(page, PageGetItemId(page, off));
+			off = OffsetNumberNext(off);
+		}
+		total += MAXALIGN(IndexTupleSize(items[i])) + sizeof(ItemIdData);
+	}
+
+	/* leave about half of the space used on either side */
+	for (nleft = 0; nleft < nitems - 1; nleft++)
+	{
+		Size		size = MAXALIGN(IndexTupleSize(items[nleft])) +
+			sizeof(ItemIdData);
+
+		if (nleft > 0 && leftsize + size > total / 2)
+			break;
+		leftsize += size;
+	}
+
+	rightbuf = _bitmap_getbuf(rel, P_NEW, BM_WRITE);
+	leftbuf = isroot ? _bitmap_getbuf(rel, P_NEW, BM_WRITE) : buf;
+
+	/* build the new contents aside, as the tuples point into page */
+	leftpage = (Page) palloc(BLCKSZ);
+	rightpage = (Page) palloc(BLCKSZ);
+	_bitmap_init_dictpage(leftpage, BLCKSZ, level);
+	_bitmap_init_dictpage(rightpage, BLCKSZ, level);
+	dict_fill_page(leftpage, items, nleft);
+	dict_fill_page(rightpage, items + nleft, nitems - nleft);
+
+	((BMDictPageOpaque) PageGetSpecialPointer(leftpage))->bm_dict_right =
+		BufferGetBlockNumber(rightbuf);
+	((BMDictPageOpaque) PageGetSpecialPointer(rightpage))->bm_dict_right =
+		isroot ? InvalidBlockNumber : opaque->bm_dict_right;
+
+	downlink = CopyIndexTuple(items[nleft]);
+	ItemPointerSet(&downlink->t_tid, BufferGetBlockNumber(rightbuf),
+				   FirstOffsetNumber);
+	if (isroot)
+	{
+		leftlink = CopyIndexTuple(items[0]);
+		ItemPointerSet(&leftlink->t_tid, BufferGetBlockNumber(leftbuf),
+					   FirstOffsetNumber);
+	}
+
+	START_CRIT_SECTION();
+
+	/* the right page goes first: it can't be reached before the left is */
+	memcpy(BufferGetPage(rightbuf), rightpage, BLCKSZ);
+	MarkBufferDirty(rightbuf);
+	memcpy(BufferGetPage(leftbuf), leftpage, BLCKSZ);
+	MarkBufferDirty(leftbuf);
+
+	if (isroot)
+	{
+		_bitmap_init_dictpage(page, BufferGetPageSize(buf), level + 1);
+		if (PageAddItem(page, (Item) leftlink, IndexTupleSize(leftlink),
+						FirstOffsetNumber, false, false) == InvalidOffsetNumber ||
+			PageAddItem(page, (Item) downlink, IndexTupleSize(downlink),
+						OffsetNumberNext(FirstOffsetNumber),
+						false, false) == InvalidOffsetNumber)
+			elog(PANIC, "failed to add dictionary tuple to \"%s\"",
+				 RelationGetRelationName(rel));
+		MarkBufferDirty(buf);
+	}
+
+	END_CRIT_SECTION();
+
+	pfree(leftpage);
+	pfree(rightpage);
+	pfree(items);
+
+	_bitmap_relbuf(rightbuf);
+	if (isroot)
+	{
+		pfree(leftlink);
+		pfree(downlink);
+		_bitmap_relbuf(leftbuf);
+		_bitmap_relbuf(buf);
+		return;
+	}
+	_bitmap_relbuf(buf);
+
+	/* now tell the parent about the new page */
+	{
+		TupleDesc	tupDesc = dict_desc(rel);
+		Datum		values[INDEX_MAX_KEYS];
+		bool		isnull[INDEX_MAX_KEYS];
+		Buffer		parentbuf;
+
+		index_deform_tuple(downlink, tupDesc, values, isnull);
+		parentbuf = dict_descend(rel, values, isnull, tupDesc->natts,
+								 level + 1, BM_WRITE);
+		off = dict_binsrch(rel, BufferGetPage(parentbuf), values, isnull,
+						   tupDesc->natts);
+		dict_insert_item(rel, parentbuf, downlink, off);
+	}
+}
+
+/*
+ * dict_fill_page() -- add the given tuples, in order, to an empty page.
+ */
+static void
+dict_fill_page(Page page, IndexTuple *items, int nitems)
+{
+	int			i;
+
+	for (i = 0; i < nitems; i++)
+	{
+		if (PageAddItem(page, (Item) items[i], IndexTupleSize(items[i]),
+						InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add tuple to dictionary page");
+	}
+}
+
+/*
+ * dict_checkkeys() -- test a dictionary tuple against the scan keys.
+ *
+ * *stop is set when no tuple after this one can satisfy the keys either,
+ * because it is past the upper bound a key puts on the first column.
+ */
+static bool
+dict_checkkeys(BMDictScan scan, IndexTuple itup, bool *stop)
+{
+	Relation	rel = scan->bm_rel;
+	TupleDesc	tupDesc = dict_desc(rel);
+	bool		scaled = _bitmap_get_relcache(rel)->bm_key_scale >= 0;
+	int			i;
+
+	*stop = false;
+
+	for (i = 0; i < scan->bm_nkeys; i++)
+	{
+		ScanKey		key = &scan->bm_keys[i];
+		Datum		datum;
+		bool		null;
+
+		datum = index_getattr(itup, key->sk_attno, tupDesc, &null);
+
+		if (!(key->sk_flags & SK_ISNULL) && !null &&
+			(scaled ?
+			 dict_test_key(key->sk_strategy, DatumGetInt64(datum),
+						   DatumGetInt64(key->sk_argument)) :
+			 DatumGetBool(FunctionCall2Coll(&key->sk_func, key->sk_collation,
+											datum, key->sk_argument))))
+			continue;
+
+		if (key->sk_attno != 1 || (key->sk_flags & SK_ISNULL))
+			return false;
+
+		/* NULLs come last, and satisfy no key */
+		if (null ||
+			key->sk_strategy == BTLessStrategyNumber ||
+			key->sk_strategy == BTLessEqualStrategyNumber)
+			*stop = true;
+		else if (key->sk_strategy == BTEqualStrategyNumber &&
+				 (key->sk_subtype == InvalidOid ||
+				  key->sk_subtype == rel->rd_opcintype[0]))
+		{
+			bool		argnull = false;
+
+			*stop = dict_compare(rel, itup, &key->sk_argument, &argnull, 1) > 0;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * dict_readpage() -- copy the positions of the matching values on a leaf
+ *	page into the scan, and their tuples if it keeps them, and remember
+ *	where to go next.
+ */
+static void
+dict_readpage(BMDictScan scan, Buffer buf)
+{
+	Page		page = BufferGetPage(buf);
+	BMDictPageOpaque opaque = (BMDictPageOpaque) PageGetSpecialPointer(page);
+	OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+	OffsetNumber off;
+	uint16		used = 0;
+
+	scan->bm_nitems = 0;
+	scan->bm_curitem = 0;
+	scan->bm_next = opaque->bm_dict_right;
+
+	for (off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+	{
+		IndexTuple	itup = (IndexTuple) PageGetItem(page,
+													PageGetItemId(page, off));
+		bool		stop;
+
+		if (dict_checkkeys(scan, itup, &stop))
+		{
+			if (scan->bm_tuples != NULL)
+			{
+				scan->bm_tupleoffs[scan->bm_nitems] = used;
+				memcpy(scan->bm_tuples + used, itup, IndexTupleSize(itup));
+				used += MAXALIGN(IndexTupleSize(itup));
+			}
+			scan->bm_items[scan->bm_nitems++] = itup->t_tid;
+		}
+		else if (stop)
+		{
+			scan->bm_next = InvalidBlockNumber;
+			break;
+		}
+	}
+}
+
+/*
+ * _bitmap_init_mappage() -- initialize a new page of the direct map.
+ *
+ * The slots of a map page start out invalid, as do the entries of the
+ * directory.
+ */
+void
+_bitmap_init_mappage(Page page, Size pageSize, bool directory)
+{
+	BMMapPageOpaque opaque;
+
+	PageInit(page, pageSize, sizeof(BMMapPageOpaqueData));
+
+	opaque = (BMMapPageOpaque) PageGetSpecialPointer(page);
+	opaque->bm_map_chunk = 0;
+	opaque->bm_map_flags = directory ? BM_MAP_DIRECTORY : 0;
+	opaque->bm_page_id = BM_MAP_PAGE_ID;
+
+	if (directory)
+		memset(BMPageGetMapDirectory(page), 0xFF,
+			   BM_MAP_DIR_ENTRIES * sizeof(BlockNumber));
+}
+
+/*
+ * _bitmap_check_direct_map() -- make sure that the direct_map option is
+ *	only given to an index the direct map can serve.
+ */
+void
+_bitmap_check_direct_map(Relation rel)
+{
+	TupleDesc	tupDesc = RelationGetDescr(rel);
+	Oid			typid;
+
+	if (!BMUsesDirectMap(rel))
+		return;
+
+	typid = TupleDescAttr(tupDesc, 0)->atttypid;
+	if (tupDesc->natts != 1 || (typid != INT4OID && typid != DATEOID))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("direct_map is only supported for yabit indexes on a single int4 or date column")));
+}
+
+/*
+ * _bitmap_map_create() -- add the directory page of an empty direct map
+ *	to the index, and return its block number.
+ */
+BlockNumber
+_bitmap_map_create(Relation rel)
+{
+	Buffer		buf;
+	BlockNumber	blkno;
+
+	buf = _bitmap_getbuf(rel, P_NEW, BM_WRITE);
+
+	START_CRIT_SECTION();
+	_bitmap_init_mappage(BufferGetPage(buf), BufferGetPageSize(buf), true);
+	MarkBufferDirty(buf);
+	END_CRIT_SECTION();
+
+	blkno = BufferGetBlockNumber(buf);
+	_bitmap_relbuf(buf);
+
+	return blkno;
+}
+
+/*
+ * map_position() -- find the map page and the slot of a value.
+ *
+ * Returns false if the direct map does not cover the value. Both int4 and
+ * date values are int32 datums.
+ */
+static bool
+map_position(Datum value, int64 *chunk, int64 *slot)
+{
+	int64		pos = (int64) DatumGetInt32(value) - BM_MAP_MIN_VALUE;
+
+	if (pos < 0 || pos >= BM_MAP_NVALUES)
+		return false;
+
+	*chunk = pos / BM_MAP_SLOTS_PER_PAGE;
+	*slot = pos % BM_MAP_SLOTS_PER_PAGE;
+	return true;
+}
+
+/*
+ * map_lookup() -- look a value up in the direct map.
+ *
+ * Returns false if the index has no direct map or the map does not cover
+ * the value, so the dictionary has to be searched. Otherwise *found tells
+ * whether the value is in the index, and the position of its LOV item is
+ * returned if it is.
+ */
+static bool
+map_lookup(Relation rel, Datum value, bool *found,
+		   BlockNumber *lovBlock, OffsetNumber *lovOffset)
+{
+	BlockNumber	root = _bitmap_get_relcache(rel)->bm_map_root;
+	int64		chunk;
+	int64		slot;
+	Buffer		buf;
+	BlockNumber	mapBlock;
+	ItemPointerData tid;
+
+	if (root == InvalidBlockNumber || !map_position(value, &chunk, &slot))
+		return false;
+
+	buf = _bitmap_getbuf(rel, root, BM_READ);
+	mapBlock = BMPageGetMapDirectory(BufferGetPage(buf))[chunk];
+	_bitmap_relbuf(buf);
+
+	*found = false;
+	if (mapBlock == InvalidBlockNumber)
+		return true;
+
+	buf = _bitmap_getbuf(rel, mapBlock, BM_READ);
+	tid = BMPageGetMapSlots(BufferGetPage(buf))[slot];
+	_bitmap_relbuf(buf);
+
+	if (ItemPointerIsValid(&tid))
+	{
+		*lovBlock = ItemPointerGetBlockNumber(&tid);
+		*lovOffset = ItemPointerGetOffsetNumber(&tid);
+		*found = true;
+	}
+	return true;
+}
+
+/*
+ * map_insert() -- record the LOV item position of a new value in the
+ *	direct map, if the index has one and it covers the value.
+ *
+ * Like _bitmap_dict_insert(), this is only done by the one writer of the
+ * dictionary. The map page of a run is added the first time a value of
+ * the run comes in.
+ */
+static void
+map_insert(Relation rel, Datum value, BlockNumber lovBlock,
+		   OffsetNumber lovOffset)
+{
+	BlockNumber	root = _bitmap_get_relcache(rel)->bm_map_root;
+	int64		chunk;
+	int64		slot;
+	Buffer		dirbuf;
+	Buffer		mapbuf;
+	BlockNumber *directory;
+
+	if (root == InvalidBlockNumber || !map_position(value, &chunk, &slot))
+		return;
+
+	dirbuf = _bitmap_getbuf(rel, root, BM_WRITE);
+	directory = BMPageGetMapDirectory(BufferGetPage(dirbuf));
+
+	if (directory[chunk] == InvalidBlockNumber)
+	{
+		Page		mappage;
+
+		mapbuf = _bitmap_getbuf(rel, P_NEW, BM_WRITE);
+		mappage = BufferGetPage(mapbuf);
+
+		START_CRIT_SECTION();
+		_bitmap_init_mappage(mappage, BufferGetPageSize(mapbuf), false);
+		((BMMapPageOpaque) PageGetSpecialPointer(mappage))->bm_map_chunk =
+			(uint32) chunk;
+		MarkBufferDirty(mapbuf);
+		directory[chunk] = BufferGetBlockNumber(mapbuf);
+		MarkBufferDirty(dirbuf);
+		END_CRIT_SECTION();
+	}
+	else
+		mapbuf = _bitmap_getbuf(rel, directory[chunk], BM_WRITE);
+
+	_bitmap_relbuf(dirbuf);
+
+	START_CRIT_SECTION();
+	ItemPointerSet(&BMPageGetMapSlots(BufferGetPage(mapbuf))[slot],
+				   lovBlock, lovOffset);
+	MarkBufferDirty(mapbuf);
+	END_CRIT_SECTION();
+
+	_bitmap_relbuf(mapbuf);
+}
@@ -0,0 +1,208 @@
+/*-------------------------------------------------------------------------
+ *
+ * bitmapfilter.c
+ *	Maintain the filter page of an on-disk bitmap index: a Bloom filter
+ *	over its distinct values, which tells most values that have no LOV
+ *	item apart without a search.
+ *
+ * The values are hashed with the hash function that goes with the
+ * equality operator of the index's operator family, so values the index
+ * takes as equal set the same bits. An index whose equality operator has
+ * no hash function gets no filter page. See BMFilterPageOpaqueData for
+ * the layout of the page.
+ *
+ * Bits are only ever set, by create_lovitem(), which runs under the
+ * index's insert lock or in the index build, before the new LOV item can
+ * be found. So a value whose bits are not all set has no LOV item; one
+ * whose bits are may still have none.
+ *
+ * IDENTIFICATION
+ *	  $PostgreSQL$
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "bitmap.h"
+
+#include "access/stratnum.h"
+#include "common/hashfn.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+
+static bool filter_hash(Relation rel, Datum *values, bool *isnull,
+						uint32 *hash);
+
+/*
+ * _bitmap_filter_hashproc() -- return the hash function for the values of
+ *	the given index that agrees with its equality operator, or InvalidOid
+ *	if the index cannot have a filter page.
+ */
+Oid
+_bitmap_filter_hashproc(Relation rel)
+{
+	Oid			eq_opr;
+	Oid			left_hash;
+	Oid			right_hash;
+
+	if (RelationGetDescr(rel)->natts != 1)
+		return InvalidOid;
+
+	eq_opr = get_opfamily_member(rel->rd_opfamily[0],
+								 rel->rd_opcintype[0],
+								 rel->rd_opcintype[0],
+								 BTEqualStrategyNumber);
+	if (!OidIsValid(eq_opr) ||
+		!get_op_hash_functions(eq_opr, &left_hash, &right_hash))
+		return InvalidOid;
+
+	return left_hash;
+}
+
+/*
+ * _bitmap_init_filterpage() -- initialize a new, empty filter page.
+ */
+void
+_bitmap_init_filterpage(Page page, Size pageSize)
+{
+	BMFilterPageOpaque opaque;
+
+	PageInit(page, pageSize, sizeof(BMFilterPageOpaqueData));
+
+	opaque = (BMFilterPageOpaque) PageGetSpecialPointer(page);
+	opaque->bm_filter_nvalues = 0;
+	opaque->bm_filter_unused = 0;
+	opaque->bm_page_id = BM_FILTER_PAGE_ID;
+
+	memset(BMPageGetFilterBits(page), 0, BM_FILTER_NBITS / BITS_PER_BYTE);
+}
+
+/*
+ * _bitmap_filter_create() -- add an empty filter page to the index, and
+ *	return its block number.
+ */
+BlockNumber
+_bitmap_filter_create(Relation rel)
+{
+	Buffer		buf;
+	BlockNumber	blkno;
+
+	buf = _bitmap_getbuf(rel, P_NEW, BM_WRITE);
+
+	START_CRIT_SECTION();
+	_bitmap_init_filterpage(BufferGetPage(buf), BufferGetPageSize(buf));
+	MarkBufferDirty(buf);
+	END_CRIT_SECTION();
+
+	blkno = BufferGetBlockNumber(buf);
+	_bitmap_relbuf(buf);
+
+	return blkno;
+}
+
+/*
+ * _bitmap_filter_maybe_present() -- tell whether the given values may have
+ *	a LOV item.
+ *
+ * Returns false only if they certainly have none. NULLs, and indexes
+ * without a usable filter, always give true.
+ */
+bool
+_bitmap_filter_maybe_present(Relation rel, Datum *values, bool *isnull)
+{
+	BMRelCache *cache = _bitmap_get_relcache(rel);
+	uint32		hash;
+	uint32		step;
+	Buffer		buf;
+	Page		page;
+	uint8	   *bits;
+	bool		present = true;
+	int			i;
+
+	if (cache->bm_filter_block == InvalidBlockNumber ||
+		!filter_hash(rel, values, isnull, &hash))
+		return true;
+
+	buf = _bitmap_getbuf(rel, cache->bm_filter_block, BM_READ);
+	page = BufferGetPage(buf);
+
+	if (((BMFilterPageOpaque) PageGetSpecialPointer(page))->bm_filter_nvalues <
+		BM_FILTER_MAX_VALUES)
+	{
+		bits = BMPageGetFilterBits(page);
+		step = hash_uint32(hash) | 1;
+		for (i = 0; i < BM_FILTER_NHASHES && present; i++)
+		{
+			uint32		bit = (hash + i * step) % BM_FILTER_NBITS;
+
+			present = (bits[bit / BITS_PER_BYTE] &
+					   (1 << (bit % BITS_PER_BYTE))) != 0;
+		}
+	}
+
+	_bitmap_relbuf(buf);
+
+	return present;
+}
+
+/*
+ * _bitmap_filter_add() -- set the bits of the given values in the filter
+ *	page, for a new LOV item.
+ */
+void
+_bitmap_filter_add(Relation rel, Datum *values, bool *isnull)
+{
+	BMRelCache *cache = _bitmap_get_relcache(rel);
+	uint32		hash;
+	uint32		step;
+	Buffer		buf;
+	Page		page;
+	BMFilterPageOpaque opaque;
+	uint8	   *bits;
+	int			i;
+
+	if (cache->bm_filter_block == InvalidBlockNumber ||
+		!filter_hash(rel, values, isnull, &hash))
+		return;
+
+	buf = _bitmap_getbuf(rel, cache->bm_filter_block, BM_WRITE);
+	page = BufferGetPage(buf);
+	opaque = (BMFilterPageOpaque) PageGetSpecialPointer(page);
+	bits = BMPageGetFilterBits(page);
+	step = hash_uint32(hash) | 1;
+
+	START_CRIT_SECTION();
+
+	for (i = 0; i < BM_FILTER_NHASHES; i++)
+	{
+		uint32		bit = (hash + i * step) % BM_FILTER_NBITS;
+
+		bits[bit / BITS_PER_BYTE] |= (1 << (bit % BITS_PER_BYTE));
+	}
+	if (opaque->bm_filter_nvalues < PG_UINT32_MAX)
+		opaque->bm_filter_nvalues++;
+
+	MarkBufferDirty(buf);
+	END_CRIT_SECTION();
+
+	_bitmap_relbuf(buf);
+}
+
+/*
+ * filter_hash() -- hash the value of the given single-column index.
+ *
+ * Returns false for a NULL, which the filter does not track.
+ */
+static bool
+filter_hash(Relation rel, Datum *values, bool *isnull, uint32 *hash)
+{
+	BMRelCache *cache = _bitmap_get_relcache(rel);
+
+	if (isnull[0])
+		return false;
+
+	*hash = DatumGetUInt32(FunctionCall1Coll(&cache->bm_filter_hash,
+											 rel->rd_indcollation[0],
+											 values[0]));
+	return true;
+}
@@ -20,13 +20,19 @@
 #include "access/tupdesc.h"
 #include "access/heapam.h"
 #include "access/tableam.h"
+#include "catalog/index.h"
+#include "commands/progress.h"
 #include "parser/parse_oper.h"
+#include "pgstat.h"
 #include "utils/builtins.h"
 #include "utils/datum.h"
+#include "utils/hsearch.h"
 #include "storage/bufmgr.h" /* for buffer manager functions */
+#include "storage/lmgr.h" /* for LockPage */
 #include "utils/snapshot.h" /* for SnapshotAny */
 #include "utils/rel.h" /* for RelationGetDescr */
 #include "utils/lsyscache.h" /* for get_opcode */
+#include "utils/memutils.h"
 
 /*
  * The following structure along with BMTIDBuffer are used to buffer
@@ -46,13 +52,63 @@ typedef struct BMTIDLOVBuffer
 	BMTIDBuffer *bufs[BM_MAX_LOVITEMS_PER_PAGE];
 } BMTIDLOVBuffer;
 
+/*
+ * BMSpillRun locates a run of complete words that a build buffer has
+ * spilled to the build's spill file: nwords content words, followed by
+ * their nwords last tids and BM_CALC_H_WORDS(nwords) header words.
+ */
+typedef struct BMSpillRun
+{
+	int			fileno;
+	off_t		offset;
+	int16		nwords;
+} BMSpillRun;
+
+/* an eviction candidate in buf_make_space() */
+typedef struct BMSpillCandidate
+{
+	BMTIDBuffer *buf;
+	double		score;
+} BMSpillCandidate;
+
+/*
+ * BMInsertPending holds the TIDs a statement has inserted for one LOV
+ * item but not yet written to its vector. See _bitmap_buffered_insert().
+ */
+typedef struct BMInsertPendingKey
+{
+	BlockNumber		lov_block;
+	OffsetNumber	lov_off;
+} BMInsertPendingKey;
+
+typedef struct BMInsertPending
+{
+	BMInsertPendingKey key;		/* hash key; must be first */
+	uint64	   *tids;
+	int			ntids;
+	int			maxtids;
+} BMInsertPending;
+
+#define BM_INSERT_PENDING_INIT_TIDS	16
+
+/*
+ * The insert states of this backend with TIDs that may be pending, so
+ * that a scan can have them written out before it reads the index.
+ */
+static BMInsertState *active_insert_states = NULL;
+
+/* bytes of words held in memory by a BMTIDBuffer */
+#define BUF_WORDS_SIZE(buf) \
+	((Size) (buf)->num_cwords * (sizeof(BM_WORD) + sizeof(uint64)))
+
 static Buffer get_lastbitmappagebuf(Relation rel, BMLOVItem lovItem);
 static void create_lovitem(Relation rel, Buffer metabuf, uint64 tidnum, 
 						   TupleDesc tupDesc, 
 						   Datum *attdata, bool *nulls,
 						   Relation lovHeap, Relation lovIndex,
 						   BlockNumber *lovBlockP, 
-						   OffsetNumber *lovOffsetP, bool use_wal);
+						   OffsetNumber *lovOffsetP, bool use_wal,
+						   BMBuildState *buildstate);
 static void build_inserttuple(Relation index, uint64 tidnum,
     ItemPointer ht_ctid,
     Datum *attdata, bool *nulls, BMBuildState *state);
@@ -63,9 +119,37 @@ static void inserttuple(Relation rel, Buffer metabuf,
 					    bool *nulls, Relation lovHeap, 
 						Relation lovIndex, ScanKey scanKey, 
 						IndexScanDesc scanDesc, bool use_wal);
+static bool lookup_lovitem(Relation rel, Datum *attdata, bool *nulls,
+						   Relation lovHeap, Relation lovIndex,
+						   ScanKey scanKey, IndexScanDesc scanDesc,
+						   BlockNumber *lovBlockP, OffsetNumber *lovOffsetP);
+static bool find_lovitem(Relation rel, Buffer metabuf, uint64 tidnum,
+						 TupleDesc tupDesc, Datum *attdata, bool *nulls,
+						 Relation lovHeap, Relation lovIndex,
+						 ScanKey scanKey, IndexScanDesc scanDesc,
+						 bool use_wal, BlockNumber *lovBlockP,
+						 OffsetNumber *lovOffsetP);
+static void insert_tid(Relation rel, BlockNumber lovBlock,
+					   OffsetNumber lovOffset, uint64 tidnum, bool use_wal);
+static void insert_tids(Relation rel, BlockNumber lovBlock,
+						OffsetNumber lovOffset, uint64 *tids, int ntids,
+						bool use_wal);
+static void init_lov_scankeys(Relation rel, ScanKey scanKeys);
+static void set_lov_scankeys(TupleDesc tupDesc, ScanKey scanKeys,
+							 Datum *attdata, bool *nulls);
+static void insert_pending_create(BMInsertState *state);
+static int	insert_pending_cmp(const void *a, const void *b);
+static int	tidnum_cmp(const void *a, const void *b);
+static void insert_state_forget(void *arg);
+static void summarize_callback(Relation index, ItemPointer tid,
+							   Datum *attdata, bool *nulls,
+							   bool tupleIsAlive, void *state);
 static void updatesetbit(Relation rel, 
 						 Buffer lovBuffer, OffsetNumber lovOffset,
-						 uint64 tidnum, bool use_wal);
+						 uint64 tidnum, bool use_wal, bool to_delta);
+static void add_delta(Relation rel, Buffer lovBuffer, BMLOVItem lovItem,
+					  uint64 tidnum);
+static void add_setbits(Buffer lovBuffer, OffsetNumber lovOffset, uint64 n);
 static void updatesetbit_inword(BM_WORD word, uint64 updateBitLoc,
 								uint64 firstTid, BMTIDBuffer *buf);
 static void updatesetbit_inpage(Relation rel, uint64 tidnum,
@@ -89,8 +173,16 @@ static void lshift_header_bits(BM_WORD *words, uint64 nwords,
 static void insert_newwords(BMTIDBuffer* words, uint32 insertPos,
 							BMTIDBuffer* new_words, BMTIDBuffer* words_left);
 static int16 mergewords(BMTIDBuffer* buf, bool lastWordFill);
-static void buf_make_space(Relation rel,
-					  BMTidBuildBuf *tidLocsBuffer, bool use_wal);
+static void write_bitmappages(Relation rel, Buffer lovBuffer,
+							  BMLOVItem lovItem, BMTIDBuffer *buf,
+							  bool grow, bool use_wal);
+static void flush_tail_words(Relation rel, Buffer lovBuffer,
+							 BMLOVItem lovItem, bool grow);
+static void buf_make_space(BMTidBuildBuf *tidLocsBuffer);
+static int	spill_candidate_cmp(const void *a, const void *b);
+static Size buf_spill(BMTIDBuffer *buf);
+static void buf_write_spilled(Relation rel, Buffer lovbuf, OffsetNumber off,
+							  BMTIDBuffer *buf, bool use_wal);
 #ifdef DEBUG_BITMAP
 static void verify_bitmappages(Relation rel, BMLOVItem lovitem);
 #endif
@@ -172,10 +264,15 @@ getnumbits(BM_WORD *contentWords, BM_WORD *headerWords, uint32 nwords)
  * enough space for these extra words. If so, these extra words are inserted
  * into the next page. Otherwise, we create a new bitmap page to hold
  * these extra words.
+ *
+ * That is expensive and fragments the vector, so when to_delta is set,
+ * a bit that falls in the bitmap pages of the vector is recorded in its
+ * delta pages instead (see add_delta()). Only the bits in the last words
+ * kept in the LOV item are updated right away.
  */
 void
 updatesetbit(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
-			 uint64 tidnum, bool use_wal)
+			 uint64 tidnum, bool use_wal, bool to_delta)
 {
 	Page		lovPage;
 	BMLOVItem	lovItem;
@@ -198,6 +295,15 @@ updatesetbit(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
 	else
 		tidLocation -= BM_WORD_SIZE;
 
+	/*
+	 * A bit in a fill word of ones is set already. This happens when a
+	 * TID is inserted twice, as _bitmap_summarize() may do.
+	 */
+	if (tidnum > tidLocation && tidnum <= lovItem->bm_last_tid_location &&
+		BM_LAST_COMPWORD_IS_FILL(lovItem) &&
+		GET_FILL_BIT(lovItem->bm_last_compword) == 1)
+		return;
+
 	/*
 	 * If tidnum is in either bm_last_compword or bm_last_word,
 	 * and this does not generate any new words, we simply
@@ -265,8 +371,17 @@ updatesetbit(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
 	}
 
 	/*
-	 * Now, tidnum is in the middle of the bitmap vector.
-	 * We try to find the bitmap page that contains this bit,
+	 * Now, tidnum is in the middle of the bitmap vector. Leave it to
+	 * the delta pages if we may.
+	 */
+	if (to_delta)
+	{
+		add_delta(rel, lovBuffer, lovItem, tidnum);
+		return;
+	}
+
+	/*
+	 * Otherwise, we try to find the bitmap page that contains this bit,
 	 * and update the bit.
 	 */
 	/* find the page that contains this bit. */
@@ -283,6 +398,208 @@ updatesetbit(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
 	_bitmap_relbuf(bitmapBuffer);
 }
 
+/*
+ * add_delta() -- record a bit set in the middle of a vector in the
+ *	newest delta page of the vector, starting a new one if it is full.
+ *
+ * lovBuffer holds lovItem, and is pinned and exclusively locked.
+ */
+static void
+add_delta(Relation rel, Buffer lovBuffer, BMLOVItem lovItem, uint64 tidnum)
+{
+	Buffer			deltaBuffer = InvalidBuffer;
+	Page			deltaPage;
+	BMPageOpaque	deltaOpaque;
+	bool			newPage = false;
+
+	if (BlockNumberIsValid(lovItem->bm_delta_head))
+	{
+		deltaBuffer = _bitmap_getbuf(rel, lovItem->bm_delta_head, BM_WRITE);
+		deltaOpaque = (BMPageOpaque)
+			PageGetSpecialPointer(BufferGetPage(deltaBuffer));
+		if (deltaOpaque->bm_hrl_words_used >= BM_MAX_DELTA_TIDS_PER_PAGE)
+		{
+			_bitmap_relbuf(deltaBuffer);
+			deltaBuffer = InvalidBuffer;
+		}
+	}
+
+	if (!BufferIsValid(deltaBuffer))
+	{
+		deltaBuffer = _bitmap_alloc_bitmappage(rel, lovBuffer, NULL, 1, false);
+		newPage = true;
+	}
+
+	deltaPage = BufferGetPage(deltaBuffer);
+	deltaOpaque = (BMPageOpaque) PageGetSpecialPointer(deltaPage);
+
+	START_CRIT_SECTION();
+
+	if (newPage)
+	{
+		deltaOpaque->bm_flags |= BM_PAGE_DELTA;
+		deltaOpaque->bm_bitmap_next = lovItem->bm_delta_head;
+		lovItem->bm_delta_head = BufferGetBlockNumber(deltaBuffer);
+		MarkBufferDirty(lovBuffer);
+	}
+
+	BMPageGetDeltaTids(deltaPage)[deltaOpaque->bm_hrl_words_used++] = tidnum;
+	MarkBufferDirty(deltaBuffer);
+
+	END_CRIT_SECTION();
+
+	_bitmap_relbuf(deltaBuffer);
+}
+
+/*
+ * add_setbits() -- count n more rows in the vector of a LOV item; see
+ *	bm_nsetbits.
+ *
+ * lovBuffer holds the item, and is pinned and exclusively locked.
+ */
+static void
+add_setbits(Buffer lovBuffer, OffsetNumber lovOffset, uint64 n)
+{
+	Page		lovPage = BufferGetPage(lovBuffer);
+	BMLOVItem	lovItem = (BMLOVItem) PageGetItem(lovPage,
+									PageGetItemId(lovPage, lovOffset));
+
+	START_CRIT_SECTION();
+	lovItem->bm_nsetbits += n;
+	MarkBufferDirty(lovBuffer);
+	END_CRIT_SECTION();
+}
+
+/*
+ * _bitmap_fold_deltas() -- set the bits recorded in the delta pages of
+ *	a vector in the vector itself, and delete the delta pages.
+ *
+ * If callback is given, the TIDs it reports as dead are dropped instead,
+ * and counted in *tuples_removed. The bits are all set before the delta
+ * pages go, and scans read the deltas of a vector before its words (see
+ * _bitmap_initscanpos()), so a concurrent scan sees each bit in one place
+ * or the other. Returns the number of delta pages deleted.
+ */
+BlockNumber
+_bitmap_fold_deltas(Relation rel, BlockNumber lovBlock,
+					OffsetNumber lovOffset, IndexBulkDeleteCallback callback,
+					void *callback_state, double *tuples_removed)
+{
+	ItemPointerData	lovItemTid;
+	Buffer			lovBuffer;
+	Page			lovPage;
+	BMLOVItem		lovItem;
+	BlockNumber		blkno;
+	BlockNumber		ndeleted = 0;
+	uint64		   *tids = NULL;
+	int				ntids = 0;
+	int				maxtids = 0;
+	uint64			nremoved = 0;
+	int				i;
+
+	/* keep inserts off the vector; see insert_tid() */
+	ItemPointerSet(&lovItemTid, lovBlock, lovOffset);
+	LockTuple(rel, &lovItemTid, ExclusiveLock);
+
+	lovBuffer = _bitmap_getbuf(rel, lovBlock, BM_WRITE);
+	lovPage = BufferGetPage(lovBuffer);
+	lovItem = (BMLOVItem) PageGetItem(lovPage,
+									  PageGetItemId(lovPage, lovOffset));
+
+	if (!BlockNumberIsValid(lovItem->bm_delta_head))
+	{
+		_bitmap_relbuf(lovBuffer);
+		UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+		return 0;
+	}
+
+	/* collect the live TIDs of all delta pages */
+	for (blkno = lovItem->bm_delta_head; BlockNumberIsValid(blkno);)
+	{
+		Buffer			deltaBuffer = _bitmap_getbuf(rel, blkno, BM_READ);
+		Page			deltaPage = BufferGetPage(deltaBuffer);
+		BMPageOpaque	deltaOpaque =
+			(BMPageOpaque) PageGetSpecialPointer(deltaPage);
+		uint64		   *deltaTids = BMPageGetDeltaTids(deltaPage);
+
+		for (i = 0; i < deltaOpaque->bm_hrl_words_used; i++)
+		{
+			if (callback != NULL)
+			{
+				ItemPointerData	htid;
+
+				ItemPointerSet(&htid, BM_INT_GET_BLOCKNO(deltaTids[i]),
+							   BM_INT_GET_OFFSET(deltaTids[i]));
+				if (callback(&htid, callback_state))
+				{
+					*tuples_removed += 1;
+					nremoved++;
+					continue;
+				}
+			}
+
+			if (ntids == maxtids)
+			{
+				maxtids = Max(maxtids * 2, BM_MAX_DELTA_TIDS_PER_PAGE);
+				tids = (tids == NULL) ?
+					(uint64 *) palloc(maxtids * sizeof(uint64)) :
+					(uint64 *) repalloc(tids, maxtids * sizeof(uint64));
+			}
+			tids[ntids++] = deltaTids[i];
+		}
+
+		blkno = deltaOpaque->bm_bitmap_next;
+		_bitmap_relbuf(deltaBuffer);
+	}
+
+	/* set the bits, in order, so each bitmap page is visited once */
+	if (ntids > 0)
+	{
+		qsort(tids, ntids, sizeof(uint64), tidnum_cmp);
+		/* the bits to set may be in the tail buffer */
+		_bitmap_flush_tail_words(rel, lovBuffer, lovItem);
+	}
+	for (i = 0; i < ntids; i++)
+	{
+		if (i > 0 && tids[i] == tids[i - 1])
+			continue;
+		updatesetbit(rel, lovBuffer, lovOffset, tids[i], true, false);
+	}
+
+	/* and only then let go of the delta pages */
+	blkno = lovItem->bm_delta_head;
+
+	START_CRIT_SECTION();
+	lovItem->bm_delta_head = InvalidBlockNumber;
+	lovItem->bm_nsetbits -= Min(lovItem->bm_nsetbits, nremoved);
+	MarkBufferDirty(lovBuffer);
+	END_CRIT_SECTION();
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer			deltaBuffer = _bitmap_getbuf(rel, blkno, BM_WRITE);
+		Page			deltaPage = BufferGetPage(deltaBuffer);
+
+		blkno = ((BMPageOpaque) PageGetSpecialPointer(deltaPage))->bm_bitmap_next;
+
+		START_CRIT_SECTION();
+		_bitmap_delete_bitmappage(deltaPage);
+		MarkBufferDirty(deltaBuffer);
+		END_CRIT_SECTION();
+
+		_bitmap_relbuf(deltaBuffer);
+		ndeleted++;
+	}
+
+	_bitmap_relbuf(lovBuffer);
+	UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+
+	if (tids != NULL)
+		pfree(tids);
+
+	return ndeleted;
+}
+
 /*
  * updatesetbit_inword() -- update the given bit to 1 in a given
  * 	word.
@@ -754,8 +1071,7 @@ updatesetbit_inpage(Relation rel, uint64 tidnum,
 		if (BufferIsValid(nextBuffer))
 			_bitmap_relbuf(nextBuffer);
 
-		nextBuffer = _bitmap_getbuf(rel, P_NEW, BM_WRITE);
-		_bitmap_init_bitmappage(nextBuffer);
+		nextBuffer = _bitmap_alloc_bitmappage(rel, lovBuffer, NULL, 1, false);
 		new_page = true;
 		free_words = BM_NUM_OF_HRL_WORDS_PER_PAGE;
 	}
@@ -815,6 +1131,10 @@ updatesetbit_inpage(Relation rel, uint64 tidnum,
 
 	if (new_page)
 	{
+		Page		lovPage = BufferGetPage(lovBuffer);
+		BMLOVItem	lovItem = (BMLOVItem) PageGetItem(lovPage,
+									PageGetItemId(lovPage, lovOffset));
+
 		nextPage = BufferGetPage(nextBuffer);
 		nextOpaque = (BMPageOpaque)PageGetSpecialPointer(nextPage);
 		nextBitmap = (BMBitmapVectorPage)PageGetContents(nextPage);
@@ -822,6 +1142,10 @@ updatesetbit_inpage(Relation rel, uint64 tidnum,
 		nextOpaque->bm_last_tid_location = bitmapOpaque->bm_last_tid_location;
 		nextOpaque->bm_bitmap_next = bitmapOpaque->bm_bitmap_next;
 		bitmapOpaque->bm_bitmap_next = BufferGetBlockNumber(nextBuffer);
+
+		/* the page is not from the vector's extent; count it here */
+		lovItem->bm_npages++;
+		MarkBufferDirty(lovBuffer);
 	}
 
 	bitmapOpaque->bm_last_tid_location -=
@@ -1092,10 +1416,12 @@ mergewords(BMTIDBuffer *buf, bool lastWordFill)
 
 /*
  * _bitmap_write_new_bitmapwords() -- write a given buffer of new bitmap words
- *	into the end of bitmap page(s).
+ *	into the end of a bitmap vector, and set its last two words.
  *
- * If the last bitmap page does not have enough space for all these new
- * words, new pages will be allocated here.
+ * The complete words go to the tail buffer of the LOV item if there is
+ * room for them. Otherwise, the words already in the tail buffer are
+ * written to the bitmap pages first, and then the new words too if they
+ * still don't fit.
  *
  * We consider a write to one bitmap page as one atomic-action WAL
  * record. The WAL record for the write to the last bitmap page also
@@ -1110,18 +1436,104 @@ _bitmap_write_new_bitmapwords(Relation rel,
 {
 	Page		lovPage;
 	BMLOVItem	lovItem;
+	uint32		nwords;
+	bool		grow;
+	int			wordNo;
+
+	lovPage = BufferGetPage(lovBuffer);
+	lovItem = (BMLOVItem) PageGetItem(lovPage, 
+		PageGetItemId(lovPage, lovOffset));
+
+	/*
+	 * A build writes each vector out in one go (see buf_free_mem()), so
+	 * it asks for exactly the pages it needs. Inserts reserve growing
+	 * extents to keep their vectors contiguous.
+	 */
+	grow = (buf->owner == NULL);
 
+	nwords = buf->curword - buf->start_wordno;
+
+	if (lovItem->bm_tail_nwords > 0 &&
+		lovItem->bm_tail_nwords + nwords > lovItem->bm_tail_size)
+		flush_tail_words(rel, lovBuffer, lovItem, grow);
+
+	if (nwords > lovItem->bm_tail_size - lovItem->bm_tail_nwords)
+		write_bitmappages(rel, lovBuffer, lovItem, buf, grow, use_wal);
+
+	START_CRIT_SECTION();
+
+	MarkBufferDirty(lovBuffer);
+
+	/* whatever is left fits in the tail buffer */
+	for (wordNo = buf->start_wordno; wordNo < buf->curword; wordNo++)
+	{
+		uint16		tailNo = lovItem->bm_tail_nwords++;
+
+		lovItem->bm_tail_words[tailNo] = buf->cwords[wordNo];
+		if (IS_FILL_WORD(buf->hwords, wordNo))
+			lovItem->bm_tail_hwords[tailNo / BM_WORD_SIZE] |=
+				WORDNO_GET_HEADER_BIT(tailNo);
+		lovItem->bm_tail_tid_location = buf->last_tids[wordNo];
+	}
+	buf->start_wordno = buf->curword;
+
+	lovItem->bm_last_compword = buf->last_compword;
+	lovItem->bm_last_word = buf->last_word;
+	lovItem->lov_words_header = (buf->is_last_compword_fill) ? 
+	   BM_LAST_COMPWORD_BIT	: BM_LOV_WORDS_NO_FILL;
+	lovItem->bm_last_setbit = buf->last_tid;
+	lovItem->bm_last_tid_location = buf->last_tid - buf->last_tid % BM_WORD_SIZE;
+
+	if (use_wal)
+	{
+		/* WAL disabled: skipping _bitmap_log_bitmap_lastwords */
+		/* _bitmap_log_bitmap_lastwords(rel, lovBuffer, lovOffset,
+									 lovItem); */
+	}
+#ifdef DEBUG_BMI
+		elog(NOTICE,"[_bitmap_write_new_bitmapwords] CP2 : buf->start_wordno = %d"
+			 "\n\tlovItem->bm_last_setbit = %llu"
+			 "\n\tlovItem->bm_last_tid_location = %llu"
+			   ,buf->start_wordno
+			   ,(unsigned long long)lovItem->bm_last_setbit
+			   ,(unsigned long long)lovItem->bm_last_tid_location
+			 );
+#endif		
+
+	END_CRIT_SECTION();
+}
+
+/*
+ * write_bitmappages() -- append the words of a given buffer to the
+ *	bitmap pages of a vector.
+ *
+ * If the last bitmap page does not have enough space for all these new
+ * words, new pages will be allocated here.
+ *
+ * lovBuffer holds lovItem, and is pinned and exclusively locked.
+ */
+static void
+write_bitmappages(Relation rel, Buffer lovBuffer, BMLOVItem lovItem,
+				  BMTIDBuffer *buf, bool grow, bool use_wal)
+{
 	Buffer		bitmapBuffer;
 	Page		bitmapPage;
 	BMPageOpaque	bitmapPageOpaque;
 		
 	uint64		numFreeWords;
 	uint64		words_written = 0;
-	// bool		isFirst = false;
+	uint64		words_left;
+	uint32		npages;
 
-	lovPage = BufferGetPage(lovBuffer);
-	lovItem = (BMLOVItem) PageGetItem(lovPage, 
-		PageGetItemId(lovPage, lovOffset));
+	/*
+	 * _bitmap_write_bitmapwords() needs scratch space for the header
+	 * words; allocate it here, as it runs in a critical section.
+	 */
+	if (buf->tmp_hwords == NULL)
+	{
+		buf->tmp_hwords_cap = BM_MAX_NUM_OF_HEADER_WORDS + 1;
+		buf->tmp_hwords = palloc0(buf->tmp_hwords_cap * sizeof(BM_WORD));
+	}
 
 	bitmapBuffer = get_lastbitmappagebuf(rel, lovItem);
 
@@ -1136,8 +1548,11 @@ _bitmap_write_new_bitmapwords(Relation rel,
 	}
 	else
 	{
-		bitmapBuffer = _bitmap_getbuf(rel, P_NEW, BM_WRITE);
-		_bitmap_init_bitmappage(bitmapBuffer);
+		words_left = buf->curword - buf->start_wordno;
+		npages = Max(1, (words_left + BM_NUM_OF_HRL_WORDS_PER_PAGE - 1) /
+					 BM_NUM_OF_HRL_WORDS_PER_PAGE);
+		bitmapBuffer = _bitmap_alloc_bitmappage(rel, lovBuffer, lovItem,
+												npages, grow);
 
 		numFreeWords = BM_NUM_OF_HRL_WORDS_PER_PAGE;
 	}
@@ -1150,8 +1565,12 @@ _bitmap_write_new_bitmapwords(Relation rel,
 		bitmapPageOpaque =
 			(BMPageOpaque)PageGetSpecialPointer(bitmapPage);
 
-		newBuffer = _bitmap_getbuf(rel, P_NEW, BM_WRITE);
-		_bitmap_init_bitmappage(newBuffer);
+		/* the pages we need for the words that do not fit in this one */
+		words_left = buf->curword - buf->start_wordno - numFreeWords;
+		npages = (words_left + BM_NUM_OF_HRL_WORDS_PER_PAGE - 1) /
+			BM_NUM_OF_HRL_WORDS_PER_PAGE;
+		newBuffer = _bitmap_alloc_bitmappage(rel, lovBuffer, lovItem,
+											 npages, grow);
 
 		START_CRIT_SECTION();
 
@@ -1167,7 +1586,6 @@ _bitmap_write_new_bitmapwords(Relation rel,
 
 		if (lovItem->bm_lov_head == InvalidBlockNumber)
 		{
-			// isFirst = true;
 			MarkBufferDirty(lovBuffer);
 			lovItem->bm_lov_head = BufferGetBlockNumber(bitmapBuffer);
 			lovItem->bm_lov_tail = lovItem->bm_lov_head;
@@ -1183,7 +1601,7 @@ _bitmap_write_new_bitmapwords(Relation rel,
 		}
 
 #ifdef DEBUG_BMI
-		elog(NOTICE,"[_bitmap_write_new_bitmapwords] CP1 (+=) : buf->start_wordno = %d , words_written = %llu"
+		elog(NOTICE,"[write_bitmappages] CP1 (+=) : buf->start_wordno = %d , words_written = %llu"
 			   ,buf->start_wordno,(unsigned long long)words_written
 			 );
 #endif		
@@ -1197,10 +1615,7 @@ _bitmap_write_new_bitmapwords(Relation rel,
 		numFreeWords = BM_NUM_OF_HRL_WORDS_PER_PAGE;
 	}
 
-	/*
-	 * Write remaining bitmap words to the last bitmap page and the
-	 * lov page.
-	 */
+	/* Write remaining bitmap words to the last bitmap page. */
 	START_CRIT_SECTION();
 
 	MarkBufferDirty(lovBuffer);
@@ -1211,34 +1626,13 @@ _bitmap_write_new_bitmapwords(Relation rel,
 	else
 		words_written = 0;
 
-	lovItem->bm_last_compword = buf->last_compword;
-	lovItem->bm_last_word = buf->last_word;
-	lovItem->lov_words_header = (buf->is_last_compword_fill) ? 
-	   BM_LAST_COMPWORD_BIT	: BM_LOV_WORDS_NO_FILL;
-	lovItem->bm_last_setbit = buf->last_tid;
-	lovItem->bm_last_tid_location = buf->last_tid - buf->last_tid % BM_WORD_SIZE;
 	lovItem->bm_lov_tail = BufferGetBlockNumber(bitmapBuffer);
 	if (lovItem->bm_lov_head == InvalidBlockNumber)
-	{
-		// isFirst = true;
 		lovItem->bm_lov_head = lovItem->bm_lov_tail;
-	}
 
-	if (use_wal)
-	{
-		/* WAL disabled: skipping _bitmap_log_bitmapwords */
-		/* _bitmap_log_bitmapwords(rel, bitmapBuffer, lovBuffer,
-								lovOffset, buf, words_written,
-								buf->last_tid, InvalidBlockNumber, true,
-								isFirst); */
-	}
 #ifdef DEBUG_BMI
-		elog(NOTICE,"[_bitmap_write_new_bitmapwords] CP2 (+=) : buf->start_wordno = %d, words_written = %llu"
-			 "\n\tlovItem->bm_last_setbit = %llu"
-			 "\n\tlovItem->bm_last_tid_location = %llu"
+		elog(NOTICE,"[write_bitmappages] CP2 (+=) : buf->start_wordno = %d, words_written = %llu"
 			   ,buf->start_wordno,(unsigned long long)words_written
-			   ,(unsigned long long)lovItem->bm_last_setbit
-			   ,(unsigned long long)lovItem->bm_last_tid_location
 			 );
 #endif		
 	buf->start_wordno += words_written;
@@ -1251,6 +1645,116 @@ _bitmap_write_new_bitmapwords(Relation rel,
 	_bitmap_relbuf(bitmapBuffer);	
 }
 
+/*
+ * flush_tail_words() -- write the words in the tail buffer of a LOV item
+ *	to the bitmap pages of its vector, and empty the buffer.
+ *
+ * lovBuffer holds lovItem, and is pinned and exclusively locked.
+ */
+static void
+flush_tail_words(Relation rel, Buffer lovBuffer, BMLOVItem lovItem,
+				 bool grow)
+{
+	BMTIDBuffer	tail;
+	uint64		last_tids[BM_MAX_LOV_TAIL_WORDS];
+	uint64		tidLocation = lovItem->bm_tail_tid_location;
+	int			wordNo;
+
+	MemSet(&tail, 0, sizeof(tail));
+	tail.cwords = lovItem->bm_tail_words;
+	tail.last_tids = last_tids;
+	tail.curword = tail.num_cwords = lovItem->bm_tail_nwords;
+	memcpy(tail.hwords, lovItem->bm_tail_hwords,
+		   sizeof(lovItem->bm_tail_hwords));
+
+	/* only the location of the last word is kept; work back from it */
+	for (wordNo = tail.curword - 1; wordNo >= 0; wordNo--)
+	{
+		last_tids[wordNo] = tidLocation;
+		if (IS_FILL_WORD(tail.hwords, wordNo))
+			tidLocation -= FILL_LENGTH(tail.cwords[wordNo]) * BM_WORD_SIZE;
+		else
+			tidLocation -= BM_WORD_SIZE;
+	}
+
+	write_bitmappages(rel, lovBuffer, lovItem, &tail, grow, false);
+
+	START_CRIT_SECTION();
+	lovItem->bm_tail_nwords = 0;
+	MemSet(lovItem->bm_tail_hwords, 0, sizeof(lovItem->bm_tail_hwords));
+	MarkBufferDirty(lovBuffer);
+	END_CRIT_SECTION();
+
+	pfree(tail.tmp_hwords);
+}
+
+/*
+ * _bitmap_flush_tail_words() -- write the words in the tail buffer of a
+ *	LOV item to the bitmap pages, for code that needs all the words of a
+ *	vector in its pages, as updating a bit in place does.
+ *
+ * lovBuffer holds lovItem, and is pinned and exclusively locked.
+ */
+void
+_bitmap_flush_tail_words(Relation rel, Buffer lovBuffer, BMLOVItem lovItem)
+{
+	if (lovItem->bm_tail_nwords > 0)
+		flush_tail_words(rel, lovBuffer, lovItem, true);
+}
+
+
+/*
+ * _bitmap_append_bitmapwords() -- append the given words to the bitmap
+ *	pages of a vector, for vacuum breaking up the last complete word of
+ *	the vector. tidLocation is the location before the first word.
+ *
+ * lovBuffer holds lovItem, and is pinned and exclusively locked. The
+ * tail buffer of lovItem is empty.
+ */
+void
+_bitmap_append_bitmapwords(Relation rel, Buffer lovBuffer, BMLOVItem lovItem,
+						   BM_WORD *words, bool *fills, uint32 nwords,
+						   uint64 tidLocation)
+{
+	uint64	   *last_tids;
+	uint32		first;
+
+	Assert(lovItem->bm_tail_nwords == 0);
+
+	last_tids = (uint64 *)
+		palloc(BM_NUM_OF_HRL_WORDS_PER_PAGE * sizeof(uint64));
+
+	/* a BMTIDBuffer holds a page of words at most */
+	for (first = 0; first < nwords; first += BM_NUM_OF_HRL_WORDS_PER_PAGE)
+	{
+		BMTIDBuffer	buf;
+		uint32		n = Min(nwords - first, BM_NUM_OF_HRL_WORDS_PER_PAGE);
+		uint32		wordNo;
+
+		MemSet(&buf, 0, sizeof(buf));
+		buf.cwords = words + first;
+		buf.last_tids = last_tids;
+		buf.curword = buf.num_cwords = n;
+		for (wordNo = 0; wordNo < n; wordNo++)
+		{
+			if (fills[first + wordNo])
+			{
+				buf.hwords[wordNo / BM_WORD_SIZE] |=
+					WORDNO_GET_HEADER_BIT(wordNo);
+				tidLocation += FILL_LENGTH(words[first + wordNo]) *
+					BM_WORD_SIZE;
+			}
+			else
+				tidLocation += BM_WORD_SIZE;
+			last_tids[wordNo] = tidLocation;
+		}
+
+		write_bitmappages(rel, lovBuffer, lovItem, &buf, true, false);
+		pfree(buf.tmp_hwords);
+	}
+
+	pfree(last_tids);
+}
 
 /*
  * _bitmap_write_bitmapwords() -- Write an array of bitmap words into a given
@@ -1371,13 +1875,19 @@ _bitmap_write_bitmapwords(Buffer bitmapBuffer, BMTIDBuffer *buf)
  * This function returns the block number and offset number of this
  * new LOV item.
  *
+ * During an index build, buildstate is given. If the build is batching
+ * the LOV heap, the distinct value is queued there and the btree entry
+ * is left to the sorted btree build at the end; otherwise buildstate is
+ * NULL and the value goes straight into both relations.
+ *
  * The caller should have an exclusive lock on metabuf.
  */
 static void
 create_lovitem(Relation rel, Buffer metabuf, uint64 tidnum,
 			   TupleDesc tupDesc, Datum *attdata, bool *nulls,
 			   Relation lovHeap, Relation lovIndex, BlockNumber *lovBlockP, 
-			   OffsetNumber *lovOffsetP, bool use_wal)
+			   OffsetNumber *lovOffsetP, bool use_wal,
+			   BMBuildState *buildstate)
 {
 
 	const int numOfAttrs = tupDesc->natts; /* number of attributes */
@@ -1403,9 +1913,9 @@ create_lovitem(Relation rel, Buffer metabuf, uint64 tidnum,
 	currLovBuffer = _bitmap_getbuf(rel, *lovBlockP, BM_WRITE);
 	currLovPage = BufferGetPage(currLovBuffer);
 
-	lovitem = _bitmap_formitem(tidnum);
+	lovitem = _bitmap_formitem(tidnum, BMGetLovTailWords(rel));
 	*lovOffsetP = OffsetNumberNext(PageGetMaxOffsetNumber(currLovPage));
-	itemSize = sizeof(BMLOVItemData);
+	itemSize = BM_LOV_ITEM_SIZE(lovitem->bm_tail_size);
 
 	/* Allocate a new Item */
 	lovDatum = palloc0((numOfAttrs + 2) * sizeof(Datum));
@@ -1415,9 +1925,12 @@ create_lovitem(Relation rel, Buffer metabuf, uint64 tidnum,
 
 	/*
 	 * If there is not enough space in the last LOV page for
-	 * a new item, create a new LOV page, and update the metapage.
+	 * a new item, or it already holds as many items as the
+	 * lov_items_per_page option allows, create a new LOV page,
+	 * and update the metapage.
 	 */
-	if (itemSize > PageGetFreeSpace(currLovPage))
+	if (itemSize > PageGetFreeSpace(currLovPage) ||
+		PageGetMaxOffsetNumber(currLovPage) >= BMGetLovItemsPerPage(rel))
 	{
 	Buffer newLovBuffer;
 
@@ -1444,17 +1957,22 @@ create_lovitem(Relation rel, Buffer metabuf, uint64 tidnum,
 
 	START_CRIT_SECTION();
 
-	if (is_new_lov_blkno)
-	{
 	MarkBufferDirty(metabuf);
+	if (is_new_lov_blkno)
 	metapage->bm_lov_lastpage = BufferGetBlockNumber(currLovBuffer);
-	}
+	if (metapage->bm_lov_nitems < PG_UINT32_MAX)
+		metapage->bm_lov_nitems++;
 
 	MarkBufferDirty(currLovBuffer);
 
 	*lovOffsetP = OffsetNumberNext(PageGetMaxOffsetNumber(currLovPage));
 	*lovBlockP = BufferGetBlockNumber(currLovBuffer);
 
+	/* no reading the metapage for the cache here: we have it locked */
+	if (rel->rd_amcache != NULL)
+		((BMRelCache *) rel->rd_amcache)->bm_lov_nitems =
+			metapage->bm_lov_nitems;
+
 
 	/* Add the block number and offset number to the LOV item */
 	lovDatum[numOfAttrs] = Int32GetDatum(*lovBlockP); /* Block number */
@@ -1464,8 +1982,17 @@ create_lovitem(Relation rel, Buffer metabuf, uint64 tidnum,
 
 
 	END_CRIT_SECTION();
-	/* Insert the LOV in the HEAP and the LOV btree index */
-	_bitmap_insert_lov(lovHeap, lovIndex, lovDatum, lovNulls, use_wal);
+	/*
+	 * Insert the LOV in the HEAP and the LOV btree index, or in the
+	 * dictionary of the index if it has no LOV heap
+	 */
+	if (lovIndex == NULL)
+		_bitmap_dict_insert(rel, attdata, nulls, *lovBlockP, *lovOffsetP);
+	else if (buildstate != NULL && buildstate->bm_lov_deferred)
+		_bitmap_bulkload_lov(buildstate, lovDatum, lovNulls);
+	else
+		_bitmap_insert_lov(lovHeap, lovIndex, lovDatum, lovNulls, use_wal);
+	_bitmap_filter_add(rel, attdata, nulls);
 	START_CRIT_SECTION();
 
 	if (PageAddItem(currLovPage, (Item)lovitem, itemSize, *lovOffsetP,
@@ -1507,20 +2034,45 @@ buf_add_tid(Relation rel, BMTidBuildBuf *tids, uint64 tidnum,
 {
 	BMTIDBuffer *buf;
 	BMTIDLOVBuffer *lov_buf = NULL;
+	Size		words_size;
 
 #ifdef DEBUG_BMI
 	_debug_view_1(tids,"CP1");
 #endif
 	/* If we surpass maintenance_work_mem, free some space from the buffer */
 	if (tids->byte_size >= maintenance_work_mem * 1024L)
-		buf_make_space(rel, tids, state->use_wal);
+		buf_make_space(tids);
+
+	tids->clock++;
+
+	/*
+	 * LOV block buffers are found by indexing lov_blocks with the LOV
+	 * block number. Grow the array when we see a block past its end.
+	 */
+	if (lov_block >= tids->num_lov_blocks)
+	{
+		BlockNumber	new_size = Max(tids->num_lov_blocks * 2, 16);
+
+		while (new_size <= lov_block)
+			new_size *= 2;
+
+		if (tids->lov_blocks == NULL)
+			tids->lov_blocks = (BMTIDLOVBuffer **)
+				palloc0(new_size * sizeof(BMTIDLOVBuffer *));
+		else
+			tids->lov_blocks = (BMTIDLOVBuffer **)
+				repalloc0(tids->lov_blocks,
+						  tids->num_lov_blocks * sizeof(BMTIDLOVBuffer *),
+						  new_size * sizeof(BMTIDLOVBuffer *));
+		tids->num_lov_blocks = new_size;
+	}
 
 	/*
 	 * tids is lazily initialized. If we do not have a current LOV block 
 	 * buffer, initialize one.
 	 */
-	if(!BlockNumberIsValid(tids->max_lov_block) || 
-	   tids->max_lov_block < lov_block)
+	lov_buf = tids->lov_blocks[lov_block];
+	if (lov_buf == NULL)
 	{
 		/*
 		 * XXX: We're currently not including the size of this data structure
@@ -1529,29 +2081,12 @@ buf_add_tid(Relation rel, BMTidBuildBuf *tids, uint64 tidnum,
 		lov_buf = palloc(sizeof(BMTIDLOVBuffer));
 		lov_buf->lov_block = lov_block;
 		MemSet(lov_buf->bufs, 0, BM_MAX_LOVITEMS_PER_PAGE * sizeof(BMTIDBuffer *));
-		tids->max_lov_block = lov_block;
-		
-		/*
-		 * Add the new LOV buffer to the list head. It seems reasonable that
-		 * future calls to this function will want this lov_block rather than
-		 * older lov_blocks.
-		 */
-		tids->lov_blocks = lcons(lov_buf, tids->lov_blocks);
-	}
-	else
-	{
-		ListCell *cell;
-		
-		foreach(cell, tids->lov_blocks)
-		{
-			BMTIDLOVBuffer *tmp = lfirst(cell);
-			if(tmp->lov_block == lov_block)
-			{
-				lov_buf = tmp;
-				break;
-			}
-		}
+		tids->lov_blocks[lov_block] = lov_buf;
 	}
+
+	if (!BlockNumberIsValid(tids->max_lov_block) ||
+		tids->max_lov_block < lov_block)
+		tids->max_lov_block = lov_block;
 	
 	Assert(lov_buf);
 	Assert(off - 1 < BM_MAX_LOVITEMS_PER_PAGE);
@@ -1560,6 +2095,7 @@ buf_add_tid(Relation rel, BMTidBuildBuf *tids, uint64 tidnum,
 	{
 
 		buf = lov_buf->bufs[off - 1];
+		words_size = BUF_WORDS_SIZE(buf);
 
 		buf_add_tid_with_fill
 		  (rel, buf, lov_block, off, 
@@ -1571,11 +2107,13 @@ buf_add_tid(Relation rel, BMTidBuildBuf *tids, uint64 tidnum,
 		Buffer lovbuf;
 		Page page;
 		BMLOVItem lovitem;
-		uint16 bytes_added;
 		
 		buf = (BMTIDBuffer *)palloc0(sizeof(BMTIDBuffer));
 		buf->tmp_hwords_cap = BM_MAX_NUM_OF_HEADER_WORDS + 1;
 		buf->tmp_hwords = palloc0(buf->tmp_hwords_cap * sizeof(BM_WORD));
+		buf->owner = tids;
+		buf->spill_runs = NIL;
+		words_size = 0;
 
 #ifdef DEBUG_BMI
 		elog(NOTICE,"[buf_add_tid] create new buf - CP1"
@@ -1638,7 +2176,7 @@ buf_add_tid(Relation rel, BMTidBuildBuf *tids, uint64 tidnum,
 		buf->hot_buffer_block=InvalidBlockNumber;
 		MemSet(buf->hot_buffer, 0, BM_SIZEOF_HOT_BUFFER * sizeof(BM_WORD));
 
-		bytes_added = buf_extend(buf);
+		buf_extend(buf);
 
 		buf->curword = 0;
 		buf->start_wordno = 0;
@@ -1648,8 +2186,16 @@ buf_add_tid(Relation rel, BMTidBuildBuf *tids, uint64 tidnum,
 							  state->use_wal);
 
 		lov_buf->bufs[off - 1] = buf;
-		tids->byte_size += bytes_added;
 	}
+
+	/*
+	 * Adding the tid may have grown the buffer's words, or spilled them
+	 * if its header words were full. Account for the difference rather
+	 * than trusting the byte counts passed up the call chain.
+	 */
+	tids->byte_size = tids->byte_size - words_size + BUF_WORDS_SIZE(buf);
+	buf->last_used = tids->clock;
+	buf->num_tids++;
 }
 
 /*
@@ -1919,6 +2465,12 @@ buf_extend(BMTIDBuffer *buf)
 
 /*
  * Spill some HRL compressed tids to disk
+ *
+ * Outside of a build, the words go straight to the vector's bitmap pages.
+ * During a build (buf->owner is set), the words are spilled to the build's
+ * spill file instead, until the final call with flush_hot_buffer set
+ * writes the spilled runs and then the remaining words to the bitmap
+ * pages, so that each vector ends up in pages written one after another.
  */
 
 static uint16
@@ -1937,8 +2489,11 @@ buf_free_mem(Relation rel, BMTIDBuffer *buf, BlockNumber lov_block,
 	if (flush_hot_buffer)
 	  bytes_freed += hot_buffer_flush(rel,buf,lov_block,off,use_wal,true);
 
+	if (buf->owner != NULL && !flush_hot_buffer)
+		return bytes_freed + buf_spill(buf);
+
 	/* already done */
-	if (buf->num_cwords == 0)
+	if (buf->num_cwords == 0 && buf->spill_runs == NIL)
 		return 0;
 
 #ifdef DEBUG_BMI
@@ -1947,13 +2502,19 @@ buf_free_mem(Relation rel, BMTIDBuffer *buf, BlockNumber lov_block,
 
 	lovbuf = _bitmap_getbuf(rel, lov_block, BM_WRITE);
 
-	_bitmap_write_new_bitmapwords(rel, lovbuf, off, buf, use_wal);
+	if (buf->spill_runs != NIL)
+		buf_write_spilled(rel, lovbuf, off, buf, use_wal);
+
+	if (buf->spill_runs == NIL || buf->curword > 0)
+		_bitmap_write_new_bitmapwords(rel, lovbuf, off, buf, use_wal);
 
 	_bitmap_relbuf(lovbuf);
 
 #ifdef DEBUG_BMI
 	_debug_view_2(buf,"[buf_free_mem] END");
 #endif
+	list_free_deep(buf->spill_runs);
+	buf->spill_runs = NIL;
 	bytes_freed += _bitmap_free_tidbuf(buf);
 #ifdef DEBUG_BMI
 	elog(NOTICE,"[buf_free_mem] END , bytes_freed ==> %u", bytes_freed);
@@ -1962,46 +2523,214 @@ buf_free_mem(Relation rel, BMTIDBuffer *buf, BlockNumber lov_block,
 }
 
 /*
- * Spill some data out of the buffer to free up space.
+ * buf_spill() -- append the complete words of a build buffer to the
+ * build's spill file as a new run, and release their memory.
+ *
+ * Only the complete words are spilled; the last complete word and the
+ * last word stay in the buffer, so HRL merging carries on as if nothing
+ * happened. Returns the number of bytes freed.
+ */
+static Size
+buf_spill(BMTIDBuffer *buf)
+{
+	BMTidBuildBuf *tids = buf->owner;
+	Size		bytes_freed;
+
+	Assert(tids != NULL);
+	Assert(buf->start_wordno == 0);
+
+	if (buf->curword > 0)
+	{
+		BMSpillRun *run = (BMSpillRun *) palloc(sizeof(BMSpillRun));
+
+		if (tids->spill_file == NULL)
+		{
+			tids->spill_file = BufFileCreateTemp(false);
+			tids->spill_end_fileno = 0;
+			tids->spill_end_offset = 0;
+		}
+
+		/* reading back a run may have moved us; runs are only appended */
+		if (BufFileSeek(tids->spill_file, tids->spill_end_fileno,
+						tids->spill_end_offset, SEEK_SET) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not seek in bitmap index build spill file")));
+
+		run->fileno = tids->spill_end_fileno;
+		run->offset = tids->spill_end_offset;
+		run->nwords = buf->curword;
+
+		BufFileWrite(tids->spill_file, buf->cwords,
+					 buf->curword * sizeof(BM_WORD));
+		BufFileWrite(tids->spill_file, buf->last_tids,
+					 buf->curword * sizeof(uint64));
+		BufFileWrite(tids->spill_file, buf->hwords,
+					 BM_CALC_H_WORDS(buf->curword) * sizeof(BM_WORD));
+		BufFileTell(tids->spill_file, &tids->spill_end_fileno,
+					&tids->spill_end_offset);
+
+		tids->stats->spilled_runs++;
+		tids->stats->spilled_bytes += buf->curword * sizeof(BM_WORD) +
+			buf->curword * sizeof(uint64) +
+			BM_CALC_H_WORDS(buf->curword) * sizeof(BM_WORD);
+
+		buf->spill_runs = lappend(buf->spill_runs, run);
+	}
+
+	bytes_freed = BUF_WORDS_SIZE(buf);
+
+	if (buf->cwords)
+		pfree(buf->cwords);
+	if (buf->last_tids)
+		pfree(buf->last_tids);
+	buf->cwords = NULL;
+	buf->last_tids = NULL;
+	buf->num_cwords = 0;
+	buf->curword = 0;
+	buf->start_wordno = 0;
+	MemSet(buf->hwords, 0, sizeof(BM_WORD) * BM_NUM_OF_HEADER_WORDS);
+
+	return bytes_freed;
+}
+
+/*
+ * buf_write_spilled() -- write the spilled runs of a build buffer, oldest
+ * first, to the end of its bitmap vector.
+ *
+ * The LOV item is left describing the buffer's current last words, which
+ * the caller then finishes off by writing the words still in memory.
+ *
+ * lovbuf is pinned and locked exclusively.
  */
 static void
-buf_make_space(Relation rel, BMTidBuildBuf *locbuf, bool use_wal)
+buf_write_spilled(Relation rel, Buffer lovbuf, OffsetNumber off,
+				  BMTIDBuffer *buf, bool use_wal)
 {
-	ListCell *cell;
+	BufFile    *file = buf->owner->spill_file;
+	BMTIDBuffer	run_buf;
+	ListCell   *cell;
+	int			max_words = BM_NUM_OF_HEADER_WORDS * BM_WORD_SIZE;
+
+	MemSet(&run_buf, 0, sizeof(run_buf));
+	run_buf.cwords = (BM_WORD *) palloc(max_words * sizeof(BM_WORD));
+	run_buf.last_tids = (uint64 *) palloc(max_words * sizeof(uint64));
+	run_buf.num_cwords = max_words;
+	run_buf.last_compword = buf->last_compword;
+	run_buf.last_word = buf->last_word;
+	run_buf.is_last_compword_fill = buf->is_last_compword_fill;
+	run_buf.last_tid = buf->last_tid;
+	run_buf.owner = buf->owner;
+
+	foreach(cell, buf->spill_runs)
+	{
+		BMSpillRun *run = (BMSpillRun *) lfirst(cell);
+
+		Assert(run->nwords <= max_words);
+
+		if (BufFileSeek(file, run->fileno, run->offset, SEEK_SET) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not seek in bitmap index build spill file")));
+
+		MemSet(run_buf.hwords, 0, sizeof(BM_WORD) * BM_NUM_OF_HEADER_WORDS);
+		BufFileReadExact(file, run_buf.cwords, run->nwords * sizeof(BM_WORD));
+		BufFileReadExact(file, run_buf.last_tids,
+						 run->nwords * sizeof(uint64));
+		BufFileReadExact(file, run_buf.hwords,
+						 BM_CALC_H_WORDS(run->nwords) * sizeof(BM_WORD));
 
-	elog(NOTICE, "making space");
+		run_buf.curword = run->nwords;
+		run_buf.start_wordno = 0;
+
+		_bitmap_write_new_bitmapwords(rel, lovbuf, off, &run_buf, use_wal);
+	}
+
+	_bitmap_free_tidbuf(&run_buf);
+}
+
+/*
+ * Spill some data out of the buffer to free up space.
+ *
+ * The buffers with the most words that have gone longest without a new
+ * tid are spilled first: they free the most memory, and are the least
+ * likely to have spilled again by the end of the build. We spill down to
+ * three quarters of maintenance_work_mem so that we don't come back here
+ * for every following tid.
+ */
+static void
+buf_make_space(BMTidBuildBuf *locbuf)
+{
+	BMSpillCandidate *cands;
+	int			ncands = 0;
+	int			nspilled = 0;
+	int			maxcands = 0;
+	BlockNumber	blkno;
+	Size		target = (Size) maintenance_work_mem * 1024L / 4 * 3;
+	int			i;
 
 	/*
-	 * Now, we could just pull the head of lov_blocks but there'd be no
-	 * guarantee that we'd free up enough space.
+	 * Now, we could just walk the buffers in LOV order but there'd be no
+	 * guarantee that we'd free up enough space, or that what we free would
+	 * not be needed again straight away.
 	 */
-	foreach(cell, locbuf->lov_blocks)
+	for (blkno = 0; blkno < locbuf->num_lov_blocks; blkno++)
+		if (locbuf->lov_blocks[blkno] != NULL)
+			maxcands += BM_MAX_LOVITEMS_PER_PAGE;
+
+	cands = (BMSpillCandidate *) palloc(maxcands * sizeof(BMSpillCandidate));
+	locbuf->stats->buf_flushes++;
+
+	for (blkno = 0; blkno < locbuf->num_lov_blocks; blkno++)
 	{
-		int i;
-		BMTIDLOVBuffer *lov_buf = (BMTIDLOVBuffer *)lfirst(cell);
-		BlockNumber lov_block = lov_buf->lov_block;
+		BMTIDLOVBuffer *lov_buf = locbuf->lov_blocks[blkno];
 
-		for(i = 0; i < BM_MAX_LOVITEMS_PER_PAGE; i++)
+		if (lov_buf == NULL)
+			continue;
+
+		for (i = 0; i < BM_MAX_LOVITEMS_PER_PAGE; i++)
 		{
-			BMTIDBuffer *buf = (BMTIDBuffer *)lov_buf->bufs[i];
-			OffsetNumber off;
+			BMTIDBuffer *buf = lov_buf->bufs[i];
 
-			/* return if we've freed enough space */
-			if(locbuf->byte_size < (maintenance_work_mem * 1024L))
-				return;
-			if(!buf || buf->num_cwords == 0)
+			if (!buf || buf->curword == 0)
 				continue;
 
-			off = i + 1;
-#ifdef DEBUG_BMI
-			elog(NOTICE,"invoking buf_free_mem from buf_make_space");
-#endif
-			locbuf->byte_size -= buf_free_mem(rel, buf, lov_block, off, 
-							  use_wal, false);
+			cands[ncands].buf = buf;
+			cands[ncands].score = (double) BUF_WORDS_SIZE(buf) *
+				(double) (locbuf->clock - buf->last_used + 1);
+			ncands++;
 		}
-		if(locbuf->byte_size < (maintenance_work_mem * 1024L))
-			return;
 	}
+
+	qsort(cands, ncands, sizeof(BMSpillCandidate), spill_candidate_cmp);
+
+	for (i = 0; i < ncands && locbuf->byte_size >= target; i++)
+	{
+		locbuf->byte_size -= buf_spill(cands[i].buf);
+		nspilled++;
+	}
+
+	elog(DEBUG1, "bitmap index build spilled %d of %d buffered vectors",
+		 nspilled, ncands);
+
+	pfree(cands);
+}
+
+/*
+ * spill_candidate_cmp() -- qsort comparator putting the best eviction
+ * candidates first.
+ */
+static int
+spill_candidate_cmp(const void *a, const void *b)
+{
+	double		sa = ((const BMSpillCandidate *) a)->score;
+	double		sb = ((const BMSpillCandidate *) b)->score;
+
+	if (sa > sb)
+		return -1;
+	if (sa < sb)
+		return 1;
+	return 0;
 }
 
 /*
@@ -2018,6 +2747,10 @@ _bitmap_free_tidbuf(BMTIDBuffer* buf)
 		pfree(buf->cwords);
 	if (buf->tmp_hwords)
 		pfree(buf->tmp_hwords);
+	buf->last_tids = NULL;
+	buf->cwords = NULL;
+	buf->tmp_hwords = NULL;
+	buf->tmp_hwords_cap = 0;
 
 	bytes_freed = buf->num_cwords * sizeof(BM_WORD) +
 		buf->num_cwords * sizeof(uint64);
@@ -2075,7 +2808,7 @@ insertsetbit(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
 		 * Scan through the bitmap vector, and update the bit in
 		 * tidnum.
 		 */
-		updatesetbit(rel, lovBuffer, lovOffset, tidnum, use_wal);
+		updatesetbit(rel, lovBuffer, lovOffset, tidnum, use_wal, true);
 
 		return;
 	}
@@ -2129,36 +2862,83 @@ void
 _bitmap_write_alltids(Relation rel, BMTidBuildBuf *tids, 
 					  bool use_wal)
 {
-	ListCell *cell;
+	BlockNumber lov_block;
+	int64		nvectors = 0;
+	int64		nwritten = 0;
 
 #ifdef DEBUG_BMI
 	elog(NOTICE,"[_bitmap_write_alltids] BEGIN");
 #endif
-	foreach(cell, tids->lov_blocks)
+	/* report the vectors we are about to write as the tuples to do */
+	for (lov_block = 0; lov_block < tids->num_lov_blocks; lov_block++)
+	{
+		int i;
+
+		if (tids->lov_blocks[lov_block] == NULL)
+			continue;
+		for (i = 0; i < BM_MAX_LOVITEMS_PER_PAGE; i++)
+			if (tids->lov_blocks[lov_block]->bufs[i])
+				nvectors++;
+	}
+	{
+		const int	progress_index[] = {
+			PROGRESS_CREATEIDX_TUPLES_TOTAL,
+			PROGRESS_CREATEIDX_TUPLES_DONE
+		};
+		const int64 progress_vals[] = {nvectors, 0};
+
+		pgstat_progress_update_multi_param(2, progress_index, progress_vals);
+	}
+
+	/*
+	 * Go in LOV order, so that each vector's spilled runs and remaining
+	 * words are written out together.
+	 */
+	for (lov_block = 0; lov_block < tids->num_lov_blocks; lov_block++)
 	{
 		int i;
-		BMTIDLOVBuffer *lov_buf = (BMTIDLOVBuffer *)lfirst(cell);
-		BlockNumber lov_block = lov_buf->lov_block;
+		BMTIDLOVBuffer *lov_buf = tids->lov_blocks[lov_block];
+
+		if (lov_buf == NULL)
+			continue;
 
 		for(i = 0; i < BM_MAX_LOVITEMS_PER_PAGE; i++)
 		{
 			BMTIDBuffer *buf = (BMTIDBuffer *)lov_buf->bufs[i];
 			OffsetNumber off;
 
-			if(!buf || buf->num_cwords == 0)
+			if(!buf)
 				continue;
 
 			off = i + 1;
 
 			buf_free_mem(rel, buf, lov_block, off, use_wal, true);
+			if (buf->num_tids > 0)
+			{
+				Buffer		lovbuf = _bitmap_getbuf(rel, lov_block, BM_WRITE);
+
+				add_setbits(lovbuf, off, buf->num_tids);
+				_bitmap_relbuf(lovbuf);
+			}
 			pfree(buf);
 
 			lov_buf->bufs[i] = NULL;
+			pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE,
+										 ++nwritten);
 		}
+
+		pfree(lov_buf);
+		tids->lov_blocks[lov_block] = NULL;
 	}
-	list_free_deep(tids->lov_blocks);
-	tids->lov_blocks = NIL;
+	if (tids->lov_blocks)
+		pfree(tids->lov_blocks);
+	tids->lov_blocks = NULL;
+	tids->num_lov_blocks = 0;
 	tids->byte_size = 0;
+
+	if (tids->spill_file)
+		BufFileClose(tids->spill_file);
+	tids->spill_file = NULL;
 #ifdef DEBUG_BMI
 	elog(NOTICE,"[_bitmap_write_alltids] END");
 #endif
@@ -2255,7 +3035,8 @@ build_inserttuple(Relation index, uint64 tidnum,
 		 */
 		create_lovitem(index, metabuf, tidnum, tupDesc, attdata, 
 			nulls, state->bm_lov_heap, state->bm_lov_index,
-			&lovBlock, &lovOffset, state->use_wal);
+			&lovBlock, &lovOffset, state->use_wal, state);
+		state->bm_stats.lov_misses++;
 
 		/* Updates the information in the LOV heap entry about the block and the offset */
 		lov = (BMBuildLovData *) &(entry[tupDesc->natts]);
@@ -2269,6 +3050,7 @@ build_inserttuple(Relation index, uint64 tidnum,
 		lov = (BMBuildLovData *) &(entry[tupDesc->natts]);
 		lovBlock = lov->lov_block;
 		lovOffset = lov->lov_off;
+		state->bm_stats.lov_hits++;
 		}
 	}
 	else
@@ -2277,6 +3059,11 @@ build_inserttuple(Relation index, uint64 tidnum,
 		 * Search the btree to find the right bitmap vector to append
 		 * this bit. Here, we reset the scan key and call index_rescan.
 		 */
+		if (state->bm_lov_index == NULL)
+		found = _bitmap_dict_lookup(index, attdata, nulls,
+		&lovBlock, &lovOffset);
+		else
+		{
 		for (attno = 0; attno<tupDesc->natts; attno++)
 		{
 		ScanKey theScanKey = (ScanKey)(((char*)state->bm_lov_scanKeys) +
@@ -2299,6 +3086,7 @@ build_inserttuple(Relation index, uint64 tidnum,
 		found = _bitmap_findvalue(state->bm_lov_heap, state->bm_lov_index,
 		state->bm_lov_scanKeys, state->bm_lov_scanDesc,
 		&lovBlock, &blockNull, &lovOffset, &offsetNull);
+		}
 
 		if (!found)
 		{
@@ -2308,8 +3096,11 @@ build_inserttuple(Relation index, uint64 tidnum,
 		 */
 		create_lovitem(index, metabuf, tidnum, tupDesc, attdata, 
 			nulls, state->bm_lov_heap, state->bm_lov_index,
-			&lovBlock, &lovOffset, state->use_wal);
+			&lovBlock, &lovOffset, state->use_wal, state);
+		state->bm_stats.lov_misses++;
 		}
+		else
+		state->bm_stats.lov_hits++;
 	}
 	}
 
@@ -2349,16 +3140,35 @@ inserttuple(Relation rel, Buffer metabuf, uint64 tidnum,
 {
 	BlockNumber		lovBlock;
 	OffsetNumber	lovOffset;
-	bool			blockNull, offsetNull;
+
+	find_lovitem(rel, metabuf, tidnum, tupDesc, attdata, nulls,
+				 lovHeap, lovIndex, scanKey, scanDesc, use_wal,
+				 &lovBlock, &lovOffset);
+
+	/*
+	 * Here, we have found the block number and offset number of the
+	 * LOV item that points to the bitmap page, to which we will
+	 * append the set bit.
+	 */
+	insert_tid(rel, lovBlock, lovOffset, tidnum, use_wal);
+}
+
+/*
+ * find_lovitem() -- find the LOV item for the given attribute values.
+ *
+ * If there is no LOV item for them yet, one is created for a vector
+ * whose first set bit will be tidnum, and true is returned.
+ */
+static bool
+find_lovitem(Relation rel, Buffer metabuf, uint64 tidnum,
+			 TupleDesc tupDesc, Datum *attdata, bool *nulls,
+			 Relation lovHeap, Relation lovIndex, ScanKey scanKey,
+			 IndexScanDesc scanDesc, bool use_wal,
+			 BlockNumber *lovBlockP, OffsetNumber *lovOffsetP)
+{
 	bool			allNulls = true;
+	bool			created = false;
 	int				attno;
-	Buffer			lovBuffer;
-
-	BMTIDBuffer		buf;
-	MemSet(&buf, 0, sizeof(buf));
-	buf_extend(&buf);
-	buf.tmp_hwords_cap = BM_MAX_NUM_OF_HEADER_WORDS + 1;
-	buf.tmp_hwords = palloc0(buf.tmp_hwords_cap * sizeof(BM_WORD));
 
 	/* Check if the values of given attributes are all NULL. */
 	for (attno = 0; attno < tupDesc->natts; attno++)
@@ -2377,58 +3187,259 @@ inserttuple(Relation rel, Buffer metabuf, uint64 tidnum,
 	 */
 	if (allNulls)
 	{
-		lovBlock = BM_LOV_STARTPAGE;
-		lovOffset = 1;
+		*lovBlockP = BM_LOV_STARTPAGE;
+		*lovOffsetP = 1;
 	}
 	else
 	{
 		bool res;
-	   
+
+		/* a value whose LOV item this backend has seen needs no lookup */
+		if (_bitmap_lovcache_lookup(rel, attdata, nulls,
+									lovBlockP, lovOffsetP))
+			return false;
+
 		/*
-		 * XXX: We lock the meta page to guard against a race condition where
-		 * by a concurrent writer is inserting the same key as us and they
-		 * create_lovitem() between us calling _bitmap_findvalue() and
-		 * create_lovitem().
-		 *
-		 * The problem is, locking the metapage is pretty heavy handed 
-		 * because the read routines need a read lock on it. There are a
-		 * few other things we could do instead: use a BM insert lock or
-		 * wrap the code below in a PG_TRY and try and catch the unique
-		 * constraint violation from the btree code.
+		 * Most inserts hit a value that already has a LOV item, so look it
+		 * up first with nothing but the share locks the LOV btree takes
+		 * internally. Readers and other inserters of existing values never
+		 * wait on us here. A value the filter page does not know is new,
+		 * and needs no search.
 		 */
-		LockBuffer(metabuf, BM_WRITE);
-		res = _bitmap_findvalue(lovHeap, lovIndex, scanKey, scanDesc, &lovBlock,
-								&blockNull, &lovOffset, &offsetNull);
+		res = _bitmap_filter_maybe_present(rel, attdata, nulls) &&
+			lookup_lovitem(rel, attdata, nulls, lovHeap, lovIndex,
+						   scanKey, scanDesc, lovBlockP, lovOffsetP);
 
-		if(!res)
+		if (!res)
 		{
 			/*
-			 * Search through the lov heap and index to find the LOV item which
-			 * has the same value as the inserting tuple. If such an item is
-			 * not found, then we create a new LOV item, and insert it into the
-			 * lov heap and index.
+			 * The value is new. Take the per-index insert lock, a heavyweight
+			 * lock on the metapage block number, so that only one backend
+			 * creates LOV items at a time, and look again: a concurrent writer
+			 * may have created the item between our lookup and getting the
+			 * lock. The scan uses SnapshotAny, so an item inserted by a
+			 * transaction that has not committed yet is found as well.
+			 *
+			 * The metapage buffer itself is only locked around
+			 * create_lovitem(), which may move bm_lov_lastpage.
+			 *
+			 * The filter page only changes under the lock as well, so if it
+			 * still does not know the value, nobody has created its item.
 			 */
-			create_lovitem(rel, metabuf, tidnum, tupDesc,
-						   attdata, nulls, lovHeap, lovIndex,
-						   &lovBlock, &lovOffset, use_wal);
+			LockPage(rel, BM_METAPAGE, ExclusiveLock);
+
+			if (_bitmap_filter_maybe_present(rel, attdata, nulls))
+			{
+				if (scanDesc != NULL)
+					index_rescan(scanDesc, scanKey, tupDesc->natts, NULL, 0);
+				res = lookup_lovitem(rel, attdata, nulls, lovHeap, lovIndex,
+									 scanKey, scanDesc, lovBlockP,
+									 lovOffsetP);
+			}
+			if (!res)
+			{
+				LockBuffer(metabuf, BM_WRITE);
+				create_lovitem(rel, metabuf, tidnum, tupDesc,
+							   attdata, nulls, lovHeap, lovIndex,
+							   lovBlockP, lovOffsetP, use_wal, NULL);
+				LockBuffer(metabuf, BUFFER_LOCK_UNLOCK);
+				created = true;
+			}
+
+			UnlockPage(rel, BM_METAPAGE, ExclusiveLock);
 		}
-		LockBuffer(metabuf, BUFFER_LOCK_UNLOCK);
+
+		_bitmap_lovcache_store(rel, attdata, nulls, *lovBlockP, *lovOffsetP);
 	}
 
-	/*
-	 * Here, we have found the block number and offset number of the
-	 * LOV item that points to the bitmap page, to which we will
-	 * append the set bit.
-	 */
+	return created;
+}
+
+/*
+ * lookup_lovitem() -- look the given attribute values up in the LOV btree,
+ *	or in the dictionary of an index that has no LOV heap and btree.
+ *
+ * scanDesc, if there is one, must have been set to look for the values.
+ */
+static bool
+lookup_lovitem(Relation rel, Datum *attdata, bool *nulls,
+			   Relation lovHeap, Relation lovIndex, ScanKey scanKey,
+			   IndexScanDesc scanDesc,
+			   BlockNumber *lovBlockP, OffsetNumber *lovOffsetP)
+{
+	bool			blockNull, offsetNull;
+
+	if (lovIndex == NULL)
+		return _bitmap_dict_lookup(rel, attdata, nulls, lovBlockP, lovOffsetP);
+
+	return _bitmap_findvalue(lovHeap, lovIndex, scanKey, scanDesc,
+							 lovBlockP, &blockNull, lovOffsetP, &offsetNull);
+}
+
+/*
+ * _bitmap_find_lovitem() -- find the LOV item of the given attribute
+ *	values without creating one. Returns false if they have none.
+ *
+ * All NULLs have the NULL item. Nothing is locked but what the lookup
+ * itself takes, so the item found may be one being created.
+ */
+bool
+_bitmap_find_lovitem(Relation rel, Datum *attdata, bool *nulls,
+					 BlockNumber *lovBlockP, OffsetNumber *lovOffsetP)
+{
+	TupleDesc		tupDesc = RelationGetDescr(rel);
+	Relation		lovHeap;
+	Relation		lovIndex;
+	ScanKey			scanKeys;
+	IndexScanDesc	scanDesc;
+	bool			allNulls = true;
+	bool			found;
+	int				attno;
+
+	for (attno = 0; attno < tupDesc->natts; attno++)
+	{
+		if (!nulls[attno])
+		{
+			allNulls = false;
+			break;
+		}
+	}
+
+	if (allNulls)
+	{
+		*lovBlockP = BM_LOV_STARTPAGE;
+		*lovOffsetP = 1;
+		return true;
+	}
+
+	if (_bitmap_lovcache_lookup(rel, attdata, nulls, lovBlockP, lovOffsetP))
+		return true;
+	if (!_bitmap_filter_maybe_present(rel, attdata, nulls))
+		return false;
+
+	if (_bitmap_get_relcache(rel)->bm_dict_root != InvalidBlockNumber)
+		return lookup_lovitem(rel, attdata, nulls, NULL, NULL, NULL, NULL,
+							  lovBlockP, lovOffsetP);
+
+	_bitmap_open_lov(rel, &lovHeap, &lovIndex, AccessShareLock);
+
+	scanKeys = (ScanKey) palloc0(tupDesc->natts * sizeof(ScanKeyData));
+	init_lov_scankeys(rel, scanKeys);
+	set_lov_scankeys(tupDesc, scanKeys, attdata, nulls);
+
+	scanDesc = index_beginscan(lovHeap, lovIndex, SnapshotAny,
+							   tupDesc->natts, 0);
+	index_rescan(scanDesc, scanKeys, tupDesc->natts, NULL, 0);
+
+	found = lookup_lovitem(rel, attdata, nulls, lovHeap, lovIndex, scanKeys,
+						   scanDesc, lovBlockP, lovOffsetP);
+
+	index_endscan(scanDesc);
+	_bitmap_close_lov_heapandindex(lovHeap, lovIndex, AccessShareLock);
+	pfree(scanKeys);
+
+	return found;
+}
+
+/*
+ * insert_tid() -- set the bit for tidnum in the vector of the given
+ *	LOV item.
+ *
+ * The tail of the vector is read from the LOV item and written back by
+ * buf_free_mem() under separate buffer locks, so a lock on the LOV item
+ * keeps other backends from appending to the same vector in between.
+ */
+static void
+insert_tid(Relation rel, BlockNumber lovBlock, OffsetNumber lovOffset,
+		   uint64 tidnum, bool use_wal)
+{
+	ItemPointerData	lovItemTid;
+	Buffer			lovBuffer;
+	BMTIDBuffer		buf;
+
+	MemSet(&buf, 0, sizeof(buf));
+	buf_extend(&buf);
+	buf.tmp_hwords_cap = BM_MAX_NUM_OF_HEADER_WORDS + 1;
+	buf.tmp_hwords = palloc0(buf.tmp_hwords_cap * sizeof(BM_WORD));
+
+	ItemPointerSet(&lovItemTid, lovBlock, lovOffset);
+	LockTuple(rel, &lovItemTid, ExclusiveLock);
+
 	lovBuffer = _bitmap_getbuf(rel, lovBlock, BM_WRITE);
 	insertsetbit(rel, lovBuffer, lovOffset, tidnum, &buf, use_wal);
+	add_setbits(lovBuffer, lovOffset, 1);
 
 	_bitmap_relbuf(lovBuffer);
 
 	buf_free_mem(rel, &buf, lovBlock, lovOffset, use_wal, true);
 
-	
+	UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+}
+
+/*
+ * insert_tids() -- set the bits for a sorted array of distinct TIDs in
+ *	the vector of the given LOV item.
+ *
+ * TIDs that fall before the last set bit of the vector are updated in
+ * place one by one, as insertsetbit() does. The rest are compressed into
+ * a BMTIDBuffer the way a build does it, and appended to the vector in
+ * one go.
+ */
+static void
+insert_tids(Relation rel, BlockNumber lovBlock, OffsetNumber lovOffset,
+			uint64 *tids, int ntids, bool use_wal)
+{
+	ItemPointerData	lovItemTid;
+	Buffer			lovBuffer;
+	Page			lovPage;
+	BMLOVItem		lovItem;
+	BMTIDBuffer		buf;
+	int				i;
+
+	/* see insert_tid() */
+	ItemPointerSet(&lovItemTid, lovBlock, lovOffset);
+	LockTuple(rel, &lovItemTid, ExclusiveLock);
 
+	lovBuffer = _bitmap_getbuf(rel, lovBlock, BM_WRITE);
+	lovPage = BufferGetPage(lovBuffer);
+	lovItem = (BMLOVItem) PageGetItem(lovPage,
+									  PageGetItemId(lovPage, lovOffset));
+
+	add_setbits(lovBuffer, lovOffset, ntids);
+
+	for (i = 0; i < ntids && tids[i] <= lovItem->bm_last_setbit; i++)
+		updatesetbit(rel, lovBuffer, lovOffset, tids[i], use_wal, true);
+
+	if (i == ntids)
+	{
+		_bitmap_relbuf(lovBuffer);
+		UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+		return;
+	}
+
+	MemSet(&buf, 0, sizeof(buf));
+	buf.last_tid = lovItem->bm_last_setbit;
+	buf.last_compword = lovItem->bm_last_compword;
+	buf.last_word = lovItem->bm_last_word;
+	buf.is_last_compword_fill = BM_LAST_COMPWORD_IS_FILL(lovItem);
+	buf.hot_buffer_block = InvalidBlockNumber;
+	buf.tmp_hwords_cap = BM_MAX_NUM_OF_HEADER_WORDS + 1;
+	buf.tmp_hwords = palloc0(buf.tmp_hwords_cap * sizeof(BM_WORD));
+	buf_extend(&buf);
+
+	/*
+	 * Filling the buffer may write full header words out through
+	 * buf_free_mem(), which locks the LOV page itself.
+	 */
+	_bitmap_relbuf(lovBuffer);
+
+	for (; i < ntids; i++)
+		buf_add_tid_with_fill(rel, &buf, lovBlock, lovOffset, tids[i],
+							  use_wal);
+
+	buf_free_mem(rel, &buf, lovBlock, lovOffset, use_wal, true);
+
+	UnlockTuple(rel, &lovItemTid, ExclusiveLock);
 }
 
 /*
@@ -2457,6 +3468,59 @@ _bitmap_buildinsert(Relation index, ItemPointer ht_ctid, Datum *attdata,
 #endif
 }
 
+/*
+ * init_lov_scankeys() -- set up the scan keys that look up the values of
+ *	the indexed attributes in the LOV btree.
+ *
+ * Only the equality procedures, taken from the relation cache, are
+ * filled in; set_lov_scankeys() sets the values to look for.
+ */
+static void
+init_lov_scankeys(Relation rel, ScanKey scanKeys)
+{
+	BMRelCache	   *cache = _bitmap_get_relcache(rel);
+	int				attno;
+
+	for (attno = 0; attno < cache->natts; attno++)
+	{
+		ScanKeyEntryInitialize(scanKeys + attno,
+						/* flags */ 0,
+						/* attributeNumber */ attno + 1,
+						/* strategy */ BTEqualStrategyNumber,
+						/* subtype (collation) */ InvalidOid,
+						/* collation */ InvalidOid,
+						/* procedure */ cache->eq_procs[attno],
+						/* argument - set below */ (Datum) 0);
+	}
+}
+
+/*
+ * set_lov_scankeys() -- make the scan keys look for the given values.
+ */
+static void
+set_lov_scankeys(TupleDesc tupDesc, ScanKey scanKeys, Datum *attdata,
+				 bool *nulls)
+{
+	int				attno;
+
+	for (attno = 0; attno < tupDesc->natts; attno++)
+	{
+		ScanKey			scanKey = scanKeys + attno;
+
+		scanKey->sk_flags &= ~(SK_ISNULL | SK_SEARCHNOTNULL);
+		if (nulls[attno])
+		{
+			scanKey->sk_flags |= SK_ISNULL;
+			scanKey->sk_argument = (Datum) 0;
+		}
+		else
+		{
+			scanKey->sk_argument = attdata[attno];
+			scanKey->sk_flags |= SK_SEARCHNOTNULL;
+		}
+	}
+}
+
 /*
  * _bitmap_doinsert() -- insert an index tuple for a given tuple.
  */
@@ -2467,11 +3531,12 @@ _bitmap_doinsert(Relation rel, ItemPointerData ht_ctid, Datum *attdata,
 	uint64			tidOffset;
 	TupleDesc		tupDesc;
 	Buffer			metabuf;
-	BMMetaPage		metapage;
 	Relation		lovHeap, lovIndex;
 	ScanKey			scanKeys;
 	IndexScanDesc	scanDesc;
 	int				attno;
+	BlockNumber		lovBlock;
+	OffsetNumber	lovOffset;
 
 	tupDesc = RelationGetDescr(rel);
 	if (tupDesc->natts <= 0)
@@ -2480,52 +3545,34 @@ _bitmap_doinsert(Relation rel, ItemPointerData ht_ctid, Datum *attdata,
 	Assert(ItemPointerGetOffsetNumber(&ht_ctid) <= BM_MAX_HTUP_PER_PAGE);
 	tidOffset = BM_IPTR_TO_INT(&ht_ctid);
 
-	/* insert a new bit into the corresponding bitmap using the HRL scheme */
-	metabuf = _bitmap_getbuf(rel, BM_METAPAGE, BM_READ);
-	metapage = (BMMetaPage)PageGetContents(BufferGetPage(metabuf));
-	_bitmap_open_lov_heapandindex(metapage, &lovHeap, &lovIndex, 
-								  RowExclusiveLock);
-
-	LockBuffer(metabuf, BUFFER_LOCK_UNLOCK);
+	/*
+	 * A value whose LOV item this backend has seen needs neither the LOV
+	 * heap and btree nor the dictionary.
+	 */
+	if (_bitmap_lovcache_lookup(rel, attdata, nulls, &lovBlock, &lovOffset))
+	{
+		insert_tid(rel, lovBlock, lovOffset, tidOffset, true);
+		return;
+	}
 
-	scanKeys = (ScanKey) palloc0(tupDesc->natts * sizeof(ScanKeyData));
+	/* insert a new bit into the corresponding bitmap using the HRL scheme */
+	metabuf = _bitmap_getbuf(rel, BM_METAPAGE, BM_NOLOCK);
 
-	for (attno = 0; attno < tupDesc->natts; attno++)
+	/* an index with a value dictionary has no LOV heap and btree */
+	if (_bitmap_get_relcache(rel)->bm_dict_root != InvalidBlockNumber)
 	{
-		RegProcedure	opfuncid = InvalidOid;
-		ScanKey			scanKey = scanKeys + attno;
-		Oid 			eq_opr = InvalidOid; /* equality operator */
-
-		/* Get the equality operator OID */
-		// Determine equality operator function for this attribute
-		// scanKey = (ScanKey) (((char *)scanKeys) + attno * sizeof(ScanKeyData));
-		get_sort_group_operators(TupleDescAttr(tupDesc, attno)->atttypid,
-					 false, true, false, NULL, &eq_opr, NULL, NULL);
-		if (OidIsValid(eq_opr))
-        	opfuncid = get_opcode(eq_opr);
-		// scanKey = (ScanKey) (((char *)scanKeys) + attno * sizeof(ScanKeyData));	
-
-		ScanKeyEntryInitialize(scanKey,
-						/* flags */ 0,
-						/* attributeNumber */ attno + 1,
-						/* strategy */ BTEqualStrategyNumber,
-						/* subtype (collation) */ InvalidOid,
-						/* collation */ InvalidOid,
-						/* procedure */ opfuncid,
-						/* argument - set below */ (Datum) 0);
-
-		if (nulls[attno])
-		{
-			scanKey->sk_flags |= SK_ISNULL;
-			// scanKey->sk_argument |= SK_SEARCHNULL;
-		}
-		else
-		{
-			scanKey->sk_argument = attdata[attno];
-			scanKey->sk_flags |=SK_SEARCHNOTNULL;
-		}
+		inserttuple(rel, metabuf, tidOffset, ht_ctid, tupDesc, attdata, nulls,
+					NULL, NULL, NULL, NULL, true);
+		ReleaseBuffer(metabuf);
+		return;
 	}
 
+	_bitmap_open_lov(rel, &lovHeap, &lovIndex, RowExclusiveLock);
+
+	scanKeys = (ScanKey) palloc0(tupDesc->natts * sizeof(ScanKeyData));
+	init_lov_scankeys(rel, scanKeys);
+	set_lov_scankeys(tupDesc, scanKeys, attdata, nulls);
+
 	scanDesc = index_beginscan(lovHeap, lovIndex, SnapshotAny,
 			       tupDesc->natts, 0);
 	index_rescan(scanDesc, scanKeys, tupDesc->natts, NULL, 0);
@@ -2551,27 +3598,489 @@ _bitmap_doinsert(Relation rel, ItemPointerData ht_ctid, Datum *attdata,
 	pfree(scanKeys);
 }
 
+/*
+ * _bitmap_begin_insert() -- set up the state for the inserts of one
+ *	statement into the given index.
+ *
+ * The state and everything it keeps are allocated in cxt, which must
+ * live until _bitmap_end_insert() is called. If the statement fails
+ * instead, the TIDs still pending are simply lost with cxt, along with
+ * the rows they belonged to.
+ */
+BMInsertState *
+_bitmap_begin_insert(Relation rel, MemoryContext cxt)
+{
+	BMInsertState  *state;
+	TupleDesc		tupDesc = RelationGetDescr(rel);
+	MemoryContextCallback *cb;
+	MemoryContext	oldcxt;
+
+	oldcxt = MemoryContextSwitchTo(cxt);
+
+	state = (BMInsertState *) palloc0(sizeof(BMInsertState));
+	state->bm_index = rel;
+
+	/* keep the metapage pinned for create_lovitem() */
+	state->bm_metabuf = _bitmap_getbuf(rel, BM_METAPAGE, BM_NOLOCK);
+
+	/* the fields for the LOV heap and btree stay NULL with a dictionary */
+	if (_bitmap_get_relcache(rel)->bm_dict_root == InvalidBlockNumber)
+	{
+		_bitmap_open_lov(rel, &state->bm_lov_heap, &state->bm_lov_index,
+						 RowExclusiveLock);
+
+		state->bm_lov_scanKeys =
+			(ScanKey) palloc0(Max(tupDesc->natts, 1) * sizeof(ScanKeyData));
+		init_lov_scankeys(rel, state->bm_lov_scanKeys);
+		state->bm_lov_scanDesc = index_beginscan(state->bm_lov_heap,
+												 state->bm_lov_index,
+												 SnapshotAny, tupDesc->natts,
+												 0);
+	}
+
+	state->pending_cxt = AllocSetContextCreate(cxt,
+											   "Bitmap index insert buffer",
+											   ALLOCSET_DEFAULT_SIZES);
+	insert_pending_create(state);
+
+	/* forget the state if cxt goes away without _bitmap_end_insert() */
+	cb = (MemoryContextCallback *) palloc(sizeof(MemoryContextCallback));
+	cb->func = insert_state_forget;
+	cb->arg = state;
+	MemoryContextRegisterResetCallback(cxt, cb);
+
+	state->next = active_insert_states;
+	active_insert_states = state;
+
+	MemoryContextSwitchTo(oldcxt);
+
+	return state;
+}
+
+/*
+ * _bitmap_buffered_insert() -- insert an index tuple as part of the
+ *	statement the given state belongs to.
+ *
+ * The LOV item for the value is found, or created, right away, but the
+ * TID is only added to the TIDs pending for that item. This turns the
+ * lock, read and write of the LOV page and the last bitmap page for
+ * every row into one sorted append per vector for many rows.
+ */
+void
+_bitmap_buffered_insert(BMInsertState *state, ItemPointerData ht_ctid,
+						Datum *attdata, bool *nulls)
+{
+	Relation		rel = state->bm_index;
+	TupleDesc		tupDesc = RelationGetDescr(rel);
+	uint64			tidnum;
+	BlockNumber		lovBlock;
+	OffsetNumber	lovOffset;
+	BMInsertPendingKey key;
+	BMInsertPending *entry;
+	bool			found;
+
+	if (tupDesc->natts <= 0)
+		return;
+
+	Assert(ItemPointerGetOffsetNumber(&ht_ctid) <= BM_MAX_HTUP_PER_PAGE);
+	tidnum = BM_IPTR_TO_INT(&ht_ctid);
+
+	if (state->bm_lov_scanDesc != NULL)
+	{
+		set_lov_scankeys(tupDesc, state->bm_lov_scanKeys, attdata, nulls);
+		index_rescan(state->bm_lov_scanDesc, state->bm_lov_scanKeys,
+					 tupDesc->natts, NULL, 0);
+	}
+
+	/*
+	 * A new LOV item is made for a vector that starts at tidnum, so that
+	 * bit has to be set before any other.
+	 */
+	if (find_lovitem(rel, state->bm_metabuf, tidnum, tupDesc, attdata, nulls,
+					 state->bm_lov_heap, state->bm_lov_index,
+					 state->bm_lov_scanKeys, state->bm_lov_scanDesc, true,
+					 &lovBlock, &lovOffset))
+	{
+		insert_tid(rel, lovBlock, lovOffset, tidnum, true);
+		return;
+	}
+
+	MemSet(&key, 0, sizeof(key));
+	key.lov_block = lovBlock;
+	key.lov_off = lovOffset;
+	entry = (BMInsertPending *) hash_search(state->pending, &key,
+											HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->maxtids = BM_INSERT_PENDING_INIT_TIDS;
+		entry->ntids = 0;
+		entry->tids = (uint64 *)
+			MemoryContextAlloc(state->pending_cxt,
+							   entry->maxtids * sizeof(uint64));
+		state->pending_bytes += sizeof(BMInsertPending) +
+			entry->maxtids * sizeof(uint64);
+	}
+	else if (entry->ntids == entry->maxtids)
+	{
+		entry->tids = (uint64 *)
+			repalloc(entry->tids, 2 * entry->maxtids * sizeof(uint64));
+		state->pending_bytes += entry->maxtids * sizeof(uint64);
+		entry->maxtids *= 2;
+	}
+	entry->tids[entry->ntids++] = tidnum;
+
+	if (state->pending_bytes >= work_mem * 1024L)
+		_bitmap_flush_inserts(state);
+}
+
+/*
+ * _bitmap_flush_inserts() -- write all TIDs pending in the given state
+ *	to their vectors.
+ *
+ * The vectors are visited in LOV order, and the TIDs of each are sorted
+ * so that the ones past the end of the vector are appended in one pass.
+ */
+void
+_bitmap_flush_inserts(BMInsertState *state)
+{
+	HASH_SEQ_STATUS	status;
+	BMInsertPending *entry;
+	BMInsertPending **items;
+	long			nitems;
+	long			i;
+	MemoryContext	oldcxt;
+
+	nitems = hash_get_num_entries(state->pending);
+	if (nitems == 0)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(state->pending_cxt);
+
+	items = (BMInsertPending **) palloc(nitems * sizeof(BMInsertPending *));
+	i = 0;
+	hash_seq_init(&status, state->pending);
+	while ((entry = (BMInsertPending *) hash_seq_search(&status)) != NULL)
+		items[i++] = entry;
+	qsort(items, nitems, sizeof(BMInsertPending *), insert_pending_cmp);
+
+	for (i = 0; i < nitems; i++)
+	{
+		uint64	   *tids = items[i]->tids;
+		int			ntids = 0;
+		int			j;
+
+		qsort(tids, items[i]->ntids, sizeof(uint64), tidnum_cmp);
+		for (j = 0; j < items[i]->ntids; j++)
+		{
+			if (ntids == 0 || tids[ntids - 1] != tids[j])
+				tids[ntids++] = tids[j];
+		}
+
+		insert_tids(state->bm_index, items[i]->key.lov_block,
+					items[i]->key.lov_off, tids, ntids, true);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	/* this releases the hash table, the TID arrays and the scratch space */
+	MemoryContextReset(state->pending_cxt);
+	insert_pending_create(state);
+}
+
+/*
+ * _bitmap_flush_pending_inserts() -- write out the TIDs that statements
+ *	of this backend have inserted into the given index but not written
+ *	yet, so that a scan of it sees them.
+ */
+void
+_bitmap_flush_pending_inserts(Relation rel)
+{
+	BMInsertState  *state;
+
+	for (state = active_insert_states; state != NULL; state = state->next)
+	{
+		if (RelationGetRelid(state->bm_index) == RelationGetRelid(rel))
+			_bitmap_flush_inserts(state);
+	}
+}
+
+/*
+ * _bitmap_end_insert() -- write out the pending TIDs and release the
+ *	resources of the given insert state.
+ */
+void
+_bitmap_end_insert(BMInsertState *state)
+{
+	_bitmap_flush_inserts(state);
+	insert_state_forget(state);
+
+	if (state->bm_lov_scanDesc != NULL)
+	{
+		index_endscan(state->bm_lov_scanDesc);
+		_bitmap_close_lov_heapandindex(state->bm_lov_heap,
+									   state->bm_lov_index,
+									   RowExclusiveLock);
+	}
+	ReleaseBuffer(state->bm_metabuf);
+	MemoryContextDelete(state->pending_cxt);
+	state->pending_cxt = NULL;
+	state->pending = NULL;
+}
+
+/*
+ * _bitmap_defer_insert() -- decide whether an insert into a deferred
+ *	index is left to _bitmap_summarize().
+ *
+ * The TIDs in heap blocks from bm_summarized_end on are not indexed;
+ * scans return these blocks as lossy pages instead. The first insert
+ * after the index is built, or after it is summarized completely, sets
+ * the mark to the current end of the heap: every tuple below it is in
+ * the index already, or its insert will be indexed as the block comes
+ * before the mark.
+ *
+ * The blocks _bitmap_summarize() is working on are indexed as usual, as
+ * the summarizing scan may have passed the tuple already. Setting the
+ * bit of a TID twice does no harm.
+ */
+bool
+_bitmap_defer_insert(Relation rel, Relation heapRel, ItemPointer ht_ctid)
+{
+	BlockNumber	blkno = ItemPointerGetBlockNumber(ht_ctid);
+	Buffer		metabuf;
+	BMMetaPage	metapage;
+	bool		defer;
+
+	if (!BMIsDeferred(rel))
+		return false;
+
+	/* check the version of the index before reading its metapage */
+	(void) _bitmap_get_relcache(rel);
+
+	metabuf = _bitmap_getbuf(rel, BM_METAPAGE, BM_READ);
+	metapage = (BMMetaPage) PageGetContents(BufferGetPage(metabuf));
+
+	if (!BlockNumberIsValid(metapage->bm_summarized_end))
+	{
+		BlockNumber	nblocks = RelationGetNumberOfBlocks(heapRel);
+
+		LockBuffer(metabuf, BUFFER_LOCK_UNLOCK);
+		LockBuffer(metabuf, BM_WRITE);
+
+		if (!BlockNumberIsValid(metapage->bm_summarized_end))
+		{
+			START_CRIT_SECTION();
+			metapage->bm_summarized_end = Max(nblocks, blkno + 1);
+			MarkBufferDirty(metabuf);
+			END_CRIT_SECTION();
+		}
+	}
+
+	defer = blkno >= metapage->bm_summarized_end &&
+		!(BlockNumberIsValid(metapage->bm_summarizing_end) &&
+		  blkno < metapage->bm_summarizing_end);
+
+	_bitmap_relbuf(metabuf);
+
+	return defer;
+}
+
+/*
+ * _bitmap_get_summarized_end() -- return the first heap block the index
+ *	does not cover, or InvalidBlockNumber if it covers the whole heap.
+ */
+BlockNumber
+_bitmap_get_summarized_end(Relation rel)
+{
+	Buffer		metabuf;
+	BlockNumber	result;
+
+	/* check the version of the index before reading its metapage */
+	(void) _bitmap_get_relcache(rel);
+
+	metabuf = _bitmap_getbuf(rel, BM_METAPAGE, BM_READ);
+	result = ((BMMetaPage)
+			  PageGetContents(BufferGetPage(metabuf)))->bm_summarized_end;
+	_bitmap_relbuf(metabuf);
+
+	return result;
+}
+
+/*
+ * _bitmap_summarize() -- index the heap blocks a deferred index has left
+ *	out so far.
+ *
+ * The blocks from bm_summarized_end up to the current end of the heap
+ * are read with the index build scan, and their TIDs are inserted the
+ * way the rows of one statement are, with one sorted append per vector.
+ * Blocks added to the heap meanwhile stay deferred. The caller holds
+ * ShareUpdateExclusiveLock on the heap and the index, so only one
+ * summarize runs at a time. Returns the number of heap blocks indexed.
+ */
+BlockNumber
+_bitmap_summarize(Relation heapRel, Relation rel)
+{
+	Buffer			metabuf;
+	BMMetaPage		metapage;
+	BlockNumber		start;
+	BlockNumber		end;
+	IndexInfo	   *indexInfo;
+	BMInsertState  *state;
+
+	/* check the version of the index before reading its metapage */
+	(void) _bitmap_get_relcache(rel);
+
+	metabuf = _bitmap_getbuf(rel, BM_METAPAGE, BM_WRITE);
+	metapage = (BMMetaPage) PageGetContents(BufferGetPage(metabuf));
+
+	start = metapage->bm_summarized_end;
+	if (!BlockNumberIsValid(start))
+	{
+		_bitmap_relbuf(metabuf);
+		return 0;
+	}
+	end = RelationGetNumberOfBlocks(heapRel);
+
+	/* from now on, inserts into [start, end) are indexed as well */
+	START_CRIT_SECTION();
+	metapage->bm_summarizing_end = end;
+	MarkBufferDirty(metabuf);
+	END_CRIT_SECTION();
+
+	LockBuffer(metabuf, BUFFER_LOCK_UNLOCK);
+
+	if (end > start)
+	{
+		indexInfo = BuildIndexInfo(rel);
+		state = _bitmap_begin_insert(rel, CurrentMemoryContext);
+
+		table_index_build_range_scan(heapRel, rel, indexInfo,
+									 false,	/* allow_sync */
+									 true,	/* anyvisible */
+									 false,	/* progress */
+									 start, end - start,
+									 summarize_callback, (void *) state,
+									 NULL);
+
+		_bitmap_end_insert(state);
+	}
+
+	/*
+	 * A deferred index goes on deferring from end; otherwise the index
+	 * covers the heap again, as inserts are no longer deferred.
+	 */
+	LockBuffer(metabuf, BM_WRITE);
+
+	START_CRIT_SECTION();
+	metapage->bm_summarized_end = BMIsDeferred(rel) ?
+		end : InvalidBlockNumber;
+	metapage->bm_summarizing_end = InvalidBlockNumber;
+	MarkBufferDirty(metabuf);
+	END_CRIT_SECTION();
+
+	_bitmap_relbuf(metabuf);
+
+	return (end > start) ? end - start : 0;
+}
+
+/*
+ * summarize_callback() -- insert a tuple found by _bitmap_summarize().
+ */
+static void
+summarize_callback(Relation index, ItemPointer tid, Datum *attdata,
+				   bool *nulls, bool tupleIsAlive, void *state)
+{
+	_bitmap_buffered_insert((BMInsertState *) state, *tid, attdata, nulls);
+}
+
+/*
+ * insert_pending_create() -- create the empty table of pending TIDs of
+ *	an insert state in its pending_cxt.
+ */
+static void
+insert_pending_create(BMInsertState *state)
+{
+	HASHCTL			hash_ctl;
+
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(BMInsertPendingKey);
+	hash_ctl.entrysize = sizeof(BMInsertPending);
+	hash_ctl.hcxt = state->pending_cxt;
+
+	state->pending = hash_create("Bitmap index pending inserts", 64,
+								 &hash_ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	state->pending_bytes = 0;
+}
+
+/* order pending LOV items by their position in the LOV */
+static int
+insert_pending_cmp(const void *a, const void *b)
+{
+	const BMInsertPending *pa = *(const BMInsertPending *const *) a;
+	const BMInsertPending *pb = *(const BMInsertPending *const *) b;
+
+	if (pa->key.lov_block != pb->key.lov_block)
+		return (pa->key.lov_block < pb->key.lov_block) ? -1 : 1;
+	if (pa->key.lov_off != pb->key.lov_off)
+		return (pa->key.lov_off < pb->key.lov_off) ? -1 : 1;
+	return 0;
+}
+
+static int
+tidnum_cmp(const void *a, const void *b)
+{
+	uint64		ta = *(const uint64 *) a;
+	uint64		tb = *(const uint64 *) b;
+
+	if (ta == tb)
+		return 0;
+	return (ta < tb) ? -1 : 1;
+}
+
+/*
+ * insert_state_forget() -- remove an insert state from the list of
+ *	active ones. Called from _bitmap_end_insert(), and again, harmlessly,
+ *	when the memory context of the state is reset or deleted.
+ */
+static void
+insert_state_forget(void *arg)
+{
+	BMInsertState  *state = (BMInsertState *) arg;
+	BMInsertState **prev;
+
+	for (prev = &active_insert_states; *prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == state)
+		{
+			*prev = state->next;
+			break;
+		}
+	}
+}
+
 /*
  * Debug helper functions 
  */
 
 void _debug_view_1(BMTidBuildBuf *x, const char *msg) 
 {
-  ListCell* c;
-  int i=0;
+  BlockNumber i;
   elog(NOTICE,"[_debug_view_BMTidBuildBuf] %s"
-	   "\n\tbyte_size = %u"
+	   "\n\tbyte_size = %zu"
 	   "\n\tmax_lov_block = %u"
-	   "\n\t\tlov_blocks:length = %d"
+	   "\n\tclock = %llu"
+	   "\n\t\tlov_blocks:length = %u"
 	   ,msg
 	   ,x->byte_size
 	   ,x->max_lov_block
-	   ,list_length(x->lov_blocks)
+	   ,(unsigned long long)x->clock
+	   ,x->num_lov_blocks
 	   );
-  foreach(c,x->lov_blocks) {
-	i++;
-  elog(NOTICE,"cell %d = %p"
-	   ,i,lfirst(c));
+  for (i = 0; i < x->num_lov_blocks; i++) {
+	if (x->lov_blocks[i] == NULL)
+	  continue;
+  elog(NOTICE,"block %u = %p"
+	   ,i,x->lov_blocks[i]);
   }
 }
 
@@ -17,8 +17,13 @@
 
 #include "access/genam.h"
 #include "access/tupdesc.h"
+#include "access/transam.h"
+#include "commands/progress.h"
 #include "parser/parse_oper.h"
+#include "pgstat.h"
+#include "storage/indexfsm.h"
 #include "storage/lmgr.h"
+#include "storage/procarray.h"
 #include "utils/memutils.h"
 #include "utils/lsyscache.h"
 #include "utils/syscache.h"
@@ -123,6 +128,9 @@ _bitmap_init_bitmappage(Buffer buf)
      * PageInit is the sice of the page, the third one of the special area */
     if(PageIsNew(page))
 	PageInit(page, BufferGetPageSize(buf), sizeof(BMPageOpaqueData));
+    else
+	/* a recycled page: words are added by or-ing in their header bits */
+	MemSet(PageGetContents(page), 0, sizeof(BMBitmapVectorPageData));
 
     /* Reset all the values (even if the page is not new) */
     opaque = (BMPageOpaque) PageGetSpecialPointer(page);
@@ -130,7 +138,166 @@ _bitmap_init_bitmappage(Buffer buf)
     opaque->bm_bitmap_next = InvalidBlockNumber;
     opaque->bm_last_tid_location = 0;
     opaque->bm_page_id = BM_PAGE_ID;
+    opaque->bm_flags = 0;
+
+}
+
+/*
+ * _bitmap_delete_bitmappage() -- mark a bitmap page that has been unlinked
+ *	from its vector as deleted.
+ *
+ * The next link is left alone; see BM_PAGE_DELETED. The caller holds an
+ * exclusive lock on the page and marks it dirty.
+ */
+void
+_bitmap_delete_bitmappage(Page page)
+{
+    BMPageOpaque opaque = (BMPageOpaque) PageGetSpecialPointer(page);
+
+    opaque->bm_hrl_words_used = 0;
+    opaque->bm_flags |= BM_PAGE_DELETED;
+    BMPageGetDeleteXid(page) = ReadNextFullTransactionId();
+}
+
+/*
+ * _bitmap_page_recyclable() -- can a page be reused for something else?
+ *
+ * Only deleted bitmap pages that no scan can still reach are. New, all
+ * zero pages are not, as they may be part of the extent reserved for a
+ * vector; vacuum turns the extents that vectors stop growing into into
+ * deleted pages (see _bitmap_vacuum_pages()).
+ */
+bool
+_bitmap_page_recyclable(Page page)
+{
+    if (PageIsNew(page) || !BMPageIsBitmapPage(page) ||
+	!BMPageIsDeleted(page))
+	return false;
+
+    return GlobalVisCheckRemovableFullXid(NULL, BMPageGetDeleteXid(page));
+}
+
+/*
+ * get_free_bitmappage() -- take a recyclable page from the free space map.
+ *
+ * Returns the page exclusively locked, or InvalidBuffer if the free space
+ * map has nothing for us.
+ */
+static Buffer
+get_free_bitmappage(Relation rel)
+{
+    for (;;)
+    {
+	BlockNumber blkno = GetFreeIndexPage(rel);
+	Buffer buf;
+
+	if (blkno == InvalidBlockNumber)
+	    return InvalidBuffer;
+
+	/*
+	 * The free space map is only a hint: someone may have reused the
+	 * page since it was recorded, so check it again.
+	 */
+	buf = _bitmap_getbuf(rel, blkno, BM_WRITE);
+	if (_bitmap_page_recyclable(BufferGetPage(buf)))
+	    return buf;
+	_bitmap_relbuf(buf);
+    }
+}
+
+/*
+ * _bitmap_alloc_bitmappage() -- get a new page to append to the bitmap
+ *	vector of a given LOV item.
+ *
+ * Pages are taken from the extent reserved for the vector, so that
+ * consecutive pages of a vector are consecutive blocks of the index even
+ * when other vectors grow at the same time. When the extent is used up,
+ * a new one is reserved by extending the index by npages, the number of
+ * pages the caller knows it needs, or when grow is set, by twice the
+ * previous extent if that is more. Callers appending to a vector that is
+ * written out in one go, as during a build, do not grow, so no blocks
+ * are left reserved at the end.
+ *
+ * Before a new extent is reserved, pages recycled by vacuum are taken
+ * from the free space map, so that an index under churn stops growing.
+ *
+ * The page is counted in the vector's bm_npages. If lovItem is NULL, a
+ * single page is added without any reservation, and is not counted; this
+ * is for pages that are linked into the middle of a vector, and delta
+ * pages.
+ *
+ * lovBuffer holds lovItem, and is pinned and exclusively locked. The
+ * returned buffer is exclusively locked and initialised as a bitmap page.
+ */
+Buffer
+_bitmap_alloc_bitmappage(Relation rel, Buffer lovBuffer, BMLOVItem lovItem,
+						 uint32 npages, bool grow)
+{
+    Buffer buf;
+
+    if (lovItem == NULL)
+    {
+	buf = get_free_bitmappage(rel);
+	if (!BufferIsValid(buf))
+	    buf = ExtendBufferedRel(BMR_REL(rel), MAIN_FORKNUM, NULL,
+				    EB_LOCK_FIRST);
+	_bitmap_init_bitmappage(buf);
+	return buf;
+    }
+
+    /*
+     * The reserved blocks may be gone if the index was truncated since
+     * they were reserved; forget about them then.
+     */
+    if (lovItem->bm_extent_next != InvalidBlockNumber &&
+	(lovItem->bm_extent_next >= lovItem->bm_extent_end ||
+	 lovItem->bm_extent_end > RelationGetNumberOfBlocks(rel)))
+	lovItem->bm_extent_next = lovItem->bm_extent_end = InvalidBlockNumber;
+
+    if (lovItem->bm_extent_next != InvalidBlockNumber)
+    {
+	buf = _bitmap_getbuf(rel, lovItem->bm_extent_next, BM_WRITE);
+	lovItem->bm_extent_next++;
+    }
+    else if (grow && BufferIsValid(buf = get_free_bitmappage(rel)))
+    {
+	/*
+	 * A recycled page will do; the next extent grows from the last one.
+	 * (A build has nothing recycled to look for.)
+	 */
+    }
+    else
+    {
+	Buffer extent[BM_MAX_EXTENT_PAGES];
+	uint32 extent_size = Max(npages, 1);
+	uint32 extended_by = 0;
+	BlockNumber first;
+	uint32 i;
+
+	if (grow)
+	    extent_size = Max(extent_size, Min(lovItem->bm_extent_size * 2,
+					       BM_MAX_EXTENT_PAGES));
+	extent_size = Min(extent_size, BM_MAX_EXTENT_PAGES);
+
+	first = ExtendBufferedRelBy(BMR_REL(rel), MAIN_FORKNUM, NULL,
+				    EB_LOCK_FIRST, extent_size,
+				    extent, &extended_by);
+
+	/* we only keep the first page; the rest stay empty until needed */
+	for (i = 1; i < extended_by; i++)
+	    ReleaseBuffer(extent[i]);
+
+	buf = extent[0];
+	lovItem->bm_extent_next = first + 1;
+	lovItem->bm_extent_end = first + extended_by;
+	lovItem->bm_extent_size = extended_by;
+    }
 
+    lovItem->bm_npages++;
+    MarkBufferDirty(lovBuffer);
+
+    _bitmap_init_bitmappage(buf);
+    return buf;
 }
 
 /*
@@ -162,18 +329,38 @@ _bitmap_init_buildstate(Relation index, BMBuildState *bmstate)
     bmstate->bm_tidLocsBuffer = (BMTidBuildBuf *)
 	palloc(sizeof(BMTidBuildBuf)); /* allocate the index build buffer and ... */
     bmstate->bm_tidLocsBuffer->byte_size = 0; /* ... initialises it */
-    bmstate->bm_tidLocsBuffer->lov_blocks = NIL;
+    bmstate->bm_tidLocsBuffer->lov_blocks = NULL;
+    bmstate->bm_tidLocsBuffer->num_lov_blocks = 0;
     bmstate->bm_tidLocsBuffer->max_lov_block = InvalidBlockNumber;
+    bmstate->bm_tidLocsBuffer->clock = 0;
+    bmstate->bm_tidLocsBuffer->spill_file = NULL;
+    bmstate->bm_tidLocsBuffer->stats = &bmstate->bm_stats;
+    MemSet(&bmstate->bm_stats, 0, sizeof(BMBuildStats));
+    bmstate->bm_lov_deferred = false;
+    bmstate->bm_lov_bistate = NULL;
+    bmstate->bm_lov_slots = NULL;
+    bmstate->bm_lov_nslots = 0;
 
     /* Get the meta page */
     metabuf = _bitmap_getbuf(index, BM_METAPAGE, BM_READ);
     page = BufferGetPage(metabuf);
     mp = (BMMetaPage) PageGetContents(page);
 
-    /* Open the heap and the index in row exclusive mode */
-    _bitmap_open_lov_heapandindex(mp, &(bmstate->bm_lov_heap),
-	&(bmstate->bm_lov_index), 
-	RowExclusiveLock);
+    /*
+     * Open the heap and the index in row exclusive mode, unless the values
+     * go to the dictionary of the index
+     */
+    if (mp->bm_dict_root == InvalidBlockNumber)
+	_bitmap_open_lov_heapandindex(mp, &(bmstate->bm_lov_heap),
+	    &(bmstate->bm_lov_index), 
+	    RowExclusiveLock);
+    else
+    {
+	bmstate->bm_lov_heap = NULL;
+	bmstate->bm_lov_index = NULL;
+    }
+    bmstate->bm_lov_scanKeys = NULL;
+    bmstate->bm_lov_scanDesc = NULL;
 
     _bitmap_relbuf(metabuf); /* release the buffer */
 
@@ -247,11 +434,29 @@ _bitmap_init_buildstate(Relation index, BMBuildState *bmstate)
 	/* Create the hash table */
 	bmstate->lovitem_hash = hash_create("Bitmap index build lov item hash",
 	    100, &hash_ctl, hash_flags);
+
+	/*
+	 * All lookups go through the hash, so the LOV btree is not needed
+	 * until the build is over: batch the LOV heap and build the btree
+	 * at the end.
+	 */
+	if (bmstate->bm_lov_heap != NULL)
+	    _bitmap_begin_lov_bulkload(bmstate);
     }
     else
     {
-	/* Contingency plan: no hash functions can be used and we have to search through the btree */
+	/*
+	 * Contingency plan: no hash functions can be used and we have to search
+	 * through the btree, or through the dictionary if there is no btree
+	 */
 	bmstate->lovitem_hash = NULL;
+    }
+
+    if (bmstate->lovitem_hash == NULL && bmstate->bm_lov_heap != NULL)
+    {
+	/* the btree is searched during the build, so it must exist now */
+	_bitmap_build_lov_index(bmstate->bm_lov_heap, bmstate->bm_lov_index);
+
 	bmstate->bm_lov_scanKeys =
 	    (ScanKey)palloc0(bmstate->bm_tupDesc->natts * sizeof(ScanKeyData));
 
@@ -329,10 +534,21 @@ _bitmap_cleanup_buildstate(Relation index, BMBuildState *bmstate)
     elog(NOTICE,"-----[_bitmap_cleanup_buildstate]----- CP1");
 #endif
 
+    pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE,
+				 PROGRESS_BM_PHASE_WRITE_VECTORS);
+
     _bitmap_write_alltids(index, tidLocsBuffer, bmstate->use_wal);
 
     pfree(bmstate->bm_tidLocsBuffer);
 
+    /* load the rest of the LOV heap and build its btree in one pass */
+    if (bmstate->bm_lov_deferred)
+    {
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE,
+				     PROGRESS_BM_PHASE_LOAD_LOV);
+	_bitmap_end_lov_bulkload(bmstate);
+    }
+
     if (cur_bmbuild)
     {
 	MemoryContextDelete(cur_bmbuild->tmpcxt);
@@ -349,12 +565,16 @@ _bitmap_cleanup_buildstate(Relation index, BMBuildState *bmstate)
 	* which case we will have searched the btree manually. Free associated
 	* memory.
 	*/
-	index_endscan(bmstate->bm_lov_scanDesc);
-	pfree(bmstate->bm_lov_scanKeys);
+	if (bmstate->bm_lov_scanDesc != NULL)
+	{
+	    index_endscan(bmstate->bm_lov_scanDesc);
+	    pfree(bmstate->bm_lov_scanKeys);
+	}
     }
 
-    _bitmap_close_lov_heapandindex(bmstate->bm_lov_heap,bmstate->bm_lov_index,
-	RowExclusiveLock);
+    if (bmstate->bm_lov_heap != NULL)
+	_bitmap_close_lov_heapandindex(bmstate->bm_lov_heap,
+	    bmstate->bm_lov_index, RowExclusiveLock);
 #ifdef DEBUG_BMI
 	elog(NOTICE,"-----[_bitmap_cleanup_buildstate]----- END");
 #endif
@@ -365,7 +585,11 @@ _bitmap_cleanup_buildstate(Relation index, BMBuildState *bmstate)
  *
  * Create the meta page, a new heap which stores the distinct values for
  * the attributes to be indexed, a btree index on this new heap for searching
- * those distinct values, and the first LOV page.
+ * those distinct values, and the first LOV page. With the dictionary
+ * option, the root of an empty value dictionary comes after the first LOV
+ * page instead of the heap and btree, and with the direct_map option the
+ * directory page of the direct map after that. The filter page of the
+ * distinct values comes last.
  */
 void
 _bitmap_init(Relation index, bool use_wal)
@@ -405,15 +629,23 @@ _bitmap_init(Relation index, bool use_wal)
     page = BufferGetPage(metabuf); /* sets the page associated with the META buffer */
     Assert(PageIsNew(page)); /* check that the page is new */
 
+    _bitmap_check_direct_map(index);
+
 
     /** 
      * before initializing the META page, we need to create the LOV heap and index.
      */
-    _bitmap_create_lov_heapandindex(index, &lovHeapId, &lovIndexId);
+    if (BMUsesDictionary(index))
+    {
+	_bitmap_drop_lov_heapandindex(index);
+	lovHeapId = lovIndexId = InvalidOid;
+    }
+    else
+	_bitmap_create_lov_heapandindex(index, &lovHeapId, &lovIndexId);
     /**
      * allocate the first LOV item
      */
-    lovItem = _bitmap_formitem(0);
+    lovItem = _bitmap_formitem(0, BMGetLovTailWords(index));
 
     START_CRIT_SECTION();
 
@@ -424,9 +656,19 @@ _bitmap_init(Relation index, bool use_wal)
 
     /* Get the content of the page (first ItemPointer - see bufpage.h) */
     metapage = (BMMetaPage) PageGetContents(page);
+    metapage->bm_magic = BM_MAGIC;
+    metapage->bm_version = BM_VERSION;
      /* Set the LOV heap and index ids */
     metapage->bm_lov_heapId = lovHeapId;
     metapage->bm_lov_indexId = lovIndexId;
+    metapage->bm_summarized_end = InvalidBlockNumber;
+    metapage->bm_summarizing_end = InvalidBlockNumber;
+    metapage->bm_dict_root = InvalidBlockNumber;
+    metapage->bm_map_root = InvalidBlockNumber;
+    metapage->bm_filter_block = InvalidBlockNumber;
+    metapage->bm_key_scale = BMUsesDictionary(index) ?
+	_bitmap_dict_key_scale(index) : -1;
+    metapage->bm_lov_nitems = 1;	/* the NULL item, added below */
 
     /* Initialise the META page elements (heap and index) */
     // _bitmap_create_lov_heapandindex(index, &(metapage->bm_lov_heapId),
@@ -461,7 +703,7 @@ _bitmap_init(Relation index, bool use_wal)
      * XXX: perhaps this could be a special page, with more efficient storage
      * after all, we have fixed size data
      */
-    o = PageAddItem(page, (Item)lovItem, sizeof(BMLOVItemData),
+    o = PageAddItem(page, (Item)lovItem, BM_LOV_ITEM_SIZE(lovItem->bm_tail_size),
 	lovOffset, false, false);
 
     if (o == InvalidOffsetNumber)
@@ -481,10 +723,33 @@ _bitmap_init(Relation index, bool use_wal)
 
     END_CRIT_SECTION();
 
-    /* Write the two buffers to disk */
     _bitmap_wrtbuf(lovbuf);
+
+    /* The dictionary root is the page after the first LOV page */
+    if (BMUsesDictionary(index))
+	metapage->bm_dict_root = _bitmap_dict_create(index);
+    if (BMUsesDirectMap(index))
+	metapage->bm_map_root = _bitmap_map_create(index);
+
+    /* and an empty filter of the distinct values, if they can be hashed */
+    if (OidIsValid(_bitmap_filter_hashproc(index)))
+	metapage->bm_filter_block = _bitmap_filter_create(index);
+
     _bitmap_wrtbuf(metabuf);
 
+    /*
+     * A REINDEX may leave the cached state of the old build behind, which
+     * names the old LOV heap, dictionary root or direct map.
+     */
+    if (index->rd_amcache != NULL)
+    {
+	pfree(index->rd_amcache);
+	index->rd_amcache = NULL;
+    }
+
+    /* nor may the shared LOV cache hold positions from a dropped index */
+    _bitmap_shared_lovcache_forget(index);
+
     pfree(lovItem); /* free the item from memory */
 }
 
@@ -0,0 +1,816 @@
+/*-------------------------------------------------------------------------
+ *
+ * bitmapplan.c
+ *	Plan and run aggregates that are answered from the vectors of an
+ *	on-disk bitmap index alone.
+ *
+ * A query like SELECT count(*) FROM t WHERE c >= a AND c < b, where each
+ * qual on t compares the column c of a yabit index with a value known
+ * when the query starts, is given a custom scan path for its aggregation
+ * besides the usual ones. The custom scan takes the place of both the
+ * Agg and the scan below it: it counts the rows with _bitmap_count(),
+ * which reads the heap only for the blocks that are not all-visible,
+ * and returns a single row holding the count. The path is costed as the
+ * index scan plus the heap fetches it still needs, so the planner takes
+ * it when that beats aggregating a scan of t.
+ *
+ * SELECT c, count(*) FROM t GROUP BY c is likewise given a custom scan
+ * that returns a row for each value with rows, counted one vector at a
+ * time by _bitmap_count_values().
+ *
+ * IDENTIFICATION
+ *	  $PostgreSQL$
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "bitmap.h"
+
+#include "access/stratnum.h"
+#include "access/table.h"
+#include "catalog/index.h"
+#include "commands/defrem.h"
+#include "commands/explain.h"
+#include "executor/executor.h"
+#include "nodes/extensible.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
+#include "optimizer/cost.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/planner.h"
+#include "optimizer/restrictinfo.h"
+#include "optimizer/tlist.h"
+#include "utils/selfuncs.h"
+#include "utils/fmgroids.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/spccache.h"
+
+/*
+ * The executor state of a count. The custom_private of its plan holds the
+ * index's OID followed by the operator of each key, and its custom_exprs
+ * the values the keys compare with.
+ */
+typedef struct BMCountScanState
+{
+	CustomScanState css;
+	List	   *args;			/* ExprStates of the key values */
+	bool		done;			/* has the count been returned? */
+} BMCountScanState;
+
+/*
+ * The executor state of the counts of all the values of an index, whose
+ * OID is all the custom_private of the plan holds.
+ */
+typedef struct BMGroupScanState
+{
+	CustomScanState css;
+	bool		counted;		/* have the rows been counted? */
+	BMValueCount *groups;		/* the values and their counts */
+	int			ngroups;
+	int			nextGroup;		/* the next group to return */
+} BMGroupScanState;
+
+static create_upper_paths_hook_type prev_create_upper_paths_hook = NULL;
+
+static void count_upper_paths(PlannerInfo *root, UpperRelationKind stage,
+							  RelOptInfo *input_rel, RelOptInfo *output_rel,
+							  void *extra);
+static void count_add_path(PlannerInfo *root, RelOptInfo *output_rel,
+						   IndexOptInfo *index, Cost cost, double rows,
+						   List *opnos, List *args, List *exprs,
+						   const CustomPathMethods *methods);
+static bool count_target_ok(PathTarget *target, Var **var, Aggref **aggref);
+static bool count_is_indexkey(IndexOptInfo *index, Node *node);
+static IndexOptInfo *group_index(PlannerInfo *root, RelOptInfo *rel,
+								 Oid amoid, Var *var);
+static bool count_index_quals(IndexOptInfo *index, List **indexclauses,
+							  List **opnos, List **args);
+static Cost count_path_cost(PlannerInfo *root, IndexOptInfo *index,
+							List *indexclauses);
+static Cost group_path_cost(PlannerInfo *root, IndexOptInfo *index,
+							double ngroups);
+static Plan *count_plan_path(PlannerInfo *root, RelOptInfo *rel,
+							 CustomPath *best_path, List *tlist,
+							 List *clauses, List *custom_plans);
+static Plan *group_plan_path(PlannerInfo *root, RelOptInfo *rel,
+							 CustomPath *best_path, List *tlist,
+							 List *clauses, List *custom_plans);
+static Plan *plan_count_scan(CustomPath *best_path, List *tlist,
+							 const CustomScanMethods *methods);
+static Node *count_create_state(CustomScan *cscan);
+static void count_begin_scan(CustomScanState *node, EState *estate,
+							 int eflags);
+static TupleTableSlot *count_exec_scan(CustomScanState *node);
+static void count_end_scan(CustomScanState *node);
+static void count_rescan(CustomScanState *node);
+static void count_explain(CustomScanState *node, List *ancestors,
+						  ExplainState *es);
+static TupleTableSlot *count_next(ScanState *node);
+static bool count_recheck(ScanState *node, TupleTableSlot *slot);
+static Node *group_create_state(CustomScan *cscan);
+static void group_begin_scan(CustomScanState *node, EState *estate,
+							 int eflags);
+static TupleTableSlot *group_exec_scan(CustomScanState *node);
+static void group_rescan(CustomScanState *node);
+static TupleTableSlot *group_next(ScanState *node);
+
+static const CustomPathMethods count_path_methods = {
+	.CustomName = "YabitCount",
+	.PlanCustomPath = count_plan_path,
+};
+
+static const CustomScanMethods count_scan_methods = {
+	.CustomName = "YabitCount",
+	.CreateCustomScanState = count_create_state,
+};
+
+static const CustomExecMethods count_exec_methods = {
+	.CustomName = "YabitCount",
+	.BeginCustomScan = count_begin_scan,
+	.ExecCustomScan = count_exec_scan,
+	.EndCustomScan = count_end_scan,
+	.ReScanCustomScan = count_rescan,
+	.ExplainCustomScan = count_explain,
+};
+
+static const CustomPathMethods group_path_methods = {
+	.CustomName = "YabitValueCounts",
+	.PlanCustomPath = group_plan_path,
+};
+
+static const CustomScanMethods group_scan_methods = {
+	.CustomName = "YabitValueCounts",
+	.CreateCustomScanState = group_create_state,
+};
+
+static const CustomExecMethods group_exec_methods = {
+	.CustomName = "YabitValueCounts",
+	.BeginCustomScan = group_begin_scan,
+	.ExecCustomScan = group_exec_scan,
+	.EndCustomScan = count_end_scan,
+	.ReScanCustomScan = group_rescan,
+	.ExplainCustomScan = count_explain,
+};
+
+/*
+ * _bitmap_init_planner() -- hook the count paths into the planner.
+ */
+void
+_bitmap_init_planner(void)
+{
+	RegisterCustomScanMethods(&count_scan_methods);
+	RegisterCustomScanMethods(&group_scan_methods);
+
+	prev_create_upper_paths_hook = create_upper_paths_hook;
+	create_upper_paths_hook = count_upper_paths;
+}
+
+/*
+ * count_upper_paths() -- add a count path to the aggregation of a query
+ *	that only counts rows a yabit index can tell, in all or for each value
+ *	of its column.
+ */
+static void
+count_upper_paths(PlannerInfo *root, UpperRelationKind stage,
+				  RelOptInfo *input_rel, RelOptInfo *output_rel,
+				  void *extra)
+{
+	Query	   *parse = root->parse;
+	RangeTblEntry *rte;
+	Var		   *var;
+	Aggref	   *aggref;
+	Oid			amoid;
+	ListCell   *lc;
+
+	if (prev_create_upper_paths_hook)
+		prev_create_upper_paths_hook(root, stage, input_rel, output_rel,
+									 extra);
+
+	if (stage != UPPERREL_GROUP_AGG || !yabit_enable_count)
+		return;
+
+	/* only an aggregation of one table */
+	if (parse->commandType != CMD_SELECT || parse->groupingSets != NIL ||
+		root->hasHavingQual || parse->hasWindowFuncs ||
+		parse->hasTargetSRFs || input_rel->reloptkind != RELOPT_BASEREL)
+		return;
+
+	rte = planner_rt_fetch(input_rel->relid, root);
+	if (rte->rtekind != RTE_RELATION || rte->inh ||
+		rte->relkind != RELKIND_RELATION || rte->tablesample != NULL)
+		return;
+
+	if (!count_target_ok(output_rel->reltarget, &var, &aggref) ||
+		aggref == NULL)
+		return;
+
+	amoid = get_index_am_oid("yabit", true);
+	if (!OidIsValid(amoid))
+		return;
+
+	/*
+	 * GROUP BY the indexed column alone, with no quals, is a count of each
+	 * vector. The vectors hold every row of a non-partial index.
+	 */
+	if (parse->groupClause != NIL)
+	{
+		IndexOptInfo *index;
+		double		ngroups;
+
+		if (list_length(parse->groupClause) != 1 ||
+			input_rel->baserestrictinfo != NIL ||
+			!equal(get_sortgroupclause_expr(linitial(parse->groupClause),
+											parse->targetList), var))
+			return;
+
+		index = group_index(root, input_rel, amoid, var);
+		if (index == NULL)
+			return;
+
+		ngroups = estimate_num_groups(root, list_make1(var),
+									  input_rel->rows, NULL, NULL);
+		count_add_path(root, output_rel, index,
+					   group_path_cost(root, index, ngroups), ngroups,
+					   NIL, NIL, list_make2(var, aggref),
+					   &group_path_methods);
+		return;
+	}
+
+	/*
+	 * Without quals the NULLs count too, and they are not in the vectors a
+	 * scan finds.
+	 */
+	if (var != NULL || input_rel->baserestrictinfo == NIL)
+		return;
+
+	foreach(lc, input_rel->indexlist)
+	{
+		IndexOptInfo *index = (IndexOptInfo *) lfirst(lc);
+		List	   *indexclauses;
+		List	   *opnos;
+		List	   *args;
+
+		if (index->relam != amoid || index->hypothetical ||
+			index->indpred != NIL || index->nkeycolumns != 1 ||
+			index->indexkeys[0] == 0 ||
+			!count_index_quals(index, &indexclauses, &opnos, &args))
+			continue;
+
+		count_add_path(root, output_rel, index,
+					   count_path_cost(root, index, indexclauses), 1,
+					   opnos, args, list_make1(aggref),
+					   &count_path_methods);
+		break;
+	}
+}
+
+/*
+ * count_add_path() -- add a custom path of the given kind to the output
+ *	relation of the aggregation.
+ *
+ * The path keeps the index's OID followed by opnos, the values the keys
+ * compare with, the expressions the scan returns, and the relid of the
+ * table, in this order.
+ */
+static void
+count_add_path(PlannerInfo *root, RelOptInfo *output_rel,
+			   IndexOptInfo *index, Cost cost, double rows, List *opnos,
+			   List *args, List *exprs, const CustomPathMethods *methods)
+{
+	CustomPath *cpath = makeNode(CustomPath);
+
+	cost += output_rel->reltarget->cost.startup +
+		output_rel->reltarget->cost.per_tuple * rows;
+
+	cpath->path.pathtype = T_CustomScan;
+	cpath->path.parent = output_rel;
+	cpath->path.pathtarget = output_rel->reltarget;
+	cpath->path.param_info = NULL;
+	cpath->path.parallel_aware = false;
+	cpath->path.parallel_safe = false;
+	cpath->path.parallel_workers = 0;
+	cpath->path.rows = rows;
+	cpath->path.startup_cost = cost;
+	cpath->path.total_cost = cost;
+	cpath->path.pathkeys = NIL;
+	cpath->flags = 0;
+	cpath->custom_paths = NIL;
+	cpath->custom_private = list_make4(lcons_oid(index->indexoid, opnos),
+									   args, exprs,
+									   makeInteger(index->rel->relid));
+	cpath->methods = methods;
+
+	add_path(output_rel, &cpath->path);
+}
+
+/*
+ * count_target_ok() -- does the given target compute nothing from the rows
+ *	but count(*) and one column?
+ *
+ * Sets *aggref to the count(*), and *var to the column, or to NULL if the
+ * target has none.
+ */
+static bool
+count_target_ok(PathTarget *target, Var **var, Aggref **aggref)
+{
+	List	   *nodes;
+	ListCell   *lc;
+	bool		result = true;
+
+	*var = NULL;
+	*aggref = NULL;
+
+	nodes = pull_var_clause((Node *) target->exprs,
+							PVC_INCLUDE_AGGREGATES |
+							PVC_INCLUDE_WINDOWFUNCS |
+							PVC_INCLUDE_PLACEHOLDERS);
+	foreach(lc, nodes)
+	{
+		Aggref	   *node = (Aggref *) lfirst(lc);
+
+		if (IsA(node, Var) && ((Var *) node)->varlevelsup == 0 &&
+			(*var == NULL || equal(*var, node)))
+		{
+			*var = (Var *) node;
+			continue;
+		}
+
+		if (!IsA(node, Aggref) || node->aggfnoid != F_COUNT_ ||
+			!node->aggstar || node->aggfilter != NULL ||
+			node->aggdistinct != NIL || node->aggorder != NIL ||
+			node->agglevelsup != 0 || node->aggsplit != AGGSPLIT_SIMPLE)
+		{
+			result = false;
+			break;
+		}
+		*aggref = node;
+	}
+	list_free(nodes);
+
+	return result;
+}
+
+/*
+ * count_is_indexkey() -- is the given expression the column of the index?
+ */
+static bool
+count_is_indexkey(IndexOptInfo *index, Node *node)
+{
+	if (node != NULL && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+
+	return node != NULL && IsA(node, Var) &&
+		((Var *) node)->varno == index->rel->relid &&
+		((Var *) node)->varattno == index->indexkeys[0] &&
+		((Var *) node)->varlevelsup == 0;
+}
+
+/*
+ * group_index() -- find a yabit index to group the rows of a table by the
+ *	given column.
+ *
+ * The index has to be on that column alone and non-partial, and its
+ * equality has to be that of the grouping.
+ */
+static IndexOptInfo *
+group_index(PlannerInfo *root, RelOptInfo *rel, Oid amoid, Var *var)
+{
+	SortGroupClause *sgc = linitial(root->parse->groupClause);
+	ListCell   *lc;
+
+	foreach(lc, rel->indexlist)
+	{
+		IndexOptInfo *index = (IndexOptInfo *) lfirst(lc);
+
+		if (index->relam != amoid || index->hypothetical ||
+			index->indpred != NIL || index->nkeycolumns != 1 ||
+			!count_is_indexkey(index, (Node *) var) ||
+			exprType((Node *) var) != index->opcintype[0] ||
+			(OidIsValid(index->indexcollations[0]) &&
+			 index->indexcollations[0] != exprCollation((Node *) var)))
+			continue;
+
+		if (op_in_opfamily(sgc->eqop, index->opfamily[0]) &&
+			get_op_opfamily_strategy(sgc->eqop, index->opfamily[0]) ==
+			BTEqualStrategyNumber)
+			return index;
+	}
+
+	return NULL;
+}
+
+/*
+ * count_index_quals() -- can the index answer each qual of its table?
+ *
+ * Each qual has to compare the index column with a value that does not
+ * depend on the rows, through a btree operator of the index's operator
+ * family. If so, returns the quals as index clauses, and the operators
+ * and values of the scan keys that answer them.
+ */
+static bool
+count_index_quals(IndexOptInfo *index, List **indexclauses, List **opnos,
+				  List **args)
+{
+	ListCell   *lc;
+
+	*indexclauses = NIL;
+	*opnos = NIL;
+	*args = NIL;
+
+	foreach(lc, index->rel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+		OpExpr	   *clause = (OpExpr *) rinfo->clause;
+		IndexClause *iclause;
+		Node	   *leftop;
+		Node	   *rightop;
+		Oid			opno;
+		int			strategy;
+		Oid			lefttype;
+		Oid			righttype;
+
+		if (rinfo->pseudoconstant || rinfo->security_level > 0 ||
+			!IsA(clause, OpExpr) || list_length(clause->args) != 2)
+			return false;
+		if (OidIsValid(index->indexcollations[0]) &&
+			index->indexcollations[0] != clause->inputcollid)
+			return false;
+
+		opno = clause->opno;
+		leftop = (Node *) linitial(clause->args);
+		rightop = (Node *) lsecond(clause->args);
+		if (!count_is_indexkey(index, leftop))
+		{
+			opno = get_commutator(opno);
+			if (!OidIsValid(opno) || !count_is_indexkey(index, rightop))
+				return false;
+			rinfo = commute_restrictinfo(rinfo, opno);
+			rightop = leftop;
+		}
+
+		if (!is_pseudo_constant_clause(rightop) || contain_subplans(rightop) ||
+			!op_in_opfamily(opno, index->opfamily[0]))
+			return false;
+
+		get_op_opfamily_properties(opno, index->opfamily[0], false,
+								   &strategy, &lefttype, &righttype);
+		if (lefttype != index->opcintype[0] ||
+			strategy < BTLessStrategyNumber ||
+			strategy > BTGreaterStrategyNumber)
+			return false;
+
+		iclause = makeNode(IndexClause);
+		iclause->rinfo = rinfo;
+		iclause->indexquals = list_make1(rinfo);
+		iclause->lossy = false;
+		iclause->indexcol = 0;
+		iclause->indexcols = NIL;
+
+		*indexclauses = lappend(*indexclauses, iclause);
+		*opnos = lappend_oid(*opnos, opno);
+		*args = lappend(*args, rightop);
+	}
+
+	return *indexclauses != NIL;
+}
+
+/*
+ * count_path_cost() -- estimate the cost of counting the rows that match
+ *	the given index clauses.
+ *
+ * That is the cost of the index scan, as bmcostestimate_internal() puts
+ * it, plus fetching the matching rows of the heap blocks that are not
+ * all-visible.
+ */
+static Cost
+count_path_cost(PlannerInfo *root, IndexOptInfo *index, List *indexclauses)
+{
+	RelOptInfo *rel = index->rel;
+	IndexPath  *ipath = makeNode(IndexPath);
+	Cost		indexStartupCost;
+	Cost		indexTotalCost;
+	Selectivity indexSelectivity;
+	double		indexCorrelation;
+	double		indexPages;
+	double		ntuples;
+	double		nfetched;
+	double		heapPages;
+	double		spc_random_page_cost;
+
+	ipath->path.pathtype = T_IndexScan;
+	ipath->path.parent = rel;
+	ipath->indexinfo = index;
+	ipath->indexclauses = indexclauses;
+	ipath->indexorderbys = NIL;
+	ipath->indexscandir = NoMovementScanDirection;
+
+	bmcostestimate_internal(root, ipath, 1.0,
+							&indexStartupCost, &indexTotalCost,
+							&indexSelectivity, &indexCorrelation,
+							&indexPages);
+
+	ntuples = clamp_row_est(indexSelectivity * rel->tuples);
+	nfetched = ntuples * (1.0 - rel->allvisfrac);
+	heapPages = Min(index_pages_fetched(nfetched, rel->pages,
+										(double) index->pages, root),
+					ceil(rel->pages * (1.0 - rel->allvisfrac)));
+
+	get_tablespace_page_costs(rel->reltablespace,
+							  &spc_random_page_cost, NULL);
+
+	return indexTotalCost + heapPages * spc_random_page_cost +
+		nfetched * cpu_tuple_cost + ntuples * cpu_operator_cost;
+}
+
+/*
+ * group_path_cost() -- estimate the cost of counting the rows of every
+ *	value of the index.
+ *
+ * That is reading the whole index once, plus fetching the rows of the
+ * heap blocks that are not all-visible.
+ */
+static Cost
+group_path_cost(PlannerInfo *root, IndexOptInfo *index, double ngroups)
+{
+	RelOptInfo *rel = index->rel;
+	double		nfetched = rel->tuples * (1.0 - rel->allvisfrac);
+	double		heapPages = ceil(rel->pages * (1.0 - rel->allvisfrac));
+	double		spc_random_page_cost;
+	double		spc_seq_page_cost;
+	Cost		cost;
+
+	get_tablespace_page_costs(index->reltablespace,
+							  &spc_random_page_cost, &spc_seq_page_cost);
+	cost = index->pages * spc_seq_page_cost +
+		index->pages * DEFAULT_PAGE_CPU_MULTIPLIER * cpu_operator_cost +
+		ngroups * (cpu_index_tuple_cost + cpu_tuple_cost);
+
+	get_tablespace_page_costs(rel->reltablespace,
+							  &spc_random_page_cost, NULL);
+
+	return cost + heapPages * spc_random_page_cost +
+		nfetched * cpu_tuple_cost + rel->tuples * cpu_operator_cost;
+}
+
+/*
+ * count_plan_path() -- make the custom scan of a count path.
+ */
+static Plan *
+count_plan_path(PlannerInfo *root, RelOptInfo *rel, CustomPath *best_path,
+				List *tlist, List *clauses, List *custom_plans)
+{
+	return plan_count_scan(best_path, tlist, &count_scan_methods);
+}
+
+/*
+ * group_plan_path() -- make the custom scan of a path counting the rows
+ *	of each value.
+ */
+static Plan *
+group_plan_path(PlannerInfo *root, RelOptInfo *rel, CustomPath *best_path,
+				List *tlist, List *clauses, List *custom_plans)
+{
+	return plan_count_scan(best_path, tlist, &group_scan_methods);
+}
+
+/*
+ * plan_count_scan() -- make the custom scan of a path of count_add_path().
+ *
+ * The scan has no relation of its own: it returns the expressions of its
+ * custom_scan_tlist, the column and count(*) the aggregation computes,
+ * and setrefs.c points the target list at those.
+ */
+static Plan *
+plan_count_scan(CustomPath *best_path, List *tlist,
+				const CustomScanMethods *methods)
+{
+	CustomScan *cscan = makeNode(CustomScan);
+	List	   *exprs = (List *) lthird(best_path->custom_private);
+	ListCell   *lc;
+
+	cscan->scan.plan.targetlist = tlist;
+	cscan->scan.plan.qual = NIL;
+	cscan->scan.scanrelid = 0;
+	cscan->flags = best_path->flags;
+	cscan->custom_plans = NIL;
+	cscan->custom_exprs = (List *) lsecond(best_path->custom_private);
+	cscan->custom_private = (List *) linitial(best_path->custom_private);
+	cscan->custom_scan_tlist = NIL;
+	foreach(lc, exprs)
+		cscan->custom_scan_tlist =
+			lappend(cscan->custom_scan_tlist,
+					makeTargetEntry((Expr *) lfirst(lc),
+									list_length(cscan->custom_scan_tlist) + 1,
+									NULL, false));
+	cscan->custom_relids =
+		bms_make_singleton(intVal(lfourth(best_path->custom_private)));
+	cscan->methods = methods;
+
+	return &cscan->scan.plan;
+}
+
+static Node *
+count_create_state(CustomScan *cscan)
+{
+	BMCountScanState *state;
+
+	state = (BMCountScanState *) newNode(sizeof(BMCountScanState),
+										 T_CustomScanState);
+	state->css.methods = &count_exec_methods;
+
+	return (Node *) state;
+}
+
+static void
+count_begin_scan(CustomScanState *node, EState *estate, int eflags)
+{
+	BMCountScanState *state = (BMCountScanState *) node;
+	CustomScan *cscan = (CustomScan *) node->ss.ps.plan;
+
+	state->args = ExecInitExprList(cscan->custom_exprs, &node->ss.ps);
+	state->done = false;
+}
+
+static TupleTableSlot *
+count_exec_scan(CustomScanState *node)
+{
+	return ExecScan(&node->ss, count_next, count_recheck);
+}
+
+static void
+count_end_scan(CustomScanState *node)
+{
+}
+
+static void
+count_rescan(CustomScanState *node)
+{
+	((BMCountScanState *) node)->done = false;
+	ExecScanReScan(&node->ss);
+}
+
+static void
+count_explain(CustomScanState *node, List *ancestors, ExplainState *es)
+{
+	CustomScan *cscan = (CustomScan *) node->ss.ps.plan;
+
+	ExplainPropertyText("Index",
+						get_rel_name(linitial_oid(cscan->custom_private)),
+						es);
+}
+
+/*
+ * count_next() -- count the rows, and return the count as the only tuple.
+ */
+static TupleTableSlot *
+count_next(ScanState *node)
+{
+	BMCountScanState *state = (BMCountScanState *) node;
+	CustomScan *cscan = (CustomScan *) node->ps.plan;
+	ExprContext *econtext = node->ps.ps_ExprContext;
+	TupleTableSlot *slot = node->ss_ScanTupleSlot;
+	Oid			indexoid = linitial_oid(cscan->custom_private);
+	Relation	heapRel;
+	Relation	indexRel;
+	ScanKey		keys;
+	int			nkeys = 0;
+	bool		isnull = false;
+	int64		count = 0;
+	ListCell   *lc;
+
+	if (state->done)
+		return ExecClearTuple(slot);
+	state->done = true;
+
+	/* the executor has locked the table already */
+	heapRel = table_open(IndexGetRelation(indexoid, false), NoLock);
+	indexRel = index_open(indexoid, AccessShareLock);
+
+	keys = (ScanKey) palloc(list_length(state->args) * sizeof(ScanKeyData));
+	foreach(lc, state->args)
+	{
+		Datum		arg;
+
+		arg = ExecEvalExprSwitchContext((ExprState *) lfirst(lc), econtext,
+										&isnull);
+
+		/* the operators are strict, so no row matches a NULL */
+		if (isnull)
+			break;
+
+		_bitmap_count_initkey(indexRel, &keys[nkeys],
+							  list_nth_oid(cscan->custom_private, nkeys + 1),
+							  arg);
+		nkeys++;
+	}
+
+	if (!isnull)
+		count = _bitmap_count(heapRel, indexRel, node->ps.state->es_snapshot,
+							  keys, nkeys);
+
+	pfree(keys);
+	index_close(indexRel, AccessShareLock);
+	table_close(heapRel, NoLock);
+
+	ExecClearTuple(slot);
+	slot->tts_values[0] = Int64GetDatum(count);
+	slot->tts_isnull[0] = false;
+
+	return ExecStoreVirtualTuple(slot);
+}
+
+static bool
+count_recheck(ScanState *node, TupleTableSlot *slot)
+{
+	return true;
+}
+
+static Node *
+group_create_state(CustomScan *cscan)
+{
+	BMGroupScanState *state;
+
+	state = (BMGroupScanState *) newNode(sizeof(BMGroupScanState),
+										 T_CustomScanState);
+	state->css.methods = &group_exec_methods;
+
+	return (Node *) state;
+}
+
+static void
+group_begin_scan(CustomScanState *node, EState *estate, int eflags)
+{
+	BMGroupScanState *state = (BMGroupScanState *) node;
+
+	state->counted = false;
+	state->groups = NULL;
+	state->ngroups = 0;
+	state->nextGroup = 0;
+}
+
+static TupleTableSlot *
+group_exec_scan(CustomScanState *node)
+{
+	return ExecScan(&node->ss, group_next, count_recheck);
+}
+
+/*
+ * The counts cannot change under the snapshot of the query, so a rescan
+ * returns the same groups again.
+ */
+static void
+group_rescan(CustomScanState *node)
+{
+	((BMGroupScanState *) node)->nextGroup = 0;
+	ExecScanReScan(&node->ss);
+}
+
+/*
+ * group_next() -- count the rows of every value of the index on the first
+ *	call, and return a value and its count on each.
+ */
+static TupleTableSlot *
+group_next(ScanState *node)
+{
+	BMGroupScanState *state = (BMGroupScanState *) node;
+	CustomScan *cscan = (CustomScan *) node->ps.plan;
+	TupleTableSlot *slot = node->ss_ScanTupleSlot;
+	BMValueCount *group;
+
+	if (!state->counted)
+	{
+		Oid			indexoid = linitial_oid(cscan->custom_private);
+		MemoryContext oldcxt;
+		Relation	heapRel;
+		Relation	indexRel;
+
+		/* the executor has locked the table already */
+		heapRel = table_open(IndexGetRelation(indexoid, false), NoLock);
+		indexRel = index_open(indexoid, AccessShareLock);
+
+		oldcxt = MemoryContextSwitchTo(node->ps.state->es_query_cxt);
+		state->groups = _bitmap_count_values(heapRel, indexRel,
+											 node->ps.state->es_snapshot,
+											 &state->ngroups);
+		MemoryContextSwitchTo(oldcxt);
+		state->counted = true;
+
+		index_close(indexRel, AccessShareLock);
+		table_close(heapRel, NoLock);
+	}
+
+	if (state->nextGroup >= state->ngroups)
+		return ExecClearTuple(slot);
+
+	group = &state->groups[state->nextGroup++];
+
+	ExecClearTuple(slot);
+	slot->tts_values[0] = group->value;
+	slot->tts_isnull[0] = group->isnull;
+	slot->tts_values[1] = Int64GetDatum(group->count);
+	slot->tts_isnull[1] = false;
+
+	return ExecStoreVirtualTuple(slot);
+}
@@ -16,6 +16,7 @@
 #include "bitmap.h"
 
 #include "access/genam.h"
+#include "access/stratnum.h"
 #include "access/tupdesc.h"
 #include "storage/lmgr.h"
 #include "parser/parse_oper.h"
@@ -241,8 +242,9 @@ next_batch_words(IndexScanDesc scan)
  * read_words() -- read one-block of bitmap words from
  *	the bitmap page.
  *
- * If nextBlockNo is an invalid block number, then the two last words
- * are stored in lovItem. Otherwise, read words from nextBlockNo.
+ * If nextBlockNo is an invalid block number, then the words in the tail
+ * buffer and the two last words are stored in lovItem. Otherwise, read
+ * words from nextBlockNo.
  */
 static void
 read_words(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
@@ -275,36 +277,33 @@ read_words(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
 		*readLastWords = false;
 
 		/*
-		 * If this is the last bitmap page and the total number of words
-		 * in this page is less than or equal to
-		 * BM_NUM_OF_HRL_WORDS_PER_PAGE - 2, we read the last two words
+		 * If this is the last bitmap page and there is room after its
+		 * words for all the words the LOV item can hold, we read those
 		 * and append them into 'headerWords' and 'words'.
 		 */
 
 		if ((!BlockNumberIsValid(*nextBlockNoP)) &&
-			(*numOfWordsP <= BM_NUM_OF_HRL_WORDS_PER_PAGE - 2))
+			(*numOfWordsP <= BM_NUM_OF_HRL_WORDS_PER_PAGE -
+			 BM_MAX_LOV_TAIL_WORDS - 2))
 		{
-			BM_WORD	cwords[2];
-			BM_WORD	hword;
-			BM_WORD tmp;
+			BM_WORD	cwords[BM_MAX_LOV_TAIL_WORDS + 2];
+			BM_WORD	hwords[BM_CALC_H_WORDS(BM_MAX_LOV_TAIL_WORDS + 2)];
 			uint32		nwords;
-			int			offs;
+			uint32		i;
 
-			read_words(rel, lovBuffer, lovOffset, nextBlockNoP, &hword, 
+			read_words(rel, lovBuffer, lovOffset, nextBlockNoP, hwords, 
 					   cwords, &nwords, readLastWords);
 
-			Assert(nwords > 0 && nwords <= 2);
+			Assert(nwords > 0 && nwords <= BM_MAX_LOV_TAIL_WORDS + 2);
 
-			memcpy(words + *numOfWordsP, cwords, nwords * sizeof(BM_WORD));
-
-			offs = *numOfWordsP / BM_WORD_SIZE;
-			tmp = hword >> *numOfWordsP % BM_WORD_SIZE;
-			headerWords[offs] |= tmp;
-
-			if (*numOfWordsP % BM_WORD_SIZE == BM_WORD_SIZE - 1)
+			for (i = 0; i < nwords; i++)
 			{
-				offs = (*numOfWordsP + 1)/BM_WORD_SIZE;
-				headerWords[offs] |= hword << 1;
+				uint32		wordNo = *numOfWordsP + i;
+
+				words[wordNo] = cwords[i];
+				if (IS_FILL_WORD(hwords, i))
+					headerWords[wordNo / BM_WORD_SIZE] |=
+						WORDNO_GET_HEADER_BIT(wordNo);
 			}
 			*numOfWordsP += nwords;
 		}
@@ -313,6 +312,7 @@ read_words(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
 	{
 		BMLOVItem	lovItem;
 		Page		lovPage;
+		uint32		nwords;
 
 		LockBuffer(lovBuffer, BM_READ);
 
@@ -320,21 +320,24 @@ read_words(Relation rel, Buffer lovBuffer, OffsetNumber lovOffset,
 		lovItem = (BMLOVItem) PageGetItem(lovPage, 
 										  PageGetItemId(lovPage, lovOffset));
 
+		nwords = lovItem->bm_tail_nwords;
+		memcpy(words, lovItem->bm_tail_words, nwords * sizeof(BM_WORD));
+		MemSet(headerWords, 0, BM_CALC_H_WORDS(nwords + 2) * sizeof(BM_WORD));
+		memcpy(headerWords, lovItem->bm_tail_hwords,
+			   BM_CALC_H_WORDS(nwords) * sizeof(BM_WORD));
+
 		if (lovItem->bm_last_compword != LITERAL_ALL_ONE)
 		{
-			*numOfWordsP = 2;
-			headerWords[0] = (((BM_WORD)lovItem->lov_words_header) <<
-							  (BM_WORD_SIZE-2));
-			words[0] = lovItem->bm_last_compword;
-			words[1] = lovItem->bm_last_word;
-		}
-		else
-		{
-			*numOfWordsP = 1;
-			headerWords[0] = (((BM_WORD)lovItem->lov_words_header) <<
-							  (BM_WORD_SIZE-1));
-			words[0] = lovItem->bm_last_word;
+			if (lovItem->lov_words_header & BM_LAST_COMPWORD_BIT)
+				headerWords[nwords / BM_WORD_SIZE] |=
+					WORDNO_GET_HEADER_BIT(nwords);
+			words[nwords++] = lovItem->bm_last_compword;
 		}
+		if (lovItem->lov_words_header & BM_LAST_WORD_BIT)
+			headerWords[nwords / BM_WORD_SIZE] |=
+				WORDNO_GET_HEADER_BIT(nwords);
+		words[nwords++] = lovItem->bm_last_word;
+		*numOfWordsP = nwords;
 
 		LockBuffer(lovBuffer, BUFFER_LOCK_UNLOCK);
 		*readLastWords = true;
@@ -350,8 +353,6 @@ _bitmap_findbitmaps(IndexScanDesc scan, ScanDirection dir)
 {
 	BMScanOpaque			so;
 	BMScanPosition			scanPos;
-	Buffer					metabuf;
-	BMMetaPage				metapage;
 	BlockNumber				lovBlock;
 	OffsetNumber			lovOffset;
 	bool					blockNull, offsetNull;
@@ -387,9 +388,6 @@ _bitmap_findbitmaps(IndexScanDesc scan, ScanDirection dir)
 		}
 	}
 
-	metabuf = _bitmap_getbuf(scan->indexRelation, BM_METAPAGE, BM_READ);
-	metapage = (BMMetaPage)PageGetContents(BufferGetPage(metabuf));
-
 	/*
 	 * If the values for these keys are all NULL, the bitmap vector
 	 * is the first LOV item in the LOV pages.
@@ -406,60 +404,103 @@ _bitmap_findbitmaps(IndexScanDesc scan, ScanDirection dir)
 	}
 	else
 	{
-		Relation		lovHeap, lovIndex;
+		Relation		lovHeap = NULL, lovIndex = NULL;
 		/* TupleDesc indexTupDesc; - unused variable */
-		ScanKey			scanKeys;
-		IndexScanDesc	scanDesc;
+		ScanKey			scanKeys = NULL;
+		IndexScanDesc	scanDesc = NULL;
+		BMDictScan		dictScan = NULL;
 		List*			lovItemPoss = NIL;
 		ListCell		*cell;
+		ScanKey			eqKey = NULL;
+		bool			cached = false;
+		bool			absent = false;
+		bool			keyNull = false;
 
 		/*
-		 * We haven't locked the metapage but that's okay... if these
-		 * values change underneath us there's something much more
-		 * fundamentally wrong. This could change when we have VACUUM
-		 * support, of course.
+		 * A lone equality key on the indexed type can be answered by the
+		 * LOV lookup cache, and its LOV item is put there when it is not.
+		 * A value the filter page does not know has no vector at all.
 		 */
-		_bitmap_open_lov_heapandindex(metapage, 
-				 &lovHeap, &lovIndex, AccessShareLock);
-
-		/* indexTupDesc = RelationGetDescr(lovIndex); - unused variable */
+		if (scan->numberOfKeys == 1 &&
+			scan->keyData[0].sk_attno == 1 &&
+			scan->keyData[0].sk_strategy == BTEqualStrategyNumber &&
+			(scan->keyData[0].sk_subtype == InvalidOid ||
+			 scan->keyData[0].sk_subtype ==
+			 scan->indexRelation->rd_opcintype[0]))
+		{
+			eqKey = &scan->keyData[0];
+			cached = _bitmap_lovcache_lookup(scan->indexRelation,
+											 &eqKey->sk_argument, &keyNull,
+											 &lovBlock, &lovOffset);
+			if (!cached)
+				absent = !_bitmap_filter_maybe_present(scan->indexRelation,
+													   &eqKey->sk_argument,
+													   &keyNull);
+		}
 
-		scanKeys = palloc0(scan->numberOfKeys * sizeof(ScanKeyData));
-		elog(NOTICE, "=_bitmap_findbitmaps: allocated memory for scanKeys, size = %lu bytes", scan->numberOfKeys * sizeof(ScanKeyData));
-		for (keyNo = 0; keyNo < scan->numberOfKeys; keyNo++)
+		/*
+		 * Otherwise an index built with the dictionary option finds its
+		 * values in its own dictionary pages, and has no LOV heap and btree.
+		 */
+		if (cached || absent)
 		{
-			ScanKey	scanKey = (ScanKey)(((char *)scanKeys) + 
-										 keyNo * sizeof(ScanKeyData));
-			uint16 flags = scan->keyData[keyNo].sk_flags;
-
-			if (!(flags & SK_ISNULL))
-				flags |= SK_SEARCHNOTNULL;
-			ScanKeyEntryInitialize(scanKey,
-			   flags,
-			   scan->keyData[keyNo].sk_attno,
-			   scan->keyData[keyNo].sk_strategy,
-			   scan->keyData[keyNo].sk_subtype, 
-			   scan->keyData[keyNo].sk_collation,
-			   scan->keyData[keyNo].sk_func.fn_oid,
-			   scan->keyData[keyNo].sk_argument);
+			/* nothing to search */
 		}
+		else if (_bitmap_get_relcache(scan->indexRelation)->bm_dict_root !=
+				 InvalidBlockNumber)
+			dictScan = _bitmap_dict_beginscan(scan->indexRelation,
+											  scan->keyData,
+											  scan->numberOfKeys);
+		else
+		{
+			/*
+			 * The LOV heap and btree of an index never change (a REINDEX
+			 * makes new ones, and invalidates the relcache entry), so the
+			 * cached ids are good and the metapage need not be read.
+			 */
+			_bitmap_open_lov(scan->indexRelation,
+					 &lovHeap, &lovIndex, AccessShareLock);
 
-		/* XXX: is SnapshotAny really the right choice? */
-		scanDesc = index_beginscan(lovHeap, lovIndex, SnapshotAny,
-						   scan->numberOfKeys, 0);
-		index_rescan(scanDesc, scanKeys, scan->numberOfKeys, NULL, 0);
+			/* indexTupDesc = RelationGetDescr(lovIndex); - unused variable */
 
-		for (keyNo = 0; keyNo < scan->numberOfKeys; keyNo++)
-		{
-			ScanKey scanKey = &scanKeys[keyNo];
-			elog(NOTICE, "ScanKey[%d]: att=%d flags=%d strategy=%d func=%u arg=%ld",
-				keyNo, scanKey->sk_attno, scanKey->sk_flags,
-				scanKey->sk_strategy, scanKey->sk_func.fn_oid,
-				(long) scanKey->sk_argument);
+			scanKeys = palloc0(scan->numberOfKeys * sizeof(ScanKeyData));
+			elog(NOTICE, "=_bitmap_findbitmaps: allocated memory for scanKeys, size = %lu bytes", scan->numberOfKeys * sizeof(ScanKeyData));
+			for (keyNo = 0; keyNo < scan->numberOfKeys; keyNo++)
+			{
+				ScanKey	scanKey = (ScanKey)(((char *)scanKeys) + 
+											 keyNo * sizeof(ScanKeyData));
+				uint16 flags = scan->keyData[keyNo].sk_flags;
+
+				if (!(flags & SK_ISNULL))
+					flags |= SK_SEARCHNOTNULL;
+				ScanKeyEntryInitialize(scanKey,
+				   flags,
+				   scan->keyData[keyNo].sk_attno,
+				   scan->keyData[keyNo].sk_strategy,
+				   scan->keyData[keyNo].sk_subtype, 
+				   scan->keyData[keyNo].sk_collation,
+				   scan->keyData[keyNo].sk_func.fn_oid,
+				   scan->keyData[keyNo].sk_argument);
+			}
+
+			/* XXX: is SnapshotAny really the right choice? */
+			scanDesc = index_beginscan(lovHeap, lovIndex, SnapshotAny,
+							   scan->numberOfKeys, 0);
+			index_rescan(scanDesc, scanKeys, scan->numberOfKeys, NULL, 0);
+
+			for (keyNo = 0; keyNo < scan->numberOfKeys; keyNo++)
+			{
+				ScanKey scanKey = &scanKeys[keyNo];
+				elog(NOTICE, "ScanKey[%d]: att=%d flags=%d strategy=%d func=%u arg=%ld",
+					keyNo, scanKey->sk_attno, scanKey->sk_flags,
+					scanKey->sk_strategy, scanKey->sk_func.fn_oid,
+					(long) scanKey->sk_argument);
+			}
 		}
 
 		/*
-		 * finds all lov items for this scan through lovHeap and lovIndex.
+		 * finds all lov items for this scan through lovHeap and lovIndex,
+		 * or through the dictionary.
 		 */
 		listContext = AllocSetContextCreate(CurrentMemoryContext,
                                     "LovListContext",
@@ -469,9 +510,19 @@ _bitmap_findbitmaps(IndexScanDesc scan, ScanDirection dir)
 		{
 			ItemPos			*itemPos;
 
-			bool res = _bitmap_findvalue(lovHeap, lovIndex, scanKeys, scanDesc,
-							  	         &lovBlock, &blockNull, &lovOffset, 
-										 &offsetNull);
+			bool res;
+
+			if (cached || absent)
+			{
+				/* a cached LOV item is in lovBlock and lovOffset already */
+				res = (cached && scanPos->nvec == 0);
+			}
+			else if (dictScan != NULL)
+				res = _bitmap_dict_getnext(dictScan, &lovBlock, &lovOffset);
+			else
+				res = _bitmap_findvalue(lovHeap, lovIndex, scanKeys, scanDesc,
+										&lovBlock, &blockNull, &lovOffset,
+										&offsetNull);
 
 			if(!res)
 				break;
@@ -507,16 +558,28 @@ _bitmap_findbitmaps(IndexScanDesc scan, ScanDirection dir)
 			vectorNo++;
 		}
 
+		if (eqKey != NULL && !cached && scanPos->nvec == 1)
+		{
+			ItemPos    *itemPos = (ItemPos *) linitial(lovItemPoss);
+
+			_bitmap_lovcache_store(scan->indexRelation, &eqKey->sk_argument,
+								   &keyNull, itemPos->blockNo,
+								   itemPos->offset);
+		}
+
 		list_free_deep(lovItemPoss);
 		MemoryContextDelete(listContext);
 
-		index_endscan(scanDesc);
-		_bitmap_close_lov_heapandindex(lovHeap, lovIndex, AccessShareLock);
-		pfree(scanKeys);
+		if (dictScan != NULL)
+			_bitmap_dict_endscan(dictScan);
+		else if (lovHeap != NULL)
+		{
+			index_endscan(scanDesc);
+			_bitmap_close_lov_heapandindex(lovHeap, lovIndex, AccessShareLock);
+			pfree(scanKeys);
+		}
 	}
 
-	_bitmap_relbuf(metabuf);
-
 	if (scanPos->nvec == 0)
 	{
 		scanPos->done = true;
@@ -565,6 +628,49 @@ _bitmap_initscanpos(IndexScanDesc scan, BMVector bmScanPos,
 			
 	bmScanPos->bm_nextBlockNo = lovItem->bm_lov_head;
 	bmScanPos->bm_readLastWords = false;
+
+	/*
+	 * Read the deltas of the vector now, before any of its words: vacuum
+	 * sets the bits of the deltas in the vector before it deletes them,
+	 * so this way we cannot miss one that moves in the meantime.
+	 */
+	bmScanPos->bm_deltaTids = NULL;
+	bmScanPos->bm_numDeltaTids = 0;
+	if (BlockNumberIsValid(lovItem->bm_delta_head))
+	{
+		BlockNumber	blkno = lovItem->bm_delta_head;
+		uint32		maxtids = 0;
+
+		while (BlockNumberIsValid(blkno))
+		{
+			Buffer			deltaBuffer;
+			Page			deltaPage;
+			BMPageOpaque	deltaOpaque;
+
+			deltaBuffer = _bitmap_getbuf(scan->indexRelation, blkno, BM_READ);
+			deltaPage = BufferGetPage(deltaBuffer);
+			deltaOpaque = (BMPageOpaque) PageGetSpecialPointer(deltaPage);
+
+			if (bmScanPos->bm_numDeltaTids + deltaOpaque->bm_hrl_words_used >
+				maxtids)
+			{
+				maxtids = Max(2 * maxtids, bmScanPos->bm_numDeltaTids +
+							  deltaOpaque->bm_hrl_words_used);
+				bmScanPos->bm_deltaTids = (bmScanPos->bm_deltaTids == NULL) ?
+					(uint64 *) MemoryContextAlloc(securityContext,
+												  maxtids * sizeof(uint64)) :
+					(uint64 *) repalloc(bmScanPos->bm_deltaTids,
+										maxtids * sizeof(uint64));
+			}
+			memcpy(bmScanPos->bm_deltaTids + bmScanPos->bm_numDeltaTids,
+				   BMPageGetDeltaTids(deltaPage),
+				   deltaOpaque->bm_hrl_words_used * sizeof(uint64));
+			bmScanPos->bm_numDeltaTids += deltaOpaque->bm_hrl_words_used;
+
+			blkno = deltaOpaque->bm_bitmap_next;
+			_bitmap_relbuf(deltaBuffer);
+		}
+	}
 	bmScanPos->bm_batchWords = (BMBatchWords *) MemoryContextAllocZero(securityContext, 
 										sizeof(BMBatchWords));
 	elog(NOTICE, "==_bitmap_initscanpos: allocated memory for bmScanPos->bm_batchWords, size = %lu bytes", sizeof(BMBatchWords));
@@ -15,94 +15,100 @@
 #include "miscadmin.h"
 #include "bitmap.h"
 
+#include <math.h>
+
 #include "access/genam.h"
 #include "access/heapam.h"
 #include "access/reloptions.h"
+#include "access/stratnum.h"
+#include "access/parallel.h"
 #include "access/tableam.h"
+#include "access/visibilitymap.h"
+#include "catalog/pg_type.h"
+#include "catalog/storage.h"
+#include "commands/progress.h"
+#include "commands/vacuum.h"
+#include "nodes/nodeFuncs.h"
+#include "port/pg_bitutils.h"
+#include "parser/parse_oper.h"
 #include "storage/bufmgr.h" /* for buffer manager functions */
+#include "storage/indexfsm.h"
+#include "storage/lmgr.h"
+#include "utils/array.h"
 #include "utils/snapshot.h" /* for SnapshotAny */
+#include "utils/lsyscache.h"
 #include "utils/rel.h" /* for RelationGetDescr */
+#include "utils/selfuncs.h"
+#include "utils/spccache.h"
 
 /*
- * Struct to pass basic vacuum info around
- */
-typedef struct bmvacinfo
-{
-	IndexVacuumInfo *info;
-	BMLOVItem lovitem;
-} bmvacinfo;
-
-/*
- * What are we vacuuming?
- */
-typedef enum bmVacType
-{
-	BM_VAC_PAGE,
-	BM_VAC_LAST_COMPWORD,
-	BM_VAC_LAST_WORD
-} bmVacType;
-
-/*
- * State structure to store a bunch of useful variables we need to pass
- * around to bitmap vacuum sub routines.
+ * State of a bulk delete.
+ *
+ * maybe_dead has a bit for each of the first nblocks heap blocks that may
+ * hold dead tuples; if it is NULL, any block may. dead collects the dead
+ * TIDs of the vector being vacuumed, in order.
  */
 typedef struct bmvacstate
 {
-	BMLOVItem curlov; /* LOV item for the current vector */ 
-	/* variables marking interesting positions in the vector */
-	uint64 cur_bitpos; /* the hypothetical location we're at */
-	uint64 last_setbit; /* last bit set set as a match */
-	uint64 start_reaped;
-	uint16 readwordno;	/* current word we're reading */
-	uint16 writewordno; /* current word we're writing */
-
-	/* block position at the physical level */
-	BlockNumber itr_blk;
-	
-	Buffer curbuf; /* current buffer we're examining */
-
-	/* actual bitmap pages for old and new */
-	BMBitmapVectorPage curbm;
-	BMPageOpaque curbmo;
-
-	bool page_updated;	/* have we dirtied the page */
-
-	/* callback info */
 	IndexBulkDeleteCallback callback;
-	void *callback_state;
-
-	/* overflow storage */
-	BMBitmapVectorPageData ovrflw;
-	int32 ovrflwwordno;
+	void	   *callback_state;
+	BlockNumber	nblocks;
+	uint8	   *maybe_dead;
+	uint64	   *dead;
+	int			ndead;
+	int			maxdead;
 } bmvacstate;
 
+/* the words of a vector being rewritten by vacuum */
+typedef struct bmvacwords
+{
+	BM_WORD	   *words;
+	bool	   *fills;
+	uint32		nwords;
+	uint32		maxwords;
+} bmvacwords;
+
 static void _bitmap_findnextword(BMBatchWords* words, uint32 nextReadNo);
 static void _bitmap_resetWord(BMBatchWords *words, uint32 prevStartNo);
 static uint8 _bitmap_find_bitset(BM_WORD word, uint8 lastPos);
-static void vacuum_vector(bmvacinfo vacinfo, IndexBulkDeleteCallback callback,
-			              void *callback_state);
-static void fill_reaped(bmvacstate *state, uint64 start, uint64 end);
-static void vacuum_fill_word(bmvacstate *state, bmVacType vactype);
-static void vacuum_literal_word(bmvacstate *state, bmVacType vavtype);
-static void try_shrink_bitmap(bmvacstate *state);
-static void progress_write_pos(bmvacstate *state);
-static void vacuum_last_words(bmvacstate *state);
-static BM_WORD vactype_get_word(bmvacstate *state, bmVacType type);
-static void put_vacuumed_literal_word(bmvacstate *state, bmVacType type,
-									  BM_WORD word);
-static void vacuum_append_ovrflw_words(bmvacstate *state);
+static void vacuum_init_state(bmvacstate *state, IndexVacuumInfo *info,
+							  IndexBulkDeleteCallback callback,
+							  void *callback_state);
+static bool vacuum_vector(bmvacstate *state, Relation rel,
+						  BlockNumber lovBlock, OffsetNumber lovOffset,
+						  IndexBulkDeleteResult *stats);
+static uint64 vacuum_count_word(BM_WORD word, bool isfill);
+static void vacuum_collect_word(bmvacstate *state, BM_WORD word, bool isfill,
+								uint64 tidLocation);
+static void vacuum_andnot_word(bmvacstate *state, int *deadNo, BM_WORD word,
+							   bool isfill, uint64 tidLocation,
+							   bmvacwords *out);
+static void vacuum_page(bmvacstate *state, Relation rel, Buffer lovBuffer,
+						BMLOVItem lovItem, Buffer bitmapBuffer,
+						uint64 tidLocation, int *deadNo, bmvacwords *out);
+static bool vacuum_last_words(bmvacstate *state, Relation rel,
+							  Buffer lovBuffer, BMLOVItem lovItem,
+							  int *deadNo, bmvacwords *out);
+static BlockNumber unlink_empty_bitmappages(Relation rel, Buffer lovBuffer,
+											BMLOVItem lovitem);
+static void compact_append_word(BM_WORD *words, bool *fills, uint32 *nwords,
+								BM_WORD word, bool isfill);
+static void release_extent(Relation rel, Buffer lovBuffer, BMLOVItem lovItem);
+static void vacuum_extent(Relation rel, BlockNumber lovBlock,
+						  OffsetNumber lovOffset);
 
 /*
- * _bitmap_formitem() -- construct a LOV entry.
+ * _bitmap_formitem() -- construct a LOV entry with a tail buffer of
+ *	tailWords words.
  *
  * If the given tid number is greater than BM_WORD_SIZE, we
  * construct the first fill word for this bitmap vector.
  */
 BMLOVItem
-_bitmap_formitem(uint64 currTidNumber)
+_bitmap_formitem(uint64 currTidNumber, uint16 tailWords)
 {
     /* Allocate a new LOV item */
-    BMLOVItem bmitem = (BMLOVItem)palloc(BM_LOV_ITEM_SIZE);
+    BMLOVItem bmitem = (BMLOVItem)palloc0(BM_LOV_ITEM_SIZE(tailWords));
 
 #ifdef DEBUG_BMI
 	  elog(NOTICE,"[_bitmap_formitem] BEGIN"
@@ -118,6 +124,11 @@ _bitmap_formitem(uint64 currTidNumber)
     bmitem->bm_last_word = LITERAL_ALL_ZERO;
     bmitem->lov_words_header = BM_LOV_WORDS_NO_FILL;
     bmitem->bm_last_tid_location = 0;
+    bmitem->bm_extent_next = bmitem->bm_extent_end = InvalidBlockNumber;
+    bmitem->bm_extent_size = 0;
+    bmitem->bm_extent_vacuumed = InvalidBlockNumber;
+    bmitem->bm_delta_head = InvalidBlockNumber;
+    bmitem->bm_tail_size = tailWords;
 
     /* fill up all existing bits with 0. */
     if (currTidNumber > BM_WORD_SIZE)
@@ -150,6 +161,86 @@ _bitmap_formitem(uint64 currTidNumber)
     return bmitem;
 }
 
+/*
+ * _bitmap_get_relcache() -- return the cached per-relation state of the
+ *	given bitmap index, setting it up on first use.
+ */
+BMRelCache *
+_bitmap_get_relcache(Relation rel)
+{
+	BMRelCache *cache = (BMRelCache *) rel->rd_amcache;
+	TupleDesc	tupDesc;
+	Buffer		metabuf;
+	BMMetaPage	metapage;
+	int			attno;
+
+	if (cache != NULL)
+		return cache;
+
+	cache = (BMRelCache *) MemoryContextAllocZero(rel->rd_indexcxt,
+												  sizeof(BMRelCache));
+
+	metabuf = _bitmap_getbuf(rel, BM_METAPAGE, BM_READ);
+	metapage = (BMMetaPage) PageGetContents(BufferGetPage(metabuf));
+	if (metapage->bm_magic != BM_MAGIC || metapage->bm_version != BM_VERSION)
+	{
+		uint32		version = (metapage->bm_magic == BM_MAGIC) ?
+			metapage->bm_version : 0;
+
+		_bitmap_relbuf(metabuf);
+		pfree(cache);
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("index \"%s\" has on-disk format version %u, but yabit expects version %u",
+						RelationGetRelationName(rel), version, BM_VERSION),
+				 errhint("REINDEX the index.")));
+	}
+	cache->bm_lov_heapId = metapage->bm_lov_heapId;
+	cache->bm_lov_indexId = metapage->bm_lov_indexId;
+	cache->bm_dict_root = metapage->bm_dict_root;
+	cache->bm_map_root = metapage->bm_map_root;
+	cache->bm_filter_block = metapage->bm_filter_block;
+	cache->bm_lov_nitems = metapage->bm_lov_nitems;
+	cache->bm_key_scale = metapage->bm_key_scale;
+	_bitmap_relbuf(metabuf);
+
+	/* a dictionary of scaled numeric keys holds int8 tuples */
+	if (cache->bm_key_scale >= 0)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(rel->rd_indexcxt);
+
+		cache->bm_dict_desc = CreateTemplateTupleDesc(1);
+		TupleDescInitEntry(cache->bm_dict_desc, (AttrNumber) 1, NULL,
+						   INT8OID, -1, 0);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	if (cache->bm_filter_block != InvalidBlockNumber)
+	{
+		Oid			hashproc = _bitmap_filter_hashproc(rel);
+
+		if (OidIsValid(hashproc))
+			fmgr_info_cxt(hashproc, &cache->bm_filter_hash, rel->rd_indexcxt);
+		else
+			cache->bm_filter_block = InvalidBlockNumber;
+	}
+
+	tupDesc = RelationGetDescr(rel);
+	cache->natts = tupDesc->natts;
+	for (attno = 0; attno < tupDesc->natts; attno++)
+	{
+		Oid			eq_opr = InvalidOid;
+
+		get_sort_group_operators(TupleDescAttr(tupDesc, attno)->atttypid,
+								 false, true, false, NULL, &eq_opr, NULL, NULL);
+		cache->eq_procs[attno] =
+			OidIsValid(eq_opr) ? get_opcode(eq_opr) : InvalidOid;
+	}
+
+	rel->rd_amcache = cache;
+	return cache;
+}
+
 /*
  * _bitmap_init_batchwords() -- initialize a BMBatchWords in a given
  * memory context.
@@ -257,6 +348,8 @@ _bitmap_cleanup_scanpos(BMVector bmScanPos, uint32 numBitmapVectors)
 		_bitmap_cleanup_batchwords((bmScanPos[keyNo]).bm_batchWords);
 		if (bmScanPos[keyNo].bm_batchWords != NULL)
 			pfree((bmScanPos[keyNo]).bm_batchWords);
+		if (bmScanPos[keyNo].bm_deltaTids != NULL)
+			pfree(bmScanPos[keyNo].bm_deltaTids);
 	}
 
 	pfree(bmScanPos);
@@ -1146,25 +1239,294 @@ _bitmap_log_updatewords(Relation rel,
 }
 	*/
 
-/* Simple cost estimation pile function */
+/* the most values of an array qual whose vectors are looked up for costs */
+#define BM_COST_MAX_LOOKUPS	64
+
+/*
+ * cost_vector_stats() -- add up the set bits and bitmap pages of the
+ *	vectors the equality or IS NULL qual of an index path admits.
+ *
+ * Only a path with that one qual, comparing with constants, is handled.
+ * The LOV item of each value is looked up as a scan would, and its
+ * bm_nsetbits and bm_npages read. Returns false for any other path, and
+ * for an array of more than BM_COST_MAX_LOOKUPS values.
+ */
+static bool
+cost_vector_stats(Relation indexRel, IndexPath *path, double *nsetbits,
+				  double *npages)
+{
+	IndexOptInfo *index = path->indexinfo;
+	IndexClause *iclause;
+	Expr	   *clause;
+	Datum		value;
+	bool		isnull;
+	Datum	   *values = &value;
+	bool	   *nulls = &isnull;
+	int			nvalues = 1;
+	int			i;
+
+	if (list_length(path->indexclauses) != 1)
+		return false;
+	iclause = linitial_node(IndexClause, path->indexclauses);
+	if (list_length(iclause->indexquals) != 1)
+		return false;
+	clause = linitial_node(RestrictInfo, iclause->indexquals)->clause;
+
+	if (IsA(clause, NullTest))
+	{
+		value = (Datum) 0;
+		isnull = true;
+	}
+	else if (IsA(clause, OpExpr))
+	{
+		Node	   *arg = get_rightop(clause);
+
+		if (!IsA(arg, Const) ||
+			((Const *) arg)->consttype != index->opcintype[0])
+			return false;
+
+		value = ((Const *) arg)->constvalue;
+		isnull = ((Const *) arg)->constisnull;
+	}
+	else if (IsA(clause, ScalarArrayOpExpr) &&
+			 ((ScalarArrayOpExpr *) clause)->useOr)
+	{
+		Node	   *arg = lsecond(((ScalarArrayOpExpr *) clause)->args);
+		ArrayType  *array;
+		int16		typlen;
+		bool		typbyval;
+		char		typalign;
+
+		if (!IsA(arg, Const) || ((Const *) arg)->constisnull)
+			return false;
+
+		array = DatumGetArrayTypeP(((Const *) arg)->constvalue);
+		if (ARR_ELEMTYPE(array) != index->opcintype[0] ||
+			ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) >
+			BM_COST_MAX_LOOKUPS)
+			return false;
+
+		get_typlenbyvalalign(ARR_ELEMTYPE(array), &typlen, &typbyval,
+							 &typalign);
+		deconstruct_array(array, ARR_ELEMTYPE(array), typlen, typbyval,
+						  typalign, &values, &nulls, &nvalues);
+	}
+	else
+		return false;
+
+	*nsetbits = 0;
+	*npages = 0;
+	for (i = 0; i < nvalues; i++)
+	{
+		BlockNumber	lovBlock;
+		OffsetNumber lovOffset;
+		Buffer		lovBuffer;
+		Page		lovPage;
+		BMLOVItem	lovItem;
+
+		/* the operators are strict, so NULL matches nothing */
+		if (nulls[i] && !IsA(clause, NullTest))
+			continue;
+
+		if (!_bitmap_find_lovitem(indexRel, &values[i], &nulls[i],
+								  &lovBlock, &lovOffset))
+			continue;
+
+		lovBuffer = _bitmap_getbuf(indexRel, lovBlock, BM_READ);
+		lovPage = BufferGetPage(lovBuffer);
+		lovItem = (BMLOVItem) PageGetItem(lovPage,
+										  PageGetItemId(lovPage, lovOffset));
+		*nsetbits += lovItem->bm_nsetbits;
+		*npages += lovItem->bm_npages;
+		_bitmap_relbuf(lovBuffer);
+	}
+
+	return true;
+}
+
+/*
+ * bmcostestimate_internal() -- estimate the cost of a bitmap index scan.
+ *
+ * genericcostestimate() gives us the selectivity of the quals and the
+ * number of scans an array qual takes, but it charges page reads and CPU
+ * per index tuple, as for a btree. A scan of a bitmap index instead looks
+ * up the LOV items of the values the quals admit, and reads and decodes
+ * the bitmap vectors of those values, which take about the share of the
+ * bitmap pages that their rows are of the table. So we count the vectors:
+ * one per scan when all the quals are equalities or IS NULL, and the
+ * admitted share of the distinct values in the metapage otherwise, and
+ * charge
+ *
+ *	- a descent of the LOV btree or the dictionary per scan, and a LOV
+ *	  page read per vector, with the CPU to test its value;
+ *	- the bitmap pages of the vectors, the first of each one at random and
+ *	  the rest in sequence, as a vector's pages are allocated together;
+ *	- the CPU to decode each of those pages, and to add each matching TID
+ *	  to the TID bitmap, which is cheaper than a btree's index tuple.
+ *
+ * When the only qual is an equality or IS NULL with constants, the LOV
+ * items of its values are looked up, and the set bits and bitmap pages
+ * their vectors keep count of replace the share of the pages and of the
+ * rows that the selectivity gives; see cost_vector_stats().
+ *
+ * The pages read by repeated scans under a nested loop are amortized with
+ * index_pages_fetched(), as genericcostestimate() does.
+ */
 void
 bmcostestimate_internal(PlannerInfo *root, IndexPath *path, double loop_count,
-               Cost *indexStartupCost, Cost *indexTotalCost,
-               Selectivity *indexSelectivity, double *indexCorrelation,
-               double *indexPages)
+						Cost *indexStartupCost, Cost *indexTotalCost,
+						Selectivity *indexSelectivity, double *indexCorrelation,
+						double *indexPages)
 {
-	/*
-     * === Key Part: Parallelism Prohibited ===
-     */
+	IndexOptInfo *index = path->indexinfo;
+	GenericCosts costs;
+	ListCell   *lc;
+	bool		allEqual = (path->indexclauses != NIL);
+	bool		usesDict = false;
+	bool		haveStats = false;
+	double		vectorSetbits = 0;
+	double		vectorPagesCounted = 0;
+	double		ndistinct = 0;
+	double		nscans;
+	double		nvectors;
+	double		numTuples;
+	double		vectorPages;
+	double		lovPages;
+	double		pagesFetched;
+	double		spc_random_page_cost;
+	double		spc_seq_page_cost;
+	Cost		descentCost;
+	Cost		pageCost;
+	Cost		cpuCost;
+
+	/* scans of a bitmap index are not parallel aware */
 	path->path.parallel_aware = false;
-    path->path.parallel_safe  = false;
-    path->path.parallel_workers = 0;
-    /* A very rough default value, actual cost should be computed based on bitmap logic */
-    if (indexPages) *indexPages = 1.0;
-    if (indexCorrelation) *indexCorrelation = 0.0;
-    if (indexSelectivity) *indexSelectivity = 0.1;
-    if (indexStartupCost) *indexStartupCost = 0.0;
-    if (indexTotalCost) *indexTotalCost = 10.0;
+	path->path.parallel_safe = false;
+	path->path.parallel_workers = 0;
+
+	MemSet(&costs, 0, sizeof(costs));
+	genericcostestimate(root, path, loop_count, &costs);
+
+	/*
+	 * Do all the quals admit a single value per scan? An array qual takes a
+	 * scan per element, counted by genericcostestimate().
+	 */
+	foreach(lc, path->indexclauses)
+	{
+		IndexClause *iclause = lfirst_node(IndexClause, lc);
+		ListCell   *lc2;
+
+		foreach(lc2, iclause->indexquals)
+		{
+			Expr	   *clause = lfirst_node(RestrictInfo, lc2)->clause;
+			Oid			opno;
+
+			if (IsA(clause, OpExpr))
+				opno = ((OpExpr *) clause)->opno;
+			else if (IsA(clause, ScalarArrayOpExpr))
+				opno = ((ScalarArrayOpExpr *) clause)->opno;
+			else
+			{
+				if (!IsA(clause, NullTest) ||
+					((NullTest *) clause)->nulltesttype != IS_NULL)
+					allEqual = false;
+				continue;
+			}
+
+			if (get_op_opfamily_strategy(opno,
+										 index->opfamily[iclause->indexcol]) !=
+				BTEqualStrategyNumber)
+				allEqual = false;
+		}
+	}
+
+	/*
+	 * The number of distinct values is kept in the metapage, and a copy of
+	 * it in the relcache entry, which is what we read here. A hypothetical
+	 * index has none, and an index built before the count was kept has
+	 * zero there; assume the default of the planner for those.
+	 */
+	if (!index->hypothetical)
+	{
+		Relation	indexRel = index_open(index->indexoid, NoLock);
+		BMRelCache *cache = _bitmap_get_relcache(indexRel);
+
+		ndistinct = cache->bm_lov_nitems;
+		usesDict = (cache->bm_dict_root != InvalidBlockNumber);
+
+		if (allEqual)
+			haveStats = cost_vector_stats(indexRel, path, &vectorSetbits,
+										  &vectorPagesCounted);
+
+		index_close(indexRel, NoLock);
+	}
+	if (ndistinct <= 0)
+		ndistinct = DEFAULT_NUM_DISTINCT;
+
+	nscans = Max(costs.num_sa_scans, 1.0);
+	numTuples = costs.numIndexTuples * nscans;
+
+	/* how many vectors the scans union */
+	if (allEqual)
+		nvectors = Min(nscans, ndistinct);
+	else
+		nvectors = Max(1.0, Min(ndistinct,
+								ceil(costs.indexSelectivity * ndistinct)));
+
+	/*
+	 * A vector with few set bits lives in the tail words of its LOV item
+	 * alone, so the bitmap pages are not bounded below by the vectors.
+	 */
+	if (haveStats)
+	{
+		vectorPages = vectorPagesCounted;
+		numTuples = vectorSetbits;
+		if (index->rel->tuples > 0)
+			costs.indexSelectivity =
+				Min(1.0, vectorSetbits / index->rel->tuples);
+	}
+	else
+		vectorPages = ceil(costs.indexSelectivity * index->pages);
+	lovPages = nvectors;
+	if (!usesDict)
+		lovPages += nscans;		/* the LOV heap tuple of each lookup */
+
+	get_tablespace_page_costs(index->reltablespace,
+							  &spc_random_page_cost, &spc_seq_page_cost);
+
+	pagesFetched = vectorPages + lovPages;
+	if (loop_count > 1)
+	{
+		/* assume all the fetches are random, as genericcostestimate() does */
+		pagesFetched = index_pages_fetched(pagesFetched * loop_count,
+										   index->pages,
+										   (double) index->rel->pages,
+										   root) / loop_count;
+		pageCost = pagesFetched * spc_random_page_cost;
+	}
+	else
+	{
+		double		randomPages = Min(pagesFetched, nvectors + lovPages);
+
+		pageCost = randomPages * spc_random_page_cost +
+			(pagesFetched - randomPages) * spc_seq_page_cost;
+	}
+
+	/* as btcostestimate(), a binary search plus the pages of one descent */
+	descentCost = (ceil(log(ndistinct) / log(2.0)) +
+				   (usesDict ? 2 : 3) * DEFAULT_PAGE_CPU_MULTIPLIER) *
+		cpu_operator_cost;
+
+	cpuCost = nvectors * cpu_index_tuple_cost +
+		vectorPages * DEFAULT_PAGE_CPU_MULTIPLIER * cpu_operator_cost +
+		numTuples * cpu_operator_cost;
+
+	*indexStartupCost = costs.indexStartupCost;
+	*indexTotalCost = costs.indexStartupCost + nscans * descentCost +
+		pageCost + cpuCost;
+	*indexSelectivity = costs.indexSelectivity;
+	*indexCorrelation = 0.0;
+	*indexPages = vectorPages + lovPages;
 }
 
 /* Simple validation function */
@@ -1174,922 +1536,1345 @@ bmvalidate_internal(Oid opclassoid)
     return true;
 }
 
+/* reloption kind of bitmap indexes, registered by _bitmap_init_reloptions() */
+static relopt_kind bm_relopt_kind;
+
+/*
+ * _bitmap_init_reloptions() -- register the bitmap index options.
+ *
+ * Called once from _PG_init().
+ */
+void
+_bitmap_init_reloptions(void)
+{
+	bm_relopt_kind = add_reloption_kind();
+
+	add_int_reloption(bm_relopt_kind, "fillfactor",
+					  "Packs bitmap index pages only to this percentage",
+					  BM_DEFAULT_FILLFACTOR, BM_MIN_FILLFACTOR, 100,
+					  ShareUpdateExclusiveLock);
+	add_int_reloption(bm_relopt_kind, "lov_items_per_page",
+					  "Maximum number of distinct values stored on one LOV page "
+					  "(0 packs the pages full)",
+					  0, 0, (int) BM_MAX_LOVITEMS_PER_PAGE,
+					  ShareUpdateExclusiveLock);
+	add_int_reloption(bm_relopt_kind, "lov_tail_words",
+					  "Number of bitmap words a new distinct value buffers "
+					  "before writing them to its bitmap pages",
+					  BM_DEFAULT_LOV_TAIL_WORDS, 0, BM_MAX_LOV_TAIL_WORDS,
+					  ShareUpdateExclusiveLock);
+	add_bool_reloption(bm_relopt_kind, "deferred",
+					   "Leave new heap blocks out of the index until they "
+					   "are summarized",
+					   false, ShareUpdateExclusiveLock);
+	add_bool_reloption(bm_relopt_kind, "dictionary",
+					   "Look up the distinct values in dictionary pages of "
+					   "the index instead of a separate heap and btree",
+					   false, AccessExclusiveLock);
+	add_bool_reloption(bm_relopt_kind, "direct_map",
+					   "Map the int4 or date values of the index directly "
+					   "to their distinct values, in addition to the "
+					   "dictionary",
+					   false, AccessExclusiveLock);
+}
+
 bytea *
 bmoptions_internal(Datum reloptions,
            bool validate)
 {
-	bytea	   *result;
-
 	/*
 	 * It's not clear that fillfactor is useful for on-disk bitmap index,
 	 * but for the moment we'll accept it anyway.  (It won't do anything...)
 	 */
-#define BM_MIN_FILLFACTOR			10
-#define BM_DEFAULT_FILLFACTOR		100
+	static const relopt_parse_elt tab[] = {
+		{"fillfactor", RELOPT_TYPE_INT, offsetof(BMOptions, fillfactor)},
+		{"lov_items_per_page", RELOPT_TYPE_INT,
+		 offsetof(BMOptions, lov_items_per_page)},
+		{"lov_tail_words", RELOPT_TYPE_INT,
+		 offsetof(BMOptions, lov_tail_words)},
+		{"deferred", RELOPT_TYPE_BOOL, offsetof(BMOptions, deferred)},
+		{"dictionary", RELOPT_TYPE_BOOL, offsetof(BMOptions, dictionary)},
+		{"direct_map", RELOPT_TYPE_BOOL, offsetof(BMOptions, direct_map)}
+	};
+
+	return (bytea *) build_reloptions(reloptions, validate, bm_relopt_kind,
+									  sizeof(BMOptions), tab, lengthof(tab));
+}
 
-	result = default_reloptions(reloptions, validate, RELOPT_KIND_BTREE);
-	if (result)
-		return result;
+/*
+ * bmbuildphasename() -- name a subphase of a bitmap index build for
+ *	pg_stat_progress_create_index.
+ */
+char *
+bmbuildphasename_internal(int64 phasenum)
+{
+	switch (phasenum)
+	{
+		case PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE:
+			return "initializing";
+		case PROGRESS_BM_PHASE_INDEXBUILD_TABLESCAN:
+			return "scanning table";
+		case PROGRESS_BM_PHASE_LOV_SORT_1:
+			return "sorting value list";
+		case PROGRESS_BM_PHASE_LOV_SORT_2:
+			return "sorting dead value list tuples";
+		case PROGRESS_BM_PHASE_LOV_LEAF_LOAD:
+			return "loading value list index";
+		case PROGRESS_BM_PHASE_WRITE_VECTORS:
+			return "writing bitmap vectors";
+		case PROGRESS_BM_PHASE_LOAD_LOV:
+			return "loading value list";
+		case PROGRESS_BM_PHASE_SYNC:
+			return "syncing index to disk";
+	}
 	return NULL;
 }
 
 /*
- * Vacuum tuples out of a bitmap index.
+ * _bitmap_vacuum() -- remove the dead TIDs the callback reports from
+ *	every vector of the index.
+ *
+ * See vacuum_vector(). The delta pages of each vector are folded into
+ * it afterwards, leaving out the dead TIDs among them. The live TIDs of
+ * the vectors are counted in stats->num_index_tuples.
  */
-
 void
 _bitmap_vacuum(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 			   IndexBulkDeleteCallback callback, void *callback_state)
 {
-	Buffer metabuf;
-	BMMetaPage metapage;
-	Relation index = info->index;
-	bmvacinfo vacinfo;
-	TableScanDesc scan;
-	Relation lovheap;
-	TupleTableSlot *slot;
-	HeapTuple tuple;
-
-	vacinfo.info = info;
-
-	metabuf = _bitmap_getbuf(info->index, BM_METAPAGE, BM_READ);
-	metapage = (BMMetaPage)PageGetContents(BufferGetPage(metabuf)); 
-
-	lovheap = table_open(metapage->bm_lov_heapId, AccessShareLock);
-	scan = table_beginscan(lovheap, SnapshotAny, 0, NULL);
-	
-	slot = table_slot_create(lovheap, NULL);
-	
-	while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
-	{
-		BMLOVItem 		lovitem;
-		BlockNumber 	lov_block;
-		OffsetNumber 	lov_off;
-		TupleDesc   	desc;
-        Datum       	d;
-		bool			isnull;
-		Buffer			lov_buf;
-		Page			page;
-
-        desc = RelationGetDescr(lovheap);
-        tuple = ExecFetchSlotHeapTuple(slot, false, NULL);
-
-        d = heap_getattr(tuple, desc->natts - 1, desc, &isnull);
-		Assert(!isnull);
-        lov_block = DatumGetInt32(d);
-		
-        d = heap_getattr(tuple, desc->natts - 0, desc, &isnull);
-		Assert(!isnull);
-        lov_off = DatumGetInt16(d);
+	Relation	index = info->index;
+	bmvacstate	state;
+	BMLovScan	scan;
+	BlockNumber	lov_block;
+	OffsetNumber lov_off;
 
-		lov_buf = _bitmap_getbuf(index, lov_block, BM_READ);
-		page = BufferGetPage(lov_buf);
-		lovitem = (BMLOVItem)PageGetItem(page,
-										 PageGetItemId(page,lov_off));
-		vacinfo.lovitem = lovitem;
+	vacuum_init_state(&state, info, callback, callback_state);
 
-#ifdef DEBUG_BMI
-		elog(NOTICE, "---- start vac");
-		elog(NOTICE, "value = %i", (int)heap_getattr(tuple, 1, desc, &isnull));
-#endif
-		vacuum_vector(vacinfo, callback, callback_state);
-		_bitmap_relbuf(lov_buf);
+	scan = _bitmap_begin_lovscan(index, false);
+	while (_bitmap_lovscan_next(scan, &lov_block, &lov_off))
+	{
+		vacuum_delay_point();
+
+		while (!vacuum_vector(&state, index, lov_block, lov_off, stats))
+			vacuum_delay_point();
+		stats->pages_newly_deleted +=
+			_bitmap_fold_deltas(index, lov_block, lov_off, callback,
+								callback_state, &stats->tuples_removed);
 	}
-	
-	/* XXX: be careful to vacuum NULL vector */
-	
-	/*vacuum null vector */
+	_bitmap_end_lovscan(scan);
+
+	/* the NULL vector has no LOV heap tuple */
+	while (!vacuum_vector(&state, index, BM_LOV_STARTPAGE, 1, stats))
+		vacuum_delay_point();
+	stats->pages_newly_deleted +=
+		_bitmap_fold_deltas(index, BM_LOV_STARTPAGE, 1, callback,
+							callback_state, &stats->tuples_removed);
+
+	if (state.maybe_dead != NULL)
+		pfree(state.maybe_dead);
+	if (state.dead != NULL)
+		pfree(state.dead);
+}
+
+/*
+ * _bitmap_vacuum_deltas() -- fold the delta pages of every vector into
+ *	the vector.
+ *
+ * Used by a vacuum that had nothing to delete, so that the deltas of an
+ * index are not left to pile up between vacuums that do.
+ */
+void
+_bitmap_vacuum_deltas(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+	Relation	index = info->index;
+	BMLovScan	scan;
+	BlockNumber	lov_block;
+	OffsetNumber lov_off;
 
-	/* iterate over all vectors, call for each */
+	scan = _bitmap_begin_lovscan(index, false);
+	while (_bitmap_lovscan_next(scan, &lov_block, &lov_off))
+	{
+		vacuum_delay_point();
 
-	/* track free pages over calls, shrink when necessary */
-	/* truncate if necessary */
+		stats->pages_newly_deleted +=
+			_bitmap_fold_deltas(index, lov_block, lov_off, NULL, NULL, NULL);
+	}
+	_bitmap_end_lovscan(scan);
 
-	ExecDropSingleTupleTableSlot(slot);
-	table_endscan(scan);
-	table_close(lovheap, AccessShareLock);
-		
-	_bitmap_relbuf(metabuf);
+	stats->pages_newly_deleted +=
+		_bitmap_fold_deltas(index, BM_LOV_STARTPAGE, 1, NULL, NULL, NULL);
 }
 
 /*
- * Vacuum a single bitmap vector.
+ * unlink_empty_bitmappages() -- unlink the pages of a vector that have no
+ *	words left after vacuuming it, and mark them deleted.
  *
- * We traverse the vector page by page, checking if any TIDs have been
- * reaped (via the callback). There are three cases:
+ * The tail page stays even if it is empty, as the vector's new words are
+ * appended to it. Returns the number of pages deleted.
  *
- * If a given word is literal and a TID is reaped, we flip the bit
- * from 1 to 0. If the whole word, when we finish, is 0, transform
- * it to a compressed word. If the previous word is compressed and is non-
- * match fill, we merge these two words.
- *
- * If the word is non-match fill, we first test if we can merge it with the
- * previous word. If not, we just copy it directly.
- *
- * If the word is match fill, we must iterate through the range and see if
- * any TIDs have been reaped. If we find a reaped TID, we have to break up
- * the fill word. This will result in 2 or 3 words replacing one word. That is,
- * If the first TID in the range is reaped, we'll create a new literal word and
- * have a fill word representing the rest of the range. If the reaped TID is
- * in the middle of the fill, we'll have an initial word representing the
- * initial matches, a literal word with the non-match and then a proceeding
- * word of matches again.
- *
- * It's reasonable that reaped TIDs might be clustered. So, instead of
- * breaking the fill word straight away, we construct a word for the initial
- * part of the range and then set a flag to indicate that we found a reaped 
- * TID. Once we find a non-reaped TID, we construct a word representing the 
- * non-match range and then continue processing the rest of the range.
- *
- * When we shrink or grow the index, we must physically shift data on the page.
- * Shrinking is not a problem, we just maintain it logically. If we need to
- * grow the storage (because we create a non-match in a match fill word) we 
- * either absorb the space between the logical write position and the read
- * position OR, if there is no such space, we must pull data off the end
- * of the page into 'overflow' storage and push the remaining data toward the
- * end of the page.
+ * lovBuffer holds lovitem, and is pinned and exclusively locked.
  */
-static void
-vacuum_vector(bmvacinfo vacinfo, IndexBulkDeleteCallback callback,
-			  void *callback_state)
+static BlockNumber
+unlink_empty_bitmappages(Relation rel, Buffer lovBuffer, BMLOVItem lovitem)
 {
-	/*
-	 * Iterate over the bitmap vector. For each setbit, see if it's in the
-	 * reaped tids (via the callback). Once we find a reaped tid, we continue 
-	 * to iterate until we find a non-reaped tid. Then we patch things up.
-	 *
-	 * There are two ways we could do this: memmove() things around a lot
-	 * on the live page or create a new page and overwrite the existing one.
-	 * For now, we do the latter.
-	 */
-	bmvacstate state;
-
-	state.cur_bitpos = 1;
-	state.readwordno = 0;
-	state.writewordno = 0;
-	
-	state.callback = callback;
-	state.callback_state = callback_state;
-	
-	state.itr_blk = vacinfo.lovitem->bm_lov_head;
-	state.curbuf = InvalidBuffer;
+	Buffer		prevbuf = InvalidBuffer;
+	BlockNumber	blkno = lovitem->bm_lov_head;
+	BlockNumber	ndeleted = 0;
 
-	state.ovrflwwordno = 0;
-
-	state.curlov = vacinfo.lovitem;
-
-	if (!BlockNumberIsValid(state.itr_blk))
-	{
-		elog(NOTICE, "invalid head, compword: %i, lastword: %i",
-			 vacinfo.lovitem->bm_last_compword, vacinfo.lovitem->bm_last_word);
-		return;
-	}
-		
-	/* The outer loop iterates over each block in the vector */
-	do
+	while (BlockNumberIsValid(blkno) && blkno != lovitem->bm_lov_tail)
 	{
-		if (!BufferIsValid(state.curbuf))
-		{
-	   		state.curbuf = _bitmap_getbuf(vacinfo.info->index, state.itr_blk, 
-										  BM_WRITE);
-		}
-		state.curbm = (BMBitmapVectorPage)PageGetContents(BufferGetPage(state.curbuf));
-		state.curbmo = 
-			(BMPageOpaque)PageGetSpecialPointer(BufferGetPage(state.curbuf));
+		Buffer		buf = _bitmap_getbuf(rel, blkno, BM_WRITE);
+		Page		page = BufferGetPage(buf);
+		BMPageOpaque opaque = (BMPageOpaque) PageGetSpecialPointer(page);
+		BlockNumber	next = opaque->bm_bitmap_next;
 
-#ifdef DEBUG_BMI
-		elog(NOTICE, "words used: %i, comp %i, last %i", 
-			 state.curbmo->bm_hrl_words_used,
-			 vacinfo.lovitem->bm_last_compword, vacinfo.lovitem->bm_last_word);
-#endif
-		while (state.readwordno < state.curbmo->bm_hrl_words_used)
+		if (opaque->bm_hrl_words_used > 0)
 		{
-			/* Fill word */
-			if (IS_FILL_WORD(state.curbm->hwords, state.readwordno))
-			{
-				vacuum_fill_word(&state, BM_VAC_PAGE);
-			}
-			else
-			{
-				vacuum_literal_word(&state, BM_VAC_PAGE);
-			}	
-			state.readwordno++;
-			state.writewordno++;
-
-			/* 
-			 * If we're reached the last word, see if there are any overflows
-			 * and if so, merge them back into the page.
-			 */
-			vacuum_append_ovrflw_words(&state);
+			if (BufferIsValid(prevbuf))
+				_bitmap_relbuf(prevbuf);
+			prevbuf = buf;
+			blkno = next;
+			continue;
 		}
 
-		if (state.ovrflwwordno)
+		START_CRIT_SECTION();
+
+		if (BufferIsValid(prevbuf))
 		{
-			/* 
-			 * We must merge the over flow into the next page. Write lock that
-			 * page first so that no one can miss the data held privately
-			 * by us.
-			 */
-			Buffer nbuf = InvalidBuffer;
-			BlockNumber nextblk = state.curbmo->bm_bitmap_next;
-			elog(NOTICE, "---------");
-			elog(NOTICE, "overflows!");
-			elog(NOTICE, "---------");
-			/* 先写入当前页 */
-			_bitmap_wrtbuf(state.curbuf);
-			/* 如果存在下一页，则读入下一页 */
-			if (BlockNumberIsValid(nextblk))
-				nbuf = _bitmap_getbuf(vacinfo.info->index, nextblk, BM_WRITE);
-
-			state.itr_blk = nextblk;
-			state.curbuf = nbuf;
+			BMPageOpaque prevopaque = (BMPageOpaque)
+				PageGetSpecialPointer(BufferGetPage(prevbuf));
 
+			prevopaque->bm_bitmap_next = next;
+			MarkBufferDirty(prevbuf);
 		}
 		else
-		{
-			state.itr_blk = state.curbmo->bm_bitmap_next;
-			_bitmap_wrtbuf(state.curbuf);
-		}
-	} while (BlockNumberIsValid(state.itr_blk));
+			lovitem->bm_lov_head = next;
+		if (lovitem->bm_npages > 0)
+			lovitem->bm_npages--;
+		MarkBufferDirty(lovBuffer);
+
+		_bitmap_delete_bitmappage(page);
+		MarkBufferDirty(buf);
+
+		END_CRIT_SECTION();
+
+		_bitmap_relbuf(buf);
+		ndeleted++;
+		blkno = next;
+	}
 
-	vacuum_last_words(&state);
+	if (BufferIsValid(prevbuf))
+		_bitmap_relbuf(prevbuf);
+
+	return ndeleted;
 }
 
-static void
-fill_matched(bmvacstate *state, uint64 start, uint64 end)
+/*
+ * _bitmap_vacuum_pages() -- recycle deleted pages and truncate the index.
+ *
+ * First the extents that vectors have left unused since the last vacuum
+ * are given up; see vacuum_extent(). Then every page of the index is
+ * read. The deleted bitmap pages that no scan can reach any more are
+ * recorded in the free space map for _bitmap_alloc_bitmappage() to reuse.
+ * If the index ends with a run of such pages, and we can get an exclusive
+ * lock on the index without waiting, the file is truncated to give the
+ * space back.
+ */
+void
+_bitmap_vacuum_pages(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 {
-	if (start && start < end)
+	Relation	rel = info->index;
+	BlockNumber	nblocks = RelationGetNumberOfBlocks(rel);
+	BlockNumber	blkno;
+	BlockNumber	new_nblocks;	/* start of the recyclable tail */
+	BMLovScan	scan;
+	BlockNumber	lov_block;
+	OffsetNumber lov_off;
+
+	scan = _bitmap_begin_lovscan(rel, false);
+	while (_bitmap_lovscan_next(scan, &lov_block, &lov_off))
 	{
-		BM_WORD newword;
-		uint64 len = end - start - 1;
+		vacuum_delay_point();
+		vacuum_extent(rel, lov_block, lov_off);
+	}
+	_bitmap_end_lovscan(scan);
+	vacuum_extent(rel, BM_LOV_STARTPAGE, 1);
 
-		Assert(len > 0);
-		
-		if (len >= BM_WORD_SIZE)
-		{
-			/* set the new fill length */
+	/* the released extents may have grown the recyclable tail */
+	nblocks = RelationGetNumberOfBlocks(rel);
+	new_nblocks = nblocks;
 
-			elog(NOTICE, "shrinking fill word. old len = "
-				 "new len = %lu", (unsigned long)(len / BM_WORD_SIZE));
-			
-			newword = BM_MAKE_FILL_WORD(1, len / BM_WORD_SIZE);
-			state->curbm->cwords[state->writewordno] = newword;
-			HEADER_SET_FILL_BIT_ON(state->curbm->hwords,
-								   state->writewordno);
+	stats->pages_deleted = 0;
+	stats->pages_free = 0;
 
-			try_shrink_bitmap(state);
-			progress_write_pos(state);
+	for (blkno = BM_METAPAGE + 1; blkno < nblocks; blkno++)
+	{
+		Buffer		buf;
+		Page		page;
 
-			len = len % BM_WORD_SIZE;
-			start = end - len;
-			newword = 0;
-		}
+		vacuum_delay_point();
 
-		if (len)
-		{
-			uint64 i;
-			
-			/*
-			 * We need to create a literal representation of the
-			 * matches. If the current write word is fill, create
-			 * a new word. If the existing word is literal, merge
-			 * in our matches.
-			 */
-			if (IS_FILL_WORD(state->curbm->hwords, 
-							 state->writewordno))
-				progress_write_pos(state);
-			
-			newword = state->curbm->cwords[state->writewordno];
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL,
+								 info->strategy);
+		LockBuffer(buf, BM_READ);
+		page = BufferGetPage(buf);
 
-			for (i = start; i < state->cur_bitpos; i++)
-			{
-				if ((i % BM_WORD_SIZE) == 0)
-				{
-					progress_write_pos(state);
-					newword = state->curbm->cwords[state->writewordno];
-				}
-				newword |= 1 << ((i % BM_WORD_SIZE) - 1);
-			}
-			try_shrink_bitmap(state);
+		if (!PageIsNew(page) && BMPageIsBitmapPage(page) &&
+			BMPageIsDeleted(page))
+			stats->pages_deleted++;
+
+		if (_bitmap_page_recyclable(page))
+		{
+			RecordFreeIndexPage(rel, blkno);
+			stats->pages_free++;
+			if (new_nblocks == nblocks)
+				new_nblocks = blkno;
 		}
+		else
+			new_nblocks = nblocks;
+
+		UnlockReleaseBuffer(buf);
 	}
-}
 
-static void
-fill_reaped(bmvacstate *state, uint64 start, uint64 end)
-{
-	uint64 len = end - start;
+	IndexFreeSpaceMapVacuum(rel);
 
-	elog(NOTICE, "inserting fill worked for "
-	 "reaped tids, from (%i, %i) to (%i, %i)",
-			 BM_INT_GET_BLOCKNO(start),
-			 BM_INT_GET_OFFSET(start),
-			 BM_INT_GET_BLOCKNO(end),
-			 BM_INT_GET_OFFSET(end));
-	if (len < BM_WORD_SIZE)
+	/*
+	 * Truncating needs the index to ourselves. Parallel workers can't take
+	 * such a lock, and we don't wait for one.
+	 */
+	if (new_nblocks < nblocks && !IsParallelWorker() &&
+		ConditionalLockRelation(rel, AccessExclusiveLock))
 	{
-		if (IS_FILL_WORD(state->curbm->hwords, state->writewordno))
+		/*
+		 * Pages may have been taken from the free space map, or the index
+		 * extended, since we looked: go over the tail again.
+		 */
+		nblocks = RelationGetNumberOfBlocks(rel);
+		for (blkno = new_nblocks; blkno < nblocks; blkno++)
 		{
-			if (GET_FILL_BIT(state->curbm->cwords[state->writewordno]) == 0 ||
-				state->curbm->cwords[state->writewordno])
-			{
-				/* 
-				 * Consuming a word is enough to insert the fill, because the
-				 * length is less than BM_WORD_SIZE.
-				 */
-				progress_write_pos(state);
-			}
-			else
-			{
-				/* match fill */
-				progress_write_pos(state);
-			}
+			Buffer		buf = _bitmap_getbuf(rel, blkno, BM_READ);
+			bool		recyclable = _bitmap_page_recyclable(BufferGetPage(buf));
+
+			_bitmap_relbuf(buf);
+			if (!recyclable)
+				new_nblocks = blkno + 1;
 		}
-		else
+
+		if (new_nblocks < nblocks)
 		{
-			/* 
-			 * Literal word. Check if we can pull all the non-matches in this
-			 * word.
-			 */
-			if (((start % BM_WORD_SIZE) - 1) + len > BM_WORD_SIZE)
-			{
-				progress_write_pos(state);
-			}
+			RelationTruncate(rel, new_nblocks);
+			stats->pages_free -= nblocks - new_nblocks;
+			stats->pages_deleted -= nblocks - new_nblocks;
 		}
+
+		UnlockRelation(rel, AccessExclusiveLock);
 	}
-	else
+}
+
+/*
+ * _bitmap_compact_vector() -- rewrite a fragmented bitmap vector into
+ *	consecutive pages.
+ *
+ * The words of the vector are re-encoded on the way: literal words of all
+ * zeroes or all ones become fill words, and neighbouring fill words of the
+ * same bit are merged, across page boundaries too. The fragmentation of
+ * the vector is the larger of the share of its pages the re-encoded words
+ * would save, and the share of its page links that do not lead to the next
+ * block. Vectors less fragmented than min_fragmentation are left alone.
+ *
+ * The new pages can't be reached before the LOV item is pointed at them,
+ * which is done in one go. Scans keep the LOV buffer of each vector they
+ * read pinned until they end (see _bitmap_initscanpos()), so once we hold
+ * a cleanup lock on it no scan is walking the old pages, and they can be
+ * deleted right away. If we can't have a cleanup lock without waiting, the
+ * vector is skipped.
+ *
+ * Returns true if the vector was rewritten.
+ */
+bool
+_bitmap_compact_vector(Relation rel, BlockNumber lovBlock,
+					   OffsetNumber lovOffset, double min_fragmentation)
+{
+	ItemPointerData	lovItemTid;
+	Buffer		lovBuffer;
+	Page		lovPage;
+	BMLOVItem	lovItem;
+	BM_WORD	   *words = NULL;
+	bool	   *fills = NULL;
+	uint32		nwords = 0;
+	uint32		maxwords = 0;
+	BlockNumber *oldpages = NULL;
+	uint32		noldpages = 0;
+	uint32		maxoldpages = 0;
+	uint32		nbreaks = 0;
+	uint32		npages;
+	double		fragmentation = 0;
+	BlockNumber	blkno;
+	BlockNumber	newHead;
+	Buffer		bitmapBuffer;
+	uint64		tidLocation = 0;
+	uint32		i;
+
+	/* the delta pages would be left behind otherwise */
+	_bitmap_fold_deltas(rel, lovBlock, lovOffset, NULL, NULL, NULL);
+
+	/* keep inserts off the vector; see insert_tid() */
+	ItemPointerSet(&lovItemTid, lovBlock, lovOffset);
+	LockTuple(rel, &lovItemTid, ExclusiveLock);
+
+	lovBuffer = _bitmap_getbuf(rel, lovBlock, BM_NOLOCK);
+	if (!ConditionalLockBufferForCleanup(lovBuffer))
+	{
+		ReleaseBuffer(lovBuffer);
+		UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+		return false;
+	}
+	lovPage = BufferGetPage(lovBuffer);
+	lovItem = (BMLOVItem) PageGetItem(lovPage,
+									  PageGetItemId(lovPage, lovOffset));
+
+	/* read the words of the vector, re-encoding them as we go */
+	for (blkno = lovItem->bm_lov_head; BlockNumberIsValid(blkno);)
 	{
-		/* Fill and non-fill word */
-		BM_WORD fillword = BM_MAKE_FILL_WORD(0, len / BM_WORD_SIZE);
-		if (IS_FILL_WORD(state->curbm->hwords, state->writewordno))
+		Buffer		buf = _bitmap_getbuf(rel, blkno, BM_READ);
+		Page		page = BufferGetPage(buf);
+		BMPageOpaque opaque = (BMPageOpaque) PageGetSpecialPointer(page);
+		BMBitmapVectorPage bitmap = (BMBitmapVectorPage) PageGetContents(page);
+		BlockNumber	next;
+
+		/* re-encoding never takes more words than it reads */
+		if (nwords + opaque->bm_hrl_words_used > maxwords)
 		{
-			if (GET_FILL_BIT(state->curbm->cwords[state->writewordno]) == 0 ||
-				state->curbm->cwords[state->writewordno] == 0)
-			{
-				BM_WORD curword = state->curbm->cwords[state->writewordno];
-				if (FILL_LENGTH(curword) + FILL_LENGTH(fillword) <
-					MAX_FILL_LENGTH)
-				{
-					state->curbm->cwords[state->writewordno] += fillword;
-				}
-				else
-				{
-					fillword -= MAX_FILL_LENGTH -
-						state->curbm->cwords[state->writewordno];
-					progress_write_pos(state);
-					state->curbm->cwords[state->writewordno] = fillword;
-					HEADER_SET_FILL_BIT_ON(state->curbm->hwords,
-										   state->writewordno);
-				}
-				len = len % BM_WORD_SIZE;
-				if (len)
-				{
-					progress_write_pos(state);
-				}
-			}
+			maxwords = Max(maxwords * 2, nwords + BM_NUM_OF_HRL_WORDS_PER_PAGE);
+			words = (words == NULL) ?
+				(BM_WORD *) palloc(maxwords * sizeof(BM_WORD)) :
+				(BM_WORD *) repalloc(words, maxwords * sizeof(BM_WORD));
+			fills = (fills == NULL) ?
+				(bool *) palloc(maxwords * sizeof(bool)) :
+				(bool *) repalloc(fills, maxwords * sizeof(bool));
 		}
-		else
+		if (noldpages == maxoldpages)
 		{
-			progress_write_pos(state);
-			state->curbm->cwords[state->writewordno] = fillword;
-			HEADER_SET_FILL_BIT_ON(state->curbm->hwords,
-								   state->writewordno);
+			maxoldpages = Max(maxoldpages * 2, 16);
+			oldpages = (oldpages == NULL) ?
+				(BlockNumber *) palloc(maxoldpages * sizeof(BlockNumber)) :
+				(BlockNumber *) repalloc(oldpages,
+										 maxoldpages * sizeof(BlockNumber));
 		}
+
+		for (i = 0; i < opaque->bm_hrl_words_used; i++)
+			compact_append_word(words, fills, &nwords, bitmap->cwords[i],
+								IS_FILL_WORD(bitmap->hwords, i));
+
+		/* pages are not in block order, so stop at the tail */
+		next = (blkno == lovItem->bm_lov_tail) ?
+			InvalidBlockNumber : opaque->bm_bitmap_next;
+		if (BlockNumberIsValid(next) && next != blkno + 1)
+			nbreaks++;
+
+		oldpages[noldpages++] = blkno;
+		_bitmap_relbuf(buf);
+		blkno = next;
 	}
-}
 
-static void
-vacuum_fill_word(bmvacstate *state, bmVacType vactype)
-{
-	BM_WORD word = vactype_get_word(state, vactype);
+	npages = Max(1, (nwords + BM_NUM_OF_HRL_WORDS_PER_PAGE - 1) /
+				 BM_NUM_OF_HRL_WORDS_PER_PAGE);
+	if (noldpages > 1)
+		fragmentation = Max(1.0 - (double) npages / noldpages,
+							(double) nbreaks / (noldpages - 1));
 
-	/*
-	 * If the fill word is for non-matches, we do not have to
-	 * check if there are any reaped TIDs. There wont be by
-	 * definition.
-	 */
-	elog(NOTICE, "new word is FILL: %i", word);
-	
-	/* only vacuum non-match fill words if this is a physical page */
-	if (GET_FILL_BIT(word) == 0 && vactype == BM_VAC_PAGE)
+	if (fragmentation <= 0 || fragmentation < min_fragmentation)
 	{
-		/* skip over */
-		elog(NOTICE, "new word is non-match fill");
-
-		/* if the current read pos is the same as the write pos, do nothing */
-		if (state->readwordno != state->writewordno)
+		_bitmap_relbuf(lovBuffer);
+		UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+		if (words != NULL)
 		{
-			state->curbm->cwords[state->writewordno] = word;
-			HEADER_SET_FILL_BIT_ON(state->curbm->hwords, state->writewordno);
-			
+			pfree(words);
+			pfree(fills);
 		}
-		progress_write_pos(state);
-		try_shrink_bitmap(state);
+		if (oldpages != NULL)
+			pfree(oldpages);
+		return false;
 	}
-	else if (GET_FILL_BIT(word) == 1)
-	{
-		/*
-		 * XXX: the call back does not take advantage of the
-		 * fact that we know that this is a range of matches. In
-		 * the future, we might have a different call back which
-		 * can use a better search algorithm. For now, play
-		 * dumb.
-		 */
-		bool found_reaped = false;
-		uint64 start_setbit = state->cur_bitpos; /* start of match range */
-		uint64 end = state->cur_bitpos + 
-			(FILL_LENGTH(word) * BM_WORD_SIZE);
 
-		state->start_reaped = 0;
-		
-		elog(NOTICE, "new word is match fill");
+	/*
+	 * The new pages come from one extent. What is left of the extent the
+	 * vector had reserved will do if it is large enough.
+	 */
+	if (lovItem->bm_extent_next != InvalidBlockNumber &&
+		lovItem->bm_extent_next + npages > lovItem->bm_extent_end)
+		release_extent(rel, lovBuffer, lovItem);
 
-		elog(NOTICE, "testing match fill range. start = (%i, %i) "
-			 "end = (%i, %i)",
-			 BM_INT_GET_BLOCKNO(state->cur_bitpos),
-			 BM_INT_GET_OFFSET(state->cur_bitpos),
-			 BM_INT_GET_BLOCKNO(end),
-			 BM_INT_GET_OFFSET(end));
+	bitmapBuffer = _bitmap_alloc_bitmappage(rel, lovBuffer, lovItem,
+											npages, false);
+	newHead = BufferGetBlockNumber(bitmapBuffer);
 
-		while (state->cur_bitpos < end)
+	for (i = 0;; i++)
+	{
+		Page		page = BufferGetPage(bitmapBuffer);
+		BMPageOpaque opaque = (BMPageOpaque) PageGetSpecialPointer(page);
+		BMBitmapVectorPage bitmap = (BMBitmapVectorPage) PageGetContents(page);
+		uint32		first = i * BM_NUM_OF_HRL_WORDS_PER_PAGE;
+		uint32		nused = Min(nwords - first, BM_NUM_OF_HRL_WORDS_PER_PAGE);
+		Buffer		nextBuffer = InvalidBuffer;
+		uint32		wordNo;
+
+		if (i + 1 < npages)
+			nextBuffer = _bitmap_alloc_bitmappage(rel, lovBuffer, lovItem,
+												  npages - i - 1, false);
+
+		START_CRIT_SECTION();
+
+		MemSet(bitmap->hwords, 0, sizeof(bitmap->hwords));
+		for (wordNo = 0; wordNo < nused; wordNo++)
 		{
-			ItemPointerData tid;
-
-			ItemPointerSet(&tid, BM_INT_GET_BLOCKNO(state->cur_bitpos),
-						  BM_INT_GET_OFFSET(state->cur_bitpos)); 
-			
-			elog(NOTICE, "testing fill tid (%i, %i)",
-				 BM_INT_GET_BLOCKNO(state->cur_bitpos),
-				 BM_INT_GET_OFFSET(state->cur_bitpos));
-
-			if (state->callback(&tid, state->callback_state))
+			bitmap->cwords[wordNo] = words[first + wordNo];
+			if (fills[first + wordNo])
 			{
-				elog(NOTICE, "tid is reaped");
-				/* 
-				 * We found a match. We don't just break the fill
-				 * word in to three. Instead, we shrink the
-				 * original fill word and continue to loop
-				 * until we find a set bit which isn't reaped,
-				 * then we'll add a word reflecting the non-matches.
-				 */
-				
-				found_reaped = true;
-				
-				fill_matched(state, start_setbit, state->cur_bitpos - 1);
-				if (!state->start_reaped)
-				{
-					state->start_reaped = state->cur_bitpos;
-					start_setbit = 0;
-				}
+				bitmap->hwords[wordNo / BM_WORD_SIZE] |=
+					WORDNO_GET_HEADER_BIT(wordNo);
+				tidLocation += FILL_LENGTH(words[first + wordNo]) *
+					BM_WORD_SIZE;
 			}
 			else
-			{
-				/*
-				 * If we're already seen a range of reaped TIDs, fill those in
-				 * on the current word.
-				 */
-				if (state->start_reaped && 
-					state->start_reaped < state->cur_bitpos - 1)
-				{
-					/* 
-					 * insert fill word. remember, previous word
-					 * might have been a fill word which we can
-					 * extend.
-					 */
-					fill_reaped(state, state->start_reaped, 
-								state->cur_bitpos - 1);
-					
-					state->start_reaped = 0;
-					Assert(start_setbit == 0);
-					start_setbit = state->cur_bitpos;
-				}
-				else
-				{
-					if (start_setbit == 0)
-						start_setbit = state->cur_bitpos;
-				}
+				tidLocation += BM_WORD_SIZE;
+		}
+		opaque->bm_hrl_words_used = nused;
+		opaque->bm_last_tid_location = tidLocation;
+		opaque->bm_bitmap_next = BufferIsValid(nextBuffer) ?
+			BufferGetBlockNumber(nextBuffer) : InvalidBlockNumber;
+		MarkBufferDirty(bitmapBuffer);
 
-				/* XXX: just do this logically!!! */
-				word |= 1 << ((state->cur_bitpos % BM_WORD_SIZE) - 1);
-				state->curbm->cwords[state->writewordno] = word;
+		END_CRIT_SECTION();
 
-				try_shrink_bitmap(state);
+		if (!BufferIsValid(nextBuffer))
+			break;
+		_bitmap_relbuf(bitmapBuffer);
+		bitmapBuffer = nextBuffer;
+	}
 
-				/* roll over to a new word if need be */
-				if (!IS_FILL_WORD(state->curbm->hwords, state->writewordno) &&
-					(state->cur_bitpos % BM_WORD_SIZE) == 0)
-				{
-					progress_write_pos(state);
-				}
-				state->last_setbit = state->cur_bitpos;
-			}
-			state->cur_bitpos++;
-		}
-		if (!found_reaped)
-		{
-			elog(NOTICE, "didn't reap any, copy directly");
-			/* only do this if we've got an on page word */
-			if (vactype == BM_VAC_PAGE)
-			{
-				state->curbm->cwords[state->writewordno] = word;
-				HEADER_SET_FILL_BIT_ON(state->curbm->hwords,
-									   state->writewordno);
-			}
-			return;
-		}
-		else if(start_setbit)
-		{
-			fill_matched(state, start_setbit, state->cur_bitpos - 1);
-		}
-		else if(state->start_reaped)
-		{
-			fill_reaped(state, state->start_reaped,	state->cur_bitpos - 1);
-		}
+	/* switch the vector over to the new pages */
+	START_CRIT_SECTION();
+	lovItem->bm_lov_head = newHead;
+	lovItem->bm_lov_tail = BufferGetBlockNumber(bitmapBuffer);
+	lovItem->bm_npages = npages;
+	MarkBufferDirty(lovBuffer);
+	END_CRIT_SECTION();
 
-		/* 
-		 * If this is last complete word or last word, we've just put the data
-		 * for that word on the physical page so get it back.
-		 */
-		if (vactype == BM_VAC_LAST_COMPWORD || 
-			vactype == BM_VAC_LAST_WORD)
-		{
-			BM_WORD newword = state->curbm->cwords[state->writewordno];
+	_bitmap_relbuf(bitmapBuffer);
+	_bitmap_relbuf(lovBuffer);
+	UnlockTuple(rel, &lovItemTid, ExclusiveLock);
 
-			switch(vactype)
-			{
-				case BM_VAC_LAST_COMPWORD:
-					state->curlov->bm_last_compword = newword;
-					state->curlov->lov_words_header &=
-						BM_LAST_COMPWORD_BIT;
-					break;
-				case BM_VAC_LAST_WORD:
-					state->curlov->bm_last_word = newword;
-					state->curlov->lov_words_header &=
-						BM_LAST_WORD_BIT;
-					break;
-				default:
-					/* wont happen */
-					break;
-			}
+	/* nobody can get to the old pages any more */
+	for (i = 0; i < noldpages; i++)
+	{
+		Buffer		buf = _bitmap_getbuf(rel, oldpages[i], BM_WRITE);
 
-			if (state->writewordno)
-				state->writewordno--;
-		}
+		START_CRIT_SECTION();
+		_bitmap_delete_bitmappage(BufferGetPage(buf));
+		MarkBufferDirty(buf);
+		END_CRIT_SECTION();
+
+		_bitmap_relbuf(buf);
 	}
+
+	pfree(words);
+	pfree(fills);
+	pfree(oldpages);
+
+	return true;
 }
 
 /*
- * Try to merge the current word with the previous word. This is only used
- * for vacuuming so we'll only shrink non-match words.
+ * compact_append_word() -- append a word to a vector being re-encoded.
+ *
+ * Literal words of all zeroes or all ones become fill words, and a fill
+ * word is merged into the word before it if that is a fill word of the
+ * same bit. A fill word covering nothing is dropped.
  */
 static void
-try_shrink_bitmap(bmvacstate *state)
+compact_append_word(BM_WORD *words, bool *fills, uint32 *nwords,
+					BM_WORD word, bool isfill)
 {
-	BM_WORD word = state->curbm->cwords[state->writewordno];
+	BM_WORD		fillBit;
+	BM_WORD		length;
 
-	/* we have no hope if there's no previous word */
-	if (!(state->writewordno >= 1))
-		return;
-	
-	if (word == LITERAL_ALL_ZERO)
+	if (!isfill)
 	{
-		BM_WORD prevword = state->curbm->cwords[state->writewordno - 1];
-		
-		/* check if earlier word was fill too */
-		if (BM_WORD_IS_NON_MATCH_FILL(state->curbm, state->writewordno - 1) &&
-			FILL_LENGTH(prevword) < MAX_FILL_LENGTH)
+		if (word != LITERAL_ALL_ZERO && word != LITERAL_ALL_ONE)
 		{
-			state->curbm->cwords[state->writewordno - 1]++;
-			/* previous word absorbed current word, so step back a word */
-			state->writewordno--;
-		}
-		else
-		{
-			state->curbm->cwords[state->writewordno] =
-				BM_MAKE_FILL_WORD(0, 1);
-			HEADER_SET_FILL_BIT_OFF(state->curbm->hwords,
-									state->writewordno);
+			words[*nwords] = word;
+			fills[(*nwords)++] = false;
+			return;
 		}
+		fillBit = (word == LITERAL_ALL_ONE) ? 1 : 0;
+		length = 1;
 	}
 	else
 	{
-		BM_WORD prevword = state->curbm->cwords[state->writewordno - 1];
+		fillBit = GET_FILL_BIT(word);
+		length = FILL_LENGTH(word);
+		if (length == 0)
+			return;
+	}
 
-		if (!BM_WORD_IS_NON_MATCH_FILL(state->curbm, state->writewordno - 1))
-		   return;
-	
-		if (FILL_LENGTH(word) + FILL_LENGTH(prevword) <= MAX_FILL_LENGTH)
-		{
-			state->curbm->cwords[state->writewordno - 1] +=
-				FILL_LENGTH(word);
-			
-			/* previous word absorbed us, see above */
-			state->writewordno--;
-		}
-		else
+	if (*nwords > 0 && fills[*nwords - 1] &&
+		GET_FILL_BIT(words[*nwords - 1]) == fillBit)
+	{
+		BM_WORD		merged = Min(length, MAX_FILL_LENGTH -
+								 FILL_LENGTH(words[*nwords - 1]));
+
+		words[*nwords - 1] += merged;
+		length -= merged;
+		if (length == 0)
+			return;
+	}
+
+	words[*nwords] = BM_MAKE_FILL_WORD(fillBit, length);
+	fills[(*nwords)++] = true;
+}
+
+/*
+ * release_extent() -- give up the blocks reserved for a vector that it
+ *	has not used yet.
+ *
+ * They are new pages, which vacuum does not recycle (see
+ * _bitmap_page_recyclable()), so they are turned into deleted bitmap
+ * pages. No scan has ever reached them, so they are recyclable at once.
+ * A block that is not new any more is not ours; the index was truncated
+ * and extended again since it was reserved.
+ *
+ * lovBuffer holds lovItem, and is pinned and exclusively locked.
+ */
+static void
+release_extent(Relation rel, Buffer lovBuffer, BMLOVItem lovItem)
+{
+	BlockNumber	nblocks = RelationGetNumberOfBlocks(rel);
+	BlockNumber	blkno;
+
+	for (blkno = lovItem->bm_extent_next;
+		 blkno < lovItem->bm_extent_end && blkno < nblocks; blkno++)
+	{
+		Buffer		buf = _bitmap_getbuf(rel, blkno, BM_WRITE);
+
+		if (PageIsNew(BufferGetPage(buf)))
 		{
-			/* fill up previous word with non-matches and shrink current word */
-			int16 diff = MAX_FILL_LENGTH - FILL_LENGTH(prevword);
-			state->curbm->cwords[state->writewordno - 1] += MAX_FILL_LENGTH;
-			state->curbm->cwords[state->writewordno] = word - diff;
+			START_CRIT_SECTION();
+			_bitmap_init_bitmappage(buf);
+			_bitmap_delete_bitmappage(BufferGetPage(buf));
+			BMPageGetDeleteXid(BufferGetPage(buf)) = InvalidFullTransactionId;
+			MarkBufferDirty(buf);
+			END_CRIT_SECTION();
 		}
+
+		_bitmap_relbuf(buf);
 	}
+
+	START_CRIT_SECTION();
+	lovItem->bm_extent_next = lovItem->bm_extent_end = InvalidBlockNumber;
+	lovItem->bm_extent_vacuumed = InvalidBlockNumber;
+	MarkBufferDirty(lovBuffer);
+	END_CRIT_SECTION();
 }
 
+/*
+ * vacuum_extent() -- give up the extent reserved for a vector if the
+ *	vector has not grown into it since the last vacuum.
+ *
+ * Otherwise, remember where the vector is in its extent for the next
+ * vacuum to compare with.
+ */
 static void
-vacuum_literal_word(bmvacstate *state, bmVacType vactype)
+vacuum_extent(Relation rel, BlockNumber lovBlock, OffsetNumber lovOffset)
 {
-	BM_WORD word;
-	uint8 i;
-	BM_WORD match = 1;
+	Buffer		lovBuffer = _bitmap_getbuf(rel, lovBlock, BM_WRITE);
+	Page		lovPage = BufferGetPage(lovBuffer);
+	BMLOVItem	lovItem = (BMLOVItem)
+		PageGetItem(lovPage, PageGetItemId(lovPage, lovOffset));
+
+	if (lovItem->bm_extent_next != InvalidBlockNumber &&
+		lovItem->bm_extent_next == lovItem->bm_extent_vacuumed)
+		release_extent(rel, lovBuffer, lovItem);
+	else if (lovItem->bm_extent_next != lovItem->bm_extent_vacuumed)
+	{
+		START_CRIT_SECTION();
+		lovItem->bm_extent_vacuumed = lovItem->bm_extent_next;
+		MarkBufferDirty(lovBuffer);
+		END_CRIT_SECTION();
+	}
+
+	_bitmap_relbuf(lovBuffer);
+}
 
-	word = vactype_get_word(state, vactype);
+/*
+ * _bitmap_compact() -- compact the fragmented vectors of an index.
+ *
+ * See _bitmap_compact_vector(). The vectors are done one at a time, each
+ * under its own short locks. Returns the number of vectors rewritten.
+ */
+int64
+_bitmap_compact(Relation rel, double min_fragmentation)
+{
+	BMLovScan	scan;
+	BlockNumber	lov_block;
+	OffsetNumber lov_off;
+	int64		ncompacted = 0;
 
-#ifdef DEBUG_BMI
-	elog(NOTICE, "vacuuming literal word %i", word);
-#endif
-	for (i = 0; i < BM_WORD_SIZE; i++)
+	scan = _bitmap_begin_lovscan(rel, false);
+	while (_bitmap_lovscan_next(scan, &lov_block, &lov_off))
 	{
-		match <<= i;
-		state->cur_bitpos++;
-		if (word & match)
-		{
-			ItemPointerData tid;
+		CHECK_FOR_INTERRUPTS();
 
-			ItemPointerSet(&tid, BM_INT_GET_BLOCKNO(state->cur_bitpos),
-						   BM_INT_GET_OFFSET(state->cur_bitpos));
-#ifdef DEBUG_BMI
-			elog(NOTICE, "found match for (%i, %i)",
-				 BM_INT_GET_BLOCKNO(state->cur_bitpos),
-				 BM_INT_GET_OFFSET(state->cur_bitpos));
-#endif
-			if (state->callback(&tid, state->callback_state))
-			{
-				/* turn the bit off, easy as that! */
-				word |= ~match;
-				elog(NOTICE, "inverted match for %i, word = %i",
-					 i, word);
-			}
-			else
-				state->last_setbit = state->cur_bitpos;
-		}
+		if (_bitmap_compact_vector(rel, lov_block, lov_off,
+								   min_fragmentation))
+			ncompacted++;
 	}
-	put_vacuumed_literal_word(state, vactype, word);
+	_bitmap_end_lovscan(scan);
+
+	/* the NULL vector has no LOV heap tuple */
+	if (_bitmap_compact_vector(rel, BM_LOV_STARTPAGE, 1, min_fragmentation))
+		ncompacted++;
+
+	return ncompacted;
 }
 
+/*
+ * vacuum_init_state() -- set up the state of a bulk delete.
+ *
+ * The heap blocks the visibility map shows as all-visible hold no dead
+ * tuples: VACUUM does not set the bit of a page while it has LP_DEAD
+ * items, and the bit is cleared before a tuple on the page is deleted.
+ * The TIDs in those blocks are not passed to the callback at all, so
+ * the work of a bulk delete follows the part of the heap that changed
+ * since the last vacuum rather than the size of the index. The blocks
+ * are looked up once here, not once per vector.
+ */
+static void
+vacuum_init_state(bmvacstate *state, IndexVacuumInfo *info,
+				  IndexBulkDeleteCallback callback, void *callback_state)
+{
+	Relation	heaprel = info->heaprel;
+	Buffer		vmbuffer = InvalidBuffer;
+	BlockNumber	blkno;
+
+	MemSet(state, 0, sizeof(bmvacstate));
+	state->callback = callback;
+	state->callback_state = callback_state;
+
+	if (heaprel == NULL)
+		return;
+
+	state->nblocks = RelationGetNumberOfBlocks(heaprel);
+	state->maybe_dead = (uint8 *)
+		palloc_extended(state->nblocks / 8 + 1,
+						MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+
+	for (blkno = 0; blkno < state->nblocks; blkno++)
+	{
+		if ((visibilitymap_get_status(heaprel, blkno, &vmbuffer) &
+			 VISIBILITYMAP_ALL_VISIBLE) == 0)
+			state->maybe_dead[blkno / 8] |= 1 << (blkno % 8);
+	}
+
+	if (BufferIsValid(vmbuffer))
+		ReleaseBuffer(vmbuffer);
+}
 
 /*
- * Check for a scenario where the next write would overwrite a block we
- * haven't read. Put words at the end of the storage into an overflow 
- * bitmap and shift everything to the right.
+ * vacuum_block_maybe_dead() -- may the given heap block hold dead tuples?
+ *
+ * The blocks added to the heap after the vacuum started do not.
+ */
+static inline bool
+vacuum_block_maybe_dead(bmvacstate *state, BlockNumber blkno)
+{
+	if (state->maybe_dead == NULL)
+		return true;
+	if (blkno >= state->nblocks)
+		return false;
+	return (state->maybe_dead[blkno / 8] & (1 << (blkno % 8))) != 0;
+}
+
+/*
+ * vacuum_check_tid() -- ask the callback about a TID, and add it to the
+ *	dead TIDs of the vector if it is dead.
  */
 static void
-check_page_space(bmvacstate *state)
+vacuum_check_tid(bmvacstate *state, uint64 tidnum)
 {
-	elog(NOTICE, "checking page space: write pos: %i, read pos: %i",
-		 state->writewordno, state->readwordno);
-
-	if (state->writewordno > state->readwordno)
-	{
-		/* 
-		 * We need to free up some space. There are two scenarios here:
-		 * the page might not actually be full so we just shift things to
-		 * the right and not worry about overflow; otherwise, the page is
-		 * full so we just move the remaining words off the page into a new
-		 * one and just tie things together. This is potentially inefficient
-		 * but alternative methods require a lot of code. 
-		 */
-		uint16 from = 0;
-		uint16 diff = 0;
-		uint16 ovrflwwords = 0; /* number of words to put into overflow */
+	ItemPointerData	htid;
 
-		/* first case */
-		if (state->curbmo->bm_hrl_words_used < BM_NUM_OF_HRL_WORDS_PER_PAGE)
-		{
-			diff = BM_NUM_OF_HRL_WORDS_PER_PAGE - 
-				state->curbmo->bm_hrl_words_used;
-			from = state->readwordno;
-
-			/* XXX: is there an off by one here? */
-			memmove(&(state->curbm->cwords[from + diff]),
-					&(state->curbm->cwords[state->readwordno]),
-					state->curbmo->bm_hrl_words_used - from);
-			memmove(&(state->curbm->hwords[(from + diff)/BM_WORD_SIZE]),
-					&(state->curbm->hwords[from/BM_WORD_SIZE]),
-				    (state->curbmo->bm_hrl_words_used - from)/BM_WORD_SIZE);
-			/* 
-			 * Now, we must change to read position to point to the new
-			 * current word.
-			 */
-			state->readwordno += diff;
-		}
-		else
-		{
-			
-	   		/*
-		 	 * We can't do this the easy way,time to free some up. We take 
-		 	 * BM_WORD_SIZE number of words at a time, because it's 
-		 	 * convenient for managing the header: we just need to copy a 
-		 	 * single word.
-			 */
+	ItemPointerSet(&htid, BM_INT_GET_BLOCKNO(tidnum),
+				   BM_INT_GET_OFFSET(tidnum));
+	if (!state->callback(&htid, state->callback_state))
+		return;
 
-			diff = 
-				BM_NUM_OF_HRL_WORDS_PER_PAGE - state->readwordno;
-			if (diff > BM_WORD_SIZE)
-				ovrflwwords = diff = BM_WORD_SIZE;
-			else
-				ovrflwwords = diff;
-		}
+	if (state->ndead == state->maxdead)
+	{
+		state->maxdead = Max(state->maxdead * 2, 1024);
+		state->dead = (state->dead == NULL) ?
+			(uint64 *) palloc(state->maxdead * sizeof(uint64)) :
+			(uint64 *) repalloc_huge(state->dead,
+									 state->maxdead * sizeof(uint64));
+	}
+	state->dead[state->ndead++] = tidnum;
+}
 
-		/* copy to overflow, if instructed */
-		if (ovrflwwords)
+/*
+ * vacuum_collect_word() -- collect the dead TIDs among the set bits of a
+ *	word that follows tidLocation in its vector.
+ *
+ * A fill word of ones skips over the blocks that hold no dead tuples a
+ * block at a time.
+ */
+static void
+vacuum_collect_word(bmvacstate *state, BM_WORD word, bool isfill,
+					uint64 tidLocation)
+{
+	uint64		tidnum;
+	uint64		last;
+	int			i;
+
+	if (!isfill)
+	{
+		for (i = 0; i < BM_WORD_SIZE; i++)
 		{
-			uint16 oo = state->ovrflwwordno;
-			state->ovrflw.hwords[oo/BM_WORD_SIZE] =	
-				state->curbm->hwords[from/BM_WORD_SIZE];
-			
-			memcpy(&(state->ovrflw.cwords[oo]),
-				   &(state->curbm->hwords[from]),
-				   diff * sizeof(BM_WORD));
+			if ((word & (((BM_WORD) 1) << i)) == 0)
+				continue;
+			tidnum = tidLocation + i + 1;
+			if (vacuum_block_maybe_dead(state, BM_INT_GET_BLOCKNO(tidnum)))
+				vacuum_check_tid(state, tidnum);
 		}
-		/* XXX: is there an off by one here? */
-		memmove(&(state->curbm->cwords[from + diff]),
-				&(state->curbm->cwords[from]),
-				diff);
+		return;
+	}
 
-		state->curbm->hwords[(from + diff)] = state->curbm->hwords[from];
+	if (GET_FILL_BIT(word) == 0)
+		return;
 
-		state->readwordno += diff;
+	last = tidLocation + FILL_LENGTH(word) * BM_WORD_SIZE;
+	for (tidnum = tidLocation + 1; tidnum <= last;)
+	{
+		BlockNumber	blkno = BM_INT_GET_BLOCKNO(tidnum);
+
+		if (!vacuum_block_maybe_dead(state, blkno))
+		{
+			tidnum = (uint64) (blkno + 1) * BM_MAX_HTUP_PER_PAGE + 1;
+			continue;
+		}
+		vacuum_check_tid(state, tidnum);
+		tidnum++;
 	}
 }
 
-
-/* 
- * Progress the write position pointer, filling the word with non-matches
- * and ensuring the write pointer doesn't overtake the read pointer.
+/*
+ * vacuum_count_word() -- the number of set bits in a word of a vector.
  */
+static uint64
+vacuum_count_word(BM_WORD word, bool isfill)
+{
+	if (isfill)
+		return (GET_FILL_BIT(word) == 1) ?
+			(uint64) FILL_LENGTH(word) * BM_WORD_SIZE : 0;
+	return pg_popcount32((uint32) word);
+}
 
+/*
+ * vacuum_append_word() -- append a word to the words being rewritten.
+ */
 static void
-progress_write_pos(bmvacstate *state)
+vacuum_append_word(bmvacwords *out, BM_WORD word, bool isfill)
 {
-	state->writewordno++;
-	check_page_space(state);
-	state->curbm->cwords[state->writewordno] = LITERAL_ALL_ZERO;
-	HEADER_SET_FILL_BIT_OFF(state->curbm->hwords, state->writewordno);
+	if (out->nwords + 1 >= out->maxwords)
+	{
+		out->maxwords = Max(out->maxwords * 2, BM_NUM_OF_HRL_WORDS_PER_PAGE);
+		out->words = (out->words == NULL) ?
+			(BM_WORD *) palloc(out->maxwords * sizeof(BM_WORD)) :
+			(BM_WORD *) repalloc(out->words, out->maxwords * sizeof(BM_WORD));
+		out->fills = (out->fills == NULL) ?
+			(bool *) palloc(out->maxwords * sizeof(bool)) :
+			(bool *) repalloc(out->fills, out->maxwords * sizeof(bool));
+	}
+
+	compact_append_word(out->words, out->fills, &out->nwords, word, isfill);
 }
 
 /*
- * We must vacuum the last_word and last_compword in the LOV item.
+ * vacuum_andnot_word() -- append a word that follows tidLocation in its
+ *	vector to the words being rewritten, with the bits of the dead TIDs
+ *	from *deadNo on that fall in it cleared.
+ *
+ * A fill word of ones is broken up around each word that has dead bits,
+ * which becomes a literal word. The words are re-encoded as they are
+ * appended (see compact_append_word()), so a literal word left with no
+ * bits set joins the fill word of zeroes next to it.
  */
 static void
-vacuum_last_words(bmvacstate *state)
+vacuum_andnot_word(bmvacstate *state, int *deadNo, BM_WORD word,
+				   bool isfill, uint64 tidLocation, bmvacwords *out)
 {
-	/* 
-	 * When initialised, the last complete word is set to LITERAL_ALL_ONE and
-	 * it should never return to that again (because we compress it first).
-	 * See _bitmap_formitem().
-	 */
-#ifdef DEBUG_BMI
-	elog(NOTICE, "vacuuming last words");
-	elog(NOTICE, "comp %i, last %i", state->curlov->bm_last_compword,
-		 state->curlov->bm_last_word);
-#endif
-	if (state->curlov->bm_last_compword != LITERAL_ALL_ONE)
+	uint64		last;
+	uint64		cur;
+
+	last = tidLocation + (isfill ? FILL_LENGTH(word) : 1) * BM_WORD_SIZE;
+	Assert(*deadNo >= state->ndead || state->dead[*deadNo] > tidLocation);
+
+	if (!isfill || GET_FILL_BIT(word) == 0)
 	{
-		/* Is the word fill */
-		if (BM_LAST_COMPWORD_IS_FILL(state->curlov))
+		for (; *deadNo < state->ndead && state->dead[*deadNo] <= last;
+			 (*deadNo)++)
 		{
-			if (GET_FILL_BIT(state->curlov->bm_last_compword) == 1)
-			{
-				elog(NOTICE, "match fill %i",
-					 state->curlov->bm_last_compword);
-			}
-			/* If non-match fill, there's nothing to do */
-		}
-		else
-		{
-			vacuum_literal_word(state, BM_VAC_LAST_COMPWORD);
+			if (!isfill)
+				word &= ~(((BM_WORD) 1) <<
+						  ((state->dead[*deadNo] - 1) % BM_WORD_SIZE));
 		}
+		vacuum_append_word(out, word, isfill);
+		return;
 	}
 
-	/* 
-	 * Now, we do the non-complete word. If it has no matches, don't 
-	 * examine it.
-	 */
-	
-	if (state->curlov->bm_last_word != 0)
+	for (cur = tidLocation;
+		 *deadNo < state->ndead && state->dead[*deadNo] <= last;)
 	{
-		if (BM_LASTWORD_IS_FILL(state->curlov))
-			vacuum_fill_word(state, BM_VAC_LAST_WORD);
-		else
-			vacuum_literal_word(state, BM_VAC_LAST_WORD);
+		uint64		wordLocation;
+		BM_WORD		literal = LITERAL_ALL_ONE;
+
+		wordLocation = ((state->dead[*deadNo] - 1) / BM_WORD_SIZE) *
+			BM_WORD_SIZE;
+		if (wordLocation > cur)
+			vacuum_append_word(out,
+							   BM_MAKE_FILL_WORD(1, (wordLocation - cur) /
+												 BM_WORD_SIZE),
+							   true);
+
+		for (; *deadNo < state->ndead &&
+			 state->dead[*deadNo] <= wordLocation + BM_WORD_SIZE;
+			 (*deadNo)++)
+			literal &= ~(((BM_WORD) 1) <<
+						 ((state->dead[*deadNo] - 1) % BM_WORD_SIZE));
+		vacuum_append_word(out, literal, false);
+
+		cur = wordLocation + BM_WORD_SIZE;
 	}
 
-	/* 
-	 * If the last comp word and last word represent non-matches, we can
-	 * truncate the bitmap.
-	 */
-	/* XXX: todo */
+	if (last > cur)
+		vacuum_append_word(out,
+						   BM_MAKE_FILL_WORD(1, (last - cur) / BM_WORD_SIZE),
+						   true);
 }
 
-static BM_WORD
-vactype_get_word(bmvacstate *state, bmVacType type)
+/*
+ * vacuum_set_words() -- set the words of a bitmap page to words
+ *	[first, first + nwords) of out, and return the location of the last
+ *	bit of the page, given the location before its first word.
+ */
+static uint64
+vacuum_set_words(Buffer bitmapBuffer, bmvacwords *out, uint32 first,
+				 uint32 nwords, uint64 tidLocation, BlockNumber next)
 {
-	switch(type)
+	Page		page = BufferGetPage(bitmapBuffer);
+	BMPageOpaque opaque = (BMPageOpaque) PageGetSpecialPointer(page);
+	BMBitmapVectorPage bitmap = (BMBitmapVectorPage) PageGetContents(page);
+	uint32		wordNo;
+
+	START_CRIT_SECTION();
+
+	MemSet(bitmap->hwords, 0, sizeof(bitmap->hwords));
+	for (wordNo = 0; wordNo < nwords; wordNo++)
 	{
-		case BM_VAC_PAGE:
-			return state->curbm->cwords[state->readwordno];
-			break;
-		case BM_VAC_LAST_COMPWORD:
-			return state->curlov->bm_last_compword;
-			break;
-		case BM_VAC_LAST_WORD:
-			return state->curlov->bm_last_word;
-			break;
-		default:
-			elog(ERROR, "invalid bitmap vacuum state");
-			return 0; /* not reached */
-			break;
+		bitmap->cwords[wordNo] = out->words[first + wordNo];
+		if (out->fills[first + wordNo])
+		{
+			bitmap->hwords[wordNo / BM_WORD_SIZE] |=
+				WORDNO_GET_HEADER_BIT(wordNo);
+			tidLocation += FILL_LENGTH(out->words[first + wordNo]) *
+				BM_WORD_SIZE;
+		}
+		else
+			tidLocation += BM_WORD_SIZE;
 	}
-	
+	opaque->bm_hrl_words_used = nwords;
+	opaque->bm_last_tid_location = tidLocation;
+	opaque->bm_bitmap_next = next;
+	MarkBufferDirty(bitmapBuffer);
+
+	END_CRIT_SECTION();
+
+	return tidLocation;
 }
 
+/*
+ * vacuum_page() -- clear the bits of the dead TIDs in a bitmap page whose
+ *	first word follows tidLocation.
+ *
+ * Breaking up fill words may take more words than fit in the page. The
+ * rest go to new pages, which are filled before the page is rewritten to
+ * link to them, so a scan reads either the old page or all of the new
+ * ones.
+ *
+ * lovBuffer holds lovItem, and it and bitmapBuffer are exclusively
+ * locked.
+ */
 static void
-put_vacuumed_literal_word(bmvacstate *state, bmVacType type, BM_WORD word)
+vacuum_page(bmvacstate *state, Relation rel, Buffer lovBuffer,
+			BMLOVItem lovItem, Buffer bitmapBuffer, uint64 tidLocation,
+			int *deadNo, bmvacwords *out)
 {
-	switch(type)
+	Page		page = BufferGetPage(bitmapBuffer);
+	BMPageOpaque opaque = (BMPageOpaque) PageGetSpecialPointer(page);
+	BMBitmapVectorPage bitmap = (BMBitmapVectorPage) PageGetContents(page);
+	BlockNumber	next = opaque->bm_bitmap_next;
+	uint64		location = tidLocation;
+	Buffer	   *newBuffers;
+	uint32		nnew;
+	uint32		wordNo;
+	uint32		i;
+
+	out->nwords = 0;
+	for (wordNo = 0; wordNo < opaque->bm_hrl_words_used; wordNo++)
 	{
-		case BM_VAC_PAGE:
-			state->curbm->cwords[state->writewordno] = word;
-			HEADER_SET_FILL_BIT_OFF(state->curbm->hwords, state->writewordno);
-			try_shrink_bitmap(state);
-			break;
-		case BM_VAC_LAST_COMPWORD:
-			state->curlov->bm_last_compword = word;
-			state->curlov->lov_words_header &= ~BM_LAST_COMPWORD_BIT;
-			break;
-		case BM_VAC_LAST_WORD:
-			state->curlov->bm_last_word = word;
-			state->curlov->lov_words_header &= ~BM_LAST_WORD_BIT;
-			break;
-		default:
-			elog(ERROR, "invalid bitmap vacuum state");
-			break;
-	}		
+		BM_WORD		word = bitmap->cwords[wordNo];
+		bool		isfill = IS_FILL_WORD(bitmap->hwords, wordNo);
+
+		vacuum_andnot_word(state, deadNo, word, isfill, location, out);
+		location += (isfill ? FILL_LENGTH(word) : 1) * BM_WORD_SIZE;
+	}
+
+	if (out->nwords <= BM_NUM_OF_HRL_WORDS_PER_PAGE)
+	{
+		vacuum_set_words(bitmapBuffer, out, 0, out->nwords, tidLocation,
+						 next);
+		return;
+	}
+
+	nnew = (out->nwords - 1) / BM_NUM_OF_HRL_WORDS_PER_PAGE;
+	newBuffers = (Buffer *) palloc(nnew * sizeof(Buffer));
+	for (i = 0; i < nnew; i++)
+		newBuffers[i] = _bitmap_alloc_bitmappage(rel, lovBuffer, NULL, 1,
+												 false);
+
+	/* the new pages, which nobody can reach yet */
+	location = tidLocation;
+	for (wordNo = 0; wordNo < BM_NUM_OF_HRL_WORDS_PER_PAGE; wordNo++)
+		location += (out->fills[wordNo] ?
+					 FILL_LENGTH(out->words[wordNo]) : 1) * BM_WORD_SIZE;
+	for (i = 0; i < nnew; i++)
+	{
+		uint32		first = (i + 1) * BM_NUM_OF_HRL_WORDS_PER_PAGE;
+
+		location = vacuum_set_words(newBuffers[i], out, first,
+									Min(out->nwords - first,
+										BM_NUM_OF_HRL_WORDS_PER_PAGE),
+									location,
+									(i + 1 < nnew) ?
+									BufferGetBlockNumber(newBuffers[i + 1]) :
+									next);
+	}
+
+	/* and then the page that links them in */
+	vacuum_set_words(bitmapBuffer, out, 0, BM_NUM_OF_HRL_WORDS_PER_PAGE,
+					 tidLocation, BufferGetBlockNumber(newBuffers[0]));
+
+	START_CRIT_SECTION();
+	if (lovItem->bm_lov_tail == BufferGetBlockNumber(bitmapBuffer))
+		lovItem->bm_lov_tail = BufferGetBlockNumber(newBuffers[nnew - 1]);
+	lovItem->bm_npages += nnew;
+	MarkBufferDirty(lovBuffer);
+	END_CRIT_SECTION();
+
+	for (i = 0; i < nnew; i++)
+		_bitmap_relbuf(newBuffers[i]);
+	pfree(newBuffers);
 }
 
-#if 0
 /*
- * Either prepend or append overflow data to the current bitmap page.
+ * vacuum_last_words() -- clear the bits of the dead TIDs from *deadNo on
+ *	in the last two words of a vector, kept in its LOV item.
+ *
+ * When the last complete word is a fill word broken up into several, all
+ * but the last of them go to the tail buffer, whose words a scan reads
+ * together with the last words. If they do not fit there, they are
+ * appended to the bitmap pages instead; that needs no scan to hold the
+ * LOV page pinned, since a scan that has read the last bitmap page but
+ * not yet the LOV item would miss them. We are holding the LOV item's
+ * tuple lock, which an insert by a scan's backend may be waiting for, so
+ * we do not wait for the pins: if another backend holds one, nothing is
+ * changed and false is returned. Otherwise returns true. A scan holds
+ * the pin only while bmgetbitmap() builds its bitmap.
+ *
+ * lovBuffer holds lovItem, and is exclusively locked, also on return. The
+ * tail buffer is empty.
  */
-static void
-merge_ovrflw(bmvacstate *state, bool append)
+static bool
+vacuum_last_words(bmvacstate *state, Relation rel, Buffer lovBuffer,
+				  BMLOVItem lovItem, int *deadNo, bmvacwords *out)
 {
-	uint16 start; /* start offset into the overflow */
-	Buffer nbuf;
+	uint64		location = lovItem->bm_last_tid_location;
+	BM_WORD		lastWord = lovItem->bm_last_word;
 
-	/*
-	 * If the current page hasn't used all of the available words, absorb those.
-	 * Push any overflow into the overflow section.
-	 */
+	Assert(lovItem->bm_tail_nwords == 0);
 
-	if (state->writewordno < (BM_NUM_OF_HRL_WORDS_PER_PAGE - 1))
+	if (lovItem->bm_last_compword != LITERAL_ALL_ONE ||
+		BM_LAST_COMPWORD_IS_FILL(lovItem))
 	{
+		BM_WORD		compword = lovItem->bm_last_compword;
+		bool		isfill = BM_LAST_COMPWORD_IS_FILL(lovItem);
+		uint64		compLocation;
+		uint32		nwords;
+		uint32		wordNo;
 
+		compLocation = location -
+			(isfill ? FILL_LENGTH(compword) : 1) * BM_WORD_SIZE;
 
+		out->nwords = 0;
+		vacuum_andnot_word(state, deadNo, compword, isfill, compLocation,
+						   out);
+		nwords = out->nwords - 1;
 
-	}	
-
-			if (BlockNumberIsValid(state->curbmo->bm_bitmap_next))
+		if (nwords > lovItem->bm_tail_size)
+		{
+			LockBuffer(lovBuffer, BUFFER_LOCK_UNLOCK);
+			if (!ConditionalLockBufferForCleanup(lovBuffer))
 			{
-				nbuf = _bitmap_getbuf(vacinfo.info->index,
-									  state->curbmo->bm_bitmap_next,
-									  BM_WRITE);
-				elog(NOTICE, "adding overflow to %u",
-					 state->curbmo->bm_bitmap_next);
+				LockBuffer(lovBuffer, BM_WRITE);
+				return false;
 			}
-			else
+			_bitmap_append_bitmapwords(rel, lovBuffer, lovItem, out->words,
+									   out->fills, nwords, compLocation);
+			nwords = 0;
+		}
+
+		START_CRIT_SECTION();
+
+		for (wordNo = 0; wordNo < nwords; wordNo++)
+		{
+			lovItem->bm_tail_words[wordNo] = out->words[wordNo];
+			if (out->fills[wordNo])
 			{
-				/* Argh, we actually need a new page! */
-				nbuf = _bitmap_getbuf(vacinfo.info->index, P_NEW, BM_WRITE);
-		        _bitmap_init_bitmappage(nbuf);
-				state->curlov->bm_lov_tail = state->curbmo->bm_bitmap_next = 
-					BufferGetBlockNumber(nbuf);
-				elog(NOTICE, "adding overflow to new block %u",
-					 state->curbmo->bm_bitmap_next);
+				lovItem->bm_tail_hwords[wordNo / BM_WORD_SIZE] |=
+					WORDNO_GET_HEADER_BIT(wordNo);
+				compLocation += FILL_LENGTH(out->words[wordNo]) *
+					BM_WORD_SIZE;
 			}
+			else
+				compLocation += BM_WORD_SIZE;
+		}
+		if (nwords > 0)
+		{
+			lovItem->bm_tail_nwords = nwords;
+			lovItem->bm_tail_tid_location = compLocation;
+		}
+
+		lovItem->bm_last_compword = out->words[out->nwords - 1];
+		if (out->fills[out->nwords - 1])
+			lovItem->lov_words_header |= BM_LAST_COMPWORD_BIT;
+		else
+			lovItem->lov_words_header &= ~BM_LAST_COMPWORD_BIT;
+		MarkBufferDirty(lovBuffer);
+
+		END_CRIT_SECTION();
+	}
+
+	for (; *deadNo < state->ndead &&
+		 state->dead[*deadNo] <= location + BM_WORD_SIZE; (*deadNo)++)
+		lastWord &= ~(((BM_WORD) 1) <<
+					  ((state->dead[*deadNo] - 1) % BM_WORD_SIZE));
+
+	if (lastWord != lovItem->bm_last_word)
+	{
+		START_CRIT_SECTION();
+		lovItem->bm_last_word = lastWord;
+		MarkBufferDirty(lovBuffer);
+		END_CRIT_SECTION();
+	}
+
+	return true;
 }
-#endif
 
-static void
-vacuum_append_ovrflw_words(bmvacstate *state)
+/*
+ * vacuum_vector() -- remove the dead TIDs from a bitmap vector.
+ *
+ * The set bits of the vector are first checked against the callback
+ * with only the LOV item's tuple lock held, which keeps inserts and
+ * compaction away but lets scans on. Then, if any TID is dead, its bit
+ * is cleared in one pass, which rewrites only the pages that hold dead
+ * bits; a vector with nothing dead is not written at all.
+ *
+ * Returns false if the last words could not be vacuumed for the scans
+ * that hold the LOV page pinned; see vacuum_last_words(). By then the
+ * scans are gone, having been waited for with no lock held, and the
+ * caller is to call us again for the dead TIDs that are left.
+ */
+static bool
+vacuum_vector(bmvacstate *state, Relation rel, BlockNumber lovBlock,
+			  OffsetNumber lovOffset, IndexBulkDeleteResult *stats)
 {
-	Assert(state->readwordno > 0);
+	ItemPointerData	lovItemTid;
+	Buffer		lovBuffer;
+	Page		lovPage;
+	BMLOVItem	lovItem;
+	BlockNumber	blkno;
+	BlockNumber	tail;
+	BM_WORD		compword;
+	bool		compfill;
+	BM_WORD		lastWord;
+	uint64		lastLocation;
+	uint64		tidLocation = 0;
+	uint64		nsetbits = 0;
+	uint64		nlive;
+	uint32		npages = 0;
+	int			deadNo = 0;
+	bmvacwords	out;
+
+	/* keep inserts off the vector; see insert_tid() */
+	ItemPointerSet(&lovItemTid, lovBlock, lovOffset);
+	LockTuple(rel, &lovItemTid, ExclusiveLock);
+
+	lovBuffer = _bitmap_getbuf(rel, lovBlock, BM_WRITE);
+	lovPage = BufferGetPage(lovBuffer);
+	lovItem = (BMLOVItem) PageGetItem(lovPage,
+									  PageGetItemId(lovPage, lovOffset));
+
+	/* only the last two words are left out of the pages */
+	_bitmap_flush_tail_words(rel, lovBuffer, lovItem);
+
+	blkno = lovItem->bm_lov_head;
+	tail = lovItem->bm_lov_tail;
+	compword = lovItem->bm_last_compword;
+	compfill = BM_LAST_COMPWORD_IS_FILL(lovItem);
+	lastWord = lovItem->bm_last_word;
+	lastLocation = lovItem->bm_last_tid_location;
+
+	LockBuffer(lovBuffer, BUFFER_LOCK_UNLOCK);
+
+	/* find the dead TIDs */
+	state->ndead = 0;
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf = _bitmap_getbuf(rel, blkno, BM_READ);
+		Page		page = BufferGetPage(buf);
+		BMPageOpaque opaque = (BMPageOpaque) PageGetSpecialPointer(page);
+		BMBitmapVectorPage bitmap = (BMBitmapVectorPage) PageGetContents(page);
+		uint32		wordNo;
+
+		for (wordNo = 0; wordNo < opaque->bm_hrl_words_used; wordNo++)
+		{
+			BM_WORD		word = bitmap->cwords[wordNo];
+			bool		isfill = IS_FILL_WORD(bitmap->hwords, wordNo);
+
+			vacuum_collect_word(state, word, isfill, tidLocation);
+			nsetbits += vacuum_count_word(word, isfill);
+			tidLocation += (isfill ? FILL_LENGTH(word) : 1) * BM_WORD_SIZE;
+		}
+		npages++;
+
+		blkno = (blkno == tail) ?
+			InvalidBlockNumber : opaque->bm_bitmap_next;
+		_bitmap_relbuf(buf);
+	}
+
+	if (compword != LITERAL_ALL_ONE || compfill)
+	{
+		vacuum_collect_word(state, compword, compfill,
+							lastLocation - (compfill ?
+											FILL_LENGTH(compword) : 1) *
+							BM_WORD_SIZE);
+		nsetbits += vacuum_count_word(compword, compfill);
+	}
+	vacuum_collect_word(state, lastWord, false, lastLocation);
+	nsetbits += vacuum_count_word(lastWord, false);
 
 	/*
-	 * We want to copy BM_WORD_SIZE words at a time but we have to be careful
-	 * of three things: a) we cannot go past BM_NUM_OF_HRL_WORDS_PER_PAGE,
-	 * b) we cannot read past the end of the overflow words
+	 * We have seen every bit of the vector, so correct its statistics.
+	 * The TIDs in its delta pages are not among those bits, though; with
+	 * any of them, only the dead TIDs are taken off the count.
 	 */
+	LockBuffer(lovBuffer, BM_WRITE);
+
+	if (!BlockNumberIsValid(lovItem->bm_delta_head))
+		nlive = nsetbits - state->ndead;
+	else
+		nlive = lovItem->bm_nsetbits -
+			Min(lovItem->bm_nsetbits, (uint64) state->ndead);
+	if (lovItem->bm_nsetbits != nlive || lovItem->bm_npages != npages)
+	{
+		START_CRIT_SECTION();
+		lovItem->bm_nsetbits = nlive;
+		lovItem->bm_npages = npages;
+		MarkBufferDirty(lovBuffer);
+		END_CRIT_SECTION();
+	}
+
+	if (state->ndead == 0)
+	{
+		_bitmap_relbuf(lovBuffer);
+		UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+		stats->num_index_tuples += nlive;
+		return true;
+	}
+
+	/* clear their bits, visiting only the pages that have any */
+	MemSet(&out, 0, sizeof(out));
+
+	tidLocation = 0;
+	for (blkno = lovItem->bm_lov_head;
+		 BlockNumberIsValid(blkno) && deadNo < state->ndead;)
+	{
+		Buffer		buf = _bitmap_getbuf(rel, blkno, BM_WRITE);
+		BMPageOpaque opaque = (BMPageOpaque)
+			PageGetSpecialPointer(BufferGetPage(buf));
+		uint64		lastTid = opaque->bm_last_tid_location;
+
+		/* any pages vacuum_page() adds are done with as well */
+		blkno = (blkno == lovItem->bm_lov_tail) ?
+			InvalidBlockNumber : opaque->bm_bitmap_next;
+
+		if (state->dead[deadNo] <= lastTid)
+			vacuum_page(state, rel, lovBuffer, lovItem, buf, tidLocation,
+						&deadNo, &out);
+
+		tidLocation = lastTid;
+		_bitmap_relbuf(buf);
+	}
 
-}
\ No newline at end of file
+	if (deadNo < state->ndead)
+	{
+		int			pagesDeadNo = deadNo;
+
+		if (!vacuum_last_words(state, rel, lovBuffer, lovItem, &deadNo,
+							   &out))
+		{
+			/*
+			 * The bits cleared in the pages stay cleared. Wait for the
+			 * pins without the tuple lock, so that inserts can go on.
+			 */
+			stats->tuples_removed += pagesDeadNo;
+			LockBuffer(lovBuffer, BUFFER_LOCK_UNLOCK);
+			UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+			LockBufferForCleanup(lovBuffer);
+			_bitmap_relbuf(lovBuffer);
+
+			if (out.words != NULL)
+			{
+				pfree(out.words);
+				pfree(out.fills);
+			}
+			return false;
+		}
+	}
+	Assert(deadNo == state->ndead);
+
+	stats->tuples_removed += state->ndead;
+	stats->num_index_tuples += nlive;
+	stats->pages_newly_deleted +=
+		unlink_empty_bitmappages(rel, lovBuffer, lovItem);
+
+	_bitmap_relbuf(lovBuffer);
+	UnlockTuple(rel, &lovItemTid, ExclusiveLock);
+
+	if (out.words != NULL)
+	{
+		pfree(out.words);
+		pfree(out.fills);
+	}
+
+	return true;
+}
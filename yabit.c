@@ -11,6 +11,25 @@
 #include "catalog/namespace.h"
 #include "miscadmin.h"
 #include "access/amapi.h"
+#include "access/stratnum.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "catalog/index.h"
+#include "catalog/pg_class.h"
+#include "commands/defrem.h"
+#include "commands/vacuum.h"
+#include "funcapi.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/acl.h"
+#include "utils/guc.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
 #include "bitmap.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,22 +42,161 @@ void fetch_tuples(Oid relid, int *positions, int count);
 
 int yabit_debug = 0;
 
-/* Initialize bitmap internal namespace */
-Oid bitmap_internal_namespace = InvalidOid;
+/* settings of the compaction worker; see yabit_compact_main() */
+static int yabit_compact_naptime = 0;
+static double yabit_compact_threshold = 0.2;
+static char *yabit_compact_database = NULL;
+
+PGDLLEXPORT void yabit_compact_main(Datum main_arg);
+
+/* see _bitmap_lovcache_lookup() */
+int yabit_lov_cache_size = 4096;
+int yabit_shared_lov_cache_size = 0;
+
+/* see _bitmap_init_planner() */
+bool yabit_enable_count = true;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void yabit_shmem_request(void);
+static void yabit_shmem_startup(void);
+
+/* the internal namespace, once found; see _bitmap_internal_namespace() */
+static Oid bitmap_internal_namespace = InvalidOid;
+
+/*
+ * _bitmap_internal_namespace() -- return the namespace of the LOV heaps
+ *	and indexes.
+ *
+ * That is the extension's yabit_internal schema, or public without it.
+ * It is looked up on first use rather than in _PG_init(), which runs in
+ * the postmaster, before any database is connected to, when yabit is in
+ * shared_preload_libraries.
+ */
+Oid
+_bitmap_internal_namespace(void)
+{
+	Oid			nspid;
+
+	if (OidIsValid(bitmap_internal_namespace))
+		return bitmap_internal_namespace;
+
+	nspid = get_namespace_oid("yabit_internal", true);
+	if (OidIsValid(nspid))
+		bitmap_internal_namespace = nspid;
+	else
+	{
+		/* not cached: the schema may be created later on */
+		nspid = get_namespace_oid("public", true);
+	}
+
+	return nspid;
+}
 
 /* Extension initialization function */
 void _PG_init(void)
 {
-	/* Set the internal namespace to the extension's namespace */
-	bitmap_internal_namespace = get_namespace_oid("yabit_internal", true);
-	
-	/* If extension namespace is not available, fallback to public namespace */
-	if (!OidIsValid(bitmap_internal_namespace))
+	_bitmap_init_reloptions();
+
+	DefineCustomIntVariable("yabit.compact_naptime",
+							"Time to sleep between compactions and summarizations of yabit indexes.",
+							"Zero disables the compaction worker.",
+							&yabit_compact_naptime,
+							0, 0, INT_MAX / 1000,
+							PGC_SIGHUP, GUC_UNIT_S,
+							NULL, NULL, NULL);
+	DefineCustomRealVariable("yabit.compact_threshold",
+							 "Fragmentation of a bitmap vector at which the compaction worker rewrites it.",
+							 NULL,
+							 &yabit_compact_threshold,
+							 0.2, 0.0, 1.0,
+							 PGC_SIGHUP, 0,
+							 NULL, NULL, NULL);
+	DefineCustomStringVariable("yabit.compact_database",
+							   "Database whose yabit indexes the compaction worker maintains.",
+							   NULL,
+							   &yabit_compact_database,
+							   "postgres",
+							   PGC_POSTMASTER, 0,
+							   NULL, NULL, NULL);
+	DefineCustomIntVariable("yabit.lov_cache_size",
+							"Number of distinct values per yabit index whose LOV item positions a backend caches.",
+							"Zero disables the cache.",
+							&yabit_lov_cache_size,
+							4096, 0, INT_MAX,
+							PGC_USERSET, 0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("yabit.shared_lov_cache_size",
+							"Number of distinct values of yabit indexes whose LOV item positions all backends share.",
+							"Zero disables the shared cache. Needs yabit in shared_preload_libraries.",
+							&yabit_shared_lov_cache_size,
+							0, 0, INT_MAX / 2,
+							PGC_POSTMASTER, 0,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("yabit.enable_count",
+							 "Enables the planner's use of yabit indexes to count rows.",
+							 NULL,
+							 &yabit_enable_count,
+							 true,
+							 PGC_USERSET, 0,
+							 NULL, NULL, NULL);
+	MarkGUCPrefixReserved("yabit");
+
+	_bitmap_init_planner();
+
+	/* the worker and the shared LOV cache need us to be preloaded */
+	if (process_shared_preload_libraries_in_progress)
 	{
-		bitmap_internal_namespace = get_namespace_oid("public", true);
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 60;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "yabit");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "yabit_compact_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "yabit compaction worker");
+		snprintf(worker.bgw_type, BGW_MAXLEN, "yabit compaction worker");
+		RegisterBackgroundWorker(&worker);
+
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = yabit_shmem_request;
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = yabit_shmem_startup;
 	}
 }
 
+/*
+ * yabit_shmem_request() -- ask for the shared memory of the shared LOV
+ *	cache.
+ */
+static void
+yabit_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	if (yabit_shared_lov_cache_size > 0)
+	{
+		RequestAddinShmemSpace(_bitmap_shared_lovcache_shmem_size());
+		RequestNamedLWLockTranche("yabit LOV cache", 1);
+	}
+}
+
+/*
+ * yabit_shmem_startup() -- set up the shared LOV cache.
+ */
+static void
+yabit_shmem_startup(void)
+{
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	_bitmap_shared_lovcache_shmem_init();
+}
+
 /*
  * Bitmap Index Access Method Handler
  */
@@ -65,21 +223,26 @@ bmhandler(PG_FUNCTION_ARGS)
     amroutine->amcanparallel = false; /* 不支持并行扫描 */
     amroutine->amcaninclude = false; /* 不支持INCLUDE子句 */
     amroutine->amusemaintenanceworkmem = false; /* 不使用maintenance_work_mem */
-    amroutine->amparallelvacuumoptions = 0; /* 暂时设置为0，不使用特定的并行清理选项 */
+    /*
+     * bmbulkdelete() works on the index alone, so a parallel vacuum may give
+     * it to a worker. bmvacuumcleanup() stays with the leader, as only the
+     * leader can take the lock that truncating the index needs.
+     */
+    amroutine->amparallelvacuumoptions = VACUUM_OPTION_PARALLEL_BULKDEL;
     amroutine->amkeytype = InvalidOid; /* 索引键类型 */
 
     /* Function pointer for setting index access method */
     amroutine->ambuild = bmbuild_internal;
     amroutine->ambuildempty = bmbuildempty_internal;
     amroutine->aminsert = bminsert_internal;
-    // amroutine->aminsertcleanup = bminsertcleanup;
+    amroutine->aminsertcleanup = bminsertcleanup_internal;
     amroutine->ambulkdelete = bmbulkdelete_internal;
     amroutine->amvacuumcleanup = bmvacuumcleanup_internal;
     amroutine->amcanreturn = NULL; /* 不支持RETURN子句 */
     amroutine->amcostestimate = bmcostestimate_internal;    
     amroutine->amoptions = bmoptions_internal;
     amroutine->amproperty = NULL;
-    amroutine->ambuildphasename = NULL;
+    amroutine->ambuildphasename = bmbuildphasename_internal;
     amroutine->amvalidate = bmvalidate_internal;
     amroutine->amadjustmembers = NULL;
     amroutine->ambeginscan = bmbeginscan_internal;
@@ -313,6 +476,14 @@ iovitemdetail(PG_FUNCTION_ARGS)
         appendStringInfo(&result, "  Last TID location: %lu\n", lov_item->bm_last_tid_location);
         appendStringInfo(&result, "  Last set bit: %lu\n", lov_item->bm_last_setbit);
         appendStringInfo(&result, "  Words header: 0x%02X\n", lov_item->lov_words_header);
+        appendStringInfo(&result, "  Reserved extent: %u to %u (last extent %u pages)\n",
+                         lov_item->bm_extent_next, lov_item->bm_extent_end,
+                         lov_item->bm_extent_size);
+        appendStringInfo(&result, "  Newest delta page: %u\n", lov_item->bm_delta_head);
+        appendStringInfo(&result, "  Set bits: %lu\n", lov_item->bm_nsetbits);
+        appendStringInfo(&result, "  Bitmap pages: %u\n", lov_item->bm_npages);
+        appendStringInfo(&result, "  Tail buffer: %u of %u words\n",
+                         lov_item->bm_tail_nwords, lov_item->bm_tail_size);
         
         /* Read bitmap vector pages */
         if (lov_item->bm_lov_head != InvalidBlockNumber) {
@@ -321,7 +492,7 @@ iovitemdetail(PG_FUNCTION_ARGS)
             
             appendStringInfo(&result, "\nBitmap Vector Pages:\n");
             
-            while (bitmap_blkno != InvalidBlockNumber && bitmap_blkno <= bitmap_blkno_end) {
+            while (bitmap_blkno != InvalidBlockNumber) {
                 Buffer bitmap_buffer;
                 Page bitmap_page_ptr;
                 BMPageOpaque bitmap_opaque;
@@ -388,7 +559,9 @@ iovitemdetail(PG_FUNCTION_ARGS)
                 }
                 appendStringInfo(&result, "\n");
                 
-                next_blkno = bitmap_opaque->bm_bitmap_next;
+                /* pages are not in block order, so stop at the tail */
+                next_blkno = (bitmap_blkno == bitmap_blkno_end) ?
+                    InvalidBlockNumber : bitmap_opaque->bm_bitmap_next;
                 
                 LockBuffer(bitmap_buffer, BUFFER_LOCK_UNLOCK);
                 ReleaseBuffer(bitmap_buffer);
@@ -405,4 +578,423 @@ iovitemdetail(PG_FUNCTION_ARGS)
     relation_close(bitmap_rel, AccessShareLock);
     
     PG_RETURN_TEXT_P(cstring_to_text(result.data));
-}
\ No newline at end of file
+}
+
+/*
+ * check_maintained_index() -- check that the given OID is that of a yabit
+ * index whose table the current user owns, and return the table's OID.
+ *
+ * This reads the catalogs without locking anything, so that a user who
+ * may not maintain the index cannot queue locks on its table; callers
+ * check again once they hold their locks, in case the index was dropped
+ * and its OID reused meanwhile.
+ */
+static Oid
+check_maintained_index(Oid indexoid)
+{
+    HeapTuple tuple;
+    Form_pg_class classForm;
+    Oid heapoid;
+
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(indexoid));
+    if (!HeapTupleIsValid(tuple))
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_OBJECT),
+                 errmsg("index with OID %u does not exist", indexoid)));
+    classForm = (Form_pg_class) GETSTRUCT(tuple);
+
+    if (classForm->relkind != RELKIND_INDEX)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not an index",
+                        NameStr(classForm->relname))));
+    if (classForm->relam != get_index_am_oid("yabit", false))
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a yabit index",
+                        NameStr(classForm->relname))));
+
+    heapoid = IndexGetRelation(indexoid, false);
+    if (!object_ownercheck(RelationRelationId, heapoid, GetUserId()))
+        aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX,
+                       NameStr(classForm->relname));
+
+    ReleaseSysCache(tuple);
+
+    return heapoid;
+}
+
+/*
+ * yabit_compact(index regclass, min_fragmentation float8) -- rewrite the
+ * bitmap vectors of an index that are at least min_fragmentation
+ * fragmented into consecutive pages. Returns the number of vectors
+ * rewritten.
+ */
+PG_FUNCTION_INFO_V1(yabit_compact);
+Datum
+yabit_compact(PG_FUNCTION_ARGS)
+{
+    Oid indexoid = PG_GETARG_OID(0);
+    float8 min_fragmentation = PG_GETARG_FLOAT8(1);
+    Oid heapoid;
+    Relation heaprel;
+    Relation indexrel;
+    int64 ncompacted;
+
+    if (min_fragmentation < 0 || min_fragmentation > 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("min_fragmentation must be between 0 and 1")));
+
+    heapoid = check_maintained_index(indexoid);
+
+    /* vacuum works on the vectors too; keep it away like it keeps itself */
+    heaprel = table_open(heapoid, ShareUpdateExclusiveLock);
+    indexrel = index_open(indexoid, RowExclusiveLock);
+    check_maintained_index(indexoid);
+
+    ncompacted = _bitmap_compact(indexrel, min_fragmentation);
+
+    index_close(indexrel, RowExclusiveLock);
+    table_close(heaprel, ShareUpdateExclusiveLock);
+
+    PG_RETURN_INT64(ncompacted);
+}
+
+/*
+ * yabit_summarize(index regclass) -- index the heap blocks a deferred
+ * index has left out. Returns the number of heap blocks indexed.
+ */
+PG_FUNCTION_INFO_V1(yabit_summarize);
+Datum
+yabit_summarize(PG_FUNCTION_ARGS)
+{
+    Oid indexoid = PG_GETARG_OID(0);
+    Oid heapoid;
+    Relation heaprel;
+    Relation indexrel;
+    BlockNumber nsummarized;
+
+    heapoid = check_maintained_index(indexoid);
+
+    /* one summarize at a time, as with brin_summarize_new_values() */
+    heaprel = table_open(heapoid, ShareUpdateExclusiveLock);
+    indexrel = index_open(indexoid, ShareUpdateExclusiveLock);
+    check_maintained_index(indexoid);
+
+    nsummarized = _bitmap_summarize(heaprel, indexrel);
+
+    index_close(indexrel, ShareUpdateExclusiveLock);
+    table_close(heaprel, ShareUpdateExclusiveLock);
+
+    PG_RETURN_INT64((int64) nsummarized);
+}
+
+/*
+ * open_counted_index() -- open a yabit index and its table for counting
+ * rows from the vectors, as the current user may.
+ */
+static void
+open_counted_index(Oid indexoid, Relation *heaprel, Relation *indexrel)
+{
+    Oid heapoid;
+    AclResult aclresult;
+
+    heapoid = IndexGetRelation(indexoid, true);
+    if (!OidIsValid(heapoid))
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not an index", get_rel_name(indexoid))));
+
+    /* before locking anything; see check_maintained_index() */
+    aclresult = pg_class_aclcheck(heapoid, GetUserId(), ACL_SELECT);
+    if (aclresult != ACLCHECK_OK)
+        aclcheck_error(aclresult, OBJECT_TABLE, get_rel_name(heapoid));
+
+    /* the vectors know nothing of the policies */
+    if (check_enable_rls(heapoid, InvalidOid, false) == RLS_ENABLED)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot count the rows of \"%s\" with row-level security enabled",
+                        get_rel_name(heapoid))));
+
+    *heaprel = table_open(heapoid, AccessShareLock);
+    *indexrel = index_open(indexoid, AccessShareLock);
+
+    if ((*indexrel)->rd_rel->relam != get_index_am_oid("yabit", false))
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a yabit index",
+                        RelationGetRelationName(*indexrel))));
+
+    /* a failed CREATE INDEX CONCURRENTLY leaves vectors that miss rows */
+    if (!(*indexrel)->rd_index->indisvalid)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("cannot count rows with invalid index \"%s\"",
+                        RelationGetRelationName(*indexrel))));
+
+    /* a vector is then a combination of values, not one value */
+    if (IndexRelationGetNumberOfKeyAttributes(*indexrel) != 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot count rows with multi-column index \"%s\"",
+                        RelationGetRelationName(*indexrel))));
+}
+
+/*
+ * yabit_count(index regclass, lower anyelement, upper anyelement) -- count
+ * the rows whose value in the index lies between lower and upper, both
+ * included, from the bitmap vectors. A NULL bound leaves that side open;
+ * upper defaults to NULL.
+ */
+PG_FUNCTION_INFO_V1(yabit_count);
+Datum
+yabit_count(PG_FUNCTION_ARGS)
+{
+    Oid argtype;
+    Relation heaprel;
+    Relation indexrel;
+    ScanKeyData keys[2];
+    int nkeys = 0;
+    int64 count;
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    open_counted_index(PG_GETARG_OID(0), &heaprel, &indexrel);
+
+    argtype = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    for (int i = 1; i <= 2; i++)
+    {
+        StrategyNumber strategy = (i == 1) ?
+            BTGreaterEqualStrategyNumber : BTLessEqualStrategyNumber;
+        Oid opno;
+
+        if (PG_ARGISNULL(i))
+            continue;
+
+        opno = get_opfamily_member(indexrel->rd_opfamily[0],
+                                   indexrel->rd_opcintype[0],
+                                   argtype, strategy);
+        if (!OidIsValid(opno))
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATATYPE_MISMATCH),
+                     errmsg("yabit index \"%s\" cannot compare its values with type %s",
+                            RelationGetRelationName(indexrel),
+                            format_type_be(argtype))));
+
+        _bitmap_count_initkey(indexrel, &keys[nkeys++], opno,
+                              PG_GETARG_DATUM(i));
+    }
+
+    count = _bitmap_count(heaprel, indexrel, GetActiveSnapshot(), keys, nkeys);
+
+    index_close(indexrel, AccessShareLock);
+    table_close(heaprel, AccessShareLock);
+
+    PG_RETURN_INT64(count);
+}
+
+/*
+ * yabit_value_counts(index regclass) -- count the rows of each distinct
+ * value of the index, NULL included, from the bitmap vectors. Returns the
+ * values that have rows, in the order of the index's operator class.
+ */
+PG_FUNCTION_INFO_V1(yabit_value_counts);
+Datum
+yabit_value_counts(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Relation heaprel;
+    Relation indexrel;
+    BMValueCount *groups;
+    int ngroups;
+    Oid typoutput;
+    bool typisvarlena;
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    open_counted_index(PG_GETARG_OID(0), &heaprel, &indexrel);
+
+    getTypeOutputInfo(TupleDescAttr(RelationGetDescr(indexrel), 0)->atttypid,
+                      &typoutput, &typisvarlena);
+
+    groups = _bitmap_count_values(heaprel, indexrel, GetActiveSnapshot(),
+                                  &ngroups);
+    for (int i = 0; i < ngroups; i++)
+    {
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        if (groups[i].isnull)
+            nulls[0] = true;
+        else
+            values[0] = CStringGetTextDatum(OidOutputFunctionCall(typoutput,
+                                                                  groups[i].value));
+        values[1] = Int64GetDatum(groups[i].count);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    index_close(indexrel, AccessShareLock);
+    table_close(heaprel, AccessShareLock);
+
+    return (Datum) 0;
+}
+
+/*
+ * compact_all_indexes() -- summarize and compact every yabit index of
+ * the database that can be had without waiting, one transaction per
+ * index.
+ */
+static void
+compact_all_indexes(MemoryContext cxt)
+{
+    List *indexes = NIL;
+    ListCell *lc;
+    Oid amoid;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    pgstat_report_activity(STATE_RUNNING, "compacting yabit indexes");
+
+    amoid = get_index_am_oid("yabit", true);
+    if (OidIsValid(amoid))
+    {
+        Relation classrel = table_open(RelationRelationId, AccessShareLock);
+        TableScanDesc scan = table_beginscan_catalog(classrel, 0, NULL);
+        HeapTuple tuple;
+
+        while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+        {
+            Form_pg_class form = (Form_pg_class) GETSTRUCT(tuple);
+
+            if (form->relkind == RELKIND_INDEX && form->relam == amoid)
+            {
+                MemoryContext oldcxt = MemoryContextSwitchTo(cxt);
+
+                indexes = lappend_oid(indexes, form->oid);
+                MemoryContextSwitchTo(oldcxt);
+            }
+        }
+
+        table_endscan(scan);
+        table_close(classrel, AccessShareLock);
+    }
+
+    CommitTransactionCommand();
+
+    foreach(lc, indexes)
+    {
+        Oid indexoid = lfirst_oid(lc);
+        Oid heapoid;
+
+        CHECK_FOR_INTERRUPTS();
+
+        StartTransactionCommand();
+
+        /* skip the index if it is gone, or vacuum is at it */
+        heapoid = IndexGetRelation(indexoid, true);
+        if (OidIsValid(heapoid) &&
+            ConditionalLockRelationOid(heapoid, ShareUpdateExclusiveLock))
+        {
+            Relation indexrel = try_relation_open(indexoid, RowExclusiveLock);
+
+            if (indexrel != NULL)
+            {
+                Relation heaprel = table_open(heapoid, NoLock);
+                BlockNumber nsummarized;
+                int64 ncompacted;
+
+                PushActiveSnapshot(GetTransactionSnapshot());
+                nsummarized = _bitmap_summarize(heaprel, indexrel);
+                PopActiveSnapshot();
+                if (nsummarized > 0)
+                    elog(LOG, "summarized %u heap blocks into index \"%s\"",
+                         nsummarized, RelationGetRelationName(indexrel));
+                table_close(heaprel, NoLock);
+
+                ncompacted = _bitmap_compact(indexrel, yabit_compact_threshold);
+                if (ncompacted > 0)
+                    elog(LOG, "compacted %lld bitmap vectors of index \"%s\"",
+                         (long long) ncompacted,
+                         RelationGetRelationName(indexrel));
+                relation_close(indexrel, RowExclusiveLock);
+            }
+            UnlockRelationOid(heapoid, ShareUpdateExclusiveLock);
+        }
+
+        CommitTransactionCommand();
+    }
+
+    pgstat_report_activity(STATE_IDLE, NULL);
+    MemoryContextReset(cxt);
+}
+
+/*
+ * yabit_compact_main() -- entry point of the compaction worker.
+ *
+ * Every yabit.compact_naptime seconds, the vectors of the yabit indexes
+ * in yabit.compact_database that are at least yabit.compact_threshold
+ * fragmented are compacted, as yabit_compact() would, after the heap
+ * blocks deferred indexes have left out are summarized. Indexes whose
+ * table is being vacuumed are left for the next round.
+ *
+ * The worker runs whenever yabit is preloaded, but does not connect to
+ * the database until yabit.compact_naptime is set, so that an install
+ * that never turns compaction on does not depend on the database.
+ */
+void
+yabit_compact_main(Datum main_arg)
+{
+    MemoryContext cxt;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    /* sleep until compaction is turned on */
+    while (yabit_compact_naptime == 0)
+    {
+        (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L,
+                         PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+    }
+
+    BackgroundWorkerInitializeConnection(yabit_compact_database, NULL, 0);
+
+    cxt = AllocSetContextCreate(TopMemoryContext, "yabit compaction",
+                                ALLOCSET_DEFAULT_SIZES);
+
+    for (;;)
+    {
+        int events = WL_LATCH_SET | WL_EXIT_ON_PM_DEATH;
+        int rc;
+
+        if (yabit_compact_naptime > 0)
+            events |= WL_TIMEOUT;
+
+        rc = WaitLatch(MyLatch, events, yabit_compact_naptime * 1000L,
+                       PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        if ((rc & WL_TIMEOUT) && yabit_compact_naptime > 0)
+            compact_all_indexes(cxt);
+    }
+}